@@ -21,21 +21,20 @@ public:
 	/**
 	* Function responsible for handling intersections between a ray and an aabb in the scene.
 	* @param r - the ray intersecting this object.
+	* @param inv_dir - the ray's inverse_direction(), computed once per ray rather than once per box.
 	* @param t_min - the minimum distance along the ray for which a hit is valid (to prevent self-intersections).
 	* @param t_max - the maximum distance along the ray for which a hit is valid (to prevent intersections further than closest_so_far
 					 from updating the hit_record, i.e. pass in t of nearest intersection in for t_max)
-	* @param rec - the hit_record for the ray's closest intersection point.
 	* @return true if this aabb intersects the ray
 	*/
-	inline bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+	inline bool hit(const ray& r, const vec3& inv_dir, double t_min, double t_max) const
 	{
 		for (int i = 0; i < 3; i++)
 		{
-			double inv_denom = 1.0f / r.direction()[i];
-			double t0 = (start[i] - r.origin()[i]) * inv_denom;
-			double t1 = (end[i] - r.origin()[i]) * inv_denom;
+			double t0 = (start[i] - r.r0[i]) * inv_dir[i];
+			double t1 = (end[i] - r.r0[i]) * inv_dir[i];
 
-			if (inv_denom < 0.0f)
+			if (inv_dir[i] < 0.0)
 				std::swap(t0, t1);
 			
 			t_min = (t0 > t_min) ? t0 : t_min;
@@ -0,0 +1,296 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <ostream>
+
+//Subsystems allocations are attributed to, see mem_scope.
+enum class mem_tag : uint8_t
+{
+    other,
+    scene,
+    accel,
+    framebuffer,
+    textures,
+    render
+};
+
+static const int num_mem_tags = 6;
+
+inline const char* mem_tag_name(mem_tag tag)
+{
+    static const char* const names[num_mem_tags] = { "other", "scene", "accel", "framebuffer", "textures", "render" };
+    return names[int(tag)];
+}
+
+//Allocation counters of every subsystem at one point in time, see alloc_tracker::snapshot.
+struct alloc_stats
+{
+    //Bytes allocated and not yet freed, and the most there were at once since the peaks were last reset
+    int64_t current[num_mem_tags];
+    int64_t peak[num_mem_tags];
+    //Allocations ever made, and those of them made on the hot path
+    uint64_t allocations[num_mem_tags];
+    uint64_t hot_allocations[num_mem_tags];
+
+    inline uint64_t total_hot_allocations() const
+    {
+        uint64_t n = 0;
+        for (int t = 0; t < num_mem_tags; t++)
+            n += hot_allocations[t];
+        return n;
+    }
+};
+
+/**
+* Counts the memory every subsystem holds. Allocations are attributed to the calling thread's current tag (see mem_scope): every
+* operator new carries a small header recording its size and tag so its delete is attributed the same way, and the arena and
+* huge page allocations report themselves with the tag they were made under.
+*
+* Allocations made while a thread is inside a hot_path_scope (tracing the samples of a pixel) are counted separately, the render
+* loop shouldn't make any.
+*/
+class alloc_tracker
+{
+private:
+    struct counters
+    {
+        std::atomic<int64_t> current;
+        std::atomic<int64_t> peak;
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> hot_allocations;
+    };
+
+    counters tags[num_mem_tags];
+
+    alloc_tracker()
+    {
+        for (int t = 0; t < num_mem_tags; t++)
+        {
+            tags[t].current.store(0);
+            tags[t].peak.store(0);
+            tags[t].allocations.store(0);
+            tags[t].hot_allocations.store(0);
+        }
+    }
+
+public:
+    static inline alloc_tracker& get()
+    {
+        static alloc_tracker instance;
+        return instance;
+    }
+
+    //Tag the calling thread's allocations are attributed to.
+    static inline mem_tag& thread_tag()
+    {
+        thread_local mem_tag tag = mem_tag::other;
+        return tag;
+    }
+
+    //How many hot_path_scopes the calling thread is in.
+    static inline int& hot_depth()
+    {
+        thread_local int depth = 0;
+        return depth;
+    }
+
+    inline void on_alloc(mem_tag tag, size_t bytes)
+    {
+        counters& c = tags[int(tag)];
+        int64_t now = c.current.fetch_add(int64_t(bytes), std::memory_order_relaxed) + int64_t(bytes);
+        int64_t peak = c.peak.load(std::memory_order_relaxed);
+        while (now > peak && !c.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+            ;
+        c.allocations.fetch_add(1, std::memory_order_relaxed);
+        if (hot_depth() > 0)
+            c.hot_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void on_free(mem_tag tag, size_t bytes) { tags[int(tag)].current.fetch_sub(int64_t(bytes), std::memory_order_relaxed); }
+
+    alloc_stats snapshot() const;
+
+    //Starts measuring peaks afresh from the current usage, e.g. at the start of a frame.
+    void reset_peaks();
+};
+
+alloc_stats alloc_tracker::snapshot() const
+{
+    alloc_stats s;
+    for (int t = 0; t < num_mem_tags; t++)
+    {
+        s.current[t] = tags[t].current.load(std::memory_order_relaxed);
+        s.peak[t] = tags[t].peak.load(std::memory_order_relaxed);
+        s.allocations[t] = tags[t].allocations.load(std::memory_order_relaxed);
+        s.hot_allocations[t] = tags[t].hot_allocations.load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+void alloc_tracker::reset_peaks()
+{
+    for (int t = 0; t < num_mem_tags; t++)
+        tags[t].peak.store(tags[t].current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+/**
+* Attributes the calling thread's allocations to tag for the lifetime of the object, e.g.
+*     mem_scope mem(mem_tag::accel);
+*/
+class mem_scope
+{
+private:
+    mem_tag previous;
+
+public:
+    explicit inline mem_scope(mem_tag tag) : previous{ alloc_tracker::thread_tag() } { alloc_tracker::thread_tag() = tag; }
+    inline ~mem_scope() { alloc_tracker::thread_tag() = previous; }
+
+    mem_scope(const mem_scope&) = delete;
+    mem_scope& operator=(const mem_scope&) = delete;
+};
+
+//Marks the calling thread as being on the hot path for the lifetime of the object, see alloc_tracker.
+class hot_path_scope
+{
+public:
+    inline hot_path_scope() { alloc_tracker::hot_depth()++; }
+    inline ~hot_path_scope() { alloc_tracker::hot_depth()--; }
+
+    hot_path_scope(const hot_path_scope&) = delete;
+    hot_path_scope& operator=(const hot_path_scope&) = delete;
+};
+
+/**
+* Prints what each subsystem holds and allocated between two snapshots.
+* @param frames - images rendered in between, allocations are also given per frame.
+* @param rays - rays traced in between, allocations are also given per million rays (0 if unknown).
+*/
+void print_alloc_report(std::ostream& os, const alloc_stats& begin, const alloc_stats& end, uint64_t frames, uint64_t rays)
+{
+    std::ios::fmtflags flags = os.flags();
+    os << std::left << std::setw(13) << "subsystem" << std::right << std::setw(12) << "current MB" << std::setw(12) << "peak MB"
+       << std::setw(12) << "allocs" << std::setw(14) << "allocs/frame" << std::setw(14) << "allocs/Mray" << std::setw(10) << "hot" << "\n";
+    for (int t = 0; t < num_mem_tags; t++)
+    {
+        uint64_t allocs = end.allocations[t] - begin.allocations[t];
+        os << std::left << std::setw(13) << mem_tag_name(mem_tag(t)) << std::right << std::fixed << std::setprecision(2)
+           << std::setw(12) << end.current[t] / 1048576.0 << std::setw(12) << end.peak[t] / 1048576.0 << std::setw(12) << allocs
+           << std::setw(14) << std::setprecision(1) << (frames ? double(allocs) / double(frames) : 0.0)
+           << std::setw(14) << std::setprecision(3) << (rays ? double(allocs) * 1e6 / double(rays) : 0.0)
+           << std::setw(10) << end.hot_allocations[t] - begin.hot_allocations[t] << "\n";
+    }
+    os.flags(flags);
+}
+
+//Every allocation through new carries a header this big (keeping the data suitably aligned) with its size and tag
+static const size_t alloc_header_size = 16;
+
+inline void* tracked_alloc(size_t bytes)
+{
+    void* p = std::malloc(bytes + alloc_header_size);
+    if (p == nullptr)
+        return nullptr;
+    mem_tag tag = alloc_tracker::thread_tag();
+    *static_cast<size_t*>(p) = bytes;
+    static_cast<uint8_t*>(p)[sizeof(size_t)] = uint8_t(tag);
+    alloc_tracker::get().on_alloc(tag, bytes);
+    return static_cast<uint8_t*>(p) + alloc_header_size;
+}
+
+inline void tracked_free(void* p)
+{
+    if (p == nullptr)
+        return;
+    uint8_t* base = static_cast<uint8_t*>(p) - alloc_header_size;
+    alloc_tracker::get().on_free(mem_tag(base[sizeof(size_t)]), *reinterpret_cast<size_t*>(base));
+    std::free(base);
+}
+
+#ifdef __cpp_aligned_new
+/**
+* Over-aligned allocations carry the same size and tag just before the data as tracked_alloc's, and in front of those the
+* pointer malloc returned, so the padding taken to align the data can be skipped on the way back.
+*/
+inline void* tracked_aligned_alloc(size_t bytes, size_t alignment)
+{
+    const size_t prefix = alloc_header_size + sizeof(void*);
+    void* raw = std::malloc(bytes + prefix + alignment);
+    if (raw == nullptr)
+        return nullptr;
+    uintptr_t data = (reinterpret_cast<uintptr_t>(raw) + prefix + alignment - 1) & ~uintptr_t(alignment - 1);
+    uint8_t* header = reinterpret_cast<uint8_t*>(data) - alloc_header_size;
+    mem_tag tag = alloc_tracker::thread_tag();
+    *reinterpret_cast<size_t*>(header) = bytes;
+    header[sizeof(size_t)] = uint8_t(tag);
+    *reinterpret_cast<void**>(header - sizeof(void*)) = raw;
+    alloc_tracker::get().on_alloc(tag, bytes);
+    return reinterpret_cast<void*>(data);
+}
+
+inline void tracked_aligned_free(void* p)
+{
+    if (p == nullptr)
+        return;
+    uint8_t* header = static_cast<uint8_t*>(p) - alloc_header_size;
+    alloc_tracker::get().on_free(mem_tag(header[sizeof(size_t)]), *reinterpret_cast<size_t*>(header));
+    std::free(*reinterpret_cast<void**>(header - sizeof(void*)));
+}
+#endif
+
+void* operator new(size_t bytes)
+{
+    void* p = tracked_alloc(bytes);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t bytes)
+{
+    void* p = tracked_alloc(bytes);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept { return tracked_alloc(bytes); }
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept { return tracked_alloc(bytes); }
+void operator delete(void* p) noexcept { tracked_free(p); }
+void operator delete[](void* p) noexcept { tracked_free(p); }
+void operator delete(void* p, size_t) noexcept { tracked_free(p); }
+void operator delete[](void* p, size_t) noexcept { tracked_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { tracked_free(p); }
+
+#ifdef __cpp_aligned_new
+//Types declared alignas beyond the default (BVH and light tree nodes) come through these
+void* operator new(size_t bytes, std::align_val_t alignment)
+{
+    void* p = tracked_aligned_alloc(bytes, size_t(alignment));
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t bytes, std::align_val_t alignment)
+{
+    void* p = tracked_aligned_alloc(bytes, size_t(alignment));
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept { return tracked_aligned_alloc(bytes, size_t(alignment)); }
+void* operator new[](size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept { return tracked_aligned_alloc(bytes, size_t(alignment)); }
+void operator delete(void* p, std::align_val_t) noexcept { tracked_aligned_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { tracked_aligned_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { tracked_aligned_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { tracked_aligned_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { tracked_aligned_free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { tracked_aligned_free(p); }
+#endif
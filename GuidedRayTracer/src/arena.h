@@ -0,0 +1,133 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+#include "huge_pages.h"
+
+//Linear (bump) allocator, hands out memory from a chain of large blocks which are all given back in one release() call.
+//Only meant for trivially destructible data, nothing allocated from it ever has its destructor run.
+//Blocks are counted under the tag of the thread that needed them (see mem_scope), and those of huge_page_threshold bytes or more
+//(i.e. the large arrays that get a block of their own) go on huge pages.
+class arena
+{
+private:
+	struct block
+	{
+		block* next;
+		size_t size;
+		size_t used;
+		//Bytes requested from the system for the block, header included
+		size_t reserved;
+		//Subsystem the block is counted under, see alloc_tracker
+		mem_tag tag;
+	};
+
+	//Data of each block starts this many bytes after its header, keeps every block base cache-line aligned.
+	static const size_t header_size = 64;
+
+	block* head;
+	size_t block_size;
+	size_t total_bytes;
+
+	block* new_block(size_t min_bytes);
+
+public:
+
+	/**
+	* @param block_size - default size of each block requested from the system, larger requests get a block of their own.
+	*/
+	explicit arena(size_t block_size = size_t(1) << 20) : head{ nullptr }, block_size{ block_size }, total_bytes{ 0 } {}
+
+	~arena() { release(); }
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	/**
+	* Carves out bytes from the current block (or a fresh one if it doesn't fit).
+	* @param bytes - size of the allocation.
+	* @param align - required alignment, must be a power of two no larger than 64.
+	* @return pointer to uninitialised memory, valid until release().
+	*/
+	void* allocate(size_t bytes, size_t align = 64);
+
+	/**
+	* Allocates and value-initialises a contiguous array of n elements of T.
+	*/
+	template <class T>
+	inline T* allocate_array(size_t n)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destructed");
+		if (n == 0)
+			return nullptr;
+		T* p = static_cast<T*>(allocate(n * sizeof(T), alignof(T) < 64 ? 64 : alignof(T)));
+		for (size_t i = 0; i < n; i++)
+			new (p + i) T();
+		return p;
+	}
+
+	//Gives every block back to the system, all pointers handed out so far become invalid.
+	void release();
+
+	//Total bytes reserved from the system (including slack at the end of blocks).
+	inline size_t bytes_reserved() const { return total_bytes; }
+};
+
+arena::block* arena::new_block(size_t min_bytes)
+{
+	size_t size = (min_bytes > block_size) ? min_bytes : block_size;
+	size_t reserved = header_size + size + 63;
+	void* mem = (reserved >= huge_page_threshold) ? huge_page_alloc(reserved) : std::malloc(reserved);
+	if (mem == nullptr)
+		throw std::bad_alloc();
+
+	block* b = static_cast<block*>(mem);
+	b->next = head;
+	b->size = size;
+	b->used = 0;
+	b->reserved = reserved;
+	b->tag = alloc_tracker::thread_tag();
+	alloc_tracker::get().on_alloc(b->tag, reserved);
+	head = b;
+	total_bytes += size;
+	return b;
+}
+
+void* arena::allocate(size_t bytes, size_t align)
+{
+	block* b = head;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (b != nullptr)
+		{
+			uintptr_t base = reinterpret_cast<uintptr_t>(b) + header_size;
+			base = (base + 63) & ~uintptr_t(63);
+			uintptr_t p = (base + b->used + (align - 1)) & ~uintptr_t(align - 1);
+			if (p + bytes <= base + b->size)
+			{
+				b->used = (p + bytes) - base;
+				return reinterpret_cast<void*>(p);
+			}
+		}
+		b = new_block(bytes + align);
+	}
+	throw std::bad_alloc();
+}
+
+void arena::release()
+{
+	while (head != nullptr)
+	{
+		block* next = head->next;
+		alloc_tracker::get().on_free(head->tag, head->reserved);
+		if (head->reserved >= huge_page_threshold)
+			huge_page_free(head, head->reserved);
+		else
+			std::free(head);
+		head = next;
+	}
+	total_bytes = 0;
+}
@@ -0,0 +1,388 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+#include "camera.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "hitable.h"
+#include "lights.h"
+#include "material.h"
+#include "sampler.h"
+
+/**
+* Bidirectional path tracing (Veach 1997, ch. 10). Every camera sample traces one subpath from the camera and another from a
+* light picked by its power, then joins each prefix of one to each prefix of the other with a shadow ray. A path with s vertices
+* from the light's side and t from the camera's can then be made in several ways: by the camera subpath hitting an emitter
+* (s = 0), by next event estimation (s = 1), by a connection in the middle, or by a light subpath vertex seen straight from the
+* camera (t = 1), which lands on any pixel and is splatted into the framebuffer. Every way is weighted against all the others
+* that could have made the same path with the power heuristic, so light focused through glass onto diffuse surfaces (caustics),
+* which the camera's side almost never finds, comes in through the strategies that start at the light.
+*
+* Only diffuse surfaces can be connected to. Glass and metal scatter through their materials' own sampling and count as delta
+* vertices, metal's fuzzy lobe included as it has no density that can be evaluated. Light subpath vertices are only connected
+* straight to a pinhole camera, with a thin lens those strategies are left out.
+*/
+
+//Longest path traced, in edges.
+const int bdpt_max_depth = 16;
+//Sampler bounce of the light subpath's first vertex, the bounces before it belong to the camera subpath.
+const int bdpt_light_bounce = bdpt_max_depth + 1;
+
+enum class bdpt_vertex_type : uint8_t
+{
+    camera,
+    light,
+    surface
+};
+
+struct bdpt_vertex
+{
+    bdpt_vertex_type type = bdpt_vertex_type::surface;
+    //Vertices the integrator can't evaluate the scattering of can't be connected to
+    bool delta = false;
+    vec3 p;
+    //Unit surface normal, unused for the camera
+    vec3 n;
+    //Direction of the ray the subpath arrived at a surface vertex along
+    vec3 dir;
+    //Surface vertices: the hit and its material. Light vertices: rec.light is the index of the light.
+    hit_record rec;
+    material mat;
+    //Throughput of the subpath up to and including this vertex, for a light vertex its radiance over its density
+    vec3 beta;
+    //Area density of this vertex being made by its own subpath, and by the other subpath had it been traced this far
+    double pdf_fwd = 0, pdf_rev = 0;
+};
+
+//Converts the solid angle density of v picking the direction towards next into an area density at next.
+inline double bdpt_area_pdf(double pdf_dir, const bdpt_vertex& v, const bdpt_vertex& next)
+{
+    vec3 d = next.p - v.p;
+    double d2 = d.squared_length();
+    if (d2 == 0)
+        return 0;
+    double pdf = pdf_dir / d2;
+    if (next.type != bdpt_vertex_type::camera)
+        pdf *= fabs(dot(next.n, d)) / sqrt(d2);
+    return pdf;
+}
+
+/**
+* Area density of v picking next as the following vertex of its subpath.
+* @param arrival - direction the subpath arrived at v in, only used for surfaces.
+*/
+inline double bdpt_pdf(const camera& cam, const bdpt_vertex& v, const vec3& arrival, const bdpt_vertex& next)
+{
+    vec3 w = unit_vector(next.p - v.p);
+    double pdf_dir;
+    if (v.type == bdpt_vertex_type::camera)
+        pdf_dir = cam.direction_pdf(w);
+    else if (v.type == bdpt_vertex_type::light)
+        pdf_dir = fmax(dot(v.n, w), 0.0) / M_PI;
+    else
+        pdf_dir = v.delta ? 0 : v.mat.pdf(arrival, v.rec, w);
+    return bdpt_area_pdf(pdf_dir, v, next);
+}
+
+/**
+* Scattering at v between the direction its subpath arrived from and unit direction w, times the cosine at v. For a light vertex
+* it's the cosine alone, its radiance is already in beta.
+*/
+inline vec3 bdpt_f(const bdpt_vertex& v, const vec3& w)
+{
+    if (v.type == bdpt_vertex_type::light)
+    {
+        double c = fmax(dot(v.n, w), 0.0);
+        return vec3(c, c, c);
+    }
+    return v.delta ? vec3(0, 0, 0) : v.mat.eval(v.dir, v.rec, w);
+}
+
+//Whether nothing blocks the segment between two vertices.
+inline bool bdpt_visible(const hitable* world, const vec3& a, const vec3& b)
+{
+    vec3 d = b - a;
+    double dist = d.length();
+    hit_record rec;
+    material mat;
+    return !world->hit(ray(a, d / dist), 0.0001, dist - 0.0001, rec, mat);
+}
+
+//Makes v the point (u1, u2) on light l, which was picked with probability pmf.
+inline void bdpt_light_vertex(const light_bvh& lights, uint32_t l, double pmf, double u1, double u2, bdpt_vertex& v)
+{
+    const light_info& info = lights.light(l);
+    v.type = bdpt_vertex_type::light;
+    v.delta = false;
+    light_point(info, u1, u2, v.p, v.n);
+    v.rec.light = l;
+    v.pdf_fwd = pmf / info.area;
+    v.pdf_rev = 0;
+    v.beta = info.radiance / v.pdf_fwd;
+}
+
+/**
+* Extends a subpath along r, which left the vertex just before path[0].
+* @param beta - throughput of the subpath carried along r.
+* @param pdf_dir - solid angle density with which r's direction was picked.
+* @param bounce - sampler bounce of the first vertex added, each later vertex takes the next one.
+* @param escaped - if not null, the sky seen by the subpath is added to it.
+* @return number of vertices added, at most max_vertices.
+*/
+inline int bdpt_walk(const hitable* world, ray r, vec3 beta, double pdf_dir, sampler& smp, int bounce, bdpt_vertex* path, int max_vertices, vec3* escaped)
+{
+    int n = 0;
+    while (n < max_vertices)
+    {
+        hit_record rec;
+        material mat;
+        if (!world->hit(r, 0.0001, FLT_MAX, rec, mat))
+        {
+            if (escaped != nullptr)
+                *escaped += beta * background(world->environment(), r);
+            break;
+        }
+
+        bdpt_vertex& v = path[n];
+        bdpt_vertex& prev = path[n - 1];
+        v.type = bdpt_vertex_type::surface;
+        v.delta = !mat.samples_lights();
+        v.p = rec.p;
+        v.n = rec.normal;
+        v.dir = r.direction();
+        v.rec = rec;
+        v.mat = mat;
+        v.beta = beta;
+        v.pdf_fwd = bdpt_area_pdf(pdf_dir, prev, v);
+        v.pdf_rev = 0;
+        if (++n >= max_vertices)
+            break;
+
+        smp.start_bounce(bounce + n - 1);
+        vec3 attenuation;
+        ray scattered;
+        if (!v.mat.scatter(r, rec, attenuation, scattered, smp))
+            break;
+        vec3 wi = unit_vector(scattered.direction());
+        double pdf_rev = 0;
+        pdf_dir = 0;
+        if (!v.delta)
+        {
+            pdf_dir = v.mat.pdf(r.direction(), rec, wi);
+            pdf_rev = v.mat.pdf(-wi, rec, -unit_vector(r.direction()));
+        }
+        beta *= attenuation;
+        prev.pdf_rev = bdpt_area_pdf(pdf_rev, v, prev);
+        r = scattered;
+    }
+    return n;
+}
+
+//Traces the camera subpath starting with r, adding the sky it sees to escaped. Returns its number of vertices, the camera's included.
+inline int bdpt_camera_subpath(const hitable* world, const camera& cam, const ray& r, sampler& smp, bdpt_vertex* path, vec3& escaped)
+{
+    bdpt_vertex& c = path[0];
+    c.type = bdpt_vertex_type::camera;
+    c.delta = cam.lens_radius > 0;
+    c.p = r.origin();
+    c.n = -cam.w;
+    c.beta = vec3(1, 1, 1);
+    c.pdf_fwd = c.pdf_rev = 0;
+    //Importance over the density of the ray is 1 for the pinhole camera, so the throughput starts at 1
+    double pdf_dir = cam.direction_pdf(unit_vector(r.direction()));
+    return 1 + bdpt_walk(world, r, vec3(1, 1, 1), pdf_dir, smp, 0, path + 1, bdpt_max_depth + 1, &escaped);
+}
+
+//Traces a subpath from a light picked by power. Returns its number of vertices, the light's included (0 if there's no light).
+inline int bdpt_light_subpath(const hitable* world, const light_bvh& lights, sampler& smp, bdpt_vertex* path)
+{
+    smp.start_bounce(bdpt_light_bounce);
+    uint32_t l;
+    double pmf, u1, u2;
+    if (!lights.sample_power(smp.get_light_choice(), l, pmf))
+        return 0;
+    smp.get_light(u1, u2);
+    bdpt_vertex& v = path[0];
+    bdpt_light_vertex(lights, l, pmf, u1, u2, v);
+
+    //Cosine-distributed about the light's normal
+    smp.get_bsdf(u1, u2);
+    vec3 tu = unit_vector(cross(fabs(v.n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0), v.n));
+    vec3 tv = cross(v.n, tu);
+    double r = sqrt(u1), phi = 2 * M_PI * u2;
+    vec3 w = r * cos(phi) * tu + r * sin(phi) * tv + sqrt(fmax(0.0, 1 - u1)) * v.n;
+    double cos_l = dot(w, v.n);
+    if (cos_l <= 0)
+        return 1;
+    double pdf_dir = cos_l / M_PI;
+    return 1 + bdpt_walk(world, ray(v.p, w), v.beta * (cos_l / pdf_dir), pdf_dir, smp, bdpt_light_bounce + 1, path + 1, bdpt_max_depth, nullptr);
+}
+
+//Maps the density of a delta vertex (0) to 1, so the ratios between strategies pass over it.
+inline double bdpt_remap0(double pdf) { return (pdf != 0) ? pdf : 1; }
+
+/**
+* Power heuristic weight of the strategy joining s light and t camera subpath vertices, against every other strategy that could
+* have made the same path. Each strategy's density differs from its neighbour's in one vertex only, so their ratios follow from
+* the forward and reverse densities stored along the subpaths, once those at the join are recomputed for the connection.
+* @param sampled - the light vertex that replaces the subpath's own when s is 1.
+*/
+inline double bdpt_mis_weight(const camera& cam, const light_bvh* lights, const bdpt_vertex* light_path, int s,
+    const bdpt_vertex* camera_path, int t, const bdpt_vertex& sampled)
+{
+    if (s + t == 2)
+        return 1;
+
+    const bdpt_vertex& pt = camera_path[t - 1];
+    const bdpt_vertex* qs = (s == 1) ? &sampled : (s > 1 ? &light_path[s - 1] : nullptr);
+    double pt_rev = 0, pt_minus_rev = 0, qs_rev = 0, qs_minus_rev = 0;
+    if (s > 0)
+    {
+        pt_rev = bdpt_pdf(cam, *qs, qs->dir, pt);
+        if (t > 1)
+            pt_minus_rev = bdpt_pdf(cam, pt, pt.p - qs->p, camera_path[t - 2]);
+        qs_rev = bdpt_pdf(cam, pt, pt.dir, *qs);
+        if (s > 1)
+            qs_minus_rev = bdpt_pdf(cam, *qs, qs->p - pt.p, light_path[s - 2]);
+    }
+    else
+    {
+        //An emitter that isn't one of the scene's lights can only ever be hit
+        if (lights == nullptr || pt.rec.light == UINT32_MAX)
+            return 1;
+        pt_rev = lights->power_pmf(pt.rec.light) / lights->light(pt.rec.light).area;
+        const bdpt_vertex& prev = camera_path[t - 2];
+        pt_minus_rev = bdpt_area_pdf(fmax(dot(pt.n, unit_vector(prev.p - pt.p)), 0.0) / M_PI, pt, prev);
+    }
+
+    double sum = 0, ri = 1;
+    for (int i = t - 1; i > 0; i--)
+    {
+        const bdpt_vertex& v = camera_path[i];
+        double rev = (i == t - 1) ? pt_rev : (i == t - 2 ? pt_minus_rev : v.pdf_rev);
+        ri *= bdpt_remap0(rev) / bdpt_remap0(v.pdf_fwd);
+        if ((i == t - 1 || !v.delta) && !camera_path[i - 1].delta)
+            sum += ri * ri;
+    }
+    ri = 1;
+    for (int i = s - 1; i >= 0; i--)
+    {
+        const bdpt_vertex& v = (i == s - 1) ? *qs : light_path[i];
+        double rev = (i == s - 1) ? qs_rev : (i == s - 2 ? qs_minus_rev : v.pdf_rev);
+        ri *= bdpt_remap0(rev) / bdpt_remap0(v.pdf_fwd);
+        if ((i == s - 1 || !v.delta) && (i == 0 || !light_path[i - 1].delta))
+            sum += ri * ri;
+    }
+    return 1 / (1 + sum);
+}
+
+/**
+* Joins the first s vertices of the light subpath to the first t of the camera subpath.
+* @param smp - sampler of the current camera sample, for the light vertex picked when s is 1.
+* @param image_s/image_t - set to the image plane coords the light lands on when t is 1.
+* @return the weighted contribution, black if the subpaths can't be joined.
+*/
+inline vec3 bdpt_connect(const hitable* world, const camera& cam, const light_bvh* lights, const bdpt_vertex* light_path, int s,
+    const bdpt_vertex* camera_path, int t, sampler& smp, double& image_s, double& image_t)
+{
+    bdpt_vertex sampled;
+    vec3 l(0, 0, 0);
+    vec3 a, b;
+    if (s == 0)
+    {
+        const bdpt_vertex& pt = camera_path[t - 1];
+        if (pt.type != bdpt_vertex_type::surface || !pt.mat.is_emissive())
+            return l;
+        l = pt.beta * pt.mat.emitted(pt.dir, pt.rec);
+    }
+    else if (t == 1)
+    {
+        const bdpt_vertex& qs = light_path[s - 1];
+        const bdpt_vertex& c = camera_path[0];
+        if (qs.delta || c.delta || !cam.project(qs.p, image_s, image_t))
+            return l;
+        vec3 d = c.p - qs.p;
+        double d2 = d.squared_length();
+        vec3 w = d / sqrt(d2);
+        l = qs.beta * bdpt_f(qs, w) * (cam.importance(-w) * dot(w, cam.w) / d2);
+        a = qs.p;
+        b = c.p;
+    }
+    else if (s == 1)
+    {
+        const bdpt_vertex& pt = camera_path[t - 1];
+        if (pt.delta || lights == nullptr)
+            return l;
+        //Same dims the path tracer's next event estimation takes at this bounce
+        smp.start_bounce(t - 2);
+        double u1, u2, u_pick = smp.get_light_choice();
+        smp.get_light(u1, u2);
+        uint32_t li;
+        double pmf;
+        if (!lights->sample_power(u_pick, li, pmf))
+            return l;
+        bdpt_light_vertex(*lights, li, pmf, u1, u2, sampled);
+        vec3 d = sampled.p - pt.p;
+        double d2 = d.squared_length();
+        vec3 w = d / sqrt(d2);
+        l = pt.beta * bdpt_f(pt, w) * bdpt_f(sampled, -w) * sampled.beta / d2;
+        a = sampled.p;
+        b = pt.p;
+    }
+    else
+    {
+        const bdpt_vertex& qs = light_path[s - 1];
+        const bdpt_vertex& pt = camera_path[t - 1];
+        if (qs.delta || pt.delta)
+            return l;
+        vec3 d = qs.p - pt.p;
+        double d2 = d.squared_length();
+        vec3 w = d / sqrt(d2);
+        l = qs.beta * bdpt_f(qs, -w) * bdpt_f(pt, w) * pt.beta / d2;
+        a = qs.p;
+        b = pt.p;
+    }
+
+    if (l.squared_length() == 0)
+        return l;
+    if (s > 0 && !bdpt_visible(world, a, b))
+        return vec3(0, 0, 0);
+    return l * bdpt_mis_weight(cam, lights, light_path, s, camera_path, t, sampled);
+}
+
+/**
+* Takes one bidirectional sample along the camera ray r, splatting the light that reaches the camera from the light subpath into
+* fb wherever it lands.
+* @return the radiance of the strategies that end on r itself.
+*/
+inline vec3 bdpt_sample(const hitable* world, const camera& cam, const ray& r, sampler& smp, framebuffer& fb)
+{
+    const light_bvh* lights = world->lights();
+    bdpt_vertex camera_path[bdpt_max_depth + 2];
+    bdpt_vertex light_path[bdpt_max_depth + 1];
+
+    vec3 radiance(0, 0, 0);
+    int num_camera = bdpt_camera_subpath(world, cam, r, smp, camera_path, radiance);
+    int num_light = (lights != nullptr) ? bdpt_light_subpath(world, *lights, smp, light_path) : 0;
+    fb.add_light_paths(1);
+
+    for (int t = 1; t <= num_camera; t++)
+    {
+        for (int s = 0; s <= num_light; s++)
+        {
+            int depth = s + t - 2;
+            if ((s == 1 && t == 1) || depth < 0 || depth > bdpt_max_depth)
+                continue;
+            double image_s, image_t;
+            vec3 c = bdpt_connect(world, cam, lights, light_path, s, camera_path, t, smp, image_s, image_t);
+            if (t > 1)
+                radiance += c;
+            else if (c.squared_length() > 0)
+                fb.add_splat(std::min(int(image_s * fb.width), fb.width - 1), std::min(int(image_t * fb.height), fb.height - 1), c);
+        }
+    }
+    return radiance;
+}
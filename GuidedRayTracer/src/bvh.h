@@ -0,0 +1,875 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aabb.h"
+#include "arena.h"
+#include "parallel.h"
+
+//Node boxes are tested 4 at a time with SSE wherever it's available, otherwise one at a time in double precision.
+#ifndef BVH_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SIMD 1
+#else
+#define BVH_SIMD 0
+#endif
+#endif
+#if BVH_SIMD
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//Reference to a single primitive: its kind in the top 3 bits, its index within that kind's arrays in the other 29.
+typedef uint32_t prim_ref;
+
+inline prim_ref make_prim_ref(uint32_t type, uint32_t index) { return (type << 29) | (index & 0x1FFFFFFFu); }
+inline uint32_t prim_ref_type(prim_ref p) { return p >> 29; }
+inline uint32_t prim_ref_index(prim_ref p) { return p & 0x1FFFFFFFu; }
+
+/**
+* Node of the compressed BVH, exactly one cache line holding up to 4 children. Instead of storing each child's box in doubles
+* (48 bytes a box) the node stores its own origin and a power of two step per axis, and each child's box as 8 bit multiples of
+* that step. Bounds are rounded outwards when quantized, so a decoded child box always contains the real one and no hit is missed.
+*
+* Inner children are stored consecutively from node_base and the prim refs of leaf children consecutively from prim_base, both
+* in child order, so a single index of each kind is enough for all 4 children.
+*/
+struct alignas(64) bvh_node
+{
+    float origin[3];
+    int8_t exponent[3];
+    //Bit k is set if child k is another node
+    uint8_t inner_mask;
+    uint32_t node_base;
+    uint32_t prim_base;
+    //Number of prims for a leaf child, 1 for an inner child, 0 for an empty slot
+    uint8_t meta[4];
+    uint8_t lo_x[4], lo_y[4], lo_z[4];
+    uint8_t hi_x[4], hi_y[4], hi_z[4];
+};
+static_assert(sizeof(bvh_node) == 64, "bvh_node must fill exactly one cache line");
+
+//How the binary tree a bvh is compressed from gets built.
+enum class bvh_builder
+{
+    //Top down with binned SAH, the best trees but serial
+    sah,
+    //Linear BVH: prims sorted along a Morton curve and the tree read off the sorted codes, every step in parallel
+    lbvh,
+    //LBVH followed by tree rotations wherever they shrink a node's box, a little slower but closer to SAH quality
+    lbvh_optimized
+};
+
+/**
+* Bounding volume hierarchy over the bounded primitives of a scene. Built into a binary tree (see bvh_builder) which is then
+* collapsed into 4 wide compressed nodes (see bvh_node), stored in one arena allocation along with the leaves' prim refs.
+*/
+class bvh
+{
+private:
+    //Binary tree produced by the build, only lives until it's been compressed.
+    struct build_node
+    {
+        aabb box;
+        uint32_t child[2];
+        //Range of the build's prim order covered by a leaf, count is 0 for inner nodes
+        uint32_t first, count;
+    };
+
+    static const int num_bins = 16;
+    static const uint32_t max_leaf_size = 8;
+    //Below this depth splits are chosen by SAH, past it by median so the tree (and traversal stack) depth stays bounded.
+    static const int max_sah_depth = 64;
+    static const int stack_size = 3 * (max_sah_depth + 32) + 4;
+    //Deepest the binary tree may get, LBVH trees are at most 63 deep and rotations may not push them past this
+    static const int max_depth = max_sah_depth + 32;
+    //Rotation sweeps over the tree done by bvh_builder::lbvh_optimized
+    static const int rotation_passes = 2;
+
+    std::vector<build_node> build_nodes;
+    std::vector<uint32_t> order;
+
+    uint32_t build_recursive(const std::vector<aabb>& boxes, const std::vector<vec3>& centroids, uint32_t begin, uint32_t end, int depth);
+    uint32_t build_lbvh(const std::vector<aabb>& boxes, const std::vector<vec3>& centroids, bool optimize);
+    void rotate(uint32_t id, int depth, std::vector<uint8_t>& height);
+    double linearize(uint32_t id, const std::vector<uint32_t>& sorted, uint32_t& next);
+    int gather_children(uint32_t b, uint32_t children[4]) const;
+    void compress(uint32_t out, uint32_t b, const std::vector<prim_ref>& refs, std::vector<bvh_node>& wide, std::vector<prim_ref>& leaf_prims,
+                  std::vector<uint32_t>& sources) const;
+    void quantize(bvh_node& n, const uint32_t* children, int num_children) const;
+
+public:
+    bvh_node* nodes;
+    size_t num_nodes;
+    prim_ref* prims;
+    size_t num_prims;
+
+    bvh() : nodes{ nullptr }, num_nodes{ 0 }, prims{ nullptr }, num_prims{ 0 } {}
+
+    /**
+    * Builds the hierarchy.
+    * @param refs - the primitives to enclose.
+    * @param boxes - bounding box of each of refs.
+    * @param mem - arena the nodes and leaf prim refs are allocated from.
+    * @param builder - how to build the tree.
+    */
+    void build(const std::vector<prim_ref>& refs, const std::vector<aabb>& boxes, arena& mem, bvh_builder builder = bvh_builder::sah);
+
+    /**
+    * Finds the closest primitive along the ray.
+    * @param leaf - called as leaf(prim, t_max) for every prim in a leaf the ray reaches, must return true and lower t_max to the
+    *               distance of the hit if the prim is hit closer than t_max.
+    * @return true if any prim was hit.
+    */
+    template <class F>
+    bool traverse(const ray& r, double t_min, double t_max, F&& leaf) const;
+
+    //Bytes used by the nodes and leaf prim refs.
+    inline size_t memory_bytes() const { return num_nodes * sizeof(bvh_node) + num_prims * sizeof(prim_ref); }
+};
+
+inline double box_area(const aabb& b)
+{
+    vec3 d = b.max() - b.min();
+    return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+//2^e for the exponents a node can hold, built directly from the bits as ldexp is a library call.
+inline double exp2_int(int e)
+{
+    uint64_t bits = uint64_t(e + 1023) << 52;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+/**
+* Decodes one quantized bound, shared by the encoder and traversal so both arrive at exactly the same value.
+*/
+inline double dequantize(float origin, uint8_t q, double step)
+{
+    return double(origin) + double(q) * step;
+}
+
+void bvh::build(const std::vector<prim_ref>& refs, const std::vector<aabb>& boxes, arena& mem, bvh_builder builder)
+{
+    nodes = nullptr;
+    prims = nullptr;
+    num_nodes = num_prims = 0;
+    if (refs.empty())
+        return;
+
+    std::vector<vec3> centroids(refs.size());
+    parallel_for(refs.size(), size_t(1) << 14, [&](size_t i) { centroids[i] = 0.5 * (boxes[i].min() + boxes[i].max()); });
+
+    uint32_t root;
+    if (builder == bvh_builder::sah)
+    {
+        order.resize(refs.size());
+        for (size_t i = 0; i < refs.size(); i++)
+            order[i] = uint32_t(i);
+        build_nodes.clear();
+        build_nodes.reserve(2 * refs.size());
+        root = build_recursive(boxes, centroids, 0, uint32_t(refs.size()), 0);
+    }
+    else
+        root = build_lbvh(boxes, centroids, builder == bvh_builder::lbvh_optimized);
+
+    std::vector<bvh_node> wide(1);
+    std::vector<prim_ref> leaf_prims;
+    leaf_prims.reserve(refs.size());
+    std::vector<uint32_t> sources(4, UINT32_MAX);
+    sources.reserve(2 * build_nodes.size() + 4);
+    compress(0, root, refs, wide, leaf_prims, sources);
+    parallel_for(wide.size(), size_t(1) << 12, [&](size_t i)
+    {
+        const uint32_t* c = &sources[4 * i];
+        quantize(wide[i], c, int(std::count_if(c, c + 4, [](uint32_t b) { return b != UINT32_MAX; })));
+    });
+
+    num_nodes = wide.size();
+    nodes = mem.allocate_array<bvh_node>(num_nodes);
+    std::copy(wide.begin(), wide.end(), nodes);
+    num_prims = leaf_prims.size();
+    prims = mem.allocate_array<prim_ref>(num_prims);
+    std::copy(leaf_prims.begin(), leaf_prims.end(), prims);
+
+    std::vector<build_node>().swap(build_nodes);
+    std::vector<uint32_t>().swap(order);
+}
+
+uint32_t bvh::build_recursive(const std::vector<aabb>& boxes, const std::vector<vec3>& centroids, uint32_t begin, uint32_t end, int depth)
+{
+    aabb box = boxes[order[begin]];
+    vec3 cmin = centroids[order[begin]], cmax = cmin;
+    for (uint32_t i = begin + 1; i < end; i++)
+    {
+        box = enclose_boxes(box, boxes[order[i]]);
+        const vec3& c = centroids[order[i]];
+        cmin = vec3(fmin(cmin.x(), c.x()), fmin(cmin.y(), c.y()), fmin(cmin.z(), c.z()));
+        cmax = vec3(fmax(cmax.x(), c.x()), fmax(cmax.y(), c.y()), fmax(cmax.z(), c.z()));
+    }
+
+    uint32_t id = uint32_t(build_nodes.size());
+    build_nodes.push_back({ box, { 0, 0 }, begin, end - begin });
+    uint32_t count = end - begin;
+    if (count == 1)
+        return id;
+
+    //Find the cheapest binned split over all 3 axes, cost relative to the parent's area with traversal and intersection both 1
+    int best_axis = -1, best_bin = 0;
+    double best_cost = DBL_MAX;
+    if (depth < max_sah_depth)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double extent = cmax[axis] - cmin[axis];
+            if (extent <= 0)
+                continue;
+            double k = num_bins * (1 - 1e-9) / extent;
+
+            aabb bin_box[num_bins];
+            uint32_t bin_count[num_bins] = {};
+            for (uint32_t i = begin; i < end; i++)
+            {
+                int b = int((centroids[order[i]][axis] - cmin[axis]) * k);
+                bin_box[b] = bin_count[b]++ ? enclose_boxes(bin_box[b], boxes[order[i]]) : boxes[order[i]];
+            }
+
+            //Sweep from the right to get the area and count on the right of every split, then from the left to cost them
+            double right_area[num_bins];
+            uint32_t right_count[num_bins];
+            aabb acc;
+            uint32_t n = 0;
+            for (int b = num_bins - 1; b > 0; b--)
+            {
+                if (bin_count[b])
+                    acc = n ? enclose_boxes(acc, bin_box[b]) : bin_box[b];
+                n += bin_count[b];
+                right_area[b] = n ? box_area(acc) : 0;
+                right_count[b] = n;
+            }
+            n = 0;
+            for (int b = 0; b < num_bins - 1; b++)
+            {
+                if (bin_count[b])
+                    acc = n ? enclose_boxes(acc, bin_box[b]) : bin_box[b];
+                n += bin_count[b];
+                if (n == 0 || right_count[b + 1] == 0)
+                    continue;
+                double cost = n * box_area(acc) + right_count[b + 1] * right_area[b + 1];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+    }
+
+    double parent_area = box_area(box);
+    double split_cost = 1 + ((parent_area > 0) ? best_cost / parent_area : double(count));
+    if (count <= max_leaf_size && (best_axis < 0 || split_cost >= double(count)))
+        return id;
+
+    uint32_t mid;
+    if (best_axis >= 0)
+    {
+        int axis = best_axis;
+        double k = num_bins * (1 - 1e-9) / (cmax[axis] - cmin[axis]);
+        uint32_t* p = std::partition(order.data() + begin, order.data() + end,
+                                     [&](uint32_t i) { return int((centroids[i][axis] - cmin[axis]) * k) <= best_bin; });
+        mid = uint32_t(p - order.data());
+    }
+    else
+    {
+        //Either too deep for SAH or every centroid in the same spot, split at the median of the widest axis
+        vec3 d = cmax - cmin;
+        int axis = (d.x() > d.y() && d.x() > d.z()) ? 0 : (d.y() > d.z() ? 1 : 2);
+        mid = begin + count / 2;
+        std::nth_element(order.data() + begin, order.data() + mid, order.data() + end,
+                         [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+    }
+
+    uint32_t left = build_recursive(boxes, centroids, begin, mid, depth + 1);
+    uint32_t right = build_recursive(boxes, centroids, mid, end, depth + 1);
+    build_nodes[id].child[0] = left;
+    build_nodes[id].child[1] = right;
+    build_nodes[id].count = 0;
+    return id;
+}
+
+//Number of zero bits above the highest set bit of x, x must not be 0.
+inline int leading_zeros(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long bit;
+    _BitScanReverse64(&bit, x);
+    return 63 - int(bit);
+#elif defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    for (uint64_t bit = uint64_t(1) << 63; (x & bit) == 0; bit >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+//Spreads the low 10 bits of v out so there are two zero bits between each of them.
+inline uint32_t expand_bits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+//30 bit Morton code of a point given in [0, 1]^3.
+inline uint32_t morton_code(double x, double y, double z)
+{
+    uint32_t ix = uint32_t(fmin(fmax(x * 1024, 0.0), 1023.0));
+    uint32_t iy = uint32_t(fmin(fmax(y * 1024, 0.0), 1023.0));
+    uint32_t iz = uint32_t(fmin(fmax(z * 1024, 0.0), 1023.0));
+    return (expand_bits(ix) << 2) | (expand_bits(iy) << 1) | expand_bits(iz);
+}
+
+/**
+* Sorts 30 bit keys along with their values by least significant digit radix sort, 11 bits a pass. Each thread counts the digits
+* of its own chunk, and scatters its keys after those of the earlier chunks with the same digit, so the sort stays stable.
+*/
+inline void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values)
+{
+    const int bits = 11, buckets = 1 << bits;
+    size_t n = keys.size();
+    unsigned chunks = parallel_chunk_count(n, size_t(1) << 14);
+    std::vector<uint32_t> keys_out(n), values_out(n);
+    std::vector<size_t> offsets(size_t(chunks) * buckets);
+    for (int shift = 0; shift < 30; shift += bits)
+    {
+        std::fill(offsets.begin(), offsets.end(), size_t(0));
+        parallel_chunks(n, chunks, [&](unsigned c, size_t begin, size_t end)
+        {
+            size_t* h = &offsets[size_t(c) * buckets];
+            for (size_t i = begin; i < end; i++)
+                h[(keys[i] >> shift) & (buckets - 1)]++;
+        });
+        size_t sum = 0;
+        for (int d = 0; d < buckets; d++)
+        {
+            for (unsigned c = 0; c < chunks; c++)
+            {
+                size_t count = offsets[size_t(c) * buckets + d];
+                offsets[size_t(c) * buckets + d] = sum;
+                sum += count;
+            }
+        }
+        parallel_chunks(n, chunks, [&](unsigned c, size_t begin, size_t end)
+        {
+            size_t* h = &offsets[size_t(c) * buckets];
+            for (size_t i = begin; i < end; i++)
+            {
+                size_t pos = h[(keys[i] >> shift) & (buckets - 1)]++;
+                keys_out[pos] = keys[i];
+                values_out[pos] = values[i];
+            }
+        });
+        keys.swap(keys_out);
+        values.swap(values_out);
+    }
+}
+
+/**
+* Builds the binary tree as a linear BVH (Karras 2012): the prims are sorted by the Morton codes of their centroids, after which
+* every inner node can find its own range of the sorted prims and its split independently, from where the codes first differ.
+* Keys are the codes with the sorted position appended, so duplicate codes still split. Boxes are then filled in bottom up, the
+* second child to finish carrying on to the parent, and subtrees of up to max_leaf_size prims become leaves where SAH says so.
+* Inner nodes are build_nodes[0, n - 1), the root first, and the leaf of sorted prim p is build_nodes[n - 1 + p].
+* @param optimize - rotate the tree to shrink its boxes (see rotate) before the leaves are formed.
+* @return index of the root.
+*/
+uint32_t bvh::build_lbvh(const std::vector<aabb>& boxes, const std::vector<vec3>& centroids, bool optimize)
+{
+    const size_t min_chunk = size_t(1) << 12;
+    uint32_t n = uint32_t(centroids.size());
+
+    vec3 cmin = centroids[0], cmax = cmin;
+    for (uint32_t i = 1; i < n; i++)
+    {
+        const vec3& c = centroids[i];
+        cmin = vec3(fmin(cmin.x(), c.x()), fmin(cmin.y(), c.y()), fmin(cmin.z(), c.z()));
+        cmax = vec3(fmax(cmax.x(), c.x()), fmax(cmax.y(), c.y()), fmax(cmax.z(), c.z()));
+    }
+    vec3 extent = cmax - cmin;
+    vec3 scale(extent.x() > 0 ? 1 / extent.x() : 0, extent.y() > 0 ? 1 / extent.y() : 0, extent.z() > 0 ? 1 / extent.z() : 0);
+
+    std::vector<uint32_t> codes(n);
+    order.resize(n);
+    parallel_for(n, min_chunk, [&](size_t i)
+    {
+        vec3 p = centroids[i] - cmin;
+        codes[i] = morton_code(p.x() * scale.x(), p.y() * scale.y(), p.z() * scale.z());
+        order[i] = uint32_t(i);
+    });
+    radix_sort(codes, order);
+
+    build_nodes.assign(2 * size_t(n) - 1, build_node());
+    parallel_for(n, min_chunk, [&](size_t p) { build_nodes[n - 1 + p] = { boxes[order[p]], { 0, 0 }, uint32_t(p), 1 }; });
+    if (n == 1)
+        return 0;
+
+    //Length of the common prefix of the keys of sorted prims i and j, -1 if j is out of range
+    auto delta = [&](int64_t i, int64_t j) -> int
+    {
+        if (j < 0 || j >= int64_t(n))
+            return -1;
+        uint64_t a = (uint64_t(codes[size_t(i)]) << 32) | uint64_t(i), b = (uint64_t(codes[size_t(j)]) << 32) | uint64_t(j);
+        return leading_zeros(a ^ b);
+    };
+
+    std::vector<uint32_t> parent(2 * size_t(n) - 1, UINT32_MAX), span(n - 1);
+    parallel_for(n - 1, min_chunk, [&](size_t node)
+    {
+        int64_t i = int64_t(node);
+        //Direction of the node's range from i, and how far it reaches
+        int d = (delta(i, i + 1) > delta(i, i - 1)) ? 1 : -1;
+        int delta_min = delta(i, i - d);
+        int64_t l_max = 2;
+        while (delta(i, i + l_max * d) > delta_min)
+            l_max *= 2;
+        int64_t l = 0;
+        for (int64_t t = l_max / 2; t >= 1; t /= 2)
+            if (delta(i, i + (l + t) * d) > delta_min)
+                l += t;
+        int64_t j = i + l * d;
+
+        //Split where the keys of the range stop sharing the prefix all of them have
+        int delta_node = delta(i, j);
+        int64_t s = 0;
+        for (int64_t div = 2, t = l; t > 1; div *= 2)
+        {
+            t = (l + div - 1) / div;
+            if (delta(i, i + (s + t) * d) > delta_node)
+                s += t;
+        }
+        int64_t gamma = i + s * d + std::min(d, 0);
+
+        uint32_t first = uint32_t(std::min(i, j)), last = uint32_t(std::max(i, j));
+        uint32_t left = (first == gamma) ? n - 1 + uint32_t(gamma) : uint32_t(gamma);
+        uint32_t right = (last == gamma + 1) ? n - 1 + uint32_t(gamma + 1) : uint32_t(gamma + 1);
+        build_node& b = build_nodes[node];
+        b.child[0] = left;
+        b.child[1] = right;
+        b.first = first;
+        b.count = 0;
+        span[node] = last - first + 1;
+        parent[left] = parent[right] = uint32_t(node);
+    });
+
+    std::vector<std::atomic<uint32_t>> arrivals(n - 1);
+    std::vector<double> cost(2 * size_t(n) - 1);
+    parallel_for(n, min_chunk, [&](size_t p)
+    {
+        uint32_t id = n - 1 + uint32_t(p);
+        cost[id] = box_area(build_nodes[id].box);
+        for (uint32_t up = parent[id]; up != UINT32_MAX; up = parent[up])
+        {
+            //The first child to arrive leaves the parent to its sibling, whose writes the acquire then makes visible
+            if (arrivals[up].fetch_add(1, std::memory_order_acq_rel) == 0)
+                return;
+            build_node& b = build_nodes[up];
+            b.box = enclose_boxes(build_nodes[b.child[0]].box, build_nodes[b.child[1]].box);
+            if (optimize)
+                continue;
+
+            double area = box_area(b.box);
+            double split_cost = area + cost[b.child[0]] + cost[b.child[1]];
+            double leaf_cost = span[up] * area;
+            if (span[up] <= max_leaf_size && leaf_cost <= split_cost)
+            {
+                b.count = span[up];
+                cost[up] = leaf_cost;
+            }
+            else
+                cost[up] = split_cost;
+        }
+    });
+
+    if (optimize)
+    {
+        std::vector<uint8_t> height(build_nodes.size(), 0);
+        for (int pass = 0; pass < rotation_passes; pass++)
+            rotate(0, 0, height);
+        //Rotations break up the sorted ranges of the subtrees, so lay the prims out again in tree order while forming the leaves
+        std::vector<uint32_t> sorted;
+        sorted.swap(order);
+        order.resize(n);
+        uint32_t next = 0;
+        linearize(0, sorted, next);
+    }
+    return 0;
+}
+
+/**
+* Improves the subtree under build node id by tree rotations (Kensler 2008), bottom up: a child's child is swapped with the other
+* child wherever that shrinks the box of the child in between the most, as long as the tree stays within max_depth.
+* @param depth - depth of node id.
+* @param height - height of each node's subtree, kept up to date.
+*/
+void bvh::rotate(uint32_t id, int depth, std::vector<uint8_t>& height)
+{
+    build_node& b = build_nodes[id];
+    if (b.count > 0)
+    {
+        height[id] = 0;
+        return;
+    }
+    rotate(b.child[0], depth + 1, height);
+    rotate(b.child[1], depth + 1, height);
+
+    //Swapping the other child into inner child c's slot k, the swapped out grandchild moves up a level and the other child down one
+    int best_c = -1, best_k = 0;
+    double best_gain = 0;
+    for (int c = 0; c < 2; c++)
+    {
+        const build_node& inner = build_nodes[b.child[c]];
+        uint32_t other = b.child[1 - c];
+        if (inner.count > 0 || depth + 2 + height[other] > max_depth)
+            continue;
+        for (int k = 0; k < 2; k++)
+        {
+            double gain = box_area(inner.box) - box_area(enclose_boxes(build_nodes[other].box, build_nodes[inner.child[1 - k]].box));
+            if (gain > best_gain)
+            {
+                best_gain = gain;
+                best_c = c;
+                best_k = k;
+            }
+        }
+    }
+
+    if (best_c >= 0)
+    {
+        uint32_t c = b.child[best_c], other = b.child[1 - best_c];
+        build_node& inner = build_nodes[c];
+        b.child[1 - best_c] = inner.child[best_k];
+        inner.child[best_k] = other;
+        inner.box = enclose_boxes(build_nodes[inner.child[0]].box, build_nodes[inner.child[1]].box);
+        height[c] = uint8_t(1 + std::max(height[inner.child[0]], height[inner.child[1]]));
+    }
+    height[id] = uint8_t(1 + std::max(height[b.child[0]], height[b.child[1]]));
+}
+
+/**
+* Writes the prims under build node id to order from next on, in tree order, so the subtree covers a contiguous range, and turns
+* subtrees into leaves where SAH says so as on the way up.
+* @param sorted - prim of each single prim leaf's first.
+* @return SAH cost of the subtree (unnormalised, intersections and traversal steps both 1).
+*/
+double bvh::linearize(uint32_t id, const std::vector<uint32_t>& sorted, uint32_t& next)
+{
+    build_node& b = build_nodes[id];
+    double area = box_area(b.box);
+    if (b.count > 0)
+    {
+        order[next] = sorted[b.first];
+        b.first = next++;
+        return area;
+    }
+
+    uint32_t first = next;
+    double split_cost = area + linearize(b.child[0], sorted, next) + linearize(b.child[1], sorted, next);
+    uint32_t count = next - first;
+    b.first = first;
+    if (count <= max_leaf_size && count * area <= split_cost)
+    {
+        b.count = count;
+        return count * area;
+    }
+    return split_cost;
+}
+
+/**
+* Collects up to 4 descendants of build node b to become the children of one wide node, always opening the largest inner one.
+* @return number of children.
+*/
+int bvh::gather_children(uint32_t b, uint32_t children[4]) const
+{
+    if (build_nodes[b].count > 0)
+    {
+        children[0] = b;
+        return 1;
+    }
+    int num_children = 2;
+    children[0] = build_nodes[b].child[0];
+    children[1] = build_nodes[b].child[1];
+    while (num_children < 4)
+    {
+        int open = -1;
+        double largest = -1;
+        for (int k = 0; k < num_children; k++)
+        {
+            const build_node& c = build_nodes[children[k]];
+            if (c.count == 0 && box_area(c.box) > largest)
+            {
+                largest = box_area(c.box);
+                open = int(k);
+            }
+        }
+        if (open < 0)
+            break;
+        uint32_t c = children[open];
+        children[open] = build_nodes[c].child[0];
+        children[num_children++] = build_nodes[c].child[1];
+    }
+    return num_children;
+}
+
+/**
+* Lays out wide node out for the subtree under build node b, then its inner children: which slots hold what, where the node's
+* inner children and leaf prims go, and which build nodes its children came from (4 per wide node in sources). The child boxes
+* are quantized afterwards by quantize, every node independently.
+*/
+void bvh::compress(uint32_t out, uint32_t b, const std::vector<prim_ref>& refs, std::vector<bvh_node>& wide, std::vector<prim_ref>& leaf_prims,
+                   std::vector<uint32_t>& sources) const
+{
+    uint32_t children[4];
+    int num_children = gather_children(b, children);
+
+    bvh_node n = {};
+    uint32_t inner[4];
+    int num_inner = 0;
+    n.node_base = uint32_t(wide.size());
+    n.prim_base = uint32_t(leaf_prims.size());
+    for (int k = 0; k < num_children; k++)
+    {
+        const build_node& c = build_nodes[children[k]];
+        if (c.count > 0)
+        {
+            n.meta[k] = uint8_t(c.count);
+            for (uint32_t i = 0; i < c.count; i++)
+                leaf_prims.push_back(refs[order[c.first + i]]);
+        }
+        else
+        {
+            n.meta[k] = 1;
+            n.inner_mask |= uint8_t(1u << k);
+            inner[num_inner++] = children[k];
+        }
+        sources[4 * size_t(out) + k] = children[k];
+    }
+
+    //Reserve the inner children's slots together so they're consecutive, then fill them in
+    wide.resize(wide.size() + num_inner);
+    sources.resize(4 * wide.size(), UINT32_MAX);
+    wide[out] = n;
+    for (int k = 0; k < num_inner; k++)
+        compress(n.node_base + uint32_t(k), inner[k], refs, wide, leaf_prims, sources);
+}
+
+/**
+* Quantizes the boxes of a wide node's children (see bvh_node) against the box enclosing them all.
+* @param children - build nodes the node's children came from, the first num_children slots are used.
+*/
+void bvh::quantize(bvh_node& n, const uint32_t* children, int num_children) const
+{
+    aabb box = build_nodes[children[0]].box;
+    for (int k = 1; k < num_children; k++)
+        box = enclose_boxes(box, build_nodes[children[k]].box);
+
+    double step[3];
+    for (int a = 0; a < 3; a++)
+    {
+        //Origin rounded down to a float, then the smallest step that still reaches the top of the box in 255 steps
+        float o = float(box.min()[a]);
+        if (double(o) > box.min()[a])
+            o = nextafterf(o, -FLT_MAX);
+        int e = -127;
+        if (box.max()[a] > double(o))
+            frexp((box.max()[a] - double(o)) / 255, &e);
+        e = (e < -127) ? -127 : e;
+        while (e < 127 && dequantize(o, 255, exp2_int(e)) < box.max()[a])
+            e++;
+        n.origin[a] = o;
+        n.exponent[a] = int8_t(e);
+        step[a] = exp2_int(e);
+    }
+
+    uint8_t* lo[3] = { n.lo_x, n.lo_y, n.lo_z };
+    uint8_t* hi[3] = { n.hi_x, n.hi_y, n.hi_z };
+    for (int k = 0; k < num_children; k++)
+    {
+        const build_node& c = build_nodes[children[k]];
+        for (int a = 0; a < 3; a++)
+        {
+            //Round outwards, then nudge in case the division rounded the wrong way
+            double ql = floor((c.box.min()[a] - n.origin[a]) / step[a]);
+            double qh = ceil((c.box.max()[a] - n.origin[a]) / step[a]);
+            int ilo = int(fmin(fmax(ql, 0), 255)), ihi = int(fmin(fmax(qh, 0), 255));
+            while (ilo > 0 && dequantize(n.origin[a], uint8_t(ilo), step[a]) > c.box.min()[a])
+                ilo--;
+            while (ihi < 255 && dequantize(n.origin[a], uint8_t(ihi), step[a]) < c.box.max()[a])
+                ihi++;
+            lo[a][k] = uint8_t(ilo);
+            hi[a][k] = uint8_t(ihi);
+        }
+    }
+}
+
+//2^e as a float, subnormal for e = -127 (the exponent of a zero-extent axis).
+inline float exp2_int_float(int e)
+{
+    uint32_t bits = (e >= -126) ? uint32_t(e + 127) << 23 : 1u << (e + 149);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+#if BVH_SIMD
+/**
+* Tests the ray against all 4 child boxes of a node at once in single precision. The decoded bounds are padded by the rounding
+* error of decoding them and of the ray origin, and the entry/exit distances by that of the products, so a box the exact test
+* would hit is never culled.
+* @param o/inv - ray origin and reciprocal direction (with no infinities), splat per axis.
+* @param t_near - set to the distance each child is entered at.
+* @return mask with bit k set if child k is hit within [t_min, t_max].
+*/
+inline int intersect_children(const bvh_node& n, const __m128 o[3], const __m128 abs_o[3], const __m128 inv[3], __m128 t_min, __m128 t_max, __m128& t_near)
+{
+    const __m128i zero = _mm_setzero_si128();
+    //lo_x, lo_y, lo_z, hi_x in one load, hi_y and hi_z in another, widened to 32 bits
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(n.lo_x));
+    __m128i b1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(n.hi_y));
+    __m128i w0 = _mm_unpacklo_epi8(b0, zero), w1 = _mm_unpackhi_epi8(b0, zero), w2 = _mm_unpacklo_epi8(b1, zero);
+    __m128i q[6] = { _mm_unpacklo_epi16(w0, zero), _mm_unpackhi_epi16(w0, zero), _mm_unpacklo_epi16(w1, zero),
+                     _mm_unpackhi_epi16(w1, zero), _mm_unpacklo_epi16(w2, zero), _mm_unpackhi_epi16(w2, zero) };
+
+    const __m128 rel = _mm_set1_ps(1.0f / (1 << 22));
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 near = t_min, far = t_max;
+    for (int a = 0; a < 3; a++)
+    {
+        __m128 origin = _mm_set1_ps(n.origin[a]), step = _mm_set1_ps(exp2_int_float(n.exponent[a]));
+        __m128 lo = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(q[a]), step));
+        __m128 hi = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(q[a + 3]), step));
+        lo = _mm_sub_ps(lo, _mm_mul_ps(_mm_add_ps(_mm_andnot_ps(sign, lo), abs_o[a]), rel));
+        hi = _mm_add_ps(hi, _mm_mul_ps(_mm_add_ps(_mm_andnot_ps(sign, hi), abs_o[a]), rel));
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, o[a]), inv[a]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, o[a]), inv[a]);
+        near = _mm_max_ps(near, _mm_min_ps(t0, t1));
+        far = _mm_min_ps(far, _mm_max_ps(t0, t1));
+    }
+    t_near = _mm_mul_ps(near, _mm_set1_ps(1 - 1.0f / (1 << 20)));
+    const __m128 widen = _mm_set1_ps(1 + 1.0f / (1 << 20));
+    return _mm_movemask_ps(_mm_cmple_ps(near, _mm_mul_ps(far, widen)));
+}
+#endif
+
+template <class F>
+bool bvh::traverse(const ray& r, double t_min, double t_max, F&& leaf) const
+{
+    if (num_nodes == 0)
+        return false;
+
+    const vec3 o = r.origin();
+    const vec3 inv = r.inverse_direction();
+
+#if BVH_SIMD
+    __m128 o4[3], abs_o4[3], inv4[3];
+    for (int a = 0; a < 3; a++)
+    {
+        o4[a] = _mm_set1_ps(float(o[a]));
+        abs_o4[a] = _mm_set1_ps(float(fabs(o[a])));
+        inv4[a] = _mm_set1_ps(float(inv[a]));
+    }
+    //Converting the range to floats may round it inwards, widen it a little
+    const __m128 t_min4 = _mm_set1_ps(float(t_min) * (1 - 1.0f / (1 << 20)));
+#endif
+
+    struct entry { uint32_t node; double t; };
+    entry stack[stack_size];
+    int sp = 0;
+    stack[sp++] = { 0, t_min };
+    bool hit_anything = false;
+
+    while (sp > 0)
+    {
+        entry e = stack[--sp];
+        if (e.t > t_max)
+            continue;
+
+        const bvh_node& n = nodes[e.node];
+#if BVH_SIMD
+        __m128 t_near4;
+        int hit_mask = intersect_children(n, o4, abs_o4, inv4, t_min4, _mm_set1_ps(float(fmin(t_max, FLT_MAX)) * (1 + 1.0f / (1 << 20))), t_near4);
+        alignas(16) float t_near[4];
+        _mm_store_ps(t_near, t_near4);
+#else
+        const double step[3] = { exp2_int(n.exponent[0]), exp2_int(n.exponent[1]), exp2_int(n.exponent[2]) };
+        const uint8_t* lo[3] = { n.lo_x, n.lo_y, n.lo_z };
+        const uint8_t* hi[3] = { n.hi_x, n.hi_y, n.hi_z };
+        int hit_mask = 0;
+        double t_near[4];
+        for (int k = 0; k < 4 && n.meta[k] != 0; k++)
+        {
+            double near = t_min, far = t_max;
+            for (int a = 0; a < 3; a++)
+            {
+                double t0 = (dequantize(n.origin[a], lo[a][k], step[a]) - o[a]) * inv[a];
+                double t1 = (dequantize(n.origin[a], hi[a][k], step[a]) - o[a]) * inv[a];
+                if (t0 > t1)
+                    std::swap(t0, t1);
+                near = (t0 > near) ? t0 : near;
+                far = (t1 < far) ? t1 : far;
+            }
+            //Widen the exit a few ulps so rounding in the slab test can't lose grazing hits
+            t_near[k] = near;
+            hit_mask |= (near <= far * (1 + 4 * DBL_EPSILON)) ? (1 << k) : 0;
+        }
+#endif
+
+        entry near_children[4];
+        int num_near = 0;
+        uint32_t next_node = n.node_base, next_prim = n.prim_base;
+        for (int k = 0; k < 4 && n.meta[k] != 0; k++)
+        {
+            bool is_inner = (n.inner_mask >> k) & 1;
+            uint32_t child_node = is_inner ? next_node++ : 0;
+            uint32_t first_prim = next_prim;
+            if (!is_inner)
+                next_prim += n.meta[k];
+            if (!((hit_mask >> k) & 1))
+                continue;
+
+            if (is_inner)
+            {
+                //Keep the hit children sorted by entry distance, furthest first
+                int j = num_near++;
+                while (j > 0 && near_children[j - 1].t < t_near[k])
+                {
+                    near_children[j] = near_children[j - 1];
+                    j--;
+                }
+                near_children[j] = { child_node, t_near[k] };
+            }
+            else
+            {
+                for (uint32_t p = first_prim; p < first_prim + n.meta[k]; p++)
+                    hit_anything |= leaf(prims[p], t_max);
+            }
+        }
+
+        //Pushed furthest first so the nearest child is visited next
+        for (int j = 0; j < num_near; j++)
+            stack[sp++] = near_children[j];
+    }
+    return hit_anything;
+}
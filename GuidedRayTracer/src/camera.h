@@ -1,4 +1,6 @@
 #pragma once
+#include <vector>
+
 #include "ray.h"
 
 class camera {
@@ -9,8 +11,15 @@ public:
     vec3 horizontal;
     vec3 vertical;
     vec3 u, v, w;
+    double lens_radius;
+    //Size of a pixel in image plane coords, used for the ray differentials (0 until set_resolution is called).
+    double pixel_ds, pixel_dt;
 
-    camera(vec3 lookfrom, vec3 lookat, vec3 vup, double vfov, double aspect) {
+    /**
+    * @param aperture - diameter of the thin lens, 0 gives a pinhole camera.
+    * @param focus_dist - distance from lookfrom to the plane in perfect focus.
+    */
+    camera(vec3 lookfrom, vec3 lookat, vec3 vup, double vfov, double aspect, double aperture = 0, double focus_dist = 1) {
         w = unit_vector(lookfrom - lookat);
         u = unit_vector(cross(vup, w));
         v = unit_vector(cross(w, u));
@@ -19,14 +28,128 @@ public:
         double height = tan(theta);
         double width = aspect * height;
         origin = lookfrom;
+        lens_radius = aperture / 2;
+        pixel_ds = pixel_dt = 0;
+
+        lower_left_corner = origin - focus_dist * ((width / 2) * u + (height / 2) * v + w);
+        horizontal = focus_dist * width * u;
+        vertical = focus_dist * height * v;
+    }
 
-        lower_left_corner = origin - (width / 2) * u - (height / 2) * v - w;
-        horizontal = width * u;
-        vertical = height * v;
+    //Tells the camera how many pixels the image has, enabling ray differentials on the rays it generates.
+    inline void set_resolution(int nx, int ny) {
+        pixel_ds = 1.0 / nx;
+        pixel_dt = 1.0 / ny;
     }
 
+    /**
+    * Gets the ray through image plane coords (s, t). Once the resolution is known the ray carries a cone bounding its differentials,
+    * i.e. the rays through the neighbouring pixels, which is what texture filtering uses to pick its footprint.
+    */
     inline ray get_ray(double s, double t) {
-        return ray(origin, lower_left_corner + s * horizontal + t * vertical - origin);
+        vec3 d = lower_left_corner + s * horizontal + t * vertical - origin;
+        if (pixel_ds <= 0)
+            return ray(origin, d);
+
+        vec3 unit_d = unit_vector(d);
+        double cos_x = dot(unit_d, unit_vector(d + pixel_ds * horizontal));
+        double cos_y = dot(unit_d, unit_vector(d + pixel_dt * vertical));
+        double spread = acos(fmin(fmin(cos_x, cos_y), 1.0));
+        return ray(origin, d, 0, spread);
+    }
+
+    /**
+    * Gets the ray through image plane coords (s, t), starting from the point on the lens picked by (lens_u, lens_v) in [0, 1)^2.
+    */
+    inline ray get_ray(double s, double t, double lens_u, double lens_v) {
+        if (lens_radius <= 0)
+            return get_ray(s, t);
+
+        //Concentric mapping of the square onto the lens disk
+        double a = 2 * lens_u - 1, b = 2 * lens_v - 1, r, phi;
+        if (a == 0 && b == 0)
+            return get_ray(s, t);
+        if (a * a > b * b) { r = a; phi = (M_PI / 4) * (b / a); }
+        else { r = b; phi = (M_PI / 2) - (M_PI / 4) * (a / b); }
+        vec3 offset = lens_radius * r * (cos(phi) * u + sin(phi) * v);
+
+        ray pinhole = get_ray(s, t);
+        return ray(origin + offset, pinhole.direction() - offset, 0, pinhole.cone_angle);
+    }
+
+    //Area of the image plane scaled to unit distance from the origin.
+    inline double image_area() const {
+        double d = dot(origin - lower_left_corner, w);
+        return horizontal.length() * vertical.length() / (d * d);
+    }
+
+    /**
+    * Finds the image plane coords (s, t) of the pinhole ray that passes through p.
+    * @return false if p is behind the camera or outside the image.
+    */
+    inline bool project(const vec3& p, double& s, double& t) const {
+        vec3 d = p - origin;
+        double z = -dot(d, w);
+        if (z <= 0)
+            return false;
+        vec3 q = origin + d * (dot(origin - lower_left_corner, w) / z) - lower_left_corner;
+        s = dot(q, horizontal) / horizontal.squared_length();
+        t = dot(q, vertical) / vertical.squared_length();
+        return s >= 0 && s < 1 && t >= 0 && t < 1;
+    }
+
+    /**
+    * Importance the pinhole camera gives to light arriving from unit direction -d, normalised so it integrates to 1 over the
+    * image. Rays through uniformly distributed (s, t) leave in direction d with a solid angle density of importance * cos(theta).
+    */
+    inline double importance(const vec3& d) const {
+        double cos_t = -dot(d, w);
+        if (cos_t <= 0)
+            return 0;
+        return 1 / (image_area() * cos_t * cos_t * cos_t * cos_t);
+    }
+
+    //Solid angle density of the pinhole ray leaving in unit direction d, for uniformly distributed (s, t).
+    inline double direction_pdf(const vec3& d) const {
+        return importance(d) * fmax(-dot(d, w), 0.0);
+    }
+
+};
+
+//Placement of a camera independent of the image it is used for, so the same view can be rebuilt for any aspect ratio.
+struct camera_view
+{
+    vec3 lookfrom, lookat, vup;
+    double vfov;
+    double aperture;
+    double focus_dist;
+
+    inline camera make_camera(double aspect) const { return camera(lookfrom, lookat, vup, vfov, aspect, aperture, focus_dist); }
+
+    //Builds the camera for an nx by ny image, with ray differentials enabled.
+    inline camera make_camera(int nx, int ny) const
+    {
+        camera cam = make_camera(double(nx) / double(ny));
+        cam.set_resolution(nx, ny);
+        return cam;
+    }
+
+    //Gets the same view with lookfrom swung around lookat by the given angle (degrees), about vup.
+    inline camera_view orbited(double degrees) const
+    {
+        vec3 k = unit_vector(vup), d = lookfrom - lookat;
+        double a = degrees * M_PI / 180, c = cos(a), s = sin(a);
+        camera_view v = *this;
+        v.lookfrom = lookat + d * c + cross(k, d) * s + k * (dot(k, d) * (1 - c));
+        return v;
     }
+};
 
-};
\ No newline at end of file
+//Gets count views evenly spaced on a full turn around the base view's lookat, starting with the base view itself.
+inline std::vector<camera_view> turntable_views(const camera_view& base, int count)
+{
+    std::vector<camera_view> views;
+    for (int i = 0; i < count; i++)
+        views.push_back(base.orbited(360.0 * i / count));
+    return views;
+}
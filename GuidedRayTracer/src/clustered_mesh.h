@@ -0,0 +1,531 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "mapped_file.h"
+#include "triangle.h"
+
+/**
+* On-disk layout of an out-of-core triangle mesh (.gmc), split into spatially coherent clusters that are paged in independently:
+*
+*     gmc_header
+*     gmc_cluster[num_clusters]     bounds and location of every cluster
+*     cluster data                  each starting on a 4096 byte boundary, so it can be mapped directly:
+*         bvh_node[num_nodes]           the cluster's own BVH, node indices relative to the cluster
+*         prim_ref[num_triangles]       leaf prim refs, indexing the cluster's triangles
+*         gmc_triangle[num_triangles]
+*
+* Nothing in a cluster refers to memory outside of it, so a mapped cluster is ready to trace as is.
+*/
+struct gmc_header
+{
+    static const uint32_t magic_value = 0x434D4746; // "FGMC"
+    static const uint32_t current_version = 1;
+    static const uint64_t cluster_alignment = 4096;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_clusters;
+    uint32_t reserved;
+    uint64_t num_triangles;
+};
+
+struct gmc_cluster
+{
+    float lo[3], hi[3];
+    uint64_t offset;
+    uint64_t bytes;
+    uint32_t num_triangles;
+    uint32_t num_nodes;
+};
+
+struct gmc_triangle
+{
+    float a[3], b[3], c[3];
+    //Unit normal
+    float n[3];
+};
+
+/**
+* A triangle mesh far larger than memory, traced straight out of a memory-mapped .gmc file. Only the cluster table and a small
+* BVH over the clusters' bounds are held in memory; clusters are mapped on first use and unmapped again, least recently used
+* first, once the mapped clusters exceed the residency budget.
+*
+* Rays can be traced one at a time (hit) or as a batch (intersect) which visits every cluster the rays reach once with all of
+* their rays, so a cluster that has to be paged in is paged in once per batch rather than once per ray.
+*
+* Rays visiting a resident cluster take no lock: each cluster has a slot with an atomic pointer to its mapping and a count of the
+* rays inside it, only mapping a cluster (and evicting others to make room) goes through the mesh's lock.
+*/
+class clustered_mesh
+{
+private:
+    struct resident_cluster
+    {
+        std::unique_ptr<mapped_region> region;
+        bvh tree;
+        const gmc_triangle* triangles;
+    };
+
+    /**
+    * Residency of one cluster. A ray announces itself in users before loading the mapping, and eviction clears the mapping before
+    * reading users, so an evicted mapping is only unmapped once no ray that could have seen it is left inside.
+    */
+    struct cluster_slot
+    {
+        std::atomic<const resident_cluster*> mapping;
+        std::atomic<uint32_t> users;
+        //Value of the mesh's epoch when the cluster was last visited, the oldest is evicted first
+        std::atomic<uint64_t> last_use;
+    };
+
+    mapped_file file;
+    gmc_header header;
+    std::vector<gmc_cluster> clusters;
+    arena top_mem;
+    //Hierarchy over the clusters' bounds, its prim refs are cluster indices
+    bvh top;
+    aabb bounds;
+
+    std::unique_ptr<cluster_slot[]> slots;
+    //Advanced whenever a cluster is mapped, so every cluster visited since then counts as more recent than the rest
+    mutable std::atomic<uint64_t> epoch;
+
+    //Guards everything below, only taken to map and evict
+    mutable std::mutex lock;
+    mutable std::vector<std::unique_ptr<const resident_cluster>> owned;
+    //Clusters whose mapping is set, and evicted mappings waiting for their last users to leave
+    mutable std::vector<uint32_t> resident;
+    mutable std::vector<std::pair<uint32_t, std::unique_ptr<const resident_cluster>>> retired;
+    mutable size_t mapped_bytes;
+    size_t budget;
+
+    /**
+    * Maps a cluster that wasn't resident when the caller (already counted in its users) looked, unmapping others to stay in budget.
+    * @return null if it can't be mapped.
+    */
+    const resident_cluster* acquire(uint32_t c) const;
+
+    //Calls f(cluster) with cluster c mapped, and keeps it mapped until f returns. f isn't called if it can't be mapped.
+    template <class F>
+    void visit_cluster(uint32_t c, F&& f) const;
+
+    //Traces the ray against a single resident cluster.
+    static bool hit_cluster(const resident_cluster& c, const ray& r, double t_min, double t_max, hit_record& rec);
+
+public:
+    mutable std::atomic<uint64_t> misses, evictions;
+
+    /**
+    * Opens a .gmc file, only its header and cluster table are read.
+    * @param budget_bytes - how much cluster data may be mapped at once.
+    */
+    clustered_mesh(const std::string& path, size_t budget_bytes);
+
+    clustered_mesh(const clustered_mesh&) = delete;
+    clustered_mesh& operator=(const clustered_mesh&) = delete;
+
+    inline bool valid() const { return header.magic == gmc_header::magic_value; }
+    inline uint64_t size() const { return header.num_triangles; }
+    inline size_t num_clusters() const { return clusters.size(); }
+
+    //Bytes of cluster data currently mapped.
+    inline size_t resident_bytes() const { std::lock_guard<std::mutex> guard(lock); return mapped_bytes; }
+
+    /**
+    * Finds the closest triangle along the ray, rec's t, p and normal are filled in on a hit.
+    */
+    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+
+    //How many (cluster, ray) pairs intersect queues up before tracing them
+    static const size_t max_queued = 1024;
+
+    /**
+    * Traces a batch of rays, grouping them per cluster so each cluster is visited once (per max_queued pairs) for all of them.
+    * @param t_max - the furthest hit to accept for each ray, brought in to every hit found.
+    * @param recs - the closest hit of every ray, only filled in where hit is true.
+    * @param hit - whether each ray hit the mesh closer than its t_max.
+    */
+    void intersect(const ray* rays, size_t count, double t_min, double* t_max, hit_record* recs, bool* hit) const;
+
+    inline bool bounding_box(aabb& box) const
+    {
+        if (clusters.empty())
+            return false;
+        box = bounds;
+        return true;
+    }
+};
+
+clustered_mesh::clustered_mesh(const std::string& path, size_t budget_bytes)
+    : file(path), header{}, epoch{ 0 }, mapped_bytes{ 0 }, budget{ budget_bytes }, misses{ 0 }, evictions{ 0 }
+{
+    std::unique_ptr<mapped_region> head = file.map(0, sizeof(gmc_header));
+    if (!head)
+        return;
+    gmc_header h;
+    memcpy(&h, head->data(), sizeof(h));
+    if (h.magic != gmc_header::magic_value || h.version != gmc_header::current_version || h.num_clusters == 0)
+        return;
+
+    std::unique_ptr<mapped_region> table = file.map(sizeof(gmc_header), size_t(h.num_clusters) * sizeof(gmc_cluster));
+    if (!table)
+        return;
+    clusters.resize(h.num_clusters);
+    memcpy(clusters.data(), table->data(), clusters.size() * sizeof(gmc_cluster));
+
+    std::vector<prim_ref> refs(clusters.size());
+    std::vector<aabb> boxes(clusters.size());
+    for (size_t c = 0; c < clusters.size(); c++)
+    {
+        const gmc_cluster& cl = clusters[c];
+        if (cl.offset % gmc_header::cluster_alignment != 0 || cl.offset > file.size() || cl.bytes > file.size() - cl.offset)
+        {
+            clusters.clear();
+            return;
+        }
+        refs[c] = make_prim_ref(0, uint32_t(c));
+        boxes[c] = aabb(vec3(cl.lo[0], cl.lo[1], cl.lo[2]), vec3(cl.hi[0], cl.hi[1], cl.hi[2]));
+        bounds = (c == 0) ? boxes[c] : enclose_boxes(bounds, boxes[c]);
+    }
+    top.build(refs, boxes, top_mem);
+
+    slots.reset(new cluster_slot[clusters.size()]);
+    owned.resize(clusters.size());
+    for (size_t c = 0; c < clusters.size(); c++)
+    {
+        slots[c].mapping.store(nullptr);
+        slots[c].users.store(0);
+        slots[c].last_use.store(0);
+    }
+    header = h;
+}
+
+const clustered_mesh::resident_cluster* clustered_mesh::acquire(uint32_t c) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    //Another ray may have mapped it in the meantime
+    if (const resident_cluster* mapped = slots[c].mapping.load())
+        return mapped;
+
+    misses.fetch_add(1, std::memory_order_relaxed);
+    const gmc_cluster& cl = clusters[c];
+    std::unique_ptr<mapped_region> region = file.map(cl.offset, size_t(cl.bytes));
+    if (!region)
+        return nullptr;
+    region->prefetch();
+
+    std::unique_ptr<resident_cluster> rc(new resident_cluster());
+    rc->region = std::move(region);
+    const uint8_t* p = rc->region->data();
+    size_t prims_offset = size_t(cl.num_nodes) * sizeof(bvh_node);
+    size_t triangles_offset = (prims_offset + size_t(cl.num_triangles) * sizeof(prim_ref) + 15) & ~size_t(15);
+    rc->tree.nodes = const_cast<bvh_node*>(reinterpret_cast<const bvh_node*>(p));
+    rc->tree.num_nodes = cl.num_nodes;
+    rc->tree.prims = const_cast<prim_ref*>(reinterpret_cast<const prim_ref*>(p + prims_offset));
+    rc->tree.num_prims = cl.num_triangles;
+    rc->triangles = reinterpret_cast<const gmc_triangle*>(p + triangles_offset);
+
+    const resident_cluster* mapped = rc.get();
+    owned[c] = std::move(rc);
+    slots[c].last_use.store(epoch.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slots[c].mapping.store(mapped);
+    resident.push_back(c);
+    mapped_bytes += size_t(cl.bytes);
+
+    while (mapped_bytes > budget && resident.size() > 1)
+    {
+        size_t oldest = (resident[0] == c) ? 1 : 0;
+        for (size_t k = 0; k < resident.size(); k++)
+            if (resident[k] != c && slots[resident[k]].last_use.load(std::memory_order_relaxed) < slots[resident[oldest]].last_use.load(std::memory_order_relaxed))
+                oldest = k;
+        uint32_t victim = resident[oldest];
+        resident[oldest] = resident.back();
+        resident.pop_back();
+        slots[victim].mapping.store(nullptr);
+        retired.emplace_back(victim, std::move(owned[victim]));
+        mapped_bytes -= size_t(clusters[victim].bytes);
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    //Unmap evicted clusters no ray is inside any more, rays that came in after the eviction see no mapping and end up here
+    for (size_t k = 0; k < retired.size();)
+    {
+        if (slots[retired[k].first].users.load() == 0)
+        {
+            retired[k] = std::move(retired.back());
+            retired.pop_back();
+        }
+        else
+            k++;
+    }
+    return mapped;
+}
+
+bool clustered_mesh::hit_cluster(const resident_cluster& c, const ray& r, double t_min, double t_max, hit_record& rec)
+{
+    return c.tree.traverse(r, t_min, t_max, [&](prim_ref p, double& t_far)
+    {
+        const gmc_triangle& t = c.triangles[prim_ref_index(p)];
+        if (!hit_triangle(vec3(t.a[0], t.a[1], t.a[2]), vec3(t.b[0], t.b[1], t.b[2]), vec3(t.c[0], t.c[1], t.c[2]),
+                          vec3(t.n[0], t.n[1], t.n[2]), r, t_min, t_far, rec))
+            return false;
+        t_far = rec.t;
+        return true;
+    });
+}
+
+template <class F>
+void clustered_mesh::visit_cluster(uint32_t c, F&& f) const
+{
+    cluster_slot& slot = slots[c];
+    slot.users.fetch_add(1);
+    const resident_cluster* rc = slot.mapping.load();
+    if (rc == nullptr)
+        rc = acquire(c);
+    uint64_t now = epoch.load(std::memory_order_relaxed);
+    //Only written when it changes, so rays sharing a cluster don't keep stealing its cache line from each other
+    if (slot.last_use.load(std::memory_order_relaxed) != now)
+        slot.last_use.store(now, std::memory_order_relaxed);
+    if (rc != nullptr)
+        f(*rc);
+    slot.users.fetch_sub(1, std::memory_order_release);
+}
+
+bool clustered_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    if (!valid())
+        return false;
+    return top.traverse(r, t_min, t_max, [&](prim_ref p, double& t_far)
+    {
+        bool found = false;
+        visit_cluster(prim_ref_index(p), [&](const resident_cluster& c) { found = hit_cluster(c, r, t_min, t_far, rec); });
+        if (!found)
+            return false;
+        t_far = rec.t;
+        return true;
+    });
+}
+
+void clustered_mesh::intersect(const ray* rays, size_t count, double t_min, double* t_max, hit_record* recs, bool* hit) const
+{
+    for (size_t i = 0; i < count; i++)
+        hit[i] = false;
+    if (!valid())
+        return;
+
+    //(cluster, ray) pairs whose bounds meet, traced a cluster at a time whenever the queue fills up
+    std::pair<uint32_t, uint32_t> queue[max_queued];
+    size_t queued = 0;
+    auto flush = [&]
+    {
+        std::sort(queue, queue + queued);
+        for (size_t q = 0; q < queued;)
+        {
+            size_t end = q;
+            while (end < queued && queue[end].first == queue[q].first)
+                end++;
+            visit_cluster(queue[q].first, [&](const resident_cluster& c)
+            {
+                for (size_t k = q; k < end; k++)
+                {
+                    uint32_t i = queue[k].second;
+                    hit_record rec;
+                    if (hit_cluster(c, rays[i], t_min, t_max[i], rec))
+                    {
+                        t_max[i] = rec.t;
+                        recs[i] = rec;
+                        hit[i] = true;
+                    }
+                }
+            });
+            q = end;
+        }
+        queued = 0;
+    };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        //The callback never reports a hit, so no cluster is culled
+        top.traverse(rays[i], t_min, t_max[i], [&](prim_ref p, double&)
+        {
+            if (queued == max_queued)
+                flush();
+            queue[queued++] = { prim_ref_index(p), uint32_t(i) };
+            return false;
+        });
+    }
+    flush();
+}
+
+/**
+* Converts a Wavefront OBJ mesh (v and f records only, polygons are fan triangulated) into a clustered .gmc file. Triangles are
+* split by median along the widest axis until every cluster holds at most cluster_size of them. The conversion itself works in
+* memory, so it has to be run on a machine that can hold the mesh once; rendering it afterwards does not.
+* @return false if the input can't be read or the output written.
+*/
+bool make_clustered_mesh(const std::string& obj_path, const std::string& gmc_path, uint32_t cluster_size = 4096)
+{
+    std::ifstream in(obj_path);
+    if (!in || cluster_size == 0)
+        return false;
+
+    std::vector<vec3> vertices;
+    std::vector<gmc_triangle> triangles;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream ls(line);
+        std::string tag;
+        ls >> tag;
+        if (tag == "v")
+        {
+            double x, y, z;
+            if (!(ls >> x >> y >> z))
+                return false;
+            vertices.push_back(vec3(x, y, z));
+        }
+        else if (tag == "f")
+        {
+            //Indices are 1 based, negative ones count back from the last vertex; texture/normal indices after '/' are ignored
+            std::vector<long> face;
+            std::string token;
+            while (ls >> token)
+            {
+                long idx = strtol(token.c_str(), nullptr, 10);
+                idx = (idx < 0) ? long(vertices.size()) + idx : idx - 1;
+                if (idx < 0 || idx >= long(vertices.size()))
+                    return false;
+                face.push_back(idx);
+            }
+            for (size_t k = 2; k < face.size(); k++)
+            {
+                vec3 v[3] = { vertices[face[0]], vertices[face[k - 1]], vertices[face[k]] };
+                vec3 n = cross(v[1] - v[0], v[2] - v[0]);
+                if (n.length() == 0)
+                    continue;
+                n.make_unit_vector();
+                gmc_triangle t;
+                for (int a = 0; a < 3; a++)
+                {
+                    t.a[a] = float(v[0][a]); t.b[a] = float(v[1][a]); t.c[a] = float(v[2][a]);
+                    t.n[a] = float(n[a]);
+                }
+                triangles.push_back(t);
+            }
+        }
+    }
+    if (triangles.empty())
+        return false;
+
+    auto centroid = [&](uint32_t i, int a) { return triangles[i].a[a] + triangles[i].b[a] + triangles[i].c[a]; };
+    auto tri_box = [&](uint32_t i)
+    {
+        const gmc_triangle& t = triangles[i];
+        return aabb(vec3(fmin(t.a[0], fmin(t.b[0], t.c[0])), fmin(t.a[1], fmin(t.b[1], t.c[1])), fmin(t.a[2], fmin(t.b[2], t.c[2]))),
+                    vec3(fmax(t.a[0], fmax(t.b[0], t.c[0])), fmax(t.a[1], fmax(t.b[1], t.c[1])), fmax(t.a[2], fmax(t.b[2], t.c[2]))));
+    };
+
+    //Split into clusters, each a contiguous range of order
+    std::vector<uint32_t> order(triangles.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = uint32_t(i);
+    std::vector<std::pair<size_t, size_t>> ranges, pending = { { 0, order.size() } };
+    while (!pending.empty())
+    {
+        std::pair<size_t, size_t> rg = pending.back();
+        pending.pop_back();
+        if (rg.second - rg.first <= cluster_size)
+        {
+            ranges.push_back(rg);
+            continue;
+        }
+        double lo[3] = { DBL_MAX, DBL_MAX, DBL_MAX }, hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+        for (size_t i = rg.first; i < rg.second; i++)
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = fmin(lo[a], centroid(order[i], a));
+                hi[a] = fmax(hi[a], centroid(order[i], a));
+            }
+        int axis = (hi[0] - lo[0] > hi[1] - lo[1] && hi[0] - lo[0] > hi[2] - lo[2]) ? 0 : (hi[1] - lo[1] > hi[2] - lo[2] ? 1 : 2);
+        size_t mid = (rg.first + rg.second) / 2;
+        std::nth_element(order.begin() + rg.first, order.begin() + mid, order.begin() + rg.second,
+                         [&](uint32_t x, uint32_t y) { return centroid(x, axis) < centroid(y, axis); });
+        //Pushed second half first so clusters come out in order, keeping neighbours close together in the file
+        pending.push_back({ mid, rg.second });
+        pending.push_back({ rg.first, mid });
+    }
+
+    gmc_header header = {};
+    header.magic = gmc_header::magic_value;
+    header.version = gmc_header::current_version;
+    header.num_clusters = uint32_t(ranges.size());
+    header.num_triangles = triangles.size();
+
+    std::ofstream out(gmc_path, std::ios::binary);
+    if (!out)
+        return false;
+    std::vector<gmc_cluster> table(ranges.size());
+    uint64_t pos = sizeof(gmc_header) + table.size() * sizeof(gmc_cluster);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(gmc_cluster));
+
+    std::vector<char> zeros(gmc_header::cluster_alignment, 0);
+    for (size_t c = 0; c < ranges.size(); c++)
+    {
+        size_t n = ranges[c].second - ranges[c].first;
+        std::vector<gmc_triangle> local(n);
+        std::vector<prim_ref> refs(n);
+        std::vector<aabb> boxes(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t t = order[ranges[c].first + i];
+            local[i] = triangles[t];
+            refs[i] = make_prim_ref(0, uint32_t(i));
+            boxes[i] = tri_box(t);
+        }
+        arena mem;
+        bvh tree;
+        tree.build(refs, boxes, mem);
+
+        aabb box = boxes[0];
+        for (size_t i = 1; i < n; i++)
+            box = enclose_boxes(box, boxes[i]);
+
+        uint64_t start = (pos + gmc_header::cluster_alignment - 1) & ~(gmc_header::cluster_alignment - 1);
+        out.write(zeros.data(), std::streamsize(start - pos));
+        size_t prims_offset = tree.num_nodes * sizeof(bvh_node);
+        size_t triangles_offset = (prims_offset + n * sizeof(prim_ref) + 15) & ~size_t(15);
+        out.write(reinterpret_cast<const char*>(tree.nodes), std::streamsize(prims_offset));
+        out.write(reinterpret_cast<const char*>(tree.prims), std::streamsize(n * sizeof(prim_ref)));
+        out.write(zeros.data(), std::streamsize(triangles_offset - prims_offset - n * sizeof(prim_ref)));
+        out.write(reinterpret_cast<const char*>(local.data()), std::streamsize(n * sizeof(gmc_triangle)));
+
+        gmc_cluster& cl = table[c];
+        for (int a = 0; a < 3; a++)
+        {
+            cl.lo[a] = float(box.min()[a]);
+            cl.hi[a] = float(box.max()[a]);
+        }
+        cl.offset = start;
+        cl.bytes = triangles_offset + n * sizeof(gmc_triangle);
+        cl.num_triangles = uint32_t(n);
+        cl.num_nodes = uint32_t(tree.num_nodes);
+        pos = start + cl.bytes;
+    }
+
+    //Now that every cluster's place is known, fill in the table
+    out.seekp(sizeof(gmc_header));
+    out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(gmc_cluster));
+    return bool(out);
+}
@@ -1,6 +1,5 @@
 #pragma once
 #include "triangle.h"
-#include "hitable_list.h"
 
 
 //This whole class outta be cleaned up eventually!
@@ -109,17 +108,33 @@ public:
 	}
 };
 
+//Tests the 12 faces in place, this runs for every ray so it mustn't allocate.
 bool cube::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
 {
-	hitable* triangles[12];
-	build_cube(triangles);
-	hitable* faces = new hitable_list(triangles, 12);
-	bool res = faces->hit(r, t_min, t_max, rec, closest_mat);
-	delete[] faces;
-	return res;
+	bool hit_anything = false;
+	for (int i = 0; i < 12; i++)
+	{
+		const vec3& a = vertices[indices[3 * i]];
+		const vec3& b = vertices[indices[3 * i + 1]];
+		const vec3& c = vertices[indices[3 * i + 2]];
+		if (hit_triangle(a, b, c, unit_vector(cross(b - a, c - a)), r, t_min, t_max, rec))
+		{
+			hit_anything = true;
+			t_max = rec.t;
+		}
+	}
+	if (hit_anything)
+		closest_mat = mat;
+	return hit_anything;
 }
-//TODO
 bool cube::bounding_box(aabb& box) const
 {
-	return false;
+	vec3 lo = vertices[0], hi = vertices[0];
+	for (int i = 1; i < 8; i++)
+	{
+		lo = vec3(fmin(lo.x(), vertices[i].x()), fmin(lo.y(), vertices[i].y()), fmin(lo.z(), vertices[i].z()));
+		hi = vec3(fmax(hi.x(), vertices[i].x()), fmax(hi.y(), vertices[i].y()), fmax(hi.z(), vertices[i].z()));
+	}
+	box = aabb(lo, hi);
+	return true;
 }
\ No newline at end of file
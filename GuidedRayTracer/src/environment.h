@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image_io.h"
+#include "lights.h"
+#include "ray.h"
+#include "trace.h"
+
+/**
+* HDR environment lighting the scene from infinitely far away, stored as a latitude-longitude map: rows run from straight up
+* (top row) to straight down, columns once around the vertical axis starting and ending behind -z, so -z is in the middle.
+*
+* Directions can be sampled in proportion to the radiance, a piecewise constant density over the texels (luminance times the
+* sine of the latitude, for the area a texel covers on the sphere), picking a row from the marginal distribution and a column
+* from that row's conditional one. A sun a few texels across then gets most of the samples however small it is.
+*/
+class environment_map
+{
+private:
+    int width, height;
+    //Radiance, top row first
+    std::vector<float> rgb;
+    //Marginal cdf over the rows, and each row's conditional cdf over its texels, both starting at 0 and ending at 1
+    std::vector<double> row_cdf;
+    std::vector<float> texel_cdf;
+
+    inline vec3 texel(int x, int y) const
+    {
+        const float* c = &rgb[(size_t(y) * width + x) * 3];
+        return vec3(c[0], c[1], c[2]);
+    }
+
+    //Finds the texel containing unit direction d, and the sine of its latitude.
+    inline void locate(const vec3& d, int& x, int& y, double& sin_t) const
+    {
+        double cos_t = fmin(fmax(d.y(), -1.0), 1.0);
+        sin_t = sqrt(fmax(0.0, 1 - cos_t * cos_t));
+        double u = 0.5 + atan2(d.x(), -d.z()) / (2 * M_PI), v = acos(cos_t) / M_PI;
+        x = std::min(std::max(int(u * width), 0), width - 1);
+        y = std::min(std::max(int(v * height), 0), height - 1);
+    }
+
+    //Probability of picking texel (x, y).
+    inline double texel_pmf(int x, int y) const
+    {
+        const float* c = &texel_cdf[size_t(y) * (width + 1)];
+        return (row_cdf[y + 1] - row_cdf[y]) * (double(c[x + 1]) - double(c[x]));
+    }
+
+    //Finds the interval of a cdf of n entries (n + 1 values) containing u, and where u lies within it.
+    template <class T>
+    static inline int invert(const T* cdf, int n, double u, double& offset)
+    {
+        int i = int(std::upper_bound(cdf, cdf + n + 1, T(u)) - cdf) - 1;
+        i = std::min(std::max(i, 0), n - 1);
+        while (i > 0 && cdf[i + 1] == cdf[i] && u < cdf[i])
+            i--;
+        double lo = cdf[i], hi = cdf[i + 1];
+        offset = (hi > lo) ? fmin(fmax((u - lo) / (hi - lo), 0.0), 1 - DBL_EPSILON) : 0.5;
+        return i;
+    }
+
+public:
+    /**
+    * @param rgb - width * height texels of linear radiance, top row first.
+    */
+    environment_map(int width, int height, std::vector<float> rgb);
+
+    inline vec3 radiance(const vec3& dir) const
+    {
+        int x, y;
+        double sin_t;
+        locate(unit_vector(dir), x, y, sin_t);
+        return texel(x, y);
+    }
+
+    /**
+    * Picks a direction in proportion to the radiance from it.
+    * @param u1/u2 - uniform numbers, u2 picks the row and u1 the column.
+    * @return false if the map is black everywhere.
+    */
+    bool sample(double u1, double u2, light_sample& ls) const;
+
+    //Solid angle density with which sample() picks the unit direction wi.
+    inline double pdf(const vec3& wi) const
+    {
+        int x, y;
+        double sin_t;
+        locate(wi, x, y, sin_t);
+        if (sin_t <= 0)
+            return 0;
+        return texel_pmf(x, y) * width * height / (2 * M_PI * M_PI * sin_t);
+    }
+};
+
+environment_map::environment_map(int width, int height, std::vector<float> rgb) : width{ width }, height{ height }, rgb(std::move(rgb))
+{
+    row_cdf.assign(size_t(height) + 1, 0.0);
+    texel_cdf.assign(size_t(height) * (width + 1), 0.0f);
+    for (int y = 0; y < height; y++)
+    {
+        float* c = &texel_cdf[size_t(y) * (width + 1)];
+        double sum = 0;
+        for (int x = 0; x < width; x++)
+        {
+            sum += luminance(texel(x, y));
+            c[x + 1] = float(sum);
+        }
+        //A black row is never picked, but keep its cdf well formed
+        for (int x = 1; x <= width; x++)
+            c[x] = (sum > 0) ? float(c[x] / sum) : float(x) / width;
+        c[width] = 1;
+        row_cdf[y + 1] = row_cdf[y] + sum * sin(M_PI * (y + 0.5) / height);
+    }
+    double total = row_cdf[height];
+    for (int y = 1; y <= height; y++)
+        row_cdf[y] = (total > 0) ? row_cdf[y] / total : 0;
+}
+
+bool environment_map::sample(double u1, double u2, light_sample& ls) const
+{
+    if (!(row_cdf[height] > 0))
+        return false;
+
+    double dv, du;
+    int y = invert(row_cdf.data(), height, u2, dv);
+    int x = invert(&texel_cdf[size_t(y) * (width + 1)], width, u1, du);
+    double theta = M_PI * (y + dv) / height, phi = 2 * M_PI * ((x + du) / width - 0.5);
+    double sin_t = sin(theta);
+    if (sin_t <= 0)
+        return false;
+
+    ls.wi = vec3(sin_t * sin(phi), cos(theta), -sin_t * cos(phi));
+    ls.dist = FLT_MAX;
+    ls.radiance = texel(x, y);
+    ls.pdf = texel_pmf(x, y) * width * height / (2 * M_PI * M_PI * sin_t);
+    return ls.pdf > 0;
+}
+
+//Colour of the sky seen along a ray that escapes the scene, the environment map if there is one.
+inline vec3 background(const environment_map* env, const ray& r)
+{
+    if (env != nullptr)
+        return env->radiance(r.direction());
+    vec3 unit_direction = unit_vector(r.direction());
+    double t = 0.5 * (unit_direction.y() + 1.0);
+    return (1.0 - t) * vec3(1, 1, 1) + t * vec3(0.5, 0.7, 1);
+}
+
+/**
+* Loads a latitude-longitude colour PFM as an environment map, its radiance scaled by intensity.
+* @return null if the file can't be read.
+*/
+inline std::unique_ptr<environment_map> load_environment_map(const std::string& path, double intensity)
+{
+    trace_scope scope("environment load", "setup");
+    int w, h;
+    std::vector<float> rgb;
+    if (!read_pfm(path, w, h, rgb))
+        return nullptr;
+    for (size_t i = 0; i < rgb.size(); i++)
+        rgb[i] = float(fmax(double(rgb[i]), 0.0) * intensity);
+    return std::unique_ptr<environment_map>(new environment_map(w, h, std::move(rgb)));
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "huge_pages.h"
+#include "relaxed_atomic.h"
+#include "vec3.h"
+
+//Accumulation buffer for progressive rendering, keeps the running sum of samples and the sample count of every pixel.
+//Pixel (i, j) follows the camera's convention, i.e. j = 0 is the bottom row.
+//
+//Light traced from the light's side of a path can land on any pixel, so it's splatted into a separate buffer any thread may add
+//to, which is averaged over the number of such paths traced for the whole image rather than over each pixel's own samples.
+//
+//The buffers of a large image sit on huge pages (see huge_page_allocator), and are counted as framebuffer memory.
+class framebuffer
+{
+private:
+    std::vector<vec3, huge_page_allocator<vec3>> sum;
+    std::vector<uint32_t, huge_page_allocator<uint32_t>> count;
+    //3 channels per pixel
+    std::vector<relaxed_atomic<float>, huge_page_allocator<relaxed_atomic<float>>> splat;
+    relaxed_atomic<uint64_t> light_paths;
+
+public:
+    int width, height;
+
+    framebuffer()
+        : sum(huge_page_allocator<vec3>(mem_tag::framebuffer)), count(huge_page_allocator<uint32_t>(mem_tag::framebuffer)),
+          splat(huge_page_allocator<relaxed_atomic<float>>(mem_tag::framebuffer)), width{ 0 }, height{ 0 } {}
+    framebuffer(int w, int h) : framebuffer() { resize(w, h); }
+
+    //Resizes the buffer and clears all accumulated samples.
+    inline void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        sum.assign(size_t(w) * h, vec3(0, 0, 0));
+        count.assign(size_t(w) * h, 0);
+        splat.assign(size_t(w) * h * 3, relaxed_atomic<float>(0));
+        light_paths.store(0);
+    }
+
+    inline void add_sample(int i, int j, const vec3& col)
+    {
+        size_t k = size_t(j) * width + i;
+        sum[k] += col;
+        count[k]++;
+    }
+
+    //Adds light that reached pixel (i, j) along a path traced from a light, safe to call from several threads at once.
+    inline void add_splat(int i, int j, const vec3& col)
+    {
+        size_t k = (size_t(j) * width + i) * 3;
+        for (int c = 0; c < 3; c++)
+            if (col[c] != 0)
+                splat[k + c].add(float(col[c]));
+    }
+
+    //Counts paths traced from the lights, whether or not they splatted anything.
+    inline void add_light_paths(uint64_t n) { light_paths.add(n); }
+
+    /**
+    * Adds another buffer of the same size into this one, as if its samples and light paths had been taken here. Not safe to call
+    * while either buffer is being rendered to.
+    */
+    inline void add(const framebuffer& other)
+    {
+        for (size_t k = 0; k < sum.size(); k++)
+        {
+            sum[k] += other.sum[k];
+            count[k] += other.count[k];
+        }
+        for (size_t k = 0; k < splat.size(); k++)
+            splat[k].add(other.splat[k].load());
+        light_paths.add(other.light_paths.load());
+    }
+
+    /**
+    * Gives every pixel of the window [x0, x1) x [j0, j1) that has no samples those of the nearest sampled corner of its block, on
+    * a grid of block pixels or a finer one, like a preview of a coarse pass shows it. Fills in what a render cut short part way
+    * through a coarse (or its first full) pass never reached, the pixel then reports the corner's sample count too.
+    */
+    void fill_unsampled(int block, int x0, int j0, int x1, int j1);
+
+    inline uint32_t samples(int i, int j) const { return count[size_t(j) * width + i]; }
+
+    //Gets the mean of the samples taken so far (black if there are none), plus the light splatted onto the pixel.
+    inline vec3 resolve(int i, int j) const
+    {
+        size_t k = size_t(j) * width + i;
+        vec3 col = (count[k] == 0) ? vec3(0, 0, 0) : sum[k] / double(count[k]);
+        uint64_t paths = light_paths.load();
+        if (paths > 0)
+        {
+            //Each light path stands for a sample of the whole image, so a pixel gets paths / (width * height) of them
+            double scale = double(width) * double(height) / double(paths);
+            col += scale * vec3(splat[3 * k].load(), splat[3 * k + 1].load(), splat[3 * k + 2].load());
+        }
+        return col;
+    }
+};
+
+void framebuffer::fill_unsampled(int block, int x0, int j0, int x1, int j1)
+{
+    //Only pixels sampled before filling started count as corners
+    std::vector<uint32_t> sampled(count.begin(), count.end());
+    for (int j = j0; j < j1; j++)
+        for (int i = x0; i < x1; i++)
+        {
+            size_t k = size_t(j) * width + i;
+            if (sampled[k] > 0)
+                continue;
+            for (int b = 2; b <= block; b *= 2)
+            {
+                //The grid starts at 0, a window not aligned to it takes the corner on its far side instead
+                int ci = i - i % b, cj = j - j % b;
+                if (ci < x0)
+                    ci += b;
+                if (cj < j0)
+                    cj += b;
+                size_t c = size_t(cj) * width + ci;
+                if (ci < x1 && cj < j1 && sampled[c] > 0)
+                {
+                    sum[k] = sum[c];
+                    count[k] = count[c];
+                    break;
+                }
+            }
+        }
+}
+
+//Gamma corrects (gamma 2) and quantises a linear colour to 8 bits per channel.
+inline void to_rgb8(const vec3& linear, int& ir, int& ig, int& ib)
+{
+    vec3 col(sqrt(fmax(0.0, linear[0])), sqrt(fmax(0.0, linear[1])), sqrt(fmax(0.0, linear[2])));
+    ir = int(255.99 * fmin(col[0], 1.0));
+    ig = int(255.99 * fmin(col[1], 1.0));
+    ib = int(255.99 * fmin(col[2], 1.0));
+}
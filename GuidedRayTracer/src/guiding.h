@@ -0,0 +1,359 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+#include "relaxed_atomic.h"
+
+/**
+* Maps a point of the unit square to a direction, cos(theta) along u and phi along v. The map preserves area, so a density over
+* the square is a density over directions up to the constant factor 4 pi.
+*/
+inline vec3 square_to_direction(double u, double v)
+{
+    double cos_t = 2 * u - 1;
+    double sin_t = sqrt(fmax(0.0, 1 - cos_t * cos_t));
+    double phi = 2 * M_PI * v;
+    return vec3(sin_t * cos(phi), sin_t * sin(phi), cos_t);
+}
+
+inline void direction_to_square(const vec3& d, double& u, double& v)
+{
+    u = fmin(fmax(0.5 * (d.z() + 1), 0.0), 1.0);
+    double phi = atan2(d.y(), d.x());
+    v = (phi < 0 ? phi + 2 * M_PI : phi) / (2 * M_PI);
+    //Keep both strictly below 1 so they always fall in a quadrant
+    u = fmin(u, 1 - 1e-12);
+    v = fmin(v, 1 - 1e-12);
+}
+
+/**
+* Directional quadtree over the unit square of direction_to_square(), holding how much radiance arrived from each region of
+* directions. Nodes split the square into 4 quadrants, quadrant c covering [c&1, (c&1)+1]/2 x [c>>1, (c>>1)+1]/2, and
+* child[c] of 0 marks a quadrant that isn't subdivided further.
+*/
+class dtree
+{
+private:
+    struct node
+    {
+        relaxed_atomic<float> sum[4];
+        uint32_t child[4] = { 0, 0, 0, 0 };
+    };
+
+    std::vector<node> nodes;
+    //Number of records made into the tree
+    relaxed_atomic<uint32_t> records;
+
+    //Finds the quadrant of (u, v) within the node and rescales (u, v) to that quadrant.
+    static inline int quadrant(double& u, double& v)
+    {
+        int c = 0;
+        if (u >= 0.5) { c |= 1; u -= 0.5; }
+        if (v >= 0.5) { c |= 2; v -= 0.5; }
+        u *= 2;
+        v *= 2;
+        return c;
+    }
+
+public:
+    static const int max_depth = 20;
+
+    dtree() : nodes(1) {}
+
+    inline uint32_t num_records() const { return records.load(); }
+    inline size_t num_nodes() const { return nodes.size(); }
+    inline float total() const { return nodes[0].sum[0].load() + nodes[0].sum[1].load() + nodes[0].sum[2].load() + nodes[0].sum[3].load(); }
+
+    /**
+    * Adds value to the leaf containing the direction. Lock-free, may be called from several threads during a pass.
+    */
+    void record(const vec3& dir, float value);
+
+    //Fills every inner quadrant's sum with the total of its children, call once nothing is recording any more.
+    void propagate();
+
+    /**
+    * Picks a direction proportionally to the recorded radiance, only valid on a propagated tree with total() > 0.
+    */
+    vec3 sample(double u, double v) const;
+
+    //Solid angle density with which sample() picks the unit direction dir.
+    double pdf(const vec3& dir) const;
+
+    /**
+    * Builds an empty tree for the next round of recording, subdividing every region holding more than the fraction rho of the
+    * radiance recorded into this (propagated) tree and merging the rest.
+    */
+    dtree refined(double rho) const;
+};
+
+void dtree::record(const vec3& dir, float value)
+{
+    if (!(value > 0) || !std::isfinite(value))
+        return;
+    records.add(1);
+
+    double u, v;
+    direction_to_square(dir, u, v);
+    uint32_t i = 0;
+    for (;;)
+    {
+        int c = quadrant(u, v);
+        if (nodes[i].child[c] == 0)
+        {
+            nodes[i].sum[c].add(value);
+            return;
+        }
+        i = nodes[i].child[c];
+    }
+}
+
+void dtree::propagate()
+{
+    //Children are always stored after their parents
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            uint32_t k = nodes[i].child[c];
+            if (k != 0)
+                nodes[i].sum[c].store(nodes[k].sum[0].load() + nodes[k].sum[1].load() + nodes[k].sum[2].load() + nodes[k].sum[3].load());
+        }
+    }
+}
+
+vec3 dtree::sample(double u, double v) const
+{
+    double x0 = 0, y0 = 0, size = 1;
+    uint32_t i = 0;
+    for (;;)
+    {
+        const node& n = nodes[i];
+        double s[4] = { n.sum[0].load(), n.sum[1].load(), n.sum[2].load(), n.sum[3].load() };
+
+        //Pick the left or right half from the marginal, then the bottom or top quadrant within it
+        double left = s[0] + s[2], right = s[1] + s[3];
+        double p_left = left / (left + right);
+        int cx, cy;
+        if (u < p_left) { cx = 0; u /= p_left; }
+        else { cx = 1; u = (u - p_left) / (1 - p_left); }
+        double p_bottom = s[cx] / (s[cx] + s[cx + 2]);
+        if (v < p_bottom) { cy = 0; v /= p_bottom; }
+        else { cy = 1; v = (v - p_bottom) / (1 - p_bottom); }
+        u = fmin(u, 1 - 1e-12);
+        v = fmin(v, 1 - 1e-12);
+
+        size *= 0.5;
+        x0 += cx * size;
+        y0 += cy * size;
+        int c = cx | (cy << 1);
+        if (n.child[c] == 0)
+            return square_to_direction(x0 + u * size, y0 + v * size);
+        i = n.child[c];
+    }
+}
+
+double dtree::pdf(const vec3& dir) const
+{
+    double u, v;
+    direction_to_square(dir, u, v);
+    double p = 1;
+    uint32_t i = 0;
+    for (;;)
+    {
+        const node& n = nodes[i];
+        double total = double(n.sum[0].load()) + n.sum[1].load() + n.sum[2].load() + n.sum[3].load();
+        if (total <= 0)
+            return 0;
+        int c = quadrant(u, v);
+        p *= 4 * n.sum[c].load() / total;
+        if (n.child[c] == 0 || p == 0)
+            break;
+        i = n.child[c];
+    }
+    return p / (4 * M_PI);
+}
+
+dtree dtree::refined(double rho) const
+{
+    dtree out;
+    double threshold = rho * total();
+    if (threshold <= 0)
+        return out;
+
+    struct item
+    {
+        uint32_t out_node;
+        //Node of this tree covering the same region, UINT32_MAX once below its leaves
+        uint32_t in_node;
+        float flux[4];
+        int depth;
+    };
+    std::vector<item> stack;
+    item root = { 0, 0, { nodes[0].sum[0].load(), nodes[0].sum[1].load(), nodes[0].sum[2].load(), nodes[0].sum[3].load() }, 1 };
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+        item it = stack.back();
+        stack.pop_back();
+        if (it.depth >= max_depth)
+            continue;
+        for (int c = 0; c < 4; c++)
+        {
+            if (it.flux[c] <= threshold)
+                continue;
+            item child;
+            child.out_node = uint32_t(out.nodes.size());
+            child.depth = it.depth + 1;
+            out.nodes.emplace_back();
+            out.nodes[it.out_node].child[c] = child.out_node;
+
+            //Without finer records assume the quadrant's radiance was spread evenly over it
+            child.in_node = (it.in_node != UINT32_MAX) ? nodes[it.in_node].child[c] : 0;
+            if (child.in_node != 0)
+            {
+                for (int k = 0; k < 4; k++)
+                    child.flux[k] = nodes[child.in_node].sum[k].load();
+            }
+            else
+            {
+                child.in_node = UINT32_MAX;
+                for (int k = 0; k < 4; k++)
+                    child.flux[k] = 0.25f * it.flux[c];
+            }
+            stack.push_back(child);
+        }
+    }
+    return out;
+}
+
+/**
+* Spatio-directional radiance cache used to guide path sampling (Muller et al. 2017, "Practical Path Guiding for Efficient
+* Light-Transport Simulation"). A binary tree splits the scene's bounds, cycling through the axes, and each of its leaves holds
+* two dtrees: one learnt in earlier passes that directions are drawn from, and one the current pass records into.
+*
+* Recording is lock-free so any number of threads may trace paths at once; refine() restructures everything and must only be
+* called while nobody is recording or sampling.
+*/
+class path_guide
+{
+private:
+    struct snode
+    {
+        //Both 0 for leaves, which index leaves instead
+        uint32_t child[2];
+        uint32_t leaf;
+    };
+    struct sleaf
+    {
+        dtree sampling;
+        dtree building;
+    };
+
+    vec3 origin, extent;
+    std::vector<snode> nodes;
+    std::vector<sleaf> leaves;
+    int iteration;
+
+    void split_leaves(uint32_t node, int depth, uint32_t threshold);
+
+public:
+    //How often a guided vertex samples its BSDF instead of the guide
+    static constexpr double bsdf_fraction = 0.5;
+    //Spatial leaves are split once they've seen more than this many records times sqrt(2^iteration)
+    static constexpr double split_records = 12000;
+    //Directional regions holding more than this fraction of a leaf's radiance are subdivided
+    static constexpr double rho = 0.01;
+
+    explicit path_guide(const aabb& bounds);
+
+    //Gets the spatial leaf containing p, points outside the bounds go to the nearest leaf.
+    uint32_t leaf_at(const vec3& p) const;
+
+    //Whether the leaf has learnt enough to sample from.
+    inline bool ready(uint32_t leaf) const { return leaves[leaf].sampling.total() > 0; }
+
+    inline vec3 sample(uint32_t leaf, double u, double v) const { return leaves[leaf].sampling.sample(u, v); }
+    inline double pdf(uint32_t leaf, const vec3& dir) const { return leaves[leaf].sampling.pdf(dir); }
+
+    /**
+    * Records radiance arriving at a point of the leaf from unit direction dir. Lock-free.
+    * @param value - incident radiance (luminance) divided by the density the direction was sampled with.
+    */
+    inline void record(uint32_t leaf, const vec3& dir, float value) { leaves[leaf].building.record(dir, value); }
+
+    /**
+    * Ends a training iteration: what was recorded becomes the distribution sampled from, crowded spatial leaves are split and
+    * the directional trees refined to follow the radiance. Not thread-safe.
+    */
+    void refine();
+
+    inline size_t num_leaves() const { return leaves.size(); }
+};
+
+path_guide::path_guide(const aabb& bounds) : iteration{ 0 }
+{
+    //Pad the bounds a little so nothing on their faces falls outside
+    vec3 pad = 1e-3 * (bounds.max() - bounds.min()) + vec3(1e-4, 1e-4, 1e-4);
+    origin = bounds.min() - pad;
+    extent = bounds.max() + pad - origin;
+    nodes.push_back({ { 0, 0 }, 0 });
+    leaves.emplace_back();
+}
+
+uint32_t path_guide::leaf_at(const vec3& p) const
+{
+    double x[3];
+    for (int a = 0; a < 3; a++)
+        x[a] = fmin(fmax((p[a] - origin[a]) / extent[a], 0.0), 1 - 1e-12);
+
+    uint32_t i = 0;
+    for (int axis = 0; nodes[i].child[0] != 0; axis = (axis + 1) % 3)
+    {
+        x[axis] *= 2;
+        int c = (x[axis] >= 1) ? 1 : 0;
+        x[axis] -= c;
+        i = nodes[i].child[c];
+    }
+    return nodes[i].leaf;
+}
+
+void path_guide::split_leaves(uint32_t node, int depth, uint32_t threshold)
+{
+    if (nodes[node].child[0] != 0)
+    {
+        split_leaves(nodes[node].child[0], depth + 1, threshold);
+        split_leaves(nodes[node].child[1], depth + 1, threshold);
+        return;
+    }
+
+    //Assume each half got half the records, and keep splitting until the halves are under the threshold
+    uint32_t leaf = nodes[node].leaf;
+    uint32_t records = leaves[leaf].sampling.num_records();
+    if (records <= threshold || depth >= 60)
+        return;
+
+    leaves.push_back(leaves[leaf]);
+    uint32_t first = uint32_t(nodes.size());
+    nodes.push_back({ { 0, 0 }, leaf });
+    nodes.push_back({ { 0, 0 }, uint32_t(leaves.size() - 1) });
+    nodes[node].child[0] = first;
+    nodes[node].child[1] = first + 1;
+    split_leaves(first, depth + 1, 2 * threshold);
+    split_leaves(first + 1, depth + 1, 2 * threshold);
+}
+
+void path_guide::refine()
+{
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+        leaves[i].building.propagate();
+        leaves[i].sampling = leaves[i].building;
+        leaves[i].building = leaves[i].building.refined(rho);
+    }
+    split_leaves(0, 0, uint32_t(split_records * sqrt(double(1u << (iteration < 30 ? iteration : 30)))));
+    iteration++;
+}
@@ -2,6 +2,10 @@
 
 #include "aabb.h"
 #include "material.h"
+#include "lights.h"
+
+class environment_map;
+
 class hitable {
 public:
 
@@ -16,6 +20,20 @@ public:
     */
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const = 0;
 
+    //Most rays hit_batch takes at once
+    static const size_t max_batch = 64;
+
+    /**
+    * Finds the closest intersections of up to max_batch rays, as hit would for each. Objects whose geometry is paged in on demand
+    * trace a batch together, so whatever the rays share is only fetched once.
+    * @param hit - whether each ray hit the object, recs and mats are only filled in where it did.
+    */
+    virtual void hit_batch(const ray* rays, size_t count, double t_min, double t_max, hit_record* recs, material* mats, bool* hit) const
+    {
+        for (size_t k = 0; k < count; k++)
+            hit[k] = this->hit(rays[k], t_min, t_max, recs[k], mats[k]);
+    }
+
     /**
     * Encloses the object within an axis-aligned bounding box.
     * @param box - the box to enclose this object.
@@ -23,5 +41,17 @@ public:
     */
     virtual bool bounding_box(aabb& box) const = 0;
 
+    /**
+    * Gets the emitters of this object for direct light sampling.
+    * @return null if the object has no lights (or doesn't support sampling them).
+    */
+    virtual const light_bvh* lights() const { return nullptr; }
+
+    /**
+    * Gets the environment map lighting the object from afar, seen by rays that escape it.
+    * @return null if the sky is the default gradient, which isn't sampled directly.
+    */
+    virtual const environment_map* environment() const { return nullptr; }
+
     virtual ~hitable() {}
 };
\ No newline at end of file
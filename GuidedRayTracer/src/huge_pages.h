@@ -0,0 +1,114 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "alloc_tracker.h"
+
+//Allocations at least this big are worth backing with huge pages, smaller ones come from the heap.
+static const size_t huge_page_threshold = size_t(2) << 20;
+
+/**
+* Gets bytes of zeroed memory backed by huge pages where the system allows it, cutting the TLB misses of streaming through large
+* scene arrays and framebuffers. Explicit huge pages are tried first (hugetlbfs on Linux, large pages on Windows, which both need
+* to be set up or granted to the process); failing that the memory is mapped normally, and on Linux marked for transparent huge
+* pages.
+* @return null if the system is out of memory.
+*/
+inline void* huge_page_alloc(size_t bytes)
+{
+#ifdef _WIN32
+    size_t large = GetLargePageMinimum();
+    if (large > 0)
+    {
+        void* p = VirtualAlloc(nullptr, (bytes + large - 1) / large * large, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p != nullptr)
+            return p;
+    }
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    size_t size = (bytes + huge_page_threshold - 1) / huge_page_threshold * huge_page_threshold;
+#ifdef MAP_HUGETLB
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+#endif
+    void* q = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q == MAP_FAILED)
+        return nullptr;
+#ifdef MADV_HUGEPAGE
+    madvise(q, size, MADV_HUGEPAGE);
+#endif
+    return q;
+#endif
+}
+
+//Gives back memory from huge_page_alloc, bytes must be the size it was asked for.
+inline void huge_page_free(void* p, size_t bytes)
+{
+    if (p == nullptr)
+        return;
+#ifdef _WIN32
+    (void)bytes;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, (bytes + huge_page_threshold - 1) / huge_page_threshold * huge_page_threshold);
+#endif
+}
+
+/**
+* Standard allocator putting large containers on huge pages (see huge_page_alloc), small ones stay on the heap. Pages are only
+* backed once first written, so on a NUMA machine they land on the node of the thread that fills the container.
+* Allocations are counted under the allocator's tag (see alloc_tracker), whichever thread makes them.
+*/
+template <class T>
+struct huge_page_allocator
+{
+    typedef T value_type;
+    //The tag goes wherever the container goes
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    mem_tag tag;
+
+    huge_page_allocator(mem_tag tag = mem_tag::other) : tag{ tag } {}
+    template <class U>
+    huge_page_allocator(const huge_page_allocator<U>& other) : tag{ other.tag } {}
+
+    inline T* allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        void* p = (bytes >= huge_page_threshold) ? huge_page_alloc(bytes) : std::malloc(bytes);
+        if (p == nullptr)
+            throw std::bad_alloc();
+        alloc_tracker::get().on_alloc(tag, bytes);
+        return static_cast<T*>(p);
+    }
+
+    inline void deallocate(T* p, size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        alloc_tracker::get().on_free(tag, bytes);
+        if (bytes >= huge_page_threshold)
+            huge_page_free(p, bytes);
+        else
+            std::free(p);
+    }
+};
+
+//Memory from one allocator can be given back through any other, the tags only need to match for the counts to balance
+template <class T, class U>
+inline bool operator==(const huge_page_allocator<T>& a, const huge_page_allocator<U>& b) { return a.tag == b.tag; }
+template <class T, class U>
+inline bool operator!=(const huge_page_allocator<T>& a, const huge_page_allocator<U>& b) { return a.tag != b.tag; }
@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+
+//File formats the final image can be written in.
+enum class image_format
+{
+    ppm,    //8 bit, gamma corrected, ascii
+    pfm     //32 bit float, linear
+};
+
+/**
+* Writes the [x0, x1) x [y0, y1) window (rows counted from the top) of the resolved framebuffer to disk.
+* @return false if the file couldn't be written.
+*/
+bool write_image(const std::string& path, const framebuffer& fb, image_format format, int x0, int y0, int x1, int y1)
+{
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    if (!out)
+        return false;
+
+    int w = x1 - x0, h = y1 - y0;
+    if (format == image_format::ppm)
+    {
+        out << "P3\n" << w << " " << h << "\n255\n";
+        int ir, ig, ib;
+        for (int row = y0; row < y1; row++) {
+            int j = fb.height - 1 - row;
+            for (int i = x0; i < x1; i++) {
+                to_rgb8(fb.resolve(i, j), ir, ig, ib);
+                out << ir << " " << ig << " " << ib << "\n";
+            }
+        }
+    }
+    else
+    {
+        //PFM stores rows bottom to top, a negative scale marks little-endian data
+        out << "PF\n" << w << " " << h << "\n-1.0\n";
+        std::vector<float> line(size_t(w) * 3);
+        for (int row = y1 - 1; row >= y0; row--) {
+            int j = fb.height - 1 - row;
+            for (int i = x0; i < x1; i++) {
+                vec3 col = fb.resolve(i, j);
+                line[3 * (i - x0)] = float(col[0]);
+                line[3 * (i - x0) + 1] = float(col[1]);
+                line[3 * (i - x0) + 2] = float(col[2]);
+            }
+            out.write(reinterpret_cast<const char*>(line.data()), line.size() * sizeof(float));
+        }
+    }
+    return bool(out);
+}
+
+/**
+* Reads a PFM written by write_image (or any little-endian colour PFM) into rgb, top row first.
+* @return false if the file can't be read or isn't a colour PFM.
+*/
+bool read_pfm(const std::string& path, int& width, int& height, std::vector<float>& rgb)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    std::string magic;
+    double scale;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0 || scale >= 0)
+        return false;
+    in.get();
+
+    rgb.resize(size_t(width) * height * 3);
+    for (int row = height - 1; row >= 0; row--)
+        in.read(reinterpret_cast<char*>(&rgb[size_t(row) * width * 3]), std::streamsize(size_t(width) * 3 * sizeof(float)));
+    return bool(in);
+}
+
+/**
+* Writes how many samples each pixel of the window received as an ascii PGM, scaled so the maximum count is white.
+* @return false if the file couldn't be written.
+*/
+bool write_sample_counts(const std::string& path, const framebuffer& fb, int x0, int y0, int x1, int y1)
+{
+    std::ofstream out(path, std::ios::out);
+    if (!out)
+        return false;
+
+    uint32_t max_count = 1;
+    for (int row = y0; row < y1; row++)
+        for (int i = x0; i < x1; i++)
+            max_count = (fb.samples(i, fb.height - 1 - row) > max_count) ? fb.samples(i, fb.height - 1 - row) : max_count;
+
+    out << "P2\n" << (x1 - x0) << " " << (y1 - y0) << "\n" << (max_count < 65535 ? max_count : 65535) << "\n";
+    for (int row = y0; row < y1; row++) {
+        for (int i = x0; i < x1; i++) {
+            uint32_t c = fb.samples(i, fb.height - 1 - row);
+            out << (c < 65535 ? c : 65535) << ((i + 1 < x1) ? " " : "\n");
+        }
+    }
+    return bool(out);
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#include "aabb.h"
+#include "sampler.h"
+
+/**
+* Ward-style irradiance cache (Ward et al. 1988, "A Ray Tracing Solution for Diffuse Interreflection"). Records of the
+* irradiance arriving at a point are spread over the scene as they are needed and reused by interpolation wherever their error
+* estimate says they're still good, so indirect diffuse light doesn't need a fresh path at every bounce.
+*
+* Records live in a lock-free spatial hash with one grid per power of two of record radius. A record is linked into every cell
+* of its grid that its sphere of validity overlaps (at most 8, the cells being twice the furthest reach of the level's records), so a
+* lookup only has to visit one cell per level. Any number of threads may look up and insert at once.
+*/
+class irradiance_cache
+{
+public:
+    struct record
+    {
+        float p[3];
+        float n[3];
+        float e[3];
+        //Radius of validity, the harmonic mean distance to the surfaces seen from p (clamped)
+        float r;
+    };
+
+private:
+    struct entry
+    {
+        uint32_t record;
+        uint32_t next;
+    };
+
+    static const uint32_t none = UINT32_MAX;
+    static const int max_levels = 12;
+
+    double error;
+    double r_min, r_max;
+    int num_levels;
+    size_t max_records;
+
+    std::unique_ptr<record[]> records;
+    std::unique_ptr<entry[]> entries;
+    std::unique_ptr<std::atomic<uint32_t>[]> buckets;
+    uint32_t bucket_mask;
+    std::atomic<uint32_t> num_records;
+    std::atomic<uint32_t> num_entries;
+
+    //Cells of level l are 2 r_min 2^l on a side and hold records reaching up to r_min 2^l.
+    inline double cell_size(int level) const { return 2 * r_min * double(1u << level); }
+
+    inline uint32_t bucket_of(int level, int64_t x, int64_t y, int64_t z) const
+    {
+        uint32_t h = hash_combine(uint32_t(level), uint32_t(x));
+        h = hash_combine(h, uint32_t(y));
+        return hash_combine(h, uint32_t(z)) & bucket_mask;
+    }
+
+public:
+    //Deepest bounce at which a missing record is gathered, deeper paths without a record nearby are traced on instead
+    static const int max_gather_depth = 3;
+
+    mutable std::atomic<uint64_t> lookups, misses;
+
+    /**
+    * @param bounds - bounds of the scene, record radii are clamped to a range relative to its size.
+    * @param error - Ward's a, the error a record may have at a point and still be used. Larger values reuse records further
+    *                away, trading bias (smoothing of the indirect light) for speed.
+    * @param max_records - capacity, once full irradiance is still computed where needed but no longer stored.
+    */
+    irradiance_cache(const aabb& bounds, double error, size_t max_records = size_t(1) << 20);
+
+    /**
+    * Interpolates the irradiance at p, with surface normal n, from the records valid there.
+    * @return false if no record is close enough, the irradiance then has to be computed (and should be inserted).
+    */
+    bool lookup(const vec3& p, const vec3& n, vec3& irradiance) const;
+
+    /**
+    * Adds a record. Lock-free.
+    * @param harmonic_dist - harmonic mean distance of the rays used to compute the irradiance, infinity if all escaped.
+    */
+    void insert(const vec3& p, const vec3& n, const vec3& irradiance, double harmonic_dist);
+
+    inline size_t size() const { size_t n = num_records.load(std::memory_order_relaxed); return (n < max_records) ? n : max_records; }
+};
+
+irradiance_cache::irradiance_cache(const aabb& bounds, double error, size_t max_records)
+    : error{ error }, max_records{ max_records }, num_records{ 0 }, num_entries{ 0 }, lookups{ 0 }, misses{ 0 }
+{
+    double diag = (bounds.max() - bounds.min()).length();
+    r_max = 0.1 * diag;
+    r_min = 0.001 * diag;
+    num_levels = 1;
+    while (num_levels < max_levels && r_min * double(1u << (num_levels - 1)) < r_max)
+        num_levels++;
+
+    size_t num_buckets = 1;
+    while (num_buckets < 2 * max_records)
+        num_buckets *= 2;
+    bucket_mask = uint32_t(num_buckets - 1);
+
+    records.reset(new record[max_records]);
+    entries.reset(new entry[8 * max_records]);
+    buckets.reset(new std::atomic<uint32_t>[num_buckets]);
+    for (size_t i = 0; i < num_buckets; i++)
+        buckets[i].store(none, std::memory_order_relaxed);
+}
+
+bool irradiance_cache::lookup(const vec3& p, const vec3& n, vec3& irradiance) const
+{
+    lookups.fetch_add(1, std::memory_order_relaxed);
+
+    double weight_sum = 0;
+    vec3 sum(0, 0, 0);
+    for (int level = 0; level < num_levels; level++)
+    {
+        double size = cell_size(level);
+        uint32_t i = buckets[bucket_of(level, int64_t(floor(p.x() / size)), int64_t(floor(p.y() / size)), int64_t(floor(p.z() / size)))]
+                         .load(std::memory_order_acquire);
+        for (; i != none; i = entries[i].next)
+        {
+            const record& rec = records[entries[i].record];
+            vec3 rp(rec.p[0], rec.p[1], rec.p[2]), rn(rec.n[0], rec.n[1], rec.n[2]);
+            vec3 d = p - rp;
+            double dist = d.length();
+            if (dist >= rec.r * error)
+                continue;
+
+            //Records whose point lies in front of p see a different part of the scene
+            if (dot(d, 0.5 * (n + rn)) < -0.05 * rec.r)
+                continue;
+
+            double w = 1 / (dist / rec.r + sqrt(fmax(0.0, 1 - dot(n, rn))) + 1e-9);
+            if (w <= 1 / error)
+                continue;
+            weight_sum += w;
+            sum += w * vec3(rec.e[0], rec.e[1], rec.e[2]);
+        }
+    }
+
+    if (weight_sum == 0)
+    {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    irradiance = sum / weight_sum;
+    return true;
+}
+
+void irradiance_cache::insert(const vec3& p, const vec3& n, const vec3& irradiance, double harmonic_dist)
+{
+    uint32_t index = num_records.fetch_add(1, std::memory_order_relaxed);
+    if (index >= max_records)
+        return;
+
+    record& rec = records[index];
+    double r = fmin(fmax(harmonic_dist, r_min), r_max);
+    for (int a = 0; a < 3; a++)
+    {
+        rec.p[a] = float(p[a]);
+        rec.n[a] = float(n[a]);
+        rec.e[a] = float(irradiance[a]);
+    }
+    rec.r = float(r);
+
+    //The record is used out to r * error, link it into every cell of the first level that big that the sphere overlaps
+    double reach = r * error;
+    int level = 0;
+    while (level + 1 < num_levels && r_min * double(1u << level) < reach)
+        level++;
+    double size = cell_size(level);
+    int64_t lo[3], hi[3];
+    for (int a = 0; a < 3; a++)
+    {
+        lo[a] = int64_t(floor((p[a] - reach) / size));
+        hi[a] = int64_t(floor((p[a] + reach) / size));
+        //Records reaching past the coarsest cells are cut down to their neighbours
+        if (hi[a] - lo[a] > 1)
+            lo[a] = hi[a] = int64_t(floor(p[a] / size));
+    }
+
+    for (int64_t x = lo[0]; x <= hi[0]; x++)
+        for (int64_t y = lo[1]; y <= hi[1]; y++)
+            for (int64_t z = lo[2]; z <= hi[2]; z++)
+            {
+                uint32_t e = num_entries.fetch_add(1, std::memory_order_relaxed);
+                entries[e].record = index;
+                std::atomic<uint32_t>& head = buckets[bucket_of(level, x, y, z)];
+                uint32_t next = head.load(std::memory_order_relaxed);
+                do
+                    entries[e].next = next;
+                while (!head.compare_exchange_weak(next, e, std::memory_order_release, std::memory_order_relaxed));
+            }
+}
@@ -0,0 +1,517 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "renderer.h"
+#include "image_io.h"
+
+/**
+* A complete description of one render, built from the command line and/or a job file. Job files hold one "key = value" per
+* line ('#' starts a comment) using the same keys as the long command line options, e.g.
+*
+*     width = 1280
+*     height = 720
+*     spp = 64
+*     crop = 0,0,640,360
+*     format = pfm
+*     seed = 7
+*     output = out/frame_0001.pfm
+*     time = 30
+*
+* Options later on the command line override those read from a job file given earlier.
+*/
+struct render_job
+{
+    render_settings settings;
+    std::string output = "out/test_cube_new.ppm";
+    image_format format = image_format::ppm;
+    //Where the per-pixel sample counts are written, defaults to <output>.spp.pgm in time-budgeted mode.
+    std::string sample_count_output;
+    //Whether spp was set explicitly, otherwise a time-budgeted render isn't capped.
+    bool spp_given = false;
+    //Memory budget of the texture tile cache.
+    size_t texture_cache_bytes = size_t(256) << 20;
+    //If set, convert this PPM into a tiled texture at output instead of rendering.
+    std::string make_texture;
+    //Out-of-core mesh (.gmc) added to the scene, and how much of it may be mapped at once.
+    std::string mesh;
+    size_t mesh_budget_bytes = size_t(512) << 20;
+    //If set, convert this OBJ into a clustered mesh at output instead of rendering.
+    std::string make_mesh;
+    //Scene cache (.gsc) the built scene is loaded from, or written to when it's missing or stale.
+    std::string scene_cache;
+    bvh_builder builder = bvh_builder::sah;
+    //Latitude-longitude HDR (colour PFM) lighting the scene in place of the default sky, and the scale applied to it.
+    std::string environment;
+    double environment_intensity = 1;
+    //Batch mode: file of views to render against the one scene, and/or how many turntable angles to render of each view.
+    //Every view's image is written to the output path with its index appended, e.g. out/frame_003.ppm.
+    std::string views;
+    int turntable = 0;
+    //If set, record a timeline of the run (setup, tiles per thread, output) and write it here as Chrome Trace Event JSON.
+    std::string trace;
+    //NUMA mode of the render workers: 0 off, -1 the machine's own nodes, N > 0 a simulated topology of N nodes (see numa_topology).
+    int numa_nodes = 0;
+    //Print the memory each subsystem holds and allocates (see alloc_tracker) once the render is done, and/or fail the run if the
+    //render loop allocated at all.
+    bool alloc_stats = false;
+    bool alloc_strict = false;
+    //If set, run the regression harness (see run_regression) against the references and history in this directory instead.
+    std::string regress;
+    //Name the timings are recorded under in the history, e.g. a commit hash.
+    std::string regress_label;
+    //Largest relative RMSE an image may have against its reference.
+    double regress_rmse = 0.02;
+    //How many percent slower than its recent timings a scene may get.
+    double regress_slowdown = 10;
+    //Overwrite the references with this run's images.
+    bool regress_update = false;
+};
+
+inline void print_usage(std::ostream& os)
+{
+    os << "Usage: GuidedRayTracer [options]\n"
+       << "  --job FILE          read options from a job file (key = value per line)\n"
+       << "  --width N           image width in pixels\n"
+       << "  --height N          image height in pixels\n"
+       << "  --spp N             samples per pixel (with --time: maximum, 0 for none)\n"
+       << "  --crop X0,Y0,X1,Y1  only render this window, rows counted from the top\n"
+       << "  --format ppm|pfm    output format\n"
+       << "  --seed N            seed for the sampler\n"
+       << "  --sampler NAME      independent, sobol or blue_noise\n"
+       << "  --output PATH       output image\n"
+       << "  --guiding on|off    learn the scene's lighting while rendering and steer bounces towards it\n"
+       << "  --integrator NAME   path, or bdpt for bidirectional path tracing (caustics)\n"
+       << "  --irradiance-cache A  reuse cached indirect light at later diffuse bounces, A is the error allowed (0.1-0.3, 0 off)\n"
+       << "  --time SECONDS      render the best image possible in this much wall time\n"
+       << "  --spp-map PATH      where to write per-pixel sample counts\n"
+       << "  --preview NAME      stream progress to the named shared-memory segment\n"
+       << "  --views FILE        render every view in FILE (one 'lookfrom lookat [vfov]' per line) sharing the scene\n"
+       << "  --turntable N       render N views evenly spaced around the lookat of each view\n"
+       << "  --trace PATH        write a timeline of the run as Chrome trace JSON (open in Perfetto or chrome://tracing)\n"
+       << "  --numa off|on|N     pin workers to NUMA nodes, each with its own copy of the scene; N simulates N nodes\n"
+       << "  --alloc-stats on|off  report memory and allocations per subsystem, per frame and per million rays\n"
+       << "  --alloc-strict on|off  fail the run if the render loop allocates memory\n"
+       << "  --texture-cache-mb N  memory budget of the texture tile cache\n"
+       << "  --make-texture PPM  convert PPM to a tiled, mip-mapped texture written to --output, then exit\n"
+       << "  --mesh PATH         add an out-of-core clustered mesh (.gmc) to the scene\n"
+       << "  --mesh-budget-mb N  how much of the mesh may be resident at once\n"
+       << "  --make-mesh OBJ     convert OBJ to a clustered mesh written to --output, then exit\n"
+       << "  --builder NAME      how the BVH is built: sah, lbvh (fast parallel build) or lbvh-opt (lbvh plus tree rotations)\n"
+       << "  --scene-cache PATH  load the built scene from PATH, rebuilding and rewriting it when the scene has changed\n"
+       << "  --environment PFM   light the scene with a latitude-longitude HDR instead of the default sky\n"
+       << "  --environment-intensity X  scale applied to the environment's radiance (default 1)\n"
+       << "  --regress DIR       render the canonical scenes and check them against the references and timings in DIR\n"
+       << "  --regress-label S   name to record this run's timings under, e.g. the commit hash\n"
+       << "  --regress-rmse X    largest relative RMSE allowed against a reference (default 0.02)\n"
+       << "  --regress-slowdown P  fail if a scene is more than P percent slower than its recent runs, and slower than the timings' noise (default 10)\n"
+       << "  --regress-update on|off  replace the references with this run's images\n"
+       << "  --help              show this message\n";
+}
+
+/**
+* Applies a single option to the job.
+* @param key - option name without leading dashes.
+* @param value - option value.
+* @param error - description of the problem if the option is invalid.
+* @return false if the key is unknown or the value malformed.
+*/
+bool apply_job_option(render_job& job, const std::string& key, const std::string& value, std::string& error)
+{
+    char* end = nullptr;
+    render_settings& s = job.settings;
+
+    if (key == "width" || key == "height" || key == "spp" || key == "seed")
+    {
+        long n = strtol(value.c_str(), &end, 10);
+        if (end == value.c_str() || *end != '\0' || n < 0 || (n == 0 && key != "spp" && key != "seed"))
+        {
+            error = "invalid value '" + value + "' for " + key;
+            return false;
+        }
+        if (key == "width") s.nx = int(n);
+        else if (key == "height") s.ny = int(n);
+        else if (key == "spp") { s.ns = int(n); job.spp_given = true; }
+        else s.seed = uint32_t(n);
+    }
+    else if (key == "crop")
+    {
+        int x0, y0, x1, y1;
+        char c1, c2, c3, extra;
+        std::istringstream is(value);
+        if (!(is >> x0 >> c1 >> y0 >> c2 >> x1 >> c3 >> y1) || c1 != ',' || c2 != ',' || c3 != ',' || (is >> extra)
+            || x0 < 0 || y0 < 0 || x1 <= x0 || y1 <= y0)
+        {
+            error = "invalid crop window '" + value + "', expected X0,Y0,X1,Y1";
+            return false;
+        }
+        s.crop_x0 = x0; s.crop_y0 = y0; s.crop_x1 = x1; s.crop_y1 = y1;
+    }
+    else if (key == "format")
+    {
+        if (value == "ppm") job.format = image_format::ppm;
+        else if (value == "pfm") job.format = image_format::pfm;
+        else
+        {
+            error = "unknown format '" + value + "'";
+            return false;
+        }
+    }
+    else if (key == "sampler")
+    {
+        if (value == "independent") s.sampler = sampler_type::independent;
+        else if (value == "sobol") s.sampler = sampler_type::sobol;
+        else if (value == "blue_noise") s.sampler = sampler_type::blue_noise;
+        else
+        {
+            error = "unknown sampler '" + value + "'";
+            return false;
+        }
+    }
+    else if (key == "guiding")
+    {
+        if (value == "on" || value == "1") s.guiding = true;
+        else if (value == "off" || value == "0") s.guiding = false;
+        else
+        {
+            error = "invalid value '" + value + "' for guiding, expected on or off";
+            return false;
+        }
+    }
+    else if (key == "integrator")
+    {
+        if (value == "path") s.integrator = integrator_type::path;
+        else if (value == "bdpt") s.integrator = integrator_type::bdpt;
+        else
+        {
+            error = "unknown integrator '" + value + "'";
+            return false;
+        }
+    }
+    else if (key == "irradiance-cache")
+    {
+        double a = strtod(value.c_str(), &end);
+        if (end == value.c_str() || *end != '\0' || a < 0 || a > 1)
+        {
+            error = "invalid irradiance cache error '" + value + "', expected 0 (off) to 1";
+            return false;
+        }
+        s.cache_error = a;
+    }
+    else if (key == "time")
+    {
+        double t = strtod(value.c_str(), &end);
+        if (end == value.c_str() || *end != '\0' || t < 0)
+        {
+            error = "invalid time budget '" + value + "'";
+            return false;
+        }
+        s.time_budget = t;
+    }
+    else if (key == "output")
+        job.output = value;
+    else if (key == "spp-map")
+        job.sample_count_output = value;
+    else if (key == "preview")
+        s.preview_name = value;
+    else if (key == "trace")
+        job.trace = value;
+    else if (key == "views")
+        job.views = value;
+    else if (key == "turntable")
+    {
+        long n = strtol(value.c_str(), &end, 10);
+        if (end == value.c_str() || *end != '\0' || n < 0)
+        {
+            error = "invalid turntable view count '" + value + "'";
+            return false;
+        }
+        job.turntable = int(n);
+    }
+    else if (key == "numa")
+    {
+        long n = strtol(value.c_str(), &end, 10);
+        if (value == "off") job.numa_nodes = 0;
+        else if (value == "on") job.numa_nodes = -1;
+        else if (end != value.c_str() && *end == '\0' && n > 0 && n <= 64) job.numa_nodes = int(n);
+        else
+        {
+            error = "invalid NUMA mode '" + value + "'";
+            return false;
+        }
+    }
+    else if (key == "alloc-stats" || key == "alloc-strict")
+    {
+        bool& flag = (key == "alloc-stats") ? job.alloc_stats : job.alloc_strict;
+        if (value == "on" || value == "1") flag = true;
+        else if (value == "off" || value == "0") flag = false;
+        else
+        {
+            error = "invalid value '" + value + "' for " + key + ", expected on or off";
+            return false;
+        }
+    }
+    else if (key == "texture-cache-mb" || key == "mesh-budget-mb")
+    {
+        long mb = strtol(value.c_str(), &end, 10);
+        if (end == value.c_str() || *end != '\0' || mb <= 0)
+        {
+            error = "invalid size '" + value + "' for " + key;
+            return false;
+        }
+        (key == "mesh-budget-mb" ? job.mesh_budget_bytes : job.texture_cache_bytes) = size_t(mb) << 20;
+    }
+    else if (key == "make-texture")
+        job.make_texture = value;
+    else if (key == "mesh")
+        job.mesh = value;
+    else if (key == "make-mesh")
+        job.make_mesh = value;
+    else if (key == "scene-cache")
+        job.scene_cache = value;
+    else if (key == "builder")
+    {
+        if (value == "sah") job.builder = bvh_builder::sah;
+        else if (value == "lbvh") job.builder = bvh_builder::lbvh;
+        else if (value == "lbvh-opt") job.builder = bvh_builder::lbvh_optimized;
+        else
+        {
+            error = "unknown BVH builder '" + value + "'";
+            return false;
+        }
+    }
+    else if (key == "environment")
+        job.environment = value;
+    else if (key == "environment-intensity")
+    {
+        double x = strtod(value.c_str(), &end);
+        if (end == value.c_str() || *end != '\0' || x < 0)
+        {
+            error = "invalid environment intensity '" + value + "'";
+            return false;
+        }
+        job.environment_intensity = x;
+    }
+    else if (key == "regress")
+        job.regress = value;
+    else if (key == "regress-label")
+    {
+        //The history is comma separated
+        job.regress_label = value;
+        std::replace(job.regress_label.begin(), job.regress_label.end(), ',', ';');
+    }
+    else if (key == "regress-rmse" || key == "regress-slowdown")
+    {
+        double x = strtod(value.c_str(), &end);
+        if (end == value.c_str() || *end != '\0' || x < 0)
+        {
+            error = "invalid value '" + value + "' for " + key;
+            return false;
+        }
+        (key == "regress-rmse" ? job.regress_rmse : job.regress_slowdown) = x;
+    }
+    else if (key == "regress-update")
+    {
+        if (value == "on" || value == "1") job.regress_update = true;
+        else if (value == "off" || value == "0") job.regress_update = false;
+        else
+        {
+            error = "invalid value '" + value + "' for regress-update, expected on or off";
+            return false;
+        }
+    }
+    else
+    {
+        error = "unknown option '" + key + "'";
+        return false;
+    }
+    return true;
+}
+
+/**
+* Reads a job file into the job.
+* @return false if the file can't be read or holds an invalid option.
+*/
+bool load_job_file(render_job& job, const std::string& path, std::string& error)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        error = "can't open job file '" + path + "'";
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line))
+    {
+        line_no++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+
+        size_t eq = line.find('=');
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            continue;
+        if (eq == std::string::npos)
+        {
+            error = path + ":" + std::to_string(line_no) + ": expected key = value";
+            return false;
+        }
+
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        key.erase(0, key.find_first_not_of(" \t"));
+        key.erase(key.find_last_not_of(" \t\r") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+
+        if (!apply_job_option(job, key, value, error))
+        {
+            error = path + ":" + std::to_string(line_no) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+* Reads a views file: one view per line as "lookfrom_x lookfrom_y lookfrom_z lookat_x lookat_y lookat_z [vfov]", '#' starting a
+* comment. Anything a line leaves out (vup, the field of view, the lens) is taken from base.
+* @return false if the file can't be read or a line is malformed.
+*/
+bool load_views_file(const std::string& path, const camera_view& base, std::vector<camera_view>& views, std::string& error)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        error = "can't open views file '" + path + "'";
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line))
+    {
+        line_no++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        camera_view v = base;
+        double f[6];
+        std::istringstream is(line);
+        for (int k = 0; k < 6; k++)
+            is >> f[k];
+        if (!is || (f[0] == f[3] && f[1] == f[4] && f[2] == f[5]))
+        {
+            error = path + ":" + std::to_string(line_no) + ": expected lookfrom and lookat as six numbers";
+            return false;
+        }
+        v.lookfrom = vec3(f[0], f[1], f[2]);
+        v.lookat = vec3(f[3], f[4], f[5]);
+        std::string extra;
+        if (is >> extra)
+        {
+            char* end = nullptr;
+            v.vfov = strtod(extra.c_str(), &end);
+            std::string rest;
+            if (*end != '\0' || !(v.vfov > 0 && v.vfov < 180) || (is >> rest))
+            {
+                error = path + ":" + std::to_string(line_no) + ": invalid field of view '" + extra + "'";
+                return false;
+            }
+        }
+        views.push_back(v);
+    }
+    if (views.empty())
+    {
+        error = "views file '" + path + "' holds no views";
+        return false;
+    }
+    return true;
+}
+
+//Gets the path a batch writes view index to: output with _NNN inserted before its extension.
+inline std::string view_output_path(const std::string& output, size_t index)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%03u", unsigned(index));
+    size_t slash = output.find_last_of("/\\"), dot = output.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return output + suffix;
+    return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+/**
+* Builds the job from the command line.
+* @param show_help - set if --help was given, in which case nothing should be rendered.
+* @return false if the command line is invalid, error then says why.
+*/
+bool parse_job_args(int argc, char** argv, render_job& job, bool& show_help, std::string& error)
+{
+    show_help = false;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--help" || arg == "-h")
+        {
+            show_help = true;
+            return true;
+        }
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            error = "unexpected argument '" + arg + "'";
+            return false;
+        }
+
+        //Accept both "--key value" and "--key=value"
+        std::string key = arg.substr(2), value;
+        size_t eq = key.find('=');
+        if (eq != std::string::npos)
+        {
+            value = key.substr(eq + 1);
+            key.erase(eq);
+        }
+        else if (a + 1 < argc)
+            value = argv[++a];
+        else
+        {
+            error = "missing value for " + arg;
+            return false;
+        }
+
+        bool ok = (key == "job") ? load_job_file(job, value, error) : apply_job_option(job, key, value, error);
+        if (!ok)
+            return false;
+    }
+
+    if (job.settings.time_budget > 0)
+    {
+        if (!job.spp_given)
+            job.settings.ns = 0;
+        if (job.sample_count_output.empty())
+            job.sample_count_output = job.output + ".spp.pgm";
+    }
+    //Batches render every view at once on the engine, which has no preview, and every view's time budget would run at once
+    if ((!job.views.empty() || job.turntable > 0) && (job.settings.time_budget > 0 || !job.settings.preview_name.empty()))
+    {
+        error = "--views and --turntable can't be combined with --time or --preview";
+        return false;
+    }
+    if (job.numa_nodes != 0 && !job.settings.preview_name.empty())
+    {
+        error = "--numa can't be combined with --preview";
+        return false;
+    }
+    return true;
+}
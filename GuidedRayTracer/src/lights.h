@@ -0,0 +1,608 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+
+//Kinds of emitters a light_bvh holds.
+enum class light_shape : uint32_t
+{
+    sphere,
+    triangle
+};
+
+/**
+* A single emitter. Spheres emit from their whole surface, triangles only from their front face (the side n points to).
+*/
+struct light_info
+{
+    light_shape shape;
+    //Sphere: center and radius. Triangle: vertices a, b, c, unit normal n and area.
+    vec3 a, b, c, n;
+    double radius;
+    double area;
+    //Emitted radiance
+    vec3 radiance;
+};
+
+//A light picked for a shading point, with a direction towards it.
+struct light_sample
+{
+    //Unit direction from the shading point to the light
+    vec3 wi;
+    //Distance to the point sampled on the light, along wi
+    double dist;
+    vec3 radiance;
+    //Solid angle density of wi, including the probability of having picked this light
+    double pdf;
+};
+
+/**
+* Bounds on the emission of a set of lights (Conty Estevez & Kulla 2018, "Importance Sampling of Many Lights with Adaptive
+* Tree Splitting"): spatial bounds, total power, and a cone of directions (axis w, half angle theta_o) containing every surface
+* normal, each of which emits within theta_e of its normal.
+*/
+struct light_bounds
+{
+    aabb box;
+    double phi = 0;
+    vec3 w = vec3(0, 0, 1);
+    double cos_o = 1;
+    double cos_e = 1;
+};
+
+//cos(max(0, a - b)) given the sines and cosines of a and b.
+inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b)
+{
+    return (cos_a > cos_b) ? 1 : cos_a * cos_b + sin_a * sin_b;
+}
+
+//sin(max(0, a - b)) given the sines and cosines of a and b.
+inline double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b)
+{
+    return (cos_a > cos_b) ? 0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+inline double safe_sqrt(double x) { return sqrt(fmax(x, 0.0)); }
+
+//Rotates v by angle theta about the unit axis k.
+inline vec3 rotate_about(const vec3& v, const vec3& k, double theta)
+{
+    double c = cos(theta), s = sin(theta);
+    return v * c + cross(k, v) * s + k * dot(k, v) * (1 - c);
+}
+
+/**
+* Smallest cone containing both cones, each given by its axis and the cosine of its half angle.
+*/
+inline void cone_union(const vec3& wa, double cos_a, const vec3& wb, double cos_b, vec3& w, double& cos_o)
+{
+    double theta_a = acos(fmin(fmax(cos_a, -1.0), 1.0)), theta_b = acos(fmin(fmax(cos_b, -1.0), 1.0));
+    double theta_d = acos(fmin(fmax(dot(wa, wb), -1.0), 1.0));
+    if (fmin(theta_d + theta_b, M_PI) <= theta_a)
+    {
+        w = wa;
+        cos_o = cos_a;
+        return;
+    }
+    if (fmin(theta_d + theta_a, M_PI) <= theta_b)
+    {
+        w = wb;
+        cos_o = cos_b;
+        return;
+    }
+
+    double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+    vec3 wr = cross(wa, wb);
+    if (theta_o >= M_PI || wr.squared_length() == 0)
+    {
+        w = wa;
+        cos_o = -1;
+        return;
+    }
+    w = unit_vector(rotate_about(wa, unit_vector(wr), theta_o - theta_a));
+    cos_o = cos(theta_o);
+}
+
+inline light_bounds bounds_union(const light_bounds& a, const light_bounds& b)
+{
+    if (a.phi == 0)
+        return b;
+    if (b.phi == 0)
+        return a;
+    light_bounds u;
+    u.box = enclose_boxes(a.box, b.box);
+    u.phi = a.phi + b.phi;
+    cone_union(a.w, a.cos_o, b.w, b.cos_o, u.w, u.cos_o);
+    u.cos_e = fmin(a.cos_e, b.cos_e);
+    return u;
+}
+
+/**
+* Bounding volume hierarchy over a scene's emitters, used to pick a light for a shading point with probability roughly
+* proportional to its contribution there (power over squared distance, weighted by how much the light can face the point
+* and the point's surface can face the light). Picking walks a single root to leaf path, so it takes O(log n) whatever
+* the number of lights, and the probability of any light can be recomputed by walking the same path from the leaf up.
+*/
+class light_bvh
+{
+private:
+    //One cache line per node, the bounds stored in floats rounded so they only ever grow.
+    struct alignas(64) node
+    {
+        float lo[3], hi[3];
+        float phi;
+        float w[3];
+        float cos_o, cos_e;
+        //Inner nodes: both children; leaves: child[0] is the light
+        uint32_t child[2];
+        uint32_t parent;
+        uint32_t leaf;
+    };
+    static_assert(sizeof(node) == 64, "light_bvh::node must fill exactly one cache line");
+
+    static node make_node(const light_bounds& b, uint32_t parent);
+
+    //Arrays built by build(), the pointers below refer to these unless the hierarchy was attached to storage of its own
+    std::vector<light_info> owned_lights;
+    std::vector<node> owned_nodes;
+    std::vector<uint32_t> owned_leaf;
+
+    const light_info* lights = nullptr;
+    size_t num_lights = 0;
+    const node* nodes = nullptr;
+    size_t num_nodes = 0;
+    //Leaf node of every light
+    const uint32_t* light_leaf = nullptr;
+
+    uint32_t build_recursive(std::vector<uint32_t>& order, const std::vector<light_bounds>& bounds, size_t begin, size_t end, uint32_t parent, int depth);
+
+    //Estimated contribution of the lights under a node to the point p with surface normal n.
+    double importance(const node& b, const vec3& p, const vec3& n) const;
+
+    //Solid angle density of sampling a point on light l as seen from p, in direction wi where it's at distance dist.
+    double direction_pdf(const light_info& l, const vec3& p, const vec3& wi, double dist) const;
+
+public:
+    static light_bounds bounds_of(const light_info& l);
+
+    /**
+    * Builds the hierarchy over the given lights, replacing any built before. Lights keep their index in all, and must each emit
+    * some power (see bounds_of).
+    */
+    void build(const std::vector<light_info>& all);
+
+    /**
+    * Calls f(pointer, count) on each array of the built hierarchy, with references so f may also point them at other storage
+    * holding the same data (e.g. a mapped scene cache, see scene_cache.h), which must then outlive the hierarchy.
+    */
+    template <class F>
+    inline void visit_arrays(F&& f)
+    {
+        f(lights, num_lights);
+        f(nodes, num_nodes);
+        f(light_leaf, num_lights);
+    }
+
+    inline size_t size() const { return num_lights; }
+    inline const light_info& light(uint32_t i) const { return lights[i]; }
+
+    /**
+    * Picks a light for the shading point and a point on it.
+    * @param p/n - position and normal of the shading point.
+    * @param u_pick - uniform number used to walk the hierarchy, u1/u2 - uniform numbers for the point on the light.
+    * @return false if no light can contribute to the point.
+    */
+    bool sample(const vec3& p, const vec3& n, double u_pick, double u1, double u2, light_sample& ls) const;
+
+    /**
+    * Probability of picking light l for the shading point (p, n).
+    */
+    double pmf(uint32_t l, const vec3& p, const vec3& n) const;
+
+    /**
+    * Solid angle density with which sample() produces the direction wi from (p, n) towards light l, which it hits at distance dist.
+    */
+    inline double pdf(uint32_t l, const vec3& p, const vec3& n, const vec3& wi, double dist) const
+    {
+        return pmf(l, p, n) * direction_pdf(lights[l], p, wi, dist);
+    }
+
+    /**
+    * Picks a light in proportion to its power alone, for paths that start on a light rather than look for one from a point.
+    * @return false if there are no lights.
+    */
+    bool sample_power(double u_pick, uint32_t& l, double& pmf) const;
+
+    //Probability of sample_power picking light l.
+    double power_pmf(uint32_t l) const;
+};
+
+/**
+* Gets a point uniformly distributed over the surface of a light (density 1 / l.area), and the light's unit normal there.
+*/
+inline void light_point(const light_info& l, double u1, double u2, vec3& p, vec3& n)
+{
+    if (l.shape == light_shape::sphere)
+    {
+        double z = 1 - 2 * u1, r = safe_sqrt(1 - z * z), phi = 2 * M_PI * u2;
+        n = vec3(r * cos(phi), r * sin(phi), z);
+        p = l.a + l.radius * n;
+    }
+    else
+    {
+        double su = sqrt(u1);
+        p = (1 - su) * l.a + su * (1 - u2) * l.b + su * u2 * l.c;
+        n = l.n;
+    }
+}
+
+light_bounds light_bvh::bounds_of(const light_info& l)
+{
+    light_bounds b;
+    double lum = luminance(l.radiance);
+    if (l.shape == light_shape::sphere)
+    {
+        vec3 r(l.radius, l.radius, l.radius);
+        b.box = aabb(l.a - r, l.a + r);
+        b.phi = M_PI * l.area * lum;
+        b.cos_o = -1;
+        b.cos_e = 0;
+    }
+    else
+    {
+        b.box = aabb(vec3(fmin(l.a.x(), fmin(l.b.x(), l.c.x())), fmin(l.a.y(), fmin(l.b.y(), l.c.y())), fmin(l.a.z(), fmin(l.b.z(), l.c.z()))),
+                     vec3(fmax(l.a.x(), fmax(l.b.x(), l.c.x())), fmax(l.a.y(), fmax(l.b.y(), l.c.y())), fmax(l.a.z(), fmax(l.b.z(), l.c.z()))));
+        b.phi = M_PI * l.area * lum;
+        b.w = l.n;
+        b.cos_o = 1;
+        b.cos_e = 0;
+    }
+    return b;
+}
+
+void light_bvh::build(const std::vector<light_info>& all)
+{
+    owned_lights = all;
+    owned_nodes.clear();
+    owned_leaf.clear();
+    if (!all.empty())
+    {
+        std::vector<light_bounds> bounds(all.size());
+        std::vector<uint32_t> order(all.size());
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            bounds[i] = bounds_of(all[i]);
+            order[i] = uint32_t(i);
+        }
+
+        owned_leaf.resize(all.size());
+        owned_nodes.reserve(2 * all.size());
+        build_recursive(order, bounds, 0, order.size(), UINT32_MAX, 0);
+    }
+
+    lights = owned_lights.data();
+    num_lights = owned_lights.size();
+    nodes = owned_nodes.data();
+    num_nodes = owned_nodes.size();
+    light_leaf = owned_leaf.data();
+}
+
+/**
+* Splits by the binned cost of Conty Estevez & Kulla, power times the measure of the cone of emitted directions times area,
+* with a penalty for boxes that are long and thin.
+*/
+uint32_t light_bvh::build_recursive(std::vector<uint32_t>& order, const std::vector<light_bounds>& bounds, size_t begin, size_t end, uint32_t parent, int depth)
+{
+    light_bounds nb;
+    for (size_t i = begin; i < end; i++)
+        nb = bounds_union(nb, bounds[order[i]]);
+
+    uint32_t id = uint32_t(owned_nodes.size());
+    owned_nodes.push_back(make_node(nb, parent));
+    if (end - begin == 1)
+    {
+        owned_nodes[id].leaf = 1;
+        owned_nodes[id].child[0] = order[begin];
+        owned_leaf[order[begin]] = id;
+        return id;
+    }
+
+    auto centroid = [&](uint32_t i) { return 0.5 * (bounds[i].box.min() + bounds[i].box.max()); };
+    vec3 cmin = centroid(order[begin]), cmax = cmin;
+    for (size_t i = begin + 1; i < end; i++)
+    {
+        vec3 c = centroid(order[i]);
+        cmin = vec3(fmin(cmin.x(), c.x()), fmin(cmin.y(), c.y()), fmin(cmin.z(), c.z()));
+        cmax = vec3(fmax(cmax.x(), c.x()), fmax(cmax.y(), c.y()), fmax(cmax.z(), c.z()));
+    }
+
+    auto cost = [](const light_bounds& b, const vec3& node_extent, int axis)
+    {
+        double theta_o = acos(fmin(fmax(b.cos_o, -1.0), 1.0)), theta_e = acos(fmin(fmax(b.cos_e, -1.0), 1.0));
+        double theta_w = fmin(theta_o + theta_e, M_PI);
+        double sin_o = sin(theta_o);
+        double m_omega = 2 * M_PI * (1 - b.cos_o)
+                       + M_PI / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + b.cos_o);
+        vec3 d = b.box.max() - b.box.min();
+        double area = 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+        double max_extent = fmax(node_extent.x(), fmax(node_extent.y(), node_extent.z()));
+        double kr = (node_extent[axis] > 0) ? max_extent / node_extent[axis] : 1;
+        return kr * b.phi * m_omega * area;
+    };
+
+    const int num_bins = 12;
+    vec3 extent = nb.box.max() - nb.box.min();
+    int best_axis = -1, best_bin = 0;
+    double best_cost = DBL_MAX;
+    //Past this depth split by median so the tree stays shallow whatever the lights' layout
+    if (depth < 48)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double span = cmax[axis] - cmin[axis];
+            if (span <= 0)
+                continue;
+            double k = num_bins * (1 - 1e-9) / span;
+            light_bounds bins[num_bins];
+            for (size_t i = begin; i < end; i++)
+            {
+                int b = int((centroid(order[i])[axis] - cmin[axis]) * k);
+                bins[b] = bounds_union(bins[b], bounds[order[i]]);
+            }
+            //Cost of everything right of each split, then sweep from the left
+            double right_cost[num_bins];
+            light_bounds acc;
+            for (int b = num_bins - 1; b > 0; b--)
+            {
+                acc = bounds_union(acc, bins[b]);
+                right_cost[b] = (acc.phi > 0) ? cost(acc, extent, axis) : -1;
+            }
+            acc = light_bounds();
+            for (int split = 0; split < num_bins - 1; split++)
+            {
+                acc = bounds_union(acc, bins[split]);
+                if (acc.phi == 0 || right_cost[split + 1] < 0)
+                    continue;
+                double c = cost(acc, extent, axis) + right_cost[split + 1];
+                if (c < best_cost)
+                {
+                    best_cost = c;
+                    best_axis = axis;
+                    best_bin = split;
+                }
+            }
+        }
+    }
+
+    size_t mid;
+    if (best_axis >= 0)
+    {
+        int axis = best_axis;
+        double k = num_bins * (1 - 1e-9) / (cmax[axis] - cmin[axis]);
+        mid = size_t(std::partition(order.begin() + begin, order.begin() + end,
+                                    [&](uint32_t i) { return int((centroid(i)[axis] - cmin[axis]) * k) <= best_bin; }) - order.begin());
+    }
+    else
+    {
+        vec3 d = cmax - cmin;
+        int axis = (d.x() > d.y() && d.x() > d.z()) ? 0 : (d.y() > d.z() ? 1 : 2);
+        mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](uint32_t a, uint32_t b) { return centroid(a)[axis] < centroid(b)[axis]; });
+    }
+
+    uint32_t left = build_recursive(order, bounds, begin, mid, id, depth + 1);
+    uint32_t right = build_recursive(order, bounds, mid, end, id, depth + 1);
+    owned_nodes[id].child[0] = left;
+    owned_nodes[id].child[1] = right;
+    return id;
+}
+
+light_bvh::node light_bvh::make_node(const light_bounds& b, uint32_t parent)
+{
+    node n = {};
+    for (int a = 0; a < 3; a++)
+    {
+        n.lo[a] = float(b.box.min()[a]);
+        if (double(n.lo[a]) > b.box.min()[a])
+            n.lo[a] = nextafterf(n.lo[a], -FLT_MAX);
+        n.hi[a] = float(b.box.max()[a]);
+        if (double(n.hi[a]) < b.box.max()[a])
+            n.hi[a] = nextafterf(n.hi[a], FLT_MAX);
+        n.w[a] = float(b.w[a]);
+    }
+    //Widen the cones a little to cover rounding of the axis
+    n.phi = float(b.phi);
+    n.cos_o = float(fmax(b.cos_o - 1e-5, -1.0));
+    n.cos_e = float(fmax(b.cos_e - 1e-5, -1.0));
+    n.parent = parent;
+    return n;
+}
+
+double light_bvh::importance(const node& b, const vec3& p, const vec3& n) const
+{
+    vec3 lo(b.lo[0], b.lo[1], b.lo[2]), hi(b.hi[0], b.hi[1], b.hi[2]);
+    vec3 pc = 0.5 * (lo + hi);
+    vec3 diag = hi - lo;
+    double d2 = fmax((p - pc).squared_length(), 0.25 * diag.squared_length());
+
+    //Within the bounds lights could face p from any direction
+    bool inside = p.x() >= lo.x() && p.x() <= hi.x() && p.y() >= lo.y() && p.y() <= hi.y() && p.z() >= lo.z() && p.z() <= hi.z();
+    double radius2 = 0.25 * diag.squared_length();
+    double dist2 = (p - pc).squared_length();
+    if (inside || dist2 <= radius2)
+        return b.phi / d2;
+
+    //Cone of directions from p the box's bounding sphere subtends
+    double sin2 = radius2 / dist2;
+    double cos_b = safe_sqrt(1 - sin2), sin_b = sqrt(sin2);
+
+    //Angle between the cone axis and the direction to p, less the normal cone and the box's own spread
+    vec3 wi = (p - pc) / sqrt(dist2);
+    double cos_w = dot(vec3(b.w[0], b.w[1], b.w[2]), wi), sin_w = safe_sqrt(1 - cos_w * cos_w);
+    double sin_o = safe_sqrt(1 - b.cos_o * b.cos_o);
+    double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, b.cos_o), sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, b.cos_o);
+    double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= b.cos_e)
+        return 0;
+
+    double result = b.phi * cos_p / d2;
+
+    //How much the surface at p can face the lights
+    double cos_i = fabs(dot(wi, n)), sin_i = safe_sqrt(1 - cos_i * cos_i);
+    result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+    return fmax(result, 0.0);
+}
+
+double light_bvh::direction_pdf(const light_info& l, const vec3& p, const vec3& wi, double dist) const
+{
+    if (l.shape == light_shape::sphere)
+    {
+        double d2 = (l.a - p).squared_length();
+        if (d2 <= l.radius * l.radius)
+            return 1 / (4 * M_PI);
+        double cos_max = safe_sqrt(1 - l.radius * l.radius / d2);
+        return 1 / (2 * M_PI * (1 - cos_max));
+    }
+    double cos_l = -dot(wi, l.n);
+    if (cos_l <= 0)
+        return 0;
+    return dist * dist / (cos_l * l.area);
+}
+
+bool light_bvh::sample(const vec3& p, const vec3& n, double u_pick, double u1, double u2, light_sample& ls) const
+{
+    if (num_nodes == 0)
+        return false;
+
+    double pmf_acc = 1;
+    uint32_t i = 0;
+    while (!nodes[i].leaf)
+    {
+        double i0 = importance(nodes[nodes[i].child[0]], p, n);
+        double i1 = importance(nodes[nodes[i].child[1]], p, n);
+        if (i0 <= 0 && i1 <= 0)
+            return false;
+        double p0 = i0 / (i0 + i1);
+        //Reuse the remaining range of u_pick for the next level
+        if (u_pick < p0)
+        {
+            u_pick = fmin(u_pick / p0, 1 - DBL_EPSILON);
+            pmf_acc *= p0;
+            i = nodes[i].child[0];
+        }
+        else
+        {
+            u_pick = fmin((u_pick - p0) / (1 - p0), 1 - DBL_EPSILON);
+            pmf_acc *= 1 - p0;
+            i = nodes[i].child[1];
+        }
+    }
+
+    const light_info& l = lights[nodes[i].child[0]];
+    ls.radiance = l.radiance;
+    if (l.shape == light_shape::sphere)
+    {
+        vec3 to_c = l.a - p;
+        double d2 = to_c.squared_length();
+        if (d2 <= l.radius * l.radius)
+            return false;
+
+        //Uniformly within the cone the sphere subtends, then find where that direction meets the sphere
+        double cos_max = safe_sqrt(1 - l.radius * l.radius / d2);
+        double cos_t = 1 - u1 * (1 - cos_max), sin_t = safe_sqrt(1 - cos_t * cos_t);
+        double phi = 2 * M_PI * u2;
+        vec3 w = unit_vector(to_c);
+        vec3 t1 = unit_vector(cross(fabs(w.x()) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0), w));
+        vec3 t2 = cross(w, t1);
+        ls.wi = unit_vector(sin_t * cos(phi) * t1 + sin_t * sin(phi) * t2 + cos_t * w);
+        double b = dot(to_c, ls.wi);
+        ls.dist = b - safe_sqrt(b * b - d2 + l.radius * l.radius);
+        ls.pdf = pmf_acc / (2 * M_PI * (1 - cos_max));
+    }
+    else
+    {
+        //Uniformly over the triangle's area
+        double su = sqrt(u1);
+        vec3 q = (1 - su) * l.a + su * (1 - u2) * l.b + su * u2 * l.c;
+        vec3 d = q - p;
+        ls.dist = d.length();
+        if (ls.dist <= 0)
+            return false;
+        ls.wi = d / ls.dist;
+        double pdf = direction_pdf(l, p, ls.wi, ls.dist);
+        if (pdf <= 0)
+            return false;
+        ls.pdf = pmf_acc * pdf;
+    }
+    return ls.pdf > 0;
+}
+
+double light_bvh::pmf(uint32_t l, const vec3& p, const vec3& n) const
+{
+    if (l >= num_lights)
+        return 0;
+
+    double result = 1;
+    uint32_t i = light_leaf[l];
+    while (nodes[i].parent != UINT32_MAX)
+    {
+        const node& parent = nodes[nodes[i].parent];
+        double i0 = importance(nodes[parent.child[0]], p, n);
+        double i1 = importance(nodes[parent.child[1]], p, n);
+        double mine = (parent.child[0] == i) ? i0 : i1;
+        if (mine <= 0)
+            return 0;
+        result *= mine / (i0 + i1);
+        i = nodes[i].parent;
+    }
+    return result;
+}
+
+bool light_bvh::sample_power(double u_pick, uint32_t& l, double& pmf) const
+{
+    if (num_nodes == 0)
+        return false;
+
+    pmf = 1;
+    uint32_t i = 0;
+    while (!nodes[i].leaf)
+    {
+        double phi0 = nodes[nodes[i].child[0]].phi, phi1 = nodes[nodes[i].child[1]].phi;
+        double p0 = phi0 / (phi0 + phi1);
+        if (u_pick < p0)
+        {
+            u_pick = fmin(u_pick / p0, 1 - DBL_EPSILON);
+            pmf *= p0;
+            i = nodes[i].child[0];
+        }
+        else
+        {
+            u_pick = fmin((u_pick - p0) / (1 - p0), 1 - DBL_EPSILON);
+            pmf *= 1 - p0;
+            i = nodes[i].child[1];
+        }
+    }
+    l = nodes[i].child[0];
+    return pmf > 0;
+}
+
+double light_bvh::power_pmf(uint32_t l) const
+{
+    if (l >= num_lights)
+        return 0;
+
+    double result = 1;
+    uint32_t i = light_leaf[l];
+    while (nodes[i].parent != UINT32_MAX)
+    {
+        const node& parent = nodes[nodes[i].parent];
+        double phi0 = nodes[parent.child[0]].phi, phi1 = nodes[parent.child[1]].phi;
+        result *= ((parent.child[0] == i) ? phi0 : phi1) / (phi0 + phi1);
+        i = nodes[i].parent;
+    }
+    return result;
+}
@@ -1,142 +1,309 @@
-#include <crtdbg.h>
 #include <stdlib.h>
-#include <crtdbg.h>
-#include <io.h>
+#include <errno.h>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 
-#include "camera.h"
-#include "sphere.h"
-#include "triangle.h"
-#include "cube.h"
-#include "torus.h"
+#include "alloc_tracker.h"
+#include "job.h"
+#include "numa.h"
+#include "regress.h"
+#include "render_engine.h"
+#include "scene.h"
 #include "curve.h"
-#include "plane.h"
-
-#ifdef   _DEBUG
-#define  SET_CRT_DEBUG_FIELD(a) \
-            _CrtSetDbgFlag((a) | _CrtSetDbgFlag(_CRTDBG_REPORT_FLAG))
-#define  CLEAR_CRT_DEBUG_FIELD(a) \
-            _CrtSetDbgFlag(~(a) & _CrtSetDbgFlag(_CRTDBG_REPORT_FLAG))
-#else
-#define  SET_CRT_DEBUG_FIELD(a)   ((void) 0)
-#define  CLEAR_CRT_DEBUG_FIELD(a) ((void) 0)
-#endif
+
+//What a run rendered, for the allocation report.
+struct render_totals
+{
+    uint64_t frames = 0;
+    //Rays traced, only counted with --alloc-stats
+    uint64_t rays = 0;
+    std::vector<std::shared_ptr<counting_hitable>> counters;
+
+    /**
+    * Wraps world in a counting_hitable so the rays traced through it make it into the report.
+    * @return the wrapper, which keeps world alive.
+    */
+    inline std::shared_ptr<const hitable> counted(const std::shared_ptr<const hitable>& world)
+    {
+        std::shared_ptr<counting_hitable> c = std::make_shared<counting_hitable>(*world);
+        counters.push_back(c);
+        return std::shared_ptr<const hitable>(c.get(), [c, world](const hitable*) {});
+    }
+};
+
+/**
+* Copies the world onto every NUMA node past the first, each copy made by a thread on its node so it sits in the node's memory.
+* The calling thread is pinned to node 0, whose workers trace the world itself.
+* @return the world of each node, for render_request::replicas.
+*/
+std::vector<std::shared_ptr<const hitable>> replicate_world(scene& world, const numa_topology& topology)
+{
+    trace_scope scope("scene replication", "setup", "nodes", int64_t(topology.size()));
+    pin_current_thread(topology.nodes[0]);
+    //The world lives on the caller's stack, so the engine mustn't delete it
+    std::vector<std::shared_ptr<const hitable>> worlds(topology.size());
+    worlds[0] = std::shared_ptr<const hitable>(&world, [](const hitable*) {});
+    for (size_t n = 1; n < topology.size(); n++)
+        run_on_node(topology, n, [&] { worlds[n] = world.replicate(); });
+    return worlds;
+}
 
 /**
-* Recursive function responsible for producing final colour of each sample, at each step attenuating reflected colours.
-* @param r - initially the sample ray through the pixel whose final colour is to be computed, subsequent calls being invoked
-*            on scattered rays from valid intersections.
-* @param world - container for all the objects in the scene.
-* @param depth - specifies the ray depth; how many times the ray has bounced about the scene..
-* @return - final colour of the sample.
+* Renders every view of a batch against the one scene. All of them go to one render_engine up front, so tiles of the next views
+* keep the cores busy while the last tiles of earlier ones finish, and each image is written as soon as it's done.
+* @param topology/replicas - NUMA nodes to render on and the world of each (see replicate_world), null/empty to not pin workers.
+* @return 0 on success, otherwise the errno of the failure.
 */
-vec3 colour(const ray& r, hitable * world, int depth)
+int render_batch(const render_job& job, const std::shared_ptr<const hitable>& world, const numa_topology* topology,
+    const std::vector<std::shared_ptr<const hitable>>& replicas, const std::vector<camera_view>& views, render_totals& totals)
 {
-    hit_record rec;
-    material closest_mat;
-    if (world->hit(r, 0.0001, FLT_MAX, rec, closest_mat))
+    //Views are written in the order they finish, so a slow view doesn't hold back (or keep in memory) the ones after it
+    std::mutex done_lock;
+    std::condition_variable done_wake;
+    std::deque<size_t> done;
+
+    //Every view shares one irradiance cache, records gathered for one view are as good for the others
+    std::shared_ptr<irradiance_cache> cache;
+    if (job.settings.cache_error > 0 && job.settings.integrator == integrator_type::path)
+    {
+        aabb bounds;
+        if (!world->bounding_box(bounds))
+            bounds = aabb(views[0].lookfrom - vec3(100, 100, 100), views[0].lookfrom + vec3(100, 100, 100));
+        cache = std::make_shared<irradiance_cache>(bounds, job.settings.cache_error);
+    }
+
+    render_engine engine(0, topology);
+    std::vector<render_handle> handles;
+    for (size_t k = 0; k < views.size(); k++)
+    {
+        render_request request;
+        request.world = world;
+        request.cache = cache;
+        request.replicas = replicas;
+        request.view = views[k];
+        request.settings = job.settings;
+        request.on_done = [&, k]
+        {
+            std::lock_guard<std::mutex> guard(done_lock);
+            done.push_back(k);
+            done_wake.notify_one();
+        };
+        handles.push_back(engine.submit(request));
+    }
+
+    int x0, y0, x1, y1;
+    job.settings.crop_window(x0, y0, x1, y1);
+    for (size_t written = 0; written < handles.size(); written++)
     {
-        ray scattered;
-        vec3 attenuation;
-        if (depth < 50 && closest_mat.scatter(r, rec, attenuation, scattered))
+        size_t k;
         {
-            return attenuation * colour(scattered, world, depth + 1);
+            std::unique_lock<std::mutex> guard(done_lock);
+            done_wake.wait(guard, [&] { return !done.empty(); });
+            k = done.front();
+            done.pop_front();
         }
-        else
-            return vec3(0, 0, 0);
+        {
+            trace_scope scope("image write", "output", "view", int64_t(k));
+            if (!write_image(view_output_path(job.output, k), handles[k].get().image, job.format, x0, y0, x1, y1))
+                return errno ? errno : EIO;
+        }
+        //Dropping the handle frees the image
+        handles[k] = render_handle();
+        totals.frames++;
     }
-    //Background colour
-    vec3 unit_direction = unit_vector(r.direction());
-    double t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * vec3(1, 1, 1) + t * vec3(0.5, 0.7, 1);
+    return 0;
 }
 
-
-void render()
+/**
+* Sets up the world and renders the given job.
+* @return 0 on success, otherwise the errno of the failure (or 1 if the render was cancelled).
+*/
+int render(render_job& job, render_totals& totals)
 {
     //Standard World setup
-    const int num_objects = 1;
-    hitable* objects[num_objects];
-    //objects[0] = new sphere(vec3(0, -100.5, -1), 100, material(vec3(0.8, 0.8, 0.0), material_type::lambertian));
-    //objects[2] = new sphere(vec3(2.0, 0, -1), 0.55, material(vec3(0.0, 0.2, 0.8), material_type::lambertian));
-    //objects[0] = new torus(vec3(2.0, 0, -1), unit_vector(vec3(1, 0, 1)), 2, 0.5, material(vec3(0.0, 0.2, 0.8), material_type::lambertian));
-    objects[0] = new cube(material(vec3(0.8, 0.3, 0.3), material_type::lambertian));
-    
-    hitable* world = new hitable_list(objects, num_objects);
-
-    //Standard render setup
-    int nx = 200;
-    int ny = 100;
-    int ns = 20;
-
-    //Cam setup
-    vec3 lookfrom(2, 2, 8);
-    vec3 lookat(0, 0, -1);
-
-    camera cam(lookfrom, lookat, vec3(0, 1, 0), 45, double(nx) / double(ny));
-    
-
-    double u, v;
-    ray r;
-    vec3 col;
-    
-    FILE* fd;
-    if (fopen_s(&fd, "out/test_cube_new.ppm", "w") != 0 || fd == NULL)
-        exit(errno);
+    scene world(job.texture_cache_bytes);
+    //world.add_sphere(vec3(0, -100.5, -1), 100, world.add_material(material(vec3(0.8, 0.8, 0.0), material_type::lambertian)));
+    //world.add_sphere(vec3(2.0, 0, -1), 0.55, world.add_material(material(vec3(0.0, 0.2, 0.8), material_type::lambertian)));
+    //world.add_torus(vec3(2.0, 0, -1), unit_vector(vec3(1, 0, 1)), 2, 0.5, world.add_material(material(vec3(0.0, 0.2, 0.8), material_type::lambertian)));
+    //world.add_cube(cube(material(vec3(1, 1, 1), material_type::lambertian).with_albedo_map(world.add_texture("res/tex/checker.gtx"))));
+    world.add_cube(cube(material(vec3(0.8, 0.3, 0.3), material_type::lambertian)));
 
-    // Use std out to write the file, then restore its reference to the console
-    int og_holder = _dup(_fileno(stdout));
+    std::unique_ptr<clustered_mesh> mesh;
+    {
+        trace_scope scope("scene setup", "setup");
+        if (!job.mesh.empty())
+        {
+            mesh.reset(new clustered_mesh(job.mesh, job.mesh_budget_bytes));
+            if (!mesh->valid())
+            {
+                std::cerr << "couldn't open mesh '" << job.mesh << "'\n";
+                return ENOENT;
+            }
+            world.add_mesh(mesh.get(), world.add_material(material(vec3(0.7, 0.7, 0.7), material_type::lambertian)));
+        }
+        world.set_builder(job.builder);
+        world.commit(job.scene_cache);
+        if (!job.environment.empty() && !world.load_environment(job.environment, job.environment_intensity))
+        {
+            std::cerr << "couldn't read environment map '" << job.environment << "'\n";
+            return ENOENT;
+        }
+    }
 
-    if (_dup2(_fileno(fd), _fileno(stdout)) != 0)
-        exit(errno);
+    std::unique_ptr<numa_topology> topology;
+    std::vector<std::shared_ptr<const hitable>> replicas;
+    if (job.numa_nodes != 0)
+    {
+        topology.reset(new numa_topology(job.numa_nodes < 0 ? numa_topology::detect() : numa_topology::simulate(unsigned(job.numa_nodes))));
+        replicas = replicate_world(world, *topology);
+    }
 
-    std::cout << "P3\n" << nx << " " << ny << "\n255\n";
+    //The world lives on the stack, so the engine mustn't delete it
+    std::shared_ptr<const hitable> traced(&world, [](const hitable*) {});
+    if (job.alloc_stats)
+    {
+        traced = totals.counted(traced);
+        for (size_t n = 0; n < replicas.size(); n++)
+            replicas[n] = totals.counted(replicas[n]);
+    }
 
+    //Cam setup
+    camera_view view;
+    view.lookfrom = vec3(2, 2, 8);
+    view.lookat = vec3(0, 0, -1);
+    view.vup = vec3(0, 1, 0);
+    view.vfov = 45;
+    view.aperture = 0;
+    view.focus_dist = 1;
 
-    for (int j = ny - 1; j >= 0; j--) {
-        for (int i = 0; i < nx; i++) {
-            col = vec3(0, 0, 0);
-            for (int s = 0; s < ns; s++)
+    if (!job.views.empty() || job.turntable > 0)
+    {
+        std::vector<camera_view> views;
+        std::string error;
+        if (job.views.empty())
+            views.push_back(view);
+        else if (!load_views_file(job.views, view, views, error))
+        {
+            std::cerr << error << "\n";
+            return EINVAL;
+        }
+        if (job.turntable > 0)
+        {
+            std::vector<camera_view> turns;
+            for (size_t k = 0; k < views.size(); k++)
             {
-                u = double(i + random_double()) / double(nx);
-                v = double(j + random_double()) / double(ny);
-
-                r = cam.get_ray(u, v);
-                col += colour(r, world, 0);
+                std::vector<camera_view> t = turntable_views(views[k], job.turntable);
+                turns.insert(turns.end(), t.begin(), t.end());
             }
-            col /= ns;
-            //Gamma correction
-            col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-            int ir = int(255.99 * col[0]);
-            int ig = int(255.99 * col[1]);
-            int ib = int(255.99 * col[2]);
-            std::cout << ir << " " << ig << " " << ib << "\n";
+            views.swap(turns);
         }
+        trace_scope scope("render batch", "render", "views", int64_t(views.size()));
+        return render_batch(job, traced, topology.get(), replicas, views, totals);
     }
-    if (fflush(stdout) != 0)
-        exit(errno);
-    if (fclose(fd) != 0)
-        exit(errno);
 
-    if (_dup2(og_holder, _fileno(stdout)) != 0)
-        exit(errno);
-    
-    delete world;
+    render_settings& settings = job.settings;
+    framebuffer fb;
+    {
+        trace_scope scope("render", "render");
+        if (settings.preview_name.empty())
+        {
+            //Renders without a preview go wide on every core, time-budgeted ones too
+            render_engine engine(0, topology.get());
+            render_request request;
+            request.world = traced;
+            request.replicas = replicas;
+            request.view = view;
+            request.settings = settings;
+            render_result result = engine.submit(request).get();
+            fb = std::move(result.image);
+        }
+        else
+        {
+            std::unique_ptr<preview_channel> preview;
+            if (!settings.preview_name.empty())
+                preview.reset(new preview_channel(settings.preview_name, settings.preview_max_width, settings.preview_max_height, settings.preview_interval_ms));
+
+            if (!render_progressive(traced.get(), view, settings, fb, preview.get()))
+                return 1;
+        }
+    }
+
+    int x0, y0, x1, y1;
+    settings.crop_window(x0, y0, x1, y1);
+    trace_scope scope("image write", "output");
+    if (!write_image(job.output, fb, job.format, x0, y0, x1, y1))
+        return errno ? errno : EIO;
+    if (!job.sample_count_output.empty() && !write_sample_counts(job.sample_count_output, fb, x0, y0, x1, y1))
+        return errno ? errno : EIO;
+    totals.frames++;
+    return 0;
 }
 
-int main() {
+int main(int argc, char** argv) {
     
-    // Checking for mem-leaks
-    _CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_DEBUG);
-    _CrtMemState state;
-    _CrtMemCheckpoint(&state);
+    render_job job;
+    bool show_help;
+    std::string error;
+    if (!parse_job_args(argc, argv, job, show_help, error))
+    {
+        std::cerr << error << "\n";
+        print_usage(std::cerr);
+        return 1;
+    }
+    if (show_help)
+    {
+        print_usage(std::cout);
+        return 0;
+    }
+    if (!job.make_texture.empty())
+    {
+        if (!make_tiled_texture(job.make_texture, job.output))
+        {
+            std::cerr << "couldn't convert '" << job.make_texture << "' to '" << job.output << "'\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (!job.make_mesh.empty())
+    {
+        if (!make_clustered_mesh(job.make_mesh, job.output))
+        {
+            std::cerr << "couldn't convert '" << job.make_mesh << "' to '" << job.output << "'\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (!job.regress.empty())
+        return run_regression(job);
 
-    render();
+    if (!job.trace.empty())
+    {
+        tracer::get().enable();
+        tracer::get().set_thread_name("main");
+    }
 
-    _CrtMemDumpAllObjectsSince(&state);
+    //Everything render() allocates is freed by the time it returns, so what's still held afterwards leaked
+    alloc_tracker::get().reset_peaks();
+    alloc_stats before = alloc_tracker::get().snapshot();
+    render_totals totals;
+    int status = render(job, totals);
+    for (size_t i = 0; i < totals.counters.size(); i++)
+        totals.rays += totals.counters[i]->rays();
+    totals.counters.clear();
+    alloc_stats after = alloc_tracker::get().snapshot();
 
-    // Set the debug-heap flag so that memory leaks are reported when
-    // the process terminates. Then, exit.
-    SET_CRT_DEBUG_FIELD(_CRTDBG_LEAK_CHECK_DF);
-    return 0;
+    if (!job.trace.empty() && !tracer::get().write_json(job.trace))
+        std::cerr << "couldn't write trace '" << job.trace << "'\n";
+    if (job.alloc_stats)
+        print_alloc_report(std::cout, before, after, totals.frames, totals.rays);
+    uint64_t hot = after.total_hot_allocations() - before.total_hot_allocations();
+    if (job.alloc_strict && hot > 0)
+    {
+        std::cerr << "the render loop made " << hot << " allocations\n";
+        if (status == 0)
+            status = 1;
+    }
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+* A read-only view of part of a mapped_file. The pages are faulted in by the OS as they're touched and released when the view
+* is destroyed.
+*/
+class mapped_region
+{
+private:
+    void* base;
+    size_t mapped_bytes;
+    const uint8_t* first;
+    size_t bytes;
+
+public:
+    mapped_region(void* base, size_t mapped_bytes, const uint8_t* first, size_t bytes)
+        : base{ base }, mapped_bytes{ mapped_bytes }, first{ first }, bytes{ bytes } {}
+    ~mapped_region();
+
+    mapped_region(const mapped_region&) = delete;
+    mapped_region& operator=(const mapped_region&) = delete;
+
+    inline const uint8_t* data() const { return first; }
+    inline size_t size() const { return bytes; }
+
+    //Asks the OS to start reading the whole region in now rather than one page fault at a time.
+    void prefetch() const;
+};
+
+/**
+* Read-only memory-mapped file (mmap, or a file mapping on Windows) that hands out views of byte ranges, so a file far larger
+* than memory can be paged in a piece at a time.
+*/
+class mapped_file
+{
+private:
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    uint64_t file_size;
+    //Offsets of views must be multiples of this
+    uint64_t granularity;
+
+public:
+    explicit mapped_file(const std::string& path);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool valid() const;
+    inline uint64_t size() const { return file_size; }
+
+    /**
+    * Maps [offset, offset + bytes) of the file.
+    * @return the view, or null if the range is outside the file or couldn't be mapped.
+    */
+    std::unique_ptr<mapped_region> map(uint64_t offset, size_t bytes) const;
+};
+
+mapped_region::~mapped_region()
+{
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+#else
+    munmap(base, mapped_bytes);
+#endif
+}
+
+void mapped_region::prefetch() const
+{
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range = { base, mapped_bytes };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    madvise(base, mapped_bytes, MADV_WILLNEED);
+#endif
+}
+
+mapped_file::mapped_file(const std::string& path) : file_size{ 0 }, granularity{ 4096 }
+{
+#ifdef _WIN32
+    mapping = NULL;
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        return;
+    file_size = uint64_t(size.QuadPart);
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    granularity = info.dwAllocationGranularity;
+#else
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+    file_size = uint64_t(st.st_size);
+    granularity = uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+    if (mapping != NULL)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+#else
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+bool mapped_file::valid() const
+{
+#ifdef _WIN32
+    return mapping != NULL;
+#else
+    return fd >= 0;
+#endif
+}
+
+std::unique_ptr<mapped_region> mapped_file::map(uint64_t offset, size_t bytes) const
+{
+    if (!valid() || bytes == 0 || offset > file_size || bytes > file_size - offset)
+        return nullptr;
+
+    //Views have to start on a granularity boundary, map from the one below and skip the difference
+    uint64_t start = offset - offset % granularity;
+    size_t length = size_t(offset - start) + bytes;
+#ifdef _WIN32
+    void* base = MapViewOfFile(mapping, FILE_MAP_READ, DWORD(start >> 32), DWORD(start & 0xffffffffu), length);
+    if (base == NULL)
+        return nullptr;
+#else
+    void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, off_t(start));
+    if (base == MAP_FAILED)
+        return nullptr;
+#endif
+    return std::unique_ptr<mapped_region>(new mapped_region(base, length, static_cast<const uint8_t*>(base) + (offset - start), bytes));
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include "ray.h"
 #include "random.h"
+#include "sampler.h"
+#include "texture.h"
 #include <algorithm>
 
 
@@ -19,6 +21,14 @@ private:
     double fuzz;
     double ref_idx;
     material_type mat;
+    //Optional textures, the albedo map tints albedo and the roughness map (red channel) replaces fuzz.
+    const image_texture* albedo_map = nullptr;
+    const image_texture* roughness_map = nullptr;
+    //Radiance emitted from the front of the surface, zero for anything that isn't a light.
+    vec3 emission = vec3(0, 0, 0);
+
+    //Extra spread (radians) added to a ray's cone when scattered off a diffuse surface, keeps texture lookups after a diffuse bounce coarse.
+    static constexpr double diffuse_cone_spread = 0.1;
 
     //Determines if a point is under shadow, only handles point/dir lights, TODO: improve this.
     /*
@@ -72,17 +82,38 @@ private:
     }
 
     /**
-    * Gets a random point within the unit sphere.
+    * Maps three uniform numbers to a uniformly distributed point within the unit sphere.
     */
-    inline vec3 random_point()
+    inline vec3 point_in_sphere(double u1, double u2, double u3)
     {
-        vec3 p;
-        do
-        {
-            p = 2.0 * vec3(random_double(), random_double(), random_double()) - vec3(1, 1, 1);
-        } while (p.squared_length() >= 1.0);
+        double z = 1.0 - 2.0 * u1;
+        double r_xy = sqrt(fmax(0.0, 1.0 - z * z));
+        double phi = 2.0 * M_PI * u2;
+        return cbrt(u3) * vec3(r_xy * cos(phi), r_xy * sin(phi), z);
+    }
 
-        return p;
+    /**
+    * Maps two uniform numbers to a uniformly distributed point on the unit sphere.
+    */
+    inline vec3 point_on_sphere(double u1, double u2)
+    {
+        double z = 1.0 - 2.0 * u1;
+        double r_xy = sqrt(fmax(0.0, 1.0 - z * z));
+        double phi = 2.0 * M_PI * u2;
+        return vec3(r_xy * cos(phi), r_xy * sin(phi), z);
+    }
+
+    //Gets the surface normal on the side the ray arrived from.
+    static inline vec3 facing_normal(const vec3& dir, const vec3& n) { return (dot(dir, n) < 0) ? n : -n; }
+
+    /**
+    * Gets a point within the unit sphere from the current bounce's bsdf dims of the sampler.
+    */
+    inline vec3 sampled_point(sampler& s)
+    {
+        double u1, u2;
+        s.get_bsdf(u1, u2);
+        return point_in_sphere(u1, u2, s.get_bsdf_choice());
     }
 
     /**
@@ -113,6 +144,88 @@ public:
     //For dielectrics
     material(material_type m, double ri) : mat{ m }, ref_idx{ ri } {}
 
+    //Sets the texture the albedo is multiplied by.
+    inline material& with_albedo_map(const image_texture* t) { albedo_map = t; return *this; }
+
+    //Sets the texture the fuzziness is read from (metals).
+    inline material& with_roughness_map(const image_texture* t) { roughness_map = t; return *this; }
+
+    //Gets the albedo at the hit point, filtered over the ray's footprint.
+    inline vec3 albedo_at(const hit_record& rec) const
+    {
+        return (albedo_map == nullptr) ? albedo : albedo * albedo_map->lookup(rec.u, rec.v, rec.uv_width);
+    }
+
+    //Gets the fuzziness at the hit point, filtered over the ray's footprint.
+    inline double fuzz_at(const hit_record& rec) const
+    {
+        return (roughness_map == nullptr) ? fuzz : fmin(roughness_map->lookup(rec.u, rec.v, rec.uv_width).r(), 1.0);
+    }
+
+    //Makes the surface a light emitting the given radiance.
+    inline material& with_emission(const vec3& e) { emission = e; return *this; }
+
+    inline bool has_textures() const { return albedo_map != nullptr || roughness_map != nullptr; }
+
+    /**
+    * Feeds every field that decides how the material looks to hasher h, as h.add(value). Fields the material's type doesn't use
+    * are skipped (they may never have been set), and textures only count by whether there are any.
+    */
+    template <class H>
+    inline void hash_fields(H& h) const
+    {
+        h.add(uint32_t(mat));
+        if (mat != material_type::dielectric)
+            h.add(albedo);
+        if (mat == material_type::metal)
+            h.add(fuzz);
+        if (mat == material_type::dielectric)
+            h.add(ref_idx);
+        h.add(emission);
+        h.add(uint32_t(albedo_map != nullptr) | (uint32_t(roughness_map != nullptr) << 1));
+    }
+
+    inline bool is_emissive() const { return emission.r() > 0 || emission.g() > 0 || emission.b() > 0; }
+    inline vec3 emission_radiance() const { return emission; }
+
+    /**
+    * Gets the radiance emitted towards the origin of a ray arriving in direction dir, lights only emit from their front face.
+    */
+    inline vec3 emitted(const vec3& dir, const hit_record& rec) const
+    {
+        return (dot(dir, rec.normal) < 0) ? emission : vec3(0, 0, 0);
+    }
+
+    //True for materials that scatter over a spread of directions, which are the ones worth sampling lights from.
+    inline bool samples_lights() const { return mat == material_type::lambertian; }
+
+    /**
+    * Evaluates the BSDF times the cosine term for light arriving along unit direction wi, for a ray arriving in direction dir.
+    * Only meaningful where samples_lights() is true.
+    */
+    inline vec3 eval(const vec3& dir, const hit_record& rec, const vec3& wi) const
+    {
+        double cos_i = dot(wi, facing_normal(dir, rec.normal));
+        return (cos_i > 0) ? albedo_at(rec) * (cos_i / M_PI) : vec3(0, 0, 0);
+    }
+
+    /**
+    * Solid angle density with which scatter() picks the unit direction wi, for a ray arriving in direction dir.
+    */
+    inline double pdf(const vec3& dir, const hit_record& rec, const vec3& wi) const
+    {
+        return fmax(dot(wi, facing_normal(dir, rec.normal)), 0.0) / M_PI;
+    }
+
+    /**
+    * Gets the ray leaving the hit point along wi as if scatter() had picked it, for directions chosen by something other than the
+    * material (e.g. path guiding).
+    */
+    inline ray scattered_towards(const ray& r_in, const hit_record& rec, const vec3& wi) const
+    {
+        return ray(rec.p, wi, rec.width, r_in.cone_angle + diffuse_cone_spread);
+    }
+
     /**
     * The function responsible for determining how incident rays interact with this material, will appropriately deduce if an incident ray is
     * absorbed, reflected, or transmitted. In doing so it will attenuate incident rays, and for those unabsorbed, update their direction as well.
@@ -122,13 +235,14 @@ public:
     * @param attenuation - by how much are incident colour_channels unabsorbed (specified by material properties, a 1 = perfect reflection)
     *                      Val to be computed, this argument is a holder for function caller to have access to attenuation upon return.
     * @param scattered - holds the ray that will be scattered from the point of intersection (generic term for reflected/transmitted)
+    * @param s - sampler positioned at the current bounce, supplies the random numbers for the scattering decision.
     * @return true if the incident ray is scattered, false if it is otherwise absorbed.
     */
-    bool scatter(const ray& r, const hit_record& rec, vec3& attenuation, ray& scattered);
+    bool scatter(const ray& r, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& s);
 
 };
 
-bool material::scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered)
+bool material::scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& s)
 {
     bool ret;
 
@@ -140,19 +254,26 @@ bool material::scatter(const ray& r_in, const hit_record& rec, vec3& attenuation
     vec3 refracted;
     double reflect_prob;
     double cosine, theta;
+    double f;
 
     switch (mat)
     {
     case material_type::lambertian:
-        target = rec.p + rec.normal + random_point();
-        attenuation = albedo;
-        scattered = ray(rec.p, target - rec.p);
-        ret = true;
+    {
+        //Normal plus a point on the unit sphere is cosine distributed about the normal
+        double u1, u2;
+        s.get_bsdf(u1, u2);
+        target = rec.p + facing_normal(r_in.direction(), rec.normal) + point_on_sphere(u1, u2);
+        attenuation = albedo_at(rec);
+        scattered = ray(rec.p, target - rec.p, rec.width, r_in.cone_angle + diffuse_cone_spread);
+        ret = scattered.direction().squared_length() > 1e-16;
         break;
+    }
     case material_type::metal:
         reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        attenuation = albedo;
-        scattered = ray(rec.p, reflected + fuzz * random_point());
+        attenuation = albedo_at(rec);
+        f = fuzz_at(rec);
+        scattered = ray(rec.p, reflected + f * sampled_point(s), rec.width, r_in.cone_angle + f * diffuse_cone_spread);
         ret = (dot(scattered.direction(), rec.normal) > 0);
         break;
     case material_type::dielectric:
@@ -174,13 +295,13 @@ bool material::scatter(const ray& r_in, const hit_record& rec, vec3& attenuation
             reflect_prob = schlick(cosine, ref_idx);
         else
             reflect_prob = 1.0;
-        if (random_double() < reflect_prob)
+        if (s.get_bsdf_choice() < reflect_prob)
         {
-            scattered = ray(rec.p, reflected);
+            scattered = ray(rec.p, reflected, rec.width, r_in.cone_angle);
         }
         else
         {
-            scattered = ray(rec.p, refracted);
+            scattered = ray(rec.p, refracted, rec.width, r_in.cone_angle);
         }
         ret = true;
         break;
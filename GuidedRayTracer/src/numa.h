@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+* NUMA nodes of the machine and the logical CPUs in each. Memory is placed on the node of the thread that first writes it, so a
+* thread pinned to a node's CPUs that fills a buffer gets it in that node's local memory.
+*/
+struct numa_topology
+{
+    std::vector<std::vector<unsigned>> nodes;
+    //True if the nodes were made up by simulated() rather than read from the system
+    bool simulated = false;
+
+    inline size_t size() const { return nodes.size(); }
+
+    //Reads the system's nodes, a machine without NUMA (or where it can't be read) comes back as a single node of every CPU.
+    static numa_topology detect();
+
+    /**
+    * Splits the CPUs into num_nodes nodes of consecutive CPUs, for trying the NUMA code paths on a machine with a single node.
+    * Nodes share CPUs round robin if there are fewer CPUs than nodes.
+    */
+    static numa_topology simulate(unsigned num_nodes);
+};
+
+/**
+* Parses a Linux CPU list such as "0-3,8-11".
+* @return false if the list is malformed.
+*/
+inline bool parse_cpu_list(const std::string& text, std::vector<unsigned>& cpus)
+{
+    cpus.clear();
+    size_t pos = 0;
+    while (pos < text.size() && text[pos] != '\n')
+    {
+        unsigned lo, hi;
+        int used = 0;
+        if (sscanf(text.c_str() + pos, "%u-%u%n", &lo, &hi, &used) == 2 && used > 0)
+            pos += used;
+        else if (sscanf(text.c_str() + pos, "%u%n", &lo, &used) == 1 && used > 0)
+        {
+            hi = lo;
+            pos += used;
+        }
+        else
+            return false;
+        if (hi < lo)
+            return false;
+        for (unsigned c = lo; c <= hi; c++)
+            cpus.push_back(c);
+        if (pos < text.size() && text[pos] == ',')
+            pos++;
+    }
+    return !cpus.empty();
+}
+
+numa_topology numa_topology::detect()
+{
+    numa_topology t;
+#ifdef _WIN32
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest))
+    {
+        for (ULONG n = 0; n <= highest; n++)
+        {
+            ULONGLONG mask = 0;
+            if (!GetNumaNodeProcessorMask(UCHAR(n), &mask) || mask == 0)
+                continue;
+            std::vector<unsigned> cpus;
+            for (unsigned c = 0; c < 64; c++)
+                if (mask & (ULONGLONG(1) << c))
+                    cpus.push_back(c);
+            t.nodes.push_back(cpus);
+        }
+    }
+#elif defined(__linux__)
+    //Node numbers can have gaps (e.g. offline or memory-only nodes), so keep looking a while past a missing one
+    for (unsigned n = 0, missing = 0; missing < 64; n++)
+    {
+        std::string path = "/sys/devices/system/node/node" + std::to_string(n) + "/cpulist";
+        FILE* f = fopen(path.c_str(), "r");
+        if (f == nullptr)
+        {
+            missing++;
+            continue;
+        }
+        char line[4096];
+        std::vector<unsigned> cpus;
+        if (fgets(line, sizeof(line), f) != nullptr && parse_cpu_list(line, cpus))
+            t.nodes.push_back(cpus);
+        fclose(f);
+    }
+#endif
+    if (t.nodes.empty())
+        return simulate(1);
+    return t;
+}
+
+numa_topology numa_topology::simulate(unsigned num_nodes)
+{
+    numa_topology t;
+    t.simulated = num_nodes > 1;
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    num_nodes = std::max(1u, num_nodes);
+    t.nodes.resize(num_nodes);
+    for (unsigned n = 0; n < num_nodes; n++)
+    {
+        if (cpus >= num_nodes)
+            for (unsigned c = cpus * n / num_nodes; c < cpus * (n + 1) / num_nodes; c++)
+                t.nodes[n].push_back(c);
+        else
+            t.nodes[n].push_back(n % cpus);
+    }
+    return t;
+}
+
+/**
+* Restricts the calling thread to the given logical CPUs.
+* @return false if the system refused (or doesn't support) it, the thread then keeps running wherever the scheduler puts it.
+*/
+inline bool pin_current_thread(const std::vector<unsigned>& cpus)
+{
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for (size_t i = 0; i < cpus.size(); i++)
+        if (cpus[i] < sizeof(DWORD_PTR) * 8)
+            mask |= DWORD_PTR(1) << cpus[i];
+    return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++)
+        if (cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+    return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+/**
+* Runs f() on a new thread pinned to the CPUs of the given node and waits for it, so whatever memory f fills is placed on that
+* node.
+*/
+template <class F>
+void run_on_node(const numa_topology& topology, size_t node, F&& f)
+{
+    std::thread t([&]
+    {
+        pin_current_thread(topology.nodes[node]);
+        f();
+    });
+    t.join();
+}
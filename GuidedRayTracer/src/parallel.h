@@ -0,0 +1,54 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "alloc_tracker.h"
+
+/**
+* Number of chunks parallel_chunks should split n items into: one per hardware thread, but none smaller than min_chunk so small
+* inputs don't pay for threads they can't use.
+*/
+inline unsigned parallel_chunk_count(size_t n, size_t min_chunk)
+{
+    size_t by_size = std::max<size_t>(1, n / std::max<size_t>(1, min_chunk));
+    return unsigned(std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), by_size));
+}
+
+/**
+* Calls f(chunk, begin, end) for each of chunks contiguous ranges covering [0, n), each on its own thread (the calling thread takes
+* the first). The split only depends on n and chunks, so passes over the same data with the same chunk count see the same ranges.
+* Allocations made by f are counted under the caller's mem_tag on every thread.
+*/
+template <class F>
+void parallel_chunks(size_t n, unsigned chunks, F&& f)
+{
+    if (chunks <= 1)
+    {
+        f(0u, size_t(0), n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    mem_tag tag = alloc_tracker::thread_tag();
+    for (unsigned c = 1; c < chunks; c++)
+        threads.emplace_back([&f, n, chunks, c, tag]
+        {
+            mem_scope mem(tag);
+            f(c, n * c / chunks, n * (c + 1) / chunks);
+        });
+    f(0u, size_t(0), n / chunks);
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+//Calls f(i) for every i in [0, n), split across threads in chunks of at least min_chunk.
+template <class F>
+void parallel_for(size_t n, size_t min_chunk, F&& f)
+{
+    parallel_chunks(n, parallel_chunk_count(n, min_chunk), [&f](unsigned, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+            f(i);
+    });
+}
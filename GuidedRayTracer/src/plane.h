@@ -23,16 +23,19 @@ public:
 };
 
 
-bool plane::hit(const ray& r, double tmin, double tmax, hit_record& rec, material& closest_mat) const
+/**
+* Ray-plane intersection shared by the plane class and the SoA scene storage.
+* @param n - unit normal of the plane, p - any point on it.
+*/
+inline bool hit_plane(const vec3& n, const vec3& p, const ray& r, double tmin, double tmax, hit_record& rec)
 {
-	vec3 n = get_normal();
 	double num, denom, t_temp;
 	double eps = 0.0001;
 	denom = dot(n, r.direction());
 	if (-eps < denom && denom < eps)
 		return false;
 
-	num = dot(n, point - r.origin());
+	num = dot(n, p - r.origin());
 	t_temp = num / denom;
 
 	if (t_temp < tmin || t_temp > tmax)
@@ -41,6 +44,13 @@ bool plane::hit(const ray& r, double tmin, double tmax, hit_record& rec, materia
 	rec.t = t_temp;
 	rec.p = r.point_at_parameter(rec.t);
 	rec.normal = n;
+	return true;
+}
+
+bool plane::hit(const ray& r, double tmin, double tmax, hit_record& rec, material& closest_mat) const
+{
+	if (!hit_plane(get_normal(), point, r, tmin, tmax, rec))
+		return false;
 	closest_mat = mat;
 	return true;
 }
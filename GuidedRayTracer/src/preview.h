@@ -0,0 +1,227 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "framebuffer.h"
+
+/**
+* Layout of the shared-memory segment the preview is published through. A viewer maps the segment by name and reads the pixels
+* in place. The renderer owns everything up to the control block; the control block is written by the viewer.
+*
+* Consistency is handled with a seqlock: seq is odd while the renderer is writing a frame, so a viewer copies the pixels only when
+* seq is even and unchanged before and after its read.
+*/
+struct preview_header
+{
+    static const uint32_t magic_value = 0x50545247; // "GRTP"
+    static const uint32_t current_version = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    //Capacity of the pixel area, the image can never be larger than this.
+    uint32_t max_width, max_height;
+    //Byte offset from the start of the segment to the pixels (row-major, top row first, 3 floats per pixel, linear RGB).
+    uint32_t pixel_offset;
+
+    std::atomic<uint32_t> seq;
+    uint32_t width, height;
+    //Number of frames published so far and the (minimum) samples per pixel in the latest one.
+    uint32_t frame;
+    uint32_t spp;
+    //Size of the blocks each rendered sample is smeared over, 1 once every pixel has its own samples.
+    uint32_t block;
+    //Set once the render has finished or been cancelled.
+    std::atomic<uint32_t> done;
+
+    //Control block, written by the viewer.
+    std::atomic<uint32_t> cancel;
+    //Set request_width/height then bump request_seq to restart the render at a new resolution (within max_width/height).
+    std::atomic<uint32_t> request_width, request_height;
+    std::atomic<uint32_t> request_seq;
+};
+
+/**
+* Publishes the progressive accumulation buffer to a named shared-memory segment (POSIX shm_open, or a named file mapping on
+* Windows), rate limited to one frame per interval, and exposes the viewer's control requests.
+*/
+class preview_channel
+{
+private:
+    std::string name;
+    preview_header* header;
+    float* pixels;
+    size_t bytes;
+    uint32_t seen_request;
+    std::chrono::steady_clock::time_point last_publish;
+    int interval_ms;
+
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+
+public:
+
+    /**
+    * Creates (or re-creates) the segment.
+    * @param segment_name - name of the segment, e.g. "grt_preview" (opened by viewers as "/grt_preview" on POSIX).
+    * @param max_w/max_h - largest image that will be published.
+    * @param interval_ms - minimum time between two published frames.
+    */
+    preview_channel(const std::string& segment_name, int max_w, int max_h, int interval_ms);
+    ~preview_channel();
+
+    preview_channel(const preview_channel&) = delete;
+    preview_channel& operator=(const preview_channel&) = delete;
+
+    //True if the segment was mapped successfully, publishing to an invalid channel does nothing.
+    inline bool valid() const { return header != nullptr; }
+
+    /**
+    * Copies the framebuffer into the segment, pixels without samples of their own take the value of the top-left pixel of their block.
+    * @param force - publish even if the interval since the last frame hasn't elapsed yet.
+    */
+    void publish(const framebuffer& fb, int block, uint32_t spp, bool force);
+
+    //Marks the render as finished so viewers can stop polling.
+    void finish();
+
+    inline bool cancel_requested() const { return valid() && header->cancel.load(std::memory_order_acquire) != 0; }
+
+    /**
+    * Checks for a pending resolution change from the viewer.
+    * @return true if one was requested since the last call, in which case w/h hold the (clamped) new resolution.
+    */
+    bool resize_requested(int& w, int& h);
+};
+
+preview_channel::preview_channel(const std::string& segment_name, int max_w, int max_h, int interval_ms)
+    : name{ segment_name }, header{ nullptr }, pixels{ nullptr }, bytes{ 0 }, seen_request{ 0 }, interval_ms{ interval_ms }
+{
+    size_t pixel_offset = (sizeof(preview_header) + 63) & ~size_t(63);
+    bytes = pixel_offset + size_t(max_w) * max_h * 3 * sizeof(float);
+    void* mem = nullptr;
+
+#ifdef _WIN32
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(bytes) >> 32), DWORD(bytes & 0xffffffffu), name.c_str());
+    if (mapping == NULL)
+        return;
+    mem = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    if (mem == NULL)
+    {
+        CloseHandle(mapping);
+        mapping = NULL;
+        return;
+    }
+#else
+    std::string shm_name = "/" + name;
+    shm_unlink(shm_name.c_str());
+    int fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, off_t(bytes)) != 0)
+    {
+        close(fd);
+        return;
+    }
+    mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return;
+#endif
+
+    std::memset(mem, 0, sizeof(preview_header));
+    header = new (mem) preview_header();
+    header->magic = preview_header::magic_value;
+    header->version = preview_header::current_version;
+    header->max_width = uint32_t(max_w);
+    header->max_height = uint32_t(max_h);
+    header->pixel_offset = uint32_t(pixel_offset);
+    pixels = reinterpret_cast<float*>(static_cast<char*>(mem) + pixel_offset);
+    last_publish = std::chrono::steady_clock::now() - std::chrono::milliseconds(interval_ms);
+}
+
+preview_channel::~preview_channel()
+{
+    if (header == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(header);
+    CloseHandle(mapping);
+#else
+    munmap(header, bytes);
+    shm_unlink(("/" + name).c_str());
+#endif
+}
+
+void preview_channel::publish(const framebuffer& fb, int block, uint32_t spp, bool force)
+{
+    if (!valid())
+        return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!force && now - last_publish < std::chrono::milliseconds(interval_ms))
+        return;
+    last_publish = now;
+
+    int w = (fb.width < int(header->max_width)) ? fb.width : int(header->max_width);
+    int h = (fb.height < int(header->max_height)) ? fb.height : int(header->max_height);
+
+    header->seq.fetch_add(1, std::memory_order_acq_rel);
+    for (int row = 0; row < h; row++)
+    {
+        int j = fb.height - 1 - row;
+        float* out = pixels + size_t(row) * w * 3;
+        for (int i = 0; i < w; i++)
+        {
+            vec3 col = (fb.samples(i, j) > 0) ? fb.resolve(i, j) : fb.resolve(i - i % block, j - j % block);
+            out[3 * i] = float(col[0]);
+            out[3 * i + 1] = float(col[1]);
+            out[3 * i + 2] = float(col[2]);
+        }
+    }
+    header->width = uint32_t(w);
+    header->height = uint32_t(h);
+    header->frame++;
+    header->spp = spp;
+    header->block = uint32_t(block);
+    header->seq.fetch_add(1, std::memory_order_release);
+}
+
+void preview_channel::finish()
+{
+    if (valid())
+        header->done.store(1, std::memory_order_release);
+}
+
+bool preview_channel::resize_requested(int& w, int& h)
+{
+    if (!valid())
+        return false;
+    uint32_t req = header->request_seq.load(std::memory_order_acquire);
+    if (req == seen_request)
+        return false;
+    seen_request = req;
+
+    uint32_t rw = header->request_width.load(std::memory_order_relaxed);
+    uint32_t rh = header->request_height.load(std::memory_order_relaxed);
+    if (rw == 0 || rh == 0)
+        return false;
+    w = int((rw < header->max_width) ? rw : header->max_width);
+    h = int((rh < header->max_height) ? rh : header->max_height);
+    return true;
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <cstdint>
+
 #include "vec3.h"
 
 struct hit_record
@@ -9,6 +11,12 @@ struct hit_record
     vec3 p;
     //Normal to surface at point of intersection
     vec3 normal;
+    //Texture coordinates of the hit point
+    double u = 0, v = 0;
+    //Width of the ray's footprint at the hit point, in world units and in texture coordinates (0 if unknown)
+    double width = 0, uv_width = 0;
+    //Index of the light hit in the scene's light_bvh, UINT32_MAX if the surface isn't a light
+    uint32_t light = UINT32_MAX;
 };
 
 class ray
@@ -18,13 +26,25 @@ private:
 
 public:
     vec3 r0;
+    //Ray cone used to estimate texture footprints: width of the cone at the origin and its spread angle (radians).
+    double cone_width = 0, cone_angle = 0;
     
     ray() {}
     ray(const vec3& r0, const vec3& rd) : r0 { r0 }, rd{ rd } {}
+    ray(const vec3& r0, const vec3& rd, double cone_width, double cone_angle) : rd{ rd }, r0{ r0 }, cone_width{ cone_width }, cone_angle{ cone_angle } {}
 
     vec3 origin() const { return r0; }
     vec3 direction() const { return rd; }
 
+    //Reciprocal of the direction for slab tests, with near-zero components clamped (keeping their sign) so they never give inf * 0.
+    inline vec3 inverse_direction() const
+    {
+        vec3 inv;
+        for (int a = 0; a < 3; a++)
+            inv[a] = 1.0 / ((fabs(rd[a]) > 1e-18) ? rd[a] : copysign(1e-18, rd[a]));
+        return inv;
+    }
+
     //Gets point along this ray at time = t.
     vec3 point_at_parameter(double t) const { return r0 + t * rd; }
 
@@ -0,0 +1,518 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "job.h"
+#include "render_engine.h"
+#include "scene.h"
+
+/**
+* Passes every query on to another hitable, counting the rays traced through it (camera, bounce, shadow and gather rays alike).
+*/
+class counting_hitable : public hitable
+{
+private:
+    const hitable& inner;
+    mutable std::atomic<uint64_t> count;
+
+public:
+    explicit counting_hitable(const hitable& inner) : inner(inner), count{ 0 } {}
+
+    inline uint64_t rays() const { return count.load(std::memory_order_relaxed); }
+    inline void reset() { count.store(0, std::memory_order_relaxed); }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const override
+    {
+        count.fetch_add(1, std::memory_order_relaxed);
+        return inner.hit(r, t_min, t_max, rec, closest_mat);
+    }
+    virtual void hit_batch(const ray* rays, size_t n, double t_min, double t_max, hit_record* recs, material* mats, bool* hit) const override
+    {
+        count.fetch_add(n, std::memory_order_relaxed);
+        inner.hit_batch(rays, n, t_min, t_max, recs, mats, hit);
+    }
+    virtual bool bounding_box(aabb& box) const override { return inner.bounding_box(box); }
+    virtual const light_bvh* lights() const override { return inner.lights(); }
+    virtual const environment_map* environment() const override { return inner.environment(); }
+};
+
+//Whatever a regression scene needs besides its world, kept alive until the scene has been rendered.
+struct regression_assets
+{
+    //The regression directory, where scenes put the files they generate
+    std::string dir;
+    std::vector<std::unique_ptr<clustered_mesh>> meshes;
+};
+
+/**
+* One of the canonical scenes the regression harness renders. build() adds the geometry (the scene is committed afterwards)
+* and sets up the view.
+*/
+struct regression_scene
+{
+    const char* name;
+    void (*build)(scene& world, camera_view& view, regression_assets& assets);
+    //Integrator the scene is rendered with, whatever the job asks for
+    integrator_type integrator;
+};
+
+//Deterministic stand-in for rand(), so scenes with scattered objects are the same on every platform.
+inline double regression_random(uint32_t& state)
+{
+    state = hash_u32(state + 0x9e3779b9u);
+    return u32_to_unit(state);
+}
+
+inline void default_view(camera_view& view, const vec3& lookfrom, const vec3& lookat, double vfov)
+{
+    view.lookfrom = lookfrom;
+    view.lookat = lookat;
+    view.vup = vec3(0, 1, 0);
+    view.vfov = vfov;
+    view.aperture = 0;
+    view.focus_dist = 1;
+}
+
+//The scene main() renders.
+void build_cube_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_cube(cube(material(vec3(0.8, 0.3, 0.3), material_type::lambertian)));
+    default_view(view, vec3(2, 2, 8), vec3(0, 0, -1), 45);
+}
+
+//One sphere of each material type on a big ground sphere.
+void build_materials_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_sphere(vec3(0, -100.5, -1), 100, world.add_material(material(vec3(0.8, 0.8, 0.0), material_type::lambertian)));
+    world.add_sphere(vec3(0, 0, -1), 0.5, world.add_material(material(vec3(0.1, 0.2, 0.5), material_type::lambertian)));
+    world.add_sphere(vec3(1, 0, -1), 0.5, world.add_material(material(vec3(0.8, 0.6, 0.2), material_type::metal, 0.3)));
+    world.add_sphere(vec3(-1, 0, -1), 0.5, world.add_material(material(material_type::dielectric, 1.5)));
+    world.add_sphere(vec3(-1, 0, -1), -0.45, world.add_material(material(material_type::dielectric, 1.5)));
+    default_view(view, vec3(-2, 2, 1), vec3(0, 0, -1), 50);
+}
+
+void build_torus_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_plane(vec3(0, 1, 0), vec3(0, -0.6, 0), world.add_material(material(vec3(0.5, 0.5, 0.5), material_type::lambertian)));
+    world.add_torus(vec3(0, 0, -1), unit_vector(vec3(1, 1, 0)), 0.6, 0.2, world.add_material(material(vec3(0.0, 0.2, 0.8), material_type::lambertian)));
+    default_view(view, vec3(0, 1, 2), vec3(0, 0, -1), 50);
+}
+
+void build_triangles_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_plane(vec3(0, 1, 0), vec3(0, -0.5, 0), world.add_material(material(vec3(0.6, 0.6, 0.6), material_type::lambertian)));
+    uint32_t red = world.add_material(material(vec3(0.8, 0.2, 0.2), material_type::lambertian));
+    uint32_t mirror = world.add_material(material(vec3(0.9, 0.9, 0.9), material_type::metal, 0.0));
+    world.add_triangle(vec3(-1.5, -0.5, -2), vec3(-0.5, -0.5, -2), vec3(-1, 0.8, -2), red);
+    world.add_triangle(vec3(0.2, -0.5, -1.5), vec3(1.6, -0.5, -2.5), vec3(0.9, 1, -2), mirror);
+    default_view(view, vec3(0, 0.5, 1.5), vec3(0, 0, -1.5), 60);
+}
+
+//Thousands of small spheres, mostly exercising the acceleration structure.
+void build_bvh_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_sphere(vec3(0, -1000, 0), 1000, world.add_material(material(vec3(0.5, 0.5, 0.5), material_type::lambertian)));
+    uint32_t state = 1;
+    for (int i = 0; i < 4000; i++)
+    {
+        vec3 c(regression_random(state) * 20 - 10, 0.1, regression_random(state) * 20 - 10);
+        vec3 albedo(regression_random(state), regression_random(state), regression_random(state));
+        double choice = regression_random(state);
+        uint32_t m = (choice < 0.8) ? world.add_material(material(albedo, material_type::lambertian))
+                   : (choice < 0.95) ? world.add_material(material(albedo, material_type::metal, 0.5 * regression_random(state)))
+                   : world.add_material(material(material_type::dielectric, 1.5));
+        world.add_sphere(c, 0.1, m);
+    }
+    default_view(view, vec3(6, 2, 6), vec3(0, 0, 0), 40);
+}
+
+//Many small emitters, exercising light selection and next event estimation.
+void build_lights_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_sphere(vec3(0, -1000.5, -1), 1000, world.add_material(material(vec3(0.5, 0.5, 0.5), material_type::lambertian)));
+    world.add_sphere(vec3(0, 0, -1), 0.5, world.add_material(material(vec3(0.8, 0.3, 0.3), material_type::lambertian)));
+    uint32_t state = 2;
+    for (int i = 0; i < 200; i++)
+    {
+        vec3 e(regression_random(state), regression_random(state), regression_random(state));
+        uint32_t m = world.add_material(material(vec3(0, 0, 0), material_type::lambertian).with_emission(20 * e));
+        vec3 c(regression_random(state) * 20 - 10, regression_random(state) * 3 + 0.5, -regression_random(state) * 20 + 2);
+        if (i % 2)
+            world.add_sphere(c, 0.05, m);
+        else
+            world.add_triangle(c, c + vec3(0.2, 0, 0), c + vec3(0, -0.05, 0.2), m);
+    }
+    default_view(view, vec3(0, 1, 3), vec3(0, 0, -1), 60);
+}
+
+//Procedural shapes, exercising the SDF tracer: a smooth blend, a repeated carved box and a displaced sphere.
+void build_sdf_scene(scene& world, camera_view& view, regression_assets&)
+{
+    world.add_plane(vec3(0, 1, 0), vec3(0, -0.5, 0), world.add_material(material(vec3(0.5, 0.5, 0.5), material_type::lambertian)));
+    sdf_shape blob = smooth_unite(sdf_shape::sphere(0.3), sdf_shape::torus(0.35, 0.08).oriented(vec3(1, 1, 0)), 0.15);
+    world.add_sdf(blob, vec3(-0.9, 0, -1.5), world.add_material(material(vec3(0.8, 0.3, 0.2), material_type::lambertian)));
+    sdf_shape cell = subtract(sdf_shape::box(vec3(0.1, 0.1, 0.1)).rounded(0.02), sdf_shape::sphere(0.13));
+    world.add_sdf(cell.repeated(vec3(0.3, 0.3, 0.3), 3, 3, 3), vec3(0, -0.05, -1.8),
+                  world.add_material(material(vec3(0.9, 0.9, 0.9), material_type::metal, 0.1)));
+    world.add_sdf(sdf_shape::sphere(0.3).displaced(0.03, 25), vec3(0.9, -0.15, -1.5),
+                  world.add_material(material(vec3(0.2, 0.5, 0.8), material_type::lambertian)));
+    default_view(view, vec3(0, 0.8, 0.5), vec3(0, -0.1, -1.6), 55);
+}
+
+//A closed room lit only by the sky through a small window, exercising indirect light (and path guiding).
+void build_window_scene(scene& world, camera_view& view, regression_assets&)
+{
+    uint32_t wall = world.add_material(material(vec3(0.7, 0.7, 0.7), material_type::lambertian));
+    auto quad = [&](const vec3& a, const vec3& b, const vec3& c, const vec3& d)
+    {
+        world.add_triangle(a, b, c, wall);
+        world.add_triangle(a, c, d, wall);
+    };
+    const double x0 = -2, x1 = 2, y0 = 0, y1 = 3, z0 = -6, z1 = 0;
+    const double wy0 = 1.5, wy1 = 2.2, wz0 = -4, wz1 = -3.4;
+    quad(vec3(x0, y0, z0), vec3(x1, y0, z0), vec3(x1, y0, z1), vec3(x0, y0, z1));
+    quad(vec3(x0, y1, z0), vec3(x1, y1, z0), vec3(x1, y1, z1), vec3(x0, y1, z1));
+    quad(vec3(x0, y0, z0), vec3(x1, y0, z0), vec3(x1, y1, z0), vec3(x0, y1, z0));
+    quad(vec3(x0, y0, z1), vec3(x1, y0, z1), vec3(x1, y1, z1), vec3(x0, y1, z1));
+    quad(vec3(x1, y0, z0), vec3(x1, y1, z0), vec3(x1, y1, z1), vec3(x1, y0, z1));
+    //Left wall, around the window
+    quad(vec3(x0, y0, z0), vec3(x0, wy0, z0), vec3(x0, wy0, z1), vec3(x0, y0, z1));
+    quad(vec3(x0, wy1, z0), vec3(x0, y1, z0), vec3(x0, y1, z1), vec3(x0, wy1, z1));
+    quad(vec3(x0, wy0, z0), vec3(x0, wy1, z0), vec3(x0, wy1, wz0), vec3(x0, wy0, wz0));
+    quad(vec3(x0, wy0, wz1), vec3(x0, wy1, wz1), vec3(x0, wy1, z1), vec3(x0, wy0, z1));
+    world.add_sphere(vec3(0.5, 0.6, -3.5), 0.6, world.add_material(material(vec3(0.8, 0.3, 0.3), material_type::lambertian)));
+    default_view(view, vec3(1.5, 1.5, -0.3), vec3(-1, 1, -4), 70);
+}
+
+//A glass ball in a closed box lit by one small light above it, which the ball focuses onto the floor. Exercises caustics and the
+//bidirectional integrator.
+void build_caustics_scene(scene& world, camera_view& view, regression_assets&)
+{
+    uint32_t wall = world.add_material(material(vec3(0.7, 0.7, 0.7), material_type::lambertian));
+    auto quad = [&](const vec3& a, const vec3& b, const vec3& c, const vec3& d)
+    {
+        world.add_triangle(a, b, c, wall);
+        world.add_triangle(a, c, d, wall);
+    };
+    quad(vec3(-1, -1, -1), vec3(-1, -1, 1), vec3(1, -1, 1), vec3(1, -1, -1));
+    quad(vec3(-1, 1, -1), vec3(1, 1, -1), vec3(1, 1, 1), vec3(-1, 1, 1));
+    quad(vec3(-1, -1, -1), vec3(1, -1, -1), vec3(1, 1, -1), vec3(-1, 1, -1));
+    quad(vec3(-1, -1, 1), vec3(-1, 1, 1), vec3(1, 1, 1), vec3(1, -1, 1));
+    quad(vec3(-1, -1, -1), vec3(-1, 1, -1), vec3(-1, 1, 1), vec3(-1, -1, 1));
+    quad(vec3(1, -1, -1), vec3(1, -1, 1), vec3(1, 1, 1), vec3(1, 1, -1));
+    world.add_sphere(vec3(0, 0.9, 0), 0.03, world.add_material(material(vec3(0, 0, 0), material_type::lambertian).with_emission(vec3(400, 400, 400))));
+    world.add_sphere(vec3(0, -0.35, 0), 0.3, world.add_material(material(material_type::dielectric, 1.5)));
+    default_view(view, vec3(0, -0.85, 0.95), vec3(0, -1, -0.2), 50);
+}
+
+//A sphere in front of an out-of-core mesh wall that hides another sphere, so the closest hit has to be found across the BVH and
+//the meshes both ways round. The wall is paged through a budget smaller than itself.
+void build_mesh_scene(scene& world, camera_view& view, regression_assets& assets)
+{
+    //A grid of quads, enough triangles to make several clusters
+    const int n = 16;
+    const double x0 = -3, x1 = 3, y0 = -1.5, y1 = 2, z = -3;
+    std::string obj_path = assets.dir + "/mesh_wall.obj", gmc_path = assets.dir + "/mesh_wall.gmc";
+    {
+        std::ofstream obj(obj_path);
+        for (int j = 0; j <= n; j++)
+            for (int i = 0; i <= n; i++)
+                obj << "v " << x0 + (x1 - x0) * i / n << " " << y0 + (y1 - y0) * j / n << " " << z << "\n";
+        for (int j = 0; j < n; j++)
+            for (int i = 0; i < n; i++)
+            {
+                int v = j * (n + 1) + i + 1;
+                obj << "f " << v << " " << v + 1 << " " << v + n + 2 << " " << v + n + 1 << "\n";
+            }
+    }
+    //A missing wall shows up as an image mismatch
+    if (make_clustered_mesh(obj_path, gmc_path, 64))
+    {
+        assets.meshes.emplace_back(new clustered_mesh(gmc_path, size_t(16) << 10));
+        if (assets.meshes.back()->valid())
+            world.add_mesh(assets.meshes.back().get(), world.add_material(material(vec3(0.6, 0.6, 0.6), material_type::lambertian)));
+    }
+    world.add_sphere(vec3(0, -100.5, -1), 100, world.add_material(material(vec3(0.5, 0.5, 0.5), material_type::lambertian)));
+    world.add_sphere(vec3(0, 0, -1), 0.5, world.add_material(material(vec3(0.8, 0.3, 0.3), material_type::lambertian)));
+    world.add_sphere(vec3(0.8, 0.3, -4), 0.8, world.add_material(material(vec3(0.2, 0.3, 0.8), material_type::lambertian)));
+    default_view(view, vec3(0, 0.5, 2), vec3(0, 0, -1), 60);
+}
+
+const regression_scene regression_scenes[] = {
+    { "cube", build_cube_scene, integrator_type::path },
+    { "materials", build_materials_scene, integrator_type::path },
+    { "torus", build_torus_scene, integrator_type::path },
+    { "triangles", build_triangles_scene, integrator_type::path },
+    { "bvh", build_bvh_scene, integrator_type::path },
+    { "lights", build_lights_scene, integrator_type::path },
+    { "window", build_window_scene, integrator_type::path },
+    { "sdf", build_sdf_scene, integrator_type::path },
+    { "caustics", build_caustics_scene, integrator_type::bdpt },
+    { "mesh", build_mesh_scene, integrator_type::path },
+};
+
+//One line of the regression history, the timing of a scene in one run of the harness.
+struct regression_entry
+{
+    std::string label;
+    std::string scene;
+    double seconds;
+};
+
+/**
+* Reads the timings recorded so far from the history CSV (see run_regression), a missing file is an empty history.
+*/
+std::vector<regression_entry> load_regression_history(const std::string& path)
+{
+    std::vector<regression_entry> history;
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> fields;
+        std::istringstream is(line);
+        std::string field;
+        while (std::getline(is, field, ','))
+            fields.push_back(field);
+        if (fields.size() >= 4)
+            history.push_back({ fields[1], fields[2], strtod(fields[3].c_str(), nullptr) });
+    }
+    return history;
+}
+
+/**
+* Relative RMSE of an image against a reference, the RMSE over all channels divided by the reference's mean.
+* @return infinity if the sizes differ.
+*/
+double relative_rmse(const std::vector<float>& image, const std::vector<float>& reference)
+{
+    if (image.size() != reference.size() || reference.empty())
+        return HUGE_VAL;
+    double sq = 0, mean = 0;
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        double d = double(image[i]) - reference[i];
+        sq += d * d;
+        mean += reference[i];
+    }
+    mean /= reference.size();
+    return sqrt(sq / image.size()) / fmax(mean, 1e-6);
+}
+
+/**
+* Median of some values, and their spread: the standard deviation estimated from their median absolute deviation, relative to
+* the median (0 for fewer than two values).
+*/
+inline double median_and_spread(std::vector<double> values, double& spread)
+{
+    std::sort(values.begin(), values.end());
+    double median = values[values.size() / 2];
+    std::vector<double> deviations;
+    for (double v : values)
+        deviations.push_back(fabs(v - median));
+    std::sort(deviations.begin(), deviations.end());
+    spread = (values.size() > 1 && median > 0) ? 1.4826 * deviations[deviations.size() / 2] / median : 0;
+    return median;
+}
+
+/**
+* Renders every canonical scene with a fixed seed, both through render_progressive and on a render_engine using every core, and
+* checks each image against <dir>/<scene>.pfm (<dir>/<scene>_engine.pfm for the engine), storing the render as the reference if
+* there isn't one yet (or the job asks for references to be updated). The engine renders without guiding: its guide is trained
+* in whatever order the workers finish their tiles, so its images would differ from run to run.
+*
+* Each timing is the best of a few runs, a run rendering the scene as many times as it takes to fill min_run_seconds so that
+* short scenes aren't at the mercy of the scheduler. Once a scene has a few recorded times it is compared with their median, and
+* only fails if it is slower by more than the job allows and by more than the noise seen in these runs and in that history. The
+* timing is then appended to <dir>/history.csv along with the ray count and rays/s, engine timings as <scene>/engine.
+* @return 0 if every image matched and no scene got slower than the job allows, 1 otherwise.
+*/
+int run_regression(const render_job& job)
+{
+    const int width = 160, height = 90, spp = 16;
+    //Runs stop early once they've taken max_runs_seconds, as long as there are min_runs of them
+    const int min_runs = 3, max_runs = 5;
+    const double min_run_seconds = 0.25, max_runs_seconds = 10;
+    //Baselines are the median of up to baseline_window of the most recent timings, and need at least min_baseline of them
+    const size_t baseline_window = 10, min_baseline = 5;
+    //A slowdown has to exceed the combined spread of the runs and the history this many times over to count
+    const double noise_margin = 3;
+
+    std::string history_path = job.regress + "/history.csv";
+    std::vector<regression_entry> history = load_regression_history(history_path);
+    bool new_history = history.empty() && !std::ifstream(history_path);
+    std::ofstream history_out(history_path, std::ios::app);
+    if (!history_out)
+    {
+        std::cerr << "can't write '" << history_path << "'\n";
+        return 1;
+    }
+    if (new_history)
+        history_out << "timestamp,label,scene,seconds,rays,rays_per_second,rmse\n";
+
+    char timestamp[32];
+    time_t now = time(nullptr);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    std::cout << std::left << std::setw(20) << "scene" << std::right << std::setw(10) << "seconds" << std::setw(12) << "Mrays/s"
+              << std::setw(10) << "rmse" << std::setw(12) << "vs median" << std::setw(10) << "allowed" << std::setw(12) << "sdf steps"
+              << "  status\n";
+
+    render_engine engine;
+    bool all_ok = true;
+    for (const regression_scene& rs : regression_scenes)
+    {
+        regression_assets assets;
+        assets.dir = job.regress;
+        scene world(job.texture_cache_bytes);
+        camera_view view;
+        rs.build(world, view, assets);
+        world.commit();
+        counting_hitable counted(world);
+        //The scene lives on the stack, so the engine mustn't delete it
+        std::shared_ptr<const hitable> traced(&counted, [](const hitable*) {});
+
+        render_settings settings = job.settings;
+        settings.nx = width;
+        settings.ny = height;
+        settings.ns = spp;
+        settings.seed = 1;
+        settings.integrator = rs.integrator;
+        settings.time_budget = 0;
+        settings.crop_x0 = settings.crop_y0 = settings.crop_x1 = settings.crop_y1 = 0;
+        settings.preview_name.clear();
+
+        for (int on_engine = 0; on_engine < 2; on_engine++)
+        {
+            std::string name = std::string(rs.name) + (on_engine ? "/engine" : "");
+            framebuffer fb;
+            uint64_t rays = 0, sdf_traces = 0, sdf_steps = 0;
+            auto render_once = [&]
+            {
+                counted.reset();
+                uint64_t traces_before = sdf_stats().traces.load(), steps_before = sdf_stats().steps.load();
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                double seconds;
+                if (on_engine)
+                {
+                    render_request request;
+                    request.world = traced;
+                    request.view = view;
+                    request.settings = settings;
+                    request.settings.guiding = false;
+                    render_handle handle = engine.submit(request);
+                    handle.get();
+                    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    fb = handle.get().image;
+                }
+                else
+                {
+                    render_settings s = settings;
+                    render_progressive(&counted, view, s, fb, nullptr);
+                    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                }
+                rays = counted.rays();
+                sdf_traces = sdf_stats().traces.load() - traces_before;
+                sdf_steps = sdf_stats().steps.load() - steps_before;
+                return seconds;
+            };
+
+            //The first render warms the caches and shows how many renders it takes to fill a run
+            int repeats = int(ceil(min_run_seconds / fmax(render_once(), 1e-6)));
+            std::vector<double> timings;
+            double total = 0;
+            for (int run = 0; run < max_runs && (run < min_runs || total < max_runs_seconds); run++)
+            {
+                double seconds = 0;
+                for (int r = 0; r < repeats; r++)
+                    seconds += render_once();
+                total += seconds;
+                timings.push_back(seconds / repeats);
+            }
+            double best = *std::min_element(timings.begin(), timings.end());
+            double run_spread;
+            median_and_spread(timings, run_spread);
+            //Image check
+            std::string ref_path = job.regress + "/" + rs.name + (on_engine ? "_engine" : "") + ".pfm";
+            std::vector<float> image(size_t(width) * height * 3), reference;
+            for (int row = 0; row < height; row++)
+                for (int i = 0; i < width; i++)
+                {
+                    vec3 c = fb.resolve(i, height - 1 - row);
+                    for (int k = 0; k < 3; k++)
+                        image[(size_t(row) * width + i) * 3 + k] = float(c[k]);
+                }
+            int ref_w, ref_h;
+            std::string status;
+            double rmse = 0;
+            if (job.regress_update || !read_pfm(ref_path, ref_w, ref_h, reference))
+            {
+                if (!write_image(ref_path, fb, image_format::pfm, 0, 0, width, height))
+                {
+                    std::cerr << "can't write '" << ref_path << "'\n";
+                    return 1;
+                }
+                status = "new reference";
+            }
+            else
+            {
+                rmse = relative_rmse(image, reference);
+                status = (rmse <= job.regress_rmse) ? "ok" : "IMAGE MISMATCH";
+                all_ok = all_ok && rmse <= job.regress_rmse;
+            }
+
+            //Performance check against the recent history of this scene
+            std::vector<double> recent;
+            for (size_t i = history.size(); i-- > 0 && recent.size() < baseline_window;)
+            {
+                if (history[i].scene == name)
+                    recent.push_back(history[i].seconds);
+            }
+            std::string change = "-", allowed = "-";
+            if (recent.size() >= min_baseline)
+            {
+                double history_spread;
+                double median = median_and_spread(recent, history_spread);
+                double percent = 100 * (best - median) / median;
+                double limit = fmax(job.regress_slowdown, noise_margin * 100 * (history_spread + run_spread));
+                std::ostringstream os, limit_os;
+                os << std::showpos << std::fixed << std::setprecision(1) << percent << "%";
+                change = os.str();
+                limit_os << std::fixed << std::setprecision(1) << limit << "%";
+                allowed = limit_os.str();
+                if (percent > limit)
+                {
+                    status = (status == "ok") ? "SLOWER" : status + ", SLOWER";
+                    all_ok = false;
+                }
+            }
+
+            double rays_per_second = double(rays) / best;
+            //Mean evaluations of the distance function per sphere trace
+            std::ostringstream steps_os;
+            if (sdf_traces > 0)
+                steps_os << std::fixed << std::setprecision(1) << double(sdf_steps) / double(sdf_traces);
+            else
+                steps_os << "-";
+            history_out << timestamp << "," << job.regress_label << "," << name << "," << best << "," << rays << ","
+                        << rays_per_second << "," << rmse << "\n";
+            std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(3) << std::setw(10) << best
+                      << std::setw(12) << std::setprecision(2) << rays_per_second * 1e-6 << std::setw(10) << std::setprecision(4) << rmse
+                      << std::setw(12) << change << std::setw(10) << allowed << std::setw(12) << steps_os.str() << "  " << status << "\n";
+        }
+    }
+
+    if (!all_ok)
+        std::cout << "regression check failed" << (job.regress_label.empty() ? "" : " for '" + job.regress_label + "'") << "\n";
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <atomic>
+
+/**
+* A value several threads can add to at once without a lock. Copying reads the current value, so copies are only meaningful
+* while nobody is adding (between render passes).
+*/
+template<class T>
+class relaxed_atomic
+{
+private:
+    std::atomic<T> value;
+
+public:
+    relaxed_atomic(T v = T()) : value{ v } {}
+    relaxed_atomic(const relaxed_atomic& other) : value{ other.load() } {}
+    relaxed_atomic& operator=(const relaxed_atomic& other) { value.store(other.load(), std::memory_order_relaxed); return *this; }
+
+    inline T load() const { return value.load(std::memory_order_relaxed); }
+    inline void store(T v) { value.store(v, std::memory_order_relaxed); }
+
+    inline void add(T v)
+    {
+        T old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, old + v, std::memory_order_relaxed))
+            ;
+    }
+};
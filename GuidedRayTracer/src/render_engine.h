@@ -0,0 +1,465 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numa.h"
+#include "renderer.h"
+
+//How a job submitted to the render_engine ended.
+enum class render_status
+{
+    completed,
+    cancelled
+};
+
+struct render_result
+{
+    render_status status;
+    //The accumulated image, partially rendered if the job was cancelled
+    framebuffer image;
+    //Wall time from submission to completion
+    double seconds;
+};
+
+/**
+* Everything a render_engine needs for one image. The geometry is shared, so any number of jobs can render the same scene at
+* once, and has to stay alive (and unmodified) until they're done.
+*/
+struct render_request
+{
+    std::shared_ptr<const hitable> world;
+    //On an engine with a NUMA topology, the copy of world each node's workers trace (see scene::replicate), world for any node
+    //without one
+    std::vector<std::shared_ptr<const hitable>> replicas;
+    camera_view view;
+    render_settings settings;
+    //Irradiance cache for a job whose settings ask for one. Irradiance doesn't depend on the view, so jobs rendering the same world
+    //(such as the views of a batch) can share one, whatever error it was made with; left null, the job makes its own
+    std::shared_ptr<irradiance_cache> cache;
+    //Jobs with a higher priority get worker threads first, equal priorities are served in submission order
+    int priority = 0;
+    //Called from a worker thread each time part of the image is done, with the fraction of all samples taken so far
+    std::function<void(double)> on_progress;
+    //Called once the job's result is ready, from whichever thread finished it and possibly with the engine locked, so it should
+    //only pass the news on (e.g. queue it for another thread) and not call into the engine
+    std::function<void()> on_done;
+};
+
+class render_engine;
+
+/**
+* State of one submitted job. Its image is split into tiles, and each pass of the job takes a range of samples in every tile.
+* With guiding on, passes follow the guide's training schedule (samples [0, 1), [1, 2), [2, 4), [4, 8), ...) and the guide is
+* refined between them while none of the job's tiles are in flight; otherwise a single pass takes all the samples.
+*
+* A job with a time budget starts with a coarse pass sampling the corner pixel of every 8x8 block, which always runs to the end,
+* then adds one sample to every pixel per pass (or follows the guide's schedule) until the budget runs out. Workers stop at the
+* next row once it has, and the pixels the last pass didn't reach take their block's colour (see framebuffer::fill_unsampled).
+*
+* On a NUMA engine every node owns a fixed share of the tiles and accumulates them in a framebuffer of its own, which the node's
+* workers allocate and so keep in local memory; the buffers are summed when the job finishes. A pixel's samples all go to the
+* same buffer, so its sample indices run on across passes just as with a single buffer.
+*/
+struct render_task
+{
+    struct tile { int x0, y0, x1, y1; };
+
+    static const int tile_size = 16;
+    //Block size of a time-budgeted job's coarse pass
+    static const int coarse_block = 8;
+
+    uint64_t id;
+    render_request request;
+    std::chrono::steady_clock::time_point start;
+    //Set for jobs with a time budget, which stop handing out tiles past it once the coarse pass is done
+    bool timed = false;
+    std::chrono::steady_clock::time_point deadline;
+    //One per node, node 0's is allocated on submission and the others by their node's first worker
+    std::vector<framebuffer> fbs;
+    std::unique_ptr<std::once_flag[]> fb_ready;
+    std::unique_ptr<path_guide> guide;
+    std::shared_ptr<irradiance_cache> cache;
+    std::vector<tile> tiles;
+    //Indices into tiles of the tiles each node renders
+    std::vector<std::vector<uint32_t>> node_tiles;
+
+    //Pass state, guarded by the engine's lock
+    int total_samples;
+    //Samples per pixel the sampler is set up for
+    int sampler_spp;
+    int pass_begin = 0, pass_end = 0;
+    //Block size the pass samples at, coarse_block for the coarse pass and 1 for full passes
+    int pass_block = 1;
+    bool coarse_done = false;
+    //Next of each node's tiles to hand out this pass, and how many of the pass's tiles are done overall
+    std::vector<size_t> next_tile;
+    size_t tiles_done = 0;
+    int in_flight = 0;
+    bool between_passes = false;
+    bool finished = false;
+
+    std::atomic<bool> cancelled{ false };
+    std::atomic<uint64_t> samples_done{ 0 };
+    uint64_t samples_total = 0;
+    std::promise<render_result> promise;
+    render_engine* engine;
+
+    //True once a time-budgeted job is past its deadline and done with the coarse pass.
+    inline bool out_of_time() const { return timed && coarse_done && pass_block == 1 && std::chrono::steady_clock::now() >= deadline; }
+};
+
+/**
+* Handle to a job submitted to a render_engine. The engine must outlive its handles.
+*/
+class render_handle
+{
+private:
+    std::shared_ptr<render_task> task;
+
+public:
+    std::shared_future<render_result> result;
+
+    render_handle() {}
+    render_handle(std::shared_ptr<render_task> task) : task{ task }, result{ task->promise.get_future().share() } {}
+
+    //Stops the job as soon as the tiles in flight are done, its result then has the status cancelled.
+    void cancel();
+
+    //Fraction of the job's samples taken so far.
+    inline double progress() const
+    {
+        return task->samples_total ? double(task->samples_done.load(std::memory_order_relaxed)) / double(task->samples_total) : 1;
+    }
+
+    //Blocks until the job is done.
+    inline const render_result& get() const { return result.get(); }
+};
+
+/**
+* Renders any number of jobs at once on one shared pool of worker threads. Workers take one tile at a time from the highest
+* priority job that has one to give, so small jobs slip in between the tiles of big ones and the pool never runs more threads
+* than it was given however many jobs are queued.
+*
+* Tiles are rendered one pixel at a time, every sample of the pass, exactly as render_progressive would render that pixel. Time
+* budgets are supported (see render_task), previews aren't (render_progressive handles those).
+*
+* Given a NUMA topology, each worker is pinned to a core of one node and only takes that node's tiles, tracing the node's replica
+* of the scene into the node's own framebuffer, so a render's memory traffic stays within the node.
+*/
+class render_engine
+{
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::shared_ptr<render_task>> tasks;
+    std::vector<std::thread> workers;
+    numa_topology topology;
+    bool pinned;
+    uint64_t next_id = 0;
+    bool stopping = false;
+
+    void worker(unsigned index, size_t node, unsigned cpu);
+    void render_tile(render_task& task, size_t node, const render_task::tile& t, int sample_end, int block);
+    //Gets the highest priority task with a tile for the node to hand out, retiring cancelled and timed out tasks on the way. Called
+    //with the lock held.
+    std::shared_ptr<render_task> pick_task(size_t node, std::vector<std::shared_ptr<render_task>>& retired);
+    //Sets up the task's next pass, or marks it finished. Called with the lock held.
+    void start_pass(render_task& task);
+    static void finish(render_task& task, render_status status);
+
+    friend class render_handle;
+
+public:
+    /**
+    * @param threads - number of workers, 0 for every hardware thread (or every CPU of the topology).
+    * @param topology - NUMA nodes to spread the workers over and pin them to, null for unpinned workers sharing one framebuffer.
+    */
+    explicit render_engine(unsigned threads = 0, const numa_topology* topology = nullptr);
+    ~render_engine();
+
+    render_engine(const render_engine&) = delete;
+    render_engine& operator=(const render_engine&) = delete;
+
+    /**
+    * Queues a job, rendering starts as soon as a worker is free.
+    * @return handle to follow, cancel and collect the job.
+    */
+    render_handle submit(const render_request& request);
+
+    inline unsigned num_threads() const { return unsigned(workers.size()); }
+    inline size_t num_nodes() const { return topology.size(); }
+};
+
+void render_handle::cancel()
+{
+    if (task->cancelled.exchange(true))
+        return;
+    //Wake the workers so one of them retires the task if none of its tiles are in flight
+    std::lock_guard<std::mutex> guard(task->engine->lock);
+    task->engine->wake.notify_all();
+}
+
+render_engine::render_engine(unsigned threads, const numa_topology* topology)
+    : topology{ (topology != nullptr) ? *topology : numa_topology::simulate(1) }, pinned{ topology != nullptr }
+{
+    size_t cpus = 0;
+    for (size_t n = 0; n < this->topology.size(); n++)
+        cpus += this->topology.nodes[n].size();
+    if (threads == 0)
+        threads = pinned ? unsigned(cpus) : std::max(1u, std::thread::hardware_concurrency());
+    //A node without a worker would never render its tiles
+    threads = std::max(threads, unsigned(this->topology.size()));
+    //Deal the workers out over the nodes' cores in turn, so every node gets a share however many threads there are
+    std::vector<size_t> used(this->topology.size(), 0);
+    for (unsigned i = 0; i < threads; i++)
+    {
+        size_t node = i % this->topology.size();
+        const std::vector<unsigned>& c = this->topology.nodes[node];
+        workers.emplace_back(&render_engine::worker, this, i, node, c[used[node]++ % c.size()]);
+    }
+}
+
+render_engine::~render_engine()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        for (size_t i = 0; i < tasks.size(); i++)
+            tasks[i]->cancelled.store(true);
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    for (size_t i = 0; i < tasks.size(); i++)
+        finish(*tasks[i], render_status::cancelled);
+}
+
+render_handle render_engine::submit(const render_request& request)
+{
+    std::shared_ptr<render_task> task = std::make_shared<render_task>();
+    task->request = request;
+    task->start = std::chrono::steady_clock::now();
+    task->engine = this;
+    mem_scope tagged(mem_tag::render);
+    render_settings& s = task->request.settings;
+    size_t nodes = topology.size();
+    task->fbs.resize(nodes);
+    task->fb_ready.reset(new std::once_flag[nodes]);
+    task->fbs[0].resize(s.nx, s.ny);
+    task->timed = s.time_budget > 0;
+    task->deadline = task->start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(s.time_budget));
+    //A time budget without a sample count keeps adding samples until it runs out
+    task->total_samples = (s.ns > 0) ? s.ns : (task->timed ? INT_MAX : 1);
+    task->sampler_spp = (s.ns > 0) ? s.ns : (task->timed ? 64 : 1);
+
+    int x0, y0, x1, y1;
+    s.crop_window(x0, y0, x1, y1);
+    for (int y = y0; y < y1; y += render_task::tile_size)
+        for (int x = x0; x < x1; x += render_task::tile_size)
+            task->tiles.push_back({ x, y, std::min(x + render_task::tile_size, x1), std::min(y + render_task::tile_size, y1) });
+    //Dealt out in turn, so every node gets tiles from all over the image and a similar share of the work
+    task->node_tiles.resize(nodes);
+    for (size_t k = 0; k < task->tiles.size(); k++)
+        task->node_tiles[k % nodes].push_back(uint32_t(k));
+    task->next_tile.assign(nodes, 0);
+    task->samples_total = uint64_t(x1 - x0) * uint64_t(y1 - y0) * uint64_t(task->total_samples);
+
+    aabb bounds;
+    if (!request.world->bounding_box(bounds))
+        bounds = aabb(request.view.lookfrom - vec3(100, 100, 100), request.view.lookfrom + vec3(100, 100, 100));
+    bool path = s.integrator == integrator_type::path;
+    if (s.guiding && path)
+        task->guide.reset(new path_guide(bounds));
+    if (s.cache_error > 0 && path)
+        task->cache = request.cache ? request.cache : std::make_shared<irradiance_cache>(bounds, s.cache_error);
+
+    render_handle handle(task);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        task->id = next_id++;
+        start_pass(*task);
+        if (task->finished)
+            return handle;
+        tasks.push_back(task);
+    }
+    wake.notify_all();
+    return handle;
+}
+
+void render_engine::start_pass(render_task& task)
+{
+    if (task.pass_end >= task.total_samples || task.tiles.empty())
+    {
+        finish(task, render_status::completed);
+        return;
+    }
+    if (task.timed && !task.coarse_done)
+    {
+        //The coarse pass takes no range of samples, just the first sample of each block's corner
+        task.coarse_done = true;
+        task.pass_block = render_task::coarse_block;
+    }
+    else
+    {
+        task.pass_block = 1;
+        task.pass_begin = task.pass_end;
+        if (task.guide != nullptr)
+            task.pass_end = std::min(std::max(1, 2 * task.pass_begin), task.total_samples);
+        else
+            task.pass_end = task.timed ? task.pass_begin + 1 : task.total_samples;
+    }
+    std::fill(task.next_tile.begin(), task.next_tile.end(), 0);
+    task.tiles_done = 0;
+    task.between_passes = false;
+}
+
+void render_engine::finish(render_task& task, render_status status)
+{
+    if (task.finished)
+        return;
+    task.finished = true;
+    render_result result;
+    result.status = status;
+    result.image = std::move(task.fbs[0]);
+    for (size_t n = 1; n < task.fbs.size(); n++)
+        if (task.fbs[n].width > 0)
+            result.image.add(task.fbs[n]);
+    if (task.timed && status == render_status::completed)
+    {
+        const render_settings& s = task.request.settings;
+        int x0, y0, x1, y1;
+        s.crop_window(x0, y0, x1, y1);
+        result.image.fill_unsampled(render_task::coarse_block, x0, s.ny - y1, x1, s.ny - y0);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - task.start).count();
+    task.promise.set_value(std::move(result));
+    if (task.request.on_done)
+        task.request.on_done();
+}
+
+std::shared_ptr<render_task> render_engine::pick_task(size_t node, std::vector<std::shared_ptr<render_task>>& retired)
+{
+    std::shared_ptr<render_task> best;
+    for (size_t i = 0; i < tasks.size();)
+    {
+        render_task& t = *tasks[i];
+        if ((t.cancelled.load() || t.out_of_time()) && t.in_flight == 0 && !t.between_passes)
+        {
+            retired.push_back(tasks[i]);
+            tasks.erase(tasks.begin() + i);
+            continue;
+        }
+        if (!t.cancelled.load() && !t.between_passes && t.next_tile[node] < t.node_tiles[node].size() && !t.out_of_time()
+            && (best == nullptr || t.request.priority > best->request.priority
+                || (t.request.priority == best->request.priority && t.id < best->id)))
+            best = tasks[i];
+        i++;
+    }
+    return best;
+}
+
+void render_engine::worker(unsigned index, size_t node, unsigned cpu)
+{
+    if (pinned)
+        pin_current_thread(std::vector<unsigned>(1, cpu));
+    //Everything a worker allocates (guide refinement, tile setup) is render memory
+    mem_scope tagged(mem_tag::render);
+    tracer::get().set_thread_name("render worker " + std::to_string(index) + (pinned ? " (node " + std::to_string(node) + ")" : std::string()));
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        std::vector<std::shared_ptr<render_task>> retired;
+        std::shared_ptr<render_task> task;
+        {
+            //Time spent waiting for work shows up as its own span, so load imbalance is visible on the timeline
+            trace_scope idle("idle", "engine");
+            wake.wait(guard, [&] { return stopping || (task = pick_task(node, retired)) != nullptr || !retired.empty(); });
+        }
+        for (size_t i = 0; i < retired.size(); i++)
+            finish(*retired[i], retired[i]->cancelled.load() ? render_status::cancelled : render_status::completed);
+        if (stopping)
+            return;
+        if (task == nullptr)
+            continue;
+
+        render_task::tile t = task->tiles[task->node_tiles[node][task->next_tile[node]++]];
+        int sample_end = task->pass_end, block = task->pass_block;
+        task->in_flight++;
+        guard.unlock();
+        render_tile(*task, node, t, sample_end, block);
+        if (task->request.on_progress)
+            task->request.on_progress(double(task->samples_done.load()) / double(task->samples_total));
+        guard.lock();
+
+        task->in_flight--;
+        task->tiles_done++;
+        if (task->cancelled.load() || task->out_of_time())
+        {
+            wake.notify_all();
+            continue;
+        }
+        if (task->tiles_done < task->tiles.size())
+            continue;
+
+        //Last tile of the pass: refine the guide while nothing else touches the task, then hand out the next pass
+        task->between_passes = true;
+        if (task->guide != nullptr && task->pass_block == 1 && task->pass_end < task->total_samples)
+        {
+            guard.unlock();
+            {
+                trace_scope scope("guide refine", "engine");
+                task->guide->refine();
+            }
+            guard.lock();
+        }
+        start_pass(*task);
+        if (task->finished)
+            tasks.erase(std::find(tasks.begin(), tasks.end(), task));
+        wake.notify_all();
+    }
+}
+
+void render_engine::render_tile(render_task& task, size_t node, const render_task::tile& t, int sample_end, int block)
+{
+    trace_scope scope("tile", "engine", "x", t.x0, "y", t.y0);
+    const render_settings& s = task.request.settings;
+    //First touched here, by a worker of the node, so the buffer's pages are the node's own
+    framebuffer& fb = task.fbs[node];
+    if (node > 0)
+        std::call_once(task.fb_ready[node], [&] { fb.resize(s.nx, s.ny); });
+    std::unique_ptr<sampler> smp = make_sampler(s.sampler, s.nx, s.ny, task.sampler_spp, s.seed);
+    camera cam = task.request.view.make_camera(s.nx, s.ny);
+    const hitable* world = (node < task.request.replicas.size() && task.request.replicas[node] != nullptr)
+        ? task.request.replicas[node].get() : task.request.world.get();
+
+    //Crop rows are counted from the top, j from the bottom. Each pixel is topped up to sample_end samples, so the corners the
+    //coarse pass already sampled aren't sampled twice in the first full pass.
+    for (int y = t.y0; y < t.y1; y++)
+    {
+        if (task.cancelled.load(std::memory_order_relaxed) || task.out_of_time())
+            return;
+        int j = s.ny - 1 - y;
+        if (j % block != 0)
+            continue;
+        uint64_t taken = 0;
+        hot_path_scope hot;
+        for (int i = t.x0; i < t.x1; i++)
+        {
+            if (i % block != 0)
+                continue;
+            uint32_t target = (block > 1) ? 1 : uint32_t(sample_end);
+            for (; fb.samples(i, j) < target; taken++)
+                render_sample(world, cam, fb, *smp, i, j, task.guide.get(), task.cache.get(), s.integrator);
+        }
+        task.samples_done.fetch_add(taken, std::memory_order_relaxed);
+    }
+}
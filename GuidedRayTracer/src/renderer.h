@@ -0,0 +1,560 @@
+#pragma once
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "alloc_tracker.h"
+#include "bdpt.h"
+#include "camera.h"
+#include "environment.h"
+#include "guiding.h"
+#include "hitable.h"
+#include "irradiance_cache.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "preview.h"
+#include "trace.h"
+
+//How the light reaching the camera is estimated.
+enum class integrator_type
+{
+    //Paths traced from the camera, with next event estimation and optionally guiding and the irradiance cache
+    path,
+    //Bidirectional path tracing (see bdpt.h), for light that's hard to find from the camera such as caustics
+    bdpt
+};
+
+//Everything about how an image is rendered that isn't the scene or the view.
+struct render_settings
+{
+    int nx = 200;
+    int ny = 100;
+    int ns = 20;
+    sampler_type sampler = sampler_type::sobol;
+    uint32_t seed = 0;
+
+    //Crop window in pixels, rows counted from the top of the image, [x0, x1) x [y0, y1). x1/y1 of 0 mean the full width/height.
+    int crop_x0 = 0, crop_y0 = 0, crop_x1 = 0, crop_y1 = 0;
+
+    //Error allowed when reusing cached irradiance at later diffuse bounces (Ward's a, around 0.1-0.3), 0 to trace every bounce.
+    double cache_error = 0;
+
+    //Learn where light comes from as the render goes and steer diffuse bounces towards it.
+    bool guiding = true;
+
+    integrator_type integrator = integrator_type::path;
+
+    //Wall-clock budget in seconds, 0 for none. With a budget ns caps the number of passes (0 for no cap).
+    double time_budget = 0;
+
+    //Name of the shared-memory segment the progressive preview is streamed to, empty to disable the preview.
+    std::string preview_name;
+    int preview_interval_ms = 250;
+    //Largest resolution a viewer may switch the render to.
+    int preview_max_width = 1920;
+    int preview_max_height = 1080;
+
+    //Gets the crop window clamped to the image.
+    inline void crop_window(int& x0, int& y0, int& x1, int& y1) const
+    {
+        x0 = (crop_x0 > 0) ? ((crop_x0 < nx) ? crop_x0 : nx) : 0;
+        y0 = (crop_y0 > 0) ? ((crop_y0 < ny) ? crop_y0 : ny) : 0;
+        x1 = (crop_x1 > 0 && crop_x1 < nx) ? crop_x1 : nx;
+        y1 = (crop_y1 > 0 && crop_y1 < ny) ? crop_y1 : ny;
+        if (x1 < x0) x1 = x0;
+        if (y1 < y0) y1 = y0;
+    }
+};
+
+//Power heuristic (beta = 2) weight of a sample taken with density pdf_a, when pdf_b could also have produced it.
+inline double power_heuristic(double pdf_a, double pdf_b)
+{
+    double a = pdf_a * pdf_a, b = pdf_b * pdf_b;
+    return (a + b > 0) ? a / (a + b) : 0;
+}
+
+//Probability of next event estimation sampling the environment map rather than the light_bvh, splitting evenly when there are both.
+inline double environment_pick(const light_bvh* lights, const environment_map* env)
+{
+    if (env == nullptr)
+        return 0;
+    return (lights != nullptr) ? 0.5 : 1;
+}
+
+/**
+* Samples a direction towards a light for next event estimation, either from the scene's emitters or from the environment map,
+* with ls.pdf including the probability of having picked which.
+* @param u_pick - uniform number picking the environment or an emitter, and then which emitter.
+*/
+inline bool sample_direct(const light_bvh* lights, const environment_map* env, const vec3& p, const vec3& n, double u_pick, double u1, double u2, light_sample& ls)
+{
+    double env_pick = environment_pick(lights, env);
+    if (u_pick < env_pick)
+    {
+        if (!env->sample(u1, u2, ls))
+            return false;
+        ls.pdf *= env_pick;
+        return true;
+    }
+    if (lights == nullptr)
+        return false;
+    if (env_pick > 0)
+        u_pick = fmin((u_pick - env_pick) / (1 - env_pick), 1 - DBL_EPSILON);
+    if (!lights->sample(p, n, u_pick, u1, u2, ls))
+        return false;
+    ls.pdf *= 1 - env_pick;
+    return true;
+}
+
+vec3 colour(const ray& r_in, const hitable * world, int depth, sampler& s, path_guide* guide, irradiance_cache* cache);
+
+/**
+* Computes the irradiance at a point by tracing a stratified, cosine-distributed set of paths over its hemisphere, and stores it
+* in the cache. Light reaching the point straight from an emitter or the environment map is left out, the integrator samples it
+* directly.
+* @param n - surface normal on the side to gather from.
+* @param depth - depth of the point along the path that needs it.
+*/
+vec3 gather_irradiance(const hitable* world, const vec3& p, const vec3& n, int depth, irradiance_cache& cache)
+{
+    const int strata = 8;
+    const light_bvh* lights = world->lights();
+    const environment_map* env = world->environment();
+
+    //Each record gets its own stream of random numbers, seeded by where it is so the same point always gathers the same paths
+    //however the threads are scheduled
+    uint32_t seed = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        float pa = float(p[a]), na = float(n[a]);
+        uint32_t bits[2];
+        memcpy(&bits[0], &pa, sizeof(float));
+        memcpy(&bits[1], &na, sizeof(float));
+        seed = hash_combine(hash_combine(seed, bits[0]), bits[1]);
+    }
+    independent_sampler s(hash_u32(seed));
+
+    vec3 tu = unit_vector(cross(fabs(n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0), n));
+    vec3 tv = cross(n, tu);
+
+    //The first hits of every direction are found as one batch, so geometry paged in on demand is fetched once for all of them
+    static_assert(strata * strata <= hitable::max_batch, "a gather's directions must fit in one batch");
+    ray gathers[strata * strata];
+    hit_record recs[strata * strata];
+    material mats[strata * strata];
+    bool hits[strata * strata];
+    for (int i = 0; i < strata; i++)
+    {
+        for (int j = 0; j < strata; j++)
+        {
+            s.start_sample(i, j, 0);
+            double u1 = (i + s.get(0)) / strata, u2 = (j + s.get(1)) / strata;
+            double r = sqrt(u1), phi = 2 * M_PI * u2;
+            vec3 wi = r * cos(phi) * tu + r * sin(phi) * tv + sqrt(fmax(0.0, 1 - u1)) * n;
+            gathers[i * strata + j] = ray(p, wi);
+        }
+    }
+    world->hit_batch(gathers, strata * strata, 0.0001, FLT_MAX, recs, mats, hits);
+
+    vec3 sum(0, 0, 0);
+    double inv_dist_sum = 0;
+    for (int i = 0; i < strata; i++)
+    {
+        for (int j = 0; j < strata; j++)
+        {
+            const ray& gather = gathers[i * strata + j];
+            const hit_record& rec = recs[i * strata + j];
+            if (!hits[i * strata + j])
+            {
+                if (env == nullptr)
+                    sum += background(env, gather);
+                continue;
+            }
+            inv_dist_sum += 1 / rec.t;
+
+            //Replay the direction's first two dims, colour() carries on from the next
+            s.start_sample(i, j, 0);
+            s.get(0);
+            s.get(1);
+            vec3 li = colour(gather, world, depth + 1, s, nullptr, &cache);
+            if (lights != nullptr && rec.light != UINT32_MAX)
+                li -= mats[i * strata + j].emitted(gather.direction(), rec);
+            sum += li;
+        }
+    }
+
+    //Cosine-weighted directions, so the irradiance is pi times the mean radiance
+    vec3 e = sum * (M_PI / (strata * strata));
+    cache.insert(p, n, e, (inv_dist_sum > 0) ? (strata * strata) / inv_dist_sum : DBL_MAX);
+    return e;
+}
+
+/**
+* A diffuse vertex of a path whose scattered direction came from the guide's mixture, kept until the path ends so the radiance
+* that arrived along that direction can be recorded into the guide.
+*/
+struct guide_vertex
+{
+    uint32_t leaf;
+    vec3 wi;
+    double pdf;
+    //Path throughput including this vertex's scattering, and the radiance the rest of the path contributed through it
+    vec3 throughput;
+    vec3 radiance;
+};
+
+/**
+* Computes the colour of each sample by following its path through the scene, at each step attenuating the light carried back.
+* At diffuse surfaces the scene's light_bvh picks an emitter to send a shadow ray to (or the environment map picks a direction
+* to look for the sky in), and emitters or sky the path hits are weighted against that with multiple importance sampling so
+* neither technique's noise dominates.
+* @param r - the sample ray through the pixel whose final colour is to be computed.
+* @param world - container for all the objects in the scene.
+* @param depth - depth of r; how many times the path has already bounced about the scene.
+* @param s - sampler for the current camera sample, every bounce draws from its own dims.
+* @param guide - if not null, diffuse bounces pick their direction from a one-sample mixture of the BSDF and the guide, and the
+*                radiance found along the path is recorded back into it.
+* @param cache - if not null, the path ends at the first diffuse surface after the camera's, taking the indirect light there from
+*                the irradiance cache instead (unless the cache has nothing there and the path is already too deep to gather).
+* @return - final colour of the sample.
+*/
+vec3 colour(const ray& r_in, const hitable * world, int depth, sampler& s, path_guide* guide = nullptr, irradiance_cache* cache = nullptr)
+{
+    const int max_depth = 50;
+    const light_bvh* lights = world->lights();
+    const environment_map* env = world->environment();
+    double env_pick = environment_pick(lights, env);
+    vec3 radiance(0, 0, 0), throughput(1, 1, 1);
+    ray r = r_in;
+    //Whether the last bounce could also have sampled the light the path now hits, and with what density it picked its direction
+    bool mis = false;
+    double bsdf_pdf = 0;
+    vec3 prev_p, prev_n;
+
+    guide_vertex vertices[max_depth];
+    int num_vertices = 0;
+    //Whether the last vertex added was made by the previous bounce
+    bool last_is_previous = false;
+
+    for (;; depth++)
+    {
+        hit_record rec;
+        material closest_mat;
+        if (!world->hit(r, 0.0001, FLT_MAX, rec, closest_mat))
+        {
+            vec3 c = throughput * background(env, r);
+            double w = 1;
+            if (mis && env != nullptr)
+                w = power_heuristic(bsdf_pdf, env_pick * env->pdf(unit_vector(r.direction())));
+            radiance += c * w;
+            for (int k = 0; k < num_vertices; k++)
+                vertices[k].radiance += (k == num_vertices - 1 && last_is_previous) ? c : c * w;
+            break;
+        }
+
+        if (closest_mat.is_emissive())
+        {
+            vec3 le = throughput * closest_mat.emitted(r.direction(), rec);
+            double w = 1;
+            if (mis && lights != nullptr && rec.light != UINT32_MAX)
+            {
+                vec3 wi = unit_vector(r.direction());
+                double dist = rec.t * r.direction().length();
+                w = power_heuristic(bsdf_pdf, (1 - env_pick) * lights->pdf(rec.light, prev_p, prev_n, wi, dist));
+            }
+            radiance += le * w;
+            //The vertex the ray left from sees all of the emitted light, those before it the MIS estimate
+            for (int k = 0; k < num_vertices; k++)
+                vertices[k].radiance += (k == num_vertices - 1 && last_is_previous) ? le : le * w;
+        }
+        last_is_previous = false;
+
+        if (depth >= max_depth)
+            break;
+        s.start_bounce(depth);
+
+        bool diffuse = closest_mat.samples_lights();
+        uint32_t leaf = (guide != nullptr && diffuse) ? guide->leaf_at(rec.p) : 0;
+        bool guided = guide != nullptr && diffuse && guide->ready(leaf);
+
+        //Past the camera's surface diffuse bounces end in the cache, gathering a new record if none is close enough. Records
+        //are gathered from paths that use the cache in turn, up to a few levels deep, after which paths without one go on.
+        vec3 cached_e;
+        bool cached = false;
+        if (cache != nullptr && diffuse && depth > 0)
+        {
+            vec3 n = (dot(r.direction(), rec.normal) < 0) ? rec.normal : -rec.normal;
+            cached = cache->lookup(rec.p, n, cached_e);
+            if (!cached && depth <= irradiance_cache::max_gather_depth)
+            {
+                cached_e = gather_irradiance(world, rec.p, n, depth, *cache);
+                cached = true;
+            }
+        }
+
+        //Next event estimation, unoccluded light reaching the point directly from an emitter or the environment
+        if ((lights != nullptr || env != nullptr) && diffuse)
+        {
+            double u1, u2;
+            s.get_light(u1, u2);
+            light_sample ls;
+            if (sample_direct(lights, env, rec.p, rec.normal, s.get_light_choice(), u1, u2, ls))
+            {
+                vec3 f = closest_mat.eval(r.direction(), rec, ls.wi);
+                if (f.squared_length() > 0)
+                {
+                    hit_record shadow_rec;
+                    material shadow_mat;
+                    if (!world->hit(ray(rec.p, ls.wi), 0.0001, ls.dist * (1 - 1e-6), shadow_rec, shadow_mat))
+                    {
+                        double p = closest_mat.pdf(r.direction(), rec, ls.wi);
+                        if (guided)
+                            p = path_guide::bsdf_fraction * p + (1 - path_guide::bsdf_fraction) * guide->pdf(leaf, ls.wi);
+                        //Cached irradiance leaves lights out, so there the light sample is the only estimate of them
+                        vec3 c = throughput * f * ls.radiance * ((cached ? 1 : power_heuristic(ls.pdf, p)) / ls.pdf);
+                        radiance += c;
+                        for (int k = 0; k < num_vertices; k++)
+                            vertices[k].radiance += c;
+                    }
+                }
+            }
+        }
+
+        if (cached)
+        {
+            vec3 c = throughput * closest_mat.albedo_at(rec) * cached_e / M_PI;
+            radiance += c;
+            for (int k = 0; k < num_vertices; k++)
+                vertices[k].radiance += c;
+            break;
+        }
+
+        ray scattered;
+        double scattered_pdf = 0;
+        if (guided)
+        {
+            //One-sample mixture of the BSDF and the learnt incident radiance, weighted by the density of the mixture
+            vec3 wi;
+            if (s.get_bsdf_choice() < path_guide::bsdf_fraction)
+            {
+                vec3 attenuation;
+                if (!closest_mat.scatter(r, rec, attenuation, scattered, s))
+                    break;
+                wi = unit_vector(scattered.direction());
+            }
+            else
+            {
+                double u1, u2;
+                s.get_bsdf(u1, u2);
+                wi = guide->sample(leaf, u1, u2);
+                scattered = closest_mat.scattered_towards(r, rec, wi);
+            }
+            scattered_pdf = path_guide::bsdf_fraction * closest_mat.pdf(r.direction(), rec, wi)
+                          + (1 - path_guide::bsdf_fraction) * guide->pdf(leaf, wi);
+            vec3 f = closest_mat.eval(r.direction(), rec, wi);
+            if (!(scattered_pdf > 0) || f.squared_length() == 0)
+                break;
+            throughput *= f / scattered_pdf;
+        }
+        else
+        {
+            vec3 attenuation;
+            if (!closest_mat.scatter(r, rec, attenuation, scattered, s))
+                break;
+            throughput *= attenuation;
+            if (diffuse)
+                scattered_pdf = closest_mat.pdf(r.direction(), rec, unit_vector(scattered.direction()));
+        }
+
+        if (guide != nullptr && diffuse)
+        {
+            guide_vertex& v = vertices[num_vertices++];
+            v.leaf = leaf;
+            v.wi = unit_vector(scattered.direction());
+            v.pdf = scattered_pdf;
+            v.throughput = throughput;
+            v.radiance = vec3(0, 0, 0);
+            last_is_previous = true;
+        }
+
+        mis = (lights != nullptr || env != nullptr) && diffuse;
+        if (mis)
+        {
+            bsdf_pdf = scattered_pdf;
+            prev_p = rec.p;
+            prev_n = rec.normal;
+        }
+        r = scattered;
+    }
+
+    //Incident radiance along each vertex's direction is what came back through it, divided by the throughput up to there
+    for (int k = 0; k < num_vertices; k++)
+    {
+        const guide_vertex& v = vertices[k];
+        vec3 li(0, 0, 0);
+        for (int c = 0; c < 3; c++)
+            li[c] = (v.throughput[c] > 0) ? v.radiance[c] / v.throughput[c] : 0;
+        guide->record(v.leaf, v.wi, float(luminance(li) / v.pdf));
+    }
+    return radiance;
+}
+
+/**
+* Takes the next sample of pixel (i, j) and adds it to the framebuffer, any light the bidirectional integrator finds for other
+* pixels is splatted into it too. The guide and cache are only used by the path integrator.
+*/
+inline void render_sample(const hitable* world, camera& cam, framebuffer& fb, sampler& smp, int i, int j, path_guide* guide, irradiance_cache* cache,
+    integrator_type integrator = integrator_type::path)
+{
+    double u, v, lu, lv;
+    smp.start_sample(i, j, fb.samples(i, j));
+    smp.get_pixel(u, v);
+    u = double(i + u) / double(fb.width);
+    v = double(j + v) / double(fb.height);
+
+    smp.get_lens(lu, lv);
+    ray r = cam.get_ray(u, v, lu, lv);
+    if (integrator == integrator_type::bdpt)
+        fb.add_sample(i, j, bdpt_sample(world, cam, r, smp, fb));
+    else
+        fb.add_sample(i, j, colour(r, world, 0, smp, guide, cache));
+}
+
+/**
+* Renders the view progressively into fb. The first passes only sample the corner pixel of 8x8, then 4x4, then 2x2 blocks so a
+* coarse image is available almost immediately, after which every pass adds one sample to every pixel until each has settings.ns.
+* The samples taken in the coarse passes count towards the final image, so no work is thrown away.
+*
+* With guiding on, the passes double as training iterations for a path_guide: the guide is refined after full passes 1, 2, 4,
+* 8, ..., so each iteration gets twice the samples of the last and later passes draw on what the earlier ones learnt.
+*
+* With a time budget the render keeps adding passes (up to settings.ns, if non-zero) and stops as soon as the budget runs out, even
+* mid-pass; fb then records how many samples each pixel actually received. Pixels it never reached share the samples of their
+* block's corner (see framebuffer::fill_unsampled).
+* @param preview - channel to stream the accumulation buffer to, may be null. A viewer can cancel the render or restart it at a
+*                  new resolution through it, in which case settings.nx/ny are updated (and the crop window reset).
+* @return false if the render was cancelled.
+*/
+bool render_progressive(const hitable* world, const camera_view& view, render_settings& settings, framebuffer& fb, preview_channel* preview)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(settings.time_budget));
+    bool timed = settings.time_budget > 0;
+    int max_passes = (settings.ns > 0) ? settings.ns : (timed ? INT_MAX : 1);
+    mem_scope tagged(mem_tag::render);
+
+    std::unique_ptr<sampler> smp = make_sampler(settings.sampler, settings.nx, settings.ny, (settings.ns > 0) ? settings.ns : 64, settings.seed);
+    camera cam = view.make_camera(settings.nx, settings.ny);
+    fb.resize(settings.nx, settings.ny);
+
+    //Unbounded scenes are guided and cached within a box around the camera, anything outside it shares the nearest cells
+    aabb bounds;
+    if (!world->bounding_box(bounds))
+        bounds = aabb(view.lookfrom - vec3(100, 100, 100), view.lookfrom + vec3(100, 100, 100));
+    std::unique_ptr<path_guide> guide;
+    bool path = settings.integrator == integrator_type::path;
+    if (settings.guiding && path)
+        guide.reset(new path_guide(bounds));
+    std::unique_ptr<irradiance_cache> cache;
+    if (settings.cache_error > 0 && path)
+        cache.reset(new irradiance_cache(bounds, settings.cache_error));
+
+    int x0, y0, x1, y1;
+    settings.crop_window(x0, y0, x1, y1);
+    //Crop rows are counted from the top, j from the bottom
+    int j_lo = settings.ny - y1, j_hi = settings.ny - y0;
+
+    //Coarse passes at block sizes 8, 4, 2, then full passes (block 1)
+    int block = 8;
+    int pass = 0;
+    int since_clock_check = 0;
+    while (pass < max_passes)
+    {
+        trace_scope scope("pass", "render", "pass", pass, "block", block);
+        int step = (block > 1) ? block : 1;
+        for (int j = j_hi - 1; j >= j_lo; j--)
+        {
+            if (j % step != 0)
+                continue;
+            for (int i = x0; i < x1; i++)
+            {
+                if (i % step != 0)
+                    continue;
+                //Full passes top every pixel up to pass + 1 samples, coarse passes sample each block corner once
+                if ((block == 1 && fb.samples(i, j) <= uint32_t(pass)) || (block > 1 && fb.samples(i, j) == 0))
+                {
+                    {
+                        hot_path_scope hot;
+                        render_sample(world, cam, fb, *smp, i, j, guide.get(), cache.get(), settings.integrator);
+                    }
+                    if (timed && ++since_clock_check >= 32)
+                    {
+                        since_clock_check = 0;
+                        if (clock::now() >= deadline)
+                        {
+                            //Pixels the coarse (or first full) pass didn't reach take their block's colour, not black
+                            fb.fill_unsampled(8, x0, j_lo, x1, j_hi);
+                            if (preview != nullptr)
+                            {
+                                preview->publish(fb, 1, uint32_t(pass), true);
+                                preview->finish();
+                            }
+                            return true;
+                        }
+                    }
+                }
+            }
+
+            if (preview != nullptr)
+            {
+                if (preview->cancel_requested())
+                {
+                    preview->finish();
+                    return false;
+                }
+                preview->publish(fb, (block > 1) ? block : (pass == 0 ? 2 : 1), uint32_t(pass), false);
+            }
+        }
+
+        if (preview != nullptr)
+        {
+            preview->publish(fb, (block > 1) ? block : 1, uint32_t(block > 1 ? 0 : pass + 1), true);
+
+            int w, h;
+            if (preview->resize_requested(w, h))
+            {
+                settings.nx = w;
+                settings.ny = h;
+                settings.crop_x0 = settings.crop_y0 = settings.crop_x1 = settings.crop_y1 = 0;
+                settings.crop_window(x0, y0, x1, y1);
+                j_lo = 0;
+                j_hi = h;
+                smp = make_sampler(settings.sampler, w, h, (settings.ns > 0) ? settings.ns : 64, settings.seed);
+                cam = view.make_camera(w, h);
+                fb.resize(w, h);
+                block = 8;
+                pass = 0;
+                continue;
+            }
+        }
+
+        if (block > 1)
+            block /= 2;
+        else
+        {
+            pass++;
+            if (guide != nullptr && (pass & (pass - 1)) == 0)
+            {
+                trace_scope refine_scope("guide refine", "render");
+                guide->refine();
+            }
+        }
+    }
+
+    if (preview != nullptr)
+        preview->finish();
+    return true;
+}
@@ -0,0 +1,280 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+
+//Which sample generator the renderer draws its random numbers from.
+enum class sampler_type
+{
+    independent,
+    sobol,
+    blue_noise
+};
+
+/**
+* Dimension layout shared by every sampler, so the same dimension always feeds the same decision along a path:
+* dims 0-1 jitter the sample within the pixel, dims 2-3 pick the point on the lens, after which each bounce gets
+* dims_per_bounce dims laid out as [bsdf u, bsdf v, light u, light v, bsdf component choice, light choice].
+* 2D decisions always start on an even dim so they land on a stratified pair.
+*/
+const uint32_t dim_pixel = 0;
+const uint32_t dim_lens = 2;
+const uint32_t dim_first_bounce = 4;
+const uint32_t dims_per_bounce = 6;
+
+//Hashing helpers used to decorrelate pixels and dimensions.
+inline uint32_t hash_u32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return hash_u32(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/**
+* Hash-based Owen scramble (Burley 2020, "Practical Hash-based Owen Scrambling"): every bit is flipped depending only on the bits
+* above it, which keeps the stratification of the Sobol points while randomising them.
+*/
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+/**
+* First two dimensions of the Sobol sequence (van der Corput and its Pascal-matrix partner), together they form a (0,2)-sequence.
+* Higher dimensions are built by padding these with independently scrambled copies.
+*/
+inline void sobol_2d(uint32_t index, uint32_t& x, uint32_t& y)
+{
+    x = reverse_bits(index);
+    y = 0;
+    for (uint32_t v = 0x80000000u; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            y ^= v;
+    }
+}
+
+inline double u32_to_unit(uint32_t x)
+{
+    //Only keep 32 bits so the result is strictly below 1
+    return x * (1.0 / 4294967296.0);
+}
+
+/**
+* Source of the random numbers used by a single camera sample. A sample is started with start_sample(), after which any
+* dimension can be queried in any order; the integrator tells the sampler which bounce it is on so every bounce consumes the
+* same dimensions no matter what happened earlier on the path.
+*/
+class sampler
+{
+protected:
+    uint32_t bounce_base;
+
+public:
+    sampler() : bounce_base{ dim_first_bounce } {}
+    virtual ~sampler() {}
+
+    /**
+    * Starts generating the given sample of the given pixel.
+    * @param px/py - pixel coordinates.
+    * @param index - index of the sample within the pixel.
+    */
+    virtual void start_sample(int px, int py, uint32_t index) = 0;
+
+    //Gets the value in [0, 1) of the given (absolute) dimension of the current sample.
+    virtual double get(uint32_t dim) = 0;
+
+    //Selects the dims handed out by the bounce-level getters below.
+    inline void start_bounce(int depth) { bounce_base = dim_first_bounce + uint32_t(depth) * dims_per_bounce; }
+
+    inline void get_pixel(double& u, double& v) { u = get(dim_pixel); v = get(dim_pixel + 1); }
+    inline void get_lens(double& u, double& v) { u = get(dim_lens); v = get(dim_lens + 1); }
+    inline void get_bsdf(double& u, double& v) { u = get(bounce_base); v = get(bounce_base + 1); }
+    inline void get_light(double& u, double& v) { u = get(bounce_base + 2); v = get(bounce_base + 3); }
+    inline double get_bsdf_choice() { return get(bounce_base + 4); }
+    inline double get_light_choice() { return get(bounce_base + 5); }
+};
+
+//Plain Monte Carlo: every query is a fresh uniform number from a per-sample PCG32 stream.
+class independent_sampler : public sampler
+{
+private:
+    uint64_t state;
+    uint32_t seed;
+
+    inline uint32_t next()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = uint32_t(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+public:
+    explicit independent_sampler(uint32_t seed = 0) : state{ 0 }, seed{ seed } {}
+
+    virtual void start_sample(int px, int py, uint32_t index) override
+    {
+        uint32_t h = hash_combine(hash_combine(hash_combine(seed, uint32_t(px)), uint32_t(py)), index);
+        state = (uint64_t(h) << 32) | hash_u32(h);
+        next();
+    }
+
+    virtual double get(uint32_t) override { return u32_to_unit(next()); }
+};
+
+/**
+* Owen-scrambled Sobol sampler. Each pair of dims is an independently scrambled and shuffled copy of the 2D Sobol sequence,
+* so every pair is well stratified over the samples of a pixel and pairs are decorrelated from one another.
+*/
+class sobol_sampler : public sampler
+{
+private:
+    uint32_t seed;
+    uint32_t pixel_seed;
+    uint32_t sample_index;
+
+public:
+    explicit sobol_sampler(uint32_t seed = 0) : seed{ seed }, pixel_seed{ 0 }, sample_index{ 0 } {}
+
+    virtual void start_sample(int px, int py, uint32_t index) override
+    {
+        pixel_seed = hash_combine(hash_combine(seed, uint32_t(px)), uint32_t(py));
+        sample_index = index;
+    }
+
+    virtual double get(uint32_t dim) override
+    {
+        uint32_t pair_seed = hash_combine(pixel_seed, dim >> 1);
+        uint32_t x, y;
+        sobol_2d(owen_scramble(sample_index, pair_seed), x, y);
+        return (dim & 1) ? u32_to_unit(owen_scramble(y, hash_combine(pair_seed, 2)))
+                         : u32_to_unit(owen_scramble(x, hash_combine(pair_seed, 1)));
+    }
+};
+
+/**
+* Screen-space blue-noise sampler (Ahmed & Wonka 2020, "Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling Error via
+* Hierarchical Ordering of Pixels"). Pixels are walked in Morton order and the samples of consecutive pixels are taken from
+* consecutive runs of one Sobol sequence, with the Morton digits randomly permuted level by level, so neighbouring pixels receive
+* complementary sample sets and the leftover error is pushed to high frequencies.
+*/
+class blue_noise_sampler : public sampler
+{
+private:
+    uint32_t seed;
+    uint32_t levels;
+    uint32_t spp_bits;
+    uint32_t morton;
+    uint32_t sample_index;
+
+    //Spreads the lower 16 bits of x out to the even bits.
+    static inline uint32_t part_1by1(uint32_t x)
+    {
+        x &= 0x0000ffffu;
+        x = (x | (x << 8)) & 0x00ff00ffu;
+        x = (x | (x << 4)) & 0x0f0f0f0fu;
+        x = (x | (x << 2)) & 0x33333333u;
+        x = (x | (x << 1)) & 0x55555555u;
+        return x;
+    }
+
+    //Randomly permutes each base-4 Morton digit, the permutation depending on the digits above it and the dimension pair.
+    inline uint32_t shuffle_morton(uint32_t pair_seed) const
+    {
+        static const uint8_t perms[24][4] = {
+            {0,1,2,3}, {0,1,3,2}, {0,2,1,3}, {0,2,3,1}, {0,3,1,2}, {0,3,2,1},
+            {1,0,2,3}, {1,0,3,2}, {1,2,0,3}, {1,2,3,0}, {1,3,0,2}, {1,3,2,0},
+            {2,0,1,3}, {2,0,3,1}, {2,1,0,3}, {2,1,3,0}, {2,3,0,1}, {2,3,1,0},
+            {3,0,1,2}, {3,0,2,1}, {3,1,0,2}, {3,1,2,0}, {3,2,0,1}, {3,2,1,0}
+        };
+        uint32_t out = 0, prefix = 1;
+        for (int level = int(levels) - 1; level >= 0; level--)
+        {
+            uint32_t digit = (morton >> (2 * level)) & 3;
+            uint32_t p = hash_combine(pair_seed, prefix) % 24;
+            out |= uint32_t(perms[p][digit]) << (2 * level);
+            prefix = (prefix << 2) | digit;
+        }
+        return out;
+    }
+
+public:
+    /**
+    * @param width/height - resolution of the image, Morton order covers the next power of two square.
+    * @param spp - expected samples per pixel, samples beyond it still get points of their own but lose some of the blue-noise
+    *              property.
+    */
+    blue_noise_sampler(int width, int height, int spp, uint32_t seed = 0) : seed{ seed }, levels{ 0 }, spp_bits{ 0 }, morton{ 0 }, sample_index{ 0 }
+    {
+        int res = (width > height) ? width : height;
+        while ((1 << levels) < res && levels < 16)
+            levels++;
+        while ((1 << spp_bits) < spp && spp_bits < 16)
+            spp_bits++;
+    }
+
+    virtual void start_sample(int px, int py, uint32_t index) override
+    {
+        morton = part_1by1(uint32_t(px)) | (part_1by1(uint32_t(py)) << 1);
+        sample_index = index;
+    }
+
+    virtual double get(uint32_t dim) override
+    {
+        uint32_t pair_seed = hash_combine(seed, dim >> 1);
+        uint32_t low = sample_index & ((1u << spp_bits) - 1);
+        uint32_t high = sample_index >> spp_bits;
+        //Up to 32 + 2 * levels bits, so large images at high sample counts (or past spp in time-budgeted renders) need 64
+        uint64_t index = (((uint64_t(high) << (2 * levels)) | shuffle_morton(pair_seed)) << spp_bits) | low;
+
+        //The Sobol sequence only has 2^32 points, the bits above fold into the scramble so every run of 2^32 indices gets a
+        //differently scrambled copy of it instead of repeating the same points
+        uint32_t run = uint32_t(index >> 32);
+        uint32_t scramble_seed = (run == 0) ? pair_seed : hash_combine(pair_seed, run + 2);
+        uint32_t x, y;
+        sobol_2d(uint32_t(index), x, y);
+        return (dim & 1) ? u32_to_unit(owen_scramble(y, hash_combine(scramble_seed, 2)))
+                         : u32_to_unit(owen_scramble(x, hash_combine(scramble_seed, 1)));
+    }
+};
+
+/**
+* Creates a sampler of the given type.
+* @param width/height/spp - image resolution and expected samples per pixel (only the blue-noise sampler uses them).
+*/
+inline std::unique_ptr<sampler> make_sampler(sampler_type type, int width, int height, int spp, uint32_t seed)
+{
+    switch (type)
+    {
+    case sampler_type::sobol:
+        return std::unique_ptr<sampler>(new sobol_sampler(seed));
+    case sampler_type::blue_noise:
+        return std::unique_ptr<sampler>(new blue_noise_sampler(width, height, spp, seed));
+    default:
+        return std::unique_ptr<sampler>(new independent_sampler(seed));
+    }
+}
@@ -0,0 +1,905 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "arena.h"
+#include "bvh.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "torus.h"
+#include "sdf.h"
+#include "plane.h"
+#include "cube.h"
+#include "environment.h"
+#include "clustered_mesh.h"
+#include "scene_cache.h"
+#include "texture.h"
+#include "trace.h"
+
+//Kinds of primitives the scene stores, each kind lives in its own set of arrays.
+enum class prim_type : uint32_t
+{
+    sphere,
+    triangle,
+    torus,
+    plane,
+    mesh,
+    sdf
+};
+
+//Structure-of-arrays storage for every sphere in the scene.
+struct sphere_soa
+{
+    double* cx; double* cy; double* cz;
+    double* radius;
+    uint32_t* mat;
+    //Index in the scene's light_bvh, UINT32_MAX unless the material is emissive
+    uint32_t* light;
+    size_t count;
+};
+
+//Structure-of-arrays storage for every triangle in the scene, n being the precomputed unit normal.
+struct triangle_soa
+{
+    double* ax; double* ay; double* az;
+    double* bx; double* by; double* bz;
+    double* cx; double* cy; double* cz;
+    double* nx; double* ny; double* nz;
+    //Texture coordinates of the three vertices
+    double* u0; double* v0; double* u1; double* v1; double* u2; double* v2;
+    uint32_t* mat;
+    //Index in the scene's light_bvh, UINT32_MAX unless the material is emissive
+    uint32_t* light;
+    size_t count;
+};
+
+//Structure-of-arrays storage for every torus in the scene.
+struct torus_soa
+{
+    double* cx; double* cy; double* cz;
+    double* nx; double* ny; double* nz;
+    double* r_disk;
+    double* r_tube;
+    uint32_t* mat;
+    size_t count;
+};
+
+//Structure-of-arrays storage for every (infinite) plane in the scene.
+struct plane_soa
+{
+    double* nx; double* ny; double* nz;
+    double* px; double* py; double* pz;
+    uint32_t* mat;
+    size_t count;
+};
+
+//Structure-of-arrays storage for every SDF shape in the scene, each a root node in the scene's sdf_nodes placed at an origin.
+struct sdf_soa
+{
+    uint32_t* root;
+    double* ox; double* oy; double* oz;
+    //World space bounds and Lipschitz bound of each shape, worked out once at commit
+    double* lo_x; double* lo_y; double* lo_z;
+    double* hi_x; double* hi_y; double* hi_z;
+    double* lipschitz;
+    uint32_t* mat;
+    size_t count;
+};
+
+/**
+* Scene storage, keeps every primitive type in its own contiguous arrays carved out of a single arena instead of one heap
+* allocation per object. Primitives are added through the add_* calls, then commit() packs them into the arena and builds a
+* compressed BVH over them; its leaves reference primitives by type and index so there is no virtual call per primitive, and
+* tearing down the scene is one arena release.
+*/
+class scene : public hitable
+{
+private:
+    //Staging for primitives added since the last commit.
+    struct sphere_in { vec3 c; double r; uint32_t mat; };
+    struct triangle_in { vec3 a, b, c; double uv[6]; uint32_t mat; };
+    struct torus_in { vec3 c, n; double r_disk, r_tube; uint32_t mat; };
+    struct plane_in { vec3 n, p; uint32_t mat; };
+    struct sdf_in { uint32_t root; vec3 origin; uint32_t mat; };
+
+    std::vector<material> staged_materials;
+    std::vector<sphere_in> staged_spheres;
+    std::vector<triangle_in> staged_triangles;
+    std::vector<torus_in> staged_tori;
+    std::vector<plane_in> staged_planes;
+    std::vector<sdf_in> staged_sdfs;
+    std::vector<sdf_node> staged_sdf_nodes;
+
+    //Out-of-core meshes, owned by the caller, each traced through its own cluster hierarchy.
+    struct mesh_ref { const clustered_mesh* mesh; uint32_t mat; };
+    std::vector<mesh_ref> meshes;
+
+    arena mem;
+    texture_set texture_store;
+    //Hierarchy over every bounded primitive, planes are always tested on their own
+    bvh accel;
+    //Every sphere and triangle with an emissive material
+    light_bvh emitters;
+    //Scene cache the arrays point into when the scene was loaded from one
+    std::unique_ptr<mapped_region> cache_view;
+    //Sky lighting the scene, null for the default gradient, shared with the scene's replicas
+    std::shared_ptr<const environment_map> env;
+    bvh_builder builder;
+
+    //Packs the staged primitives into the arena and builds the hierarchies over them.
+    void build();
+
+    /**
+    * Calls f(pointer, count) on every array that makes up the committed scene, in the same order every time, with references so
+    * the scene cache can both write them and point them back into a mapped file.
+    */
+    template <class F>
+    void visit_arrays(F&& f);
+
+    //Fills in the texture coordinates and footprint of the closest hit once the search is over.
+    void surface_params(const ray& r, prim_type type, size_t index, hit_record& rec) const;
+
+    //The closest hit found so far while tracing a ray, mat is UINT32_MAX until there is one
+    struct closest_hit
+    {
+        double t;
+        uint32_t mat;
+        prim_type type;
+        size_t index;
+    };
+
+    void hit_local(const ray& r, double t_min, closest_hit& c, hit_record& rec) const;
+
+    //Finishes rec and gets the material once c is known to be the closest hit, false if there is none.
+    bool resolve_hit(const ray& r, const closest_hit& c, hit_record& rec, material& closest_mat) const;
+
+public:
+    material* materials;
+    size_t num_materials;
+
+    sphere_soa spheres;
+    triangle_soa triangles;
+    torus_soa tori;
+    plane_soa planes;
+    sdf_soa sdfs;
+    //Nodes of every SDF shape, each shape's children indexed within this array
+    sdf_node* sdf_nodes;
+    size_t num_sdf_nodes;
+
+    /**
+    * @param texture_budget - memory budget (bytes) of the tile cache all the scene's textures stream through.
+    */
+    explicit scene(size_t texture_budget = size_t(256) << 20)
+        : texture_store(texture_budget), builder{ bvh_builder::sah }, materials{ nullptr }, num_materials{ 0 }, spheres{}, triangles{}, tori{}, planes{}, sdfs{},
+          sdf_nodes{ nullptr }, num_sdf_nodes{ 0 } {}
+
+    scene(const scene&) = delete;
+    scene& operator=(const scene&) = delete;
+
+    /**
+    * Adds a material to the scene's material table.
+    * @return index of the material, used to reference it from primitives.
+    */
+    inline uint32_t add_material(const material& m)
+    {
+        staged_materials.push_back(m);
+        return uint32_t(staged_materials.size() - 1);
+    }
+
+    inline void add_sphere(const vec3& c, double r, uint32_t mat) { staged_spheres.push_back({ c, r, mat }); }
+    inline void add_triangle(const vec3& a, const vec3& b, const vec3& c, uint32_t mat) { add_triangle(a, b, c, 0, 0, 1, 0, 0, 1, mat); }
+    //Adds a triangle with texture coordinates (u, v) given for each vertex.
+    inline void add_triangle(const vec3& a, const vec3& b, const vec3& c, double ua, double va, double ub, double vb, double uc, double vc, uint32_t mat)
+    {
+        staged_triangles.push_back({ a, b, c, { ua, va, ub, vb, uc, vc }, mat });
+    }
+    //n must be unit length, r_disk is dist from center to medial axis, r_tube is dist from medial axis to surface.
+    inline void add_torus(const vec3& c, const vec3& n, double r_disk, double r_tube, uint32_t mat) { staged_tori.push_back({ c, n, r_disk, r_tube, mat }); }
+    inline void add_plane(const vec3& n, const vec3& p, uint32_t mat) { staged_planes.push_back({ unit_vector(n), p, mat }); }
+
+    /**
+    * Adds a shape given by a distance function, its nodes are copied into the scene.
+    * @param origin - where the shape's origin is placed.
+    */
+    void add_sdf(const sdf_shape& shape, const vec3& origin, uint32_t mat);
+
+    /**
+    * Adds an out-of-core mesh. It isn't copied: it must outlive the scene and its clusters stay on disk until rays reach them.
+    */
+    inline void add_mesh(const clustered_mesh* m, uint32_t mat) { meshes.push_back({ m, mat }); }
+
+    //Adds the 12 triangles making up the given cube (in its current orientation), using the cube's own material.
+    void add_cube(const cube& c);
+
+    /**
+    * Opens a tiled texture (.gtx, see make_tiled_texture) for use in this scene's materials.
+    * @return the texture, or null if it couldn't be opened.
+    */
+    inline const image_texture* add_texture(const std::string& path) { return texture_store.add(path); }
+
+    inline const texture_set& textures() const { return texture_store; }
+
+    //Lights the scene with the given environment map instead of the default gradient, null to go back to the gradient.
+    inline void set_environment(std::unique_ptr<environment_map> e) { env = std::move(e); }
+
+    /**
+    * Lights the scene with a latitude-longitude HDR (colour PFM), see environment_map.
+    * @param intensity - scale applied to the map's radiance.
+    * @return false if the file couldn't be read, the scene keeps its previous sky.
+    */
+    inline bool load_environment(const std::string& path, double intensity = 1)
+    {
+        std::unique_ptr<environment_map> e = load_environment_map(path, intensity);
+        if (e == nullptr)
+            return false;
+        env = std::move(e);
+        return true;
+    }
+
+    /**
+    * Packs everything added so far into the arena's SoA arrays. Must be called before the scene is traced, can only be called once.
+    * @param cache_path - optional scene cache (.gsc, see scene_cache.h). If it was written for the same primitives, materials and builder
+    *                     the scene is traced straight out of the mapped file instead of being built, otherwise the scene is
+    *                     built and the cache (re)written.
+    */
+    void commit(const std::string& cache_path = std::string());
+
+    /**
+    * Copies the committed scene (materials, primitives and both hierarchies) into a new scene with an arena of its own. Called
+    * from a thread pinned to a NUMA node (see run_on_node), the copy lands in that node's memory. Meshes, textures and the
+    * environment map aren't copied but shared, so this scene has to outlive the replica.
+    */
+    std::unique_ptr<scene> replicate();
+
+    //Picks how commit() builds the BVH, SAH by default. A cache is only loaded if it holds a tree from the same builder.
+    inline void set_builder(bvh_builder b) { builder = b; }
+
+    //Hash of everything added so far and the BVH builder, a scene cache is only used if it was written for the same hash.
+    uint64_t source_hash() const;
+
+    //True if commit() found a valid scene cache and used it.
+    inline bool loaded_from_cache() const { return cache_view != nullptr; }
+
+    //Total number of primitives in the scene.
+    inline size_t size() const { return spheres.count + triangles.count + tori.count + planes.count + sdfs.count; }
+
+    //Bytes used by the acceleration structure.
+    inline size_t accel_bytes() const { return accel.memory_bytes(); }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const override;
+    virtual void hit_batch(const ray* rays, size_t count, double t_min, double t_max, hit_record* recs, material* mats, bool* hit) const override;
+    virtual bool bounding_box(aabb& box) const override;
+    virtual const light_bvh* lights() const override { return emitters.size() ? &emitters : nullptr; }
+    virtual const environment_map* environment() const override { return env.get(); }
+};
+
+void scene::add_cube(const cube& c)
+{
+    uint32_t m = add_material(c.mat);
+    for (int i = 0; i < 12; i++)
+    {
+        vec3 v[3] = { c.vertices[c.indices[3 * i]], c.vertices[c.indices[3 * i + 1]], c.vertices[c.indices[3 * i + 2]] };
+
+        //Each face is mapped to the unit square by projecting onto the face's own axes, so both triangles of a face line up
+        vec3 n = unit_vector(cross(v[1] - v[0], v[2] - v[0]));
+        vec3 tu = unit_vector(cross(fabs(n.y()) < 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0), n));
+        vec3 tv = cross(n, tu);
+        double uv[6];
+        for (int k = 0; k < 3; k++)
+        {
+            uv[2 * k] = 0.5 * (dot(v[k], tu) + 1);
+            uv[2 * k + 1] = 0.5 * (dot(v[k], tv) + 1);
+        }
+        add_triangle(v[0], v[1], v[2], uv[0], uv[1], uv[2], uv[3], uv[4], uv[5], m);
+    }
+}
+
+void scene::add_sdf(const sdf_shape& shape, const vec3& origin, uint32_t mat)
+{
+    uint32_t offset = uint32_t(staged_sdf_nodes.size());
+    for (size_t i = 0; i < shape.nodes().size(); i++)
+    {
+        staged_sdf_nodes.push_back(shape.nodes()[i]);
+        sdf_offset_children(staged_sdf_nodes.back(), offset);
+    }
+    staged_sdfs.push_back({ shape.root() + offset, origin, mat });
+}
+
+void scene::commit(const std::string& cache_path)
+{
+    trace_scope scope("scene commit", "setup");
+    mem_scope tagged(mem_tag::scene);
+    bool loaded = false;
+    uint64_t hash = 0;
+    if (!cache_path.empty())
+    {
+        hash = source_hash();
+        scene_cache_reader reader;
+        if (reader.open(cache_path, hash))
+        {
+            trace_scope load_scope("scene cache load", "setup");
+            loaded = true;
+            visit_arrays([&](auto*& data, size_t& count) { loaded = loaded && reader.next(data, count); });
+            if (loaded && reader.done())
+            {
+                cache_view = reader.release();
+                //Texture pointers are only good in the process that made them, the staged table is the same one anyway
+                for (size_t i = 0; i < staged_materials.size(); i++)
+                {
+                    if (staged_materials[i].has_textures())
+                    {
+                        materials = mem.allocate_array<material>(num_materials);
+                        for (size_t j = 0; j < num_materials; j++)
+                            materials[j] = staged_materials[j];
+                        break;
+                    }
+                }
+            }
+            else
+                loaded = false;
+        }
+    }
+
+    //A cache that failed part way may have set some of the arrays, building sets every one of them again
+    if (!loaded)
+    {
+        build();
+        if (!cache_path.empty())
+        {
+            trace_scope write_scope("scene cache write", "setup");
+            scene_cache_writer writer;
+            visit_arrays([&](auto*& data, size_t& count) { writer.add(data, count); });
+            if (!writer.write(cache_path, hash))
+                std::cerr << "couldn't write scene cache '" << cache_path << "'\n";
+        }
+    }
+
+    //Staging is no longer needed, give its memory back
+    std::vector<material>().swap(staged_materials);
+    std::vector<sphere_in>().swap(staged_spheres);
+    std::vector<triangle_in>().swap(staged_triangles);
+    std::vector<torus_in>().swap(staged_tori);
+    std::vector<plane_in>().swap(staged_planes);
+    std::vector<sdf_in>().swap(staged_sdfs);
+    std::vector<sdf_node>().swap(staged_sdf_nodes);
+}
+
+std::unique_ptr<scene> scene::replicate()
+{
+    trace_scope scope("scene replicate", "setup");
+    mem_scope tagged(mem_tag::scene);
+    std::unique_ptr<scene> copy(new scene());
+    copy->meshes = meshes;
+    copy->env = env;
+    copy->builder = builder;
+
+    //Both scenes visit their arrays in the same order, so the n-th array of one is the n-th of the other
+    std::vector<std::pair<const void*, size_t>> arrays;
+    visit_arrays([&](auto*& data, size_t& count) { arrays.push_back({ data, count }); });
+    size_t next = 0;
+    copy->visit_arrays([&](auto*& data, size_t& count)
+    {
+        typedef typename std::remove_const<typename std::remove_pointer<typename std::remove_reference<decltype(data)>::type>::type>::type T;
+        count = arrays[next].second;
+        T* dst = (count == 0) ? nullptr : static_cast<T*>(copy->mem.allocate(count * sizeof(T), alignof(T) < 64 ? 64 : alignof(T)));
+        if (count > 0)
+            memcpy(dst, arrays[next].first, count * sizeof(T));
+        data = dst;
+        next++;
+    });
+    return copy;
+}
+
+uint64_t scene::source_hash() const
+{
+    content_hash h;
+    h.add(uint32_t(builder));
+    h.add(uint64_t(staged_materials.size()));
+    for (size_t i = 0; i < staged_materials.size(); i++)
+        staged_materials[i].hash_fields(h);
+    h.add(uint64_t(staged_spheres.size()));
+    for (size_t i = 0; i < staged_spheres.size(); i++)
+    {
+        const sphere_in& s = staged_spheres[i];
+        h.add(s.c); h.add(s.r); h.add(s.mat);
+    }
+    h.add(uint64_t(staged_triangles.size()));
+    for (size_t i = 0; i < staged_triangles.size(); i++)
+    {
+        const triangle_in& t = staged_triangles[i];
+        h.add(t.a); h.add(t.b); h.add(t.c); h.add(t.uv); h.add(t.mat);
+    }
+    h.add(uint64_t(staged_tori.size()));
+    for (size_t i = 0; i < staged_tori.size(); i++)
+    {
+        const torus_in& t = staged_tori[i];
+        h.add(t.c); h.add(t.n); h.add(t.r_disk); h.add(t.r_tube); h.add(t.mat);
+    }
+    h.add(uint64_t(staged_planes.size()));
+    for (size_t i = 0; i < staged_planes.size(); i++)
+    {
+        const plane_in& p = staged_planes[i];
+        h.add(p.n); h.add(p.p); h.add(p.mat);
+    }
+    h.add(uint64_t(staged_sdf_nodes.size()));
+    for (size_t i = 0; i < staged_sdf_nodes.size(); i++)
+    {
+        const sdf_node& n = staged_sdf_nodes[i];
+        h.add(uint32_t(n.op)); h.add(n.a); h.add(n.b); h.add(n.p);
+    }
+    h.add(uint64_t(staged_sdfs.size()));
+    for (size_t i = 0; i < staged_sdfs.size(); i++)
+    {
+        const sdf_in& d = staged_sdfs[i];
+        h.add(d.root); h.add(d.origin); h.add(d.mat);
+    }
+    return h.value();
+}
+
+template <class F>
+void scene::visit_arrays(F&& f)
+{
+    f(materials, num_materials);
+
+    f(spheres.cx, spheres.count); f(spheres.cy, spheres.count); f(spheres.cz, spheres.count);
+    f(spheres.radius, spheres.count);
+    f(spheres.mat, spheres.count);
+    f(spheres.light, spheres.count);
+
+    f(triangles.ax, triangles.count); f(triangles.ay, triangles.count); f(triangles.az, triangles.count);
+    f(triangles.bx, triangles.count); f(triangles.by, triangles.count); f(triangles.bz, triangles.count);
+    f(triangles.cx, triangles.count); f(triangles.cy, triangles.count); f(triangles.cz, triangles.count);
+    f(triangles.nx, triangles.count); f(triangles.ny, triangles.count); f(triangles.nz, triangles.count);
+    f(triangles.u0, triangles.count); f(triangles.v0, triangles.count);
+    f(triangles.u1, triangles.count); f(triangles.v1, triangles.count);
+    f(triangles.u2, triangles.count); f(triangles.v2, triangles.count);
+    f(triangles.mat, triangles.count);
+    f(triangles.light, triangles.count);
+
+    f(tori.cx, tori.count); f(tori.cy, tori.count); f(tori.cz, tori.count);
+    f(tori.nx, tori.count); f(tori.ny, tori.count); f(tori.nz, tori.count);
+    f(tori.r_disk, tori.count);
+    f(tori.r_tube, tori.count);
+    f(tori.mat, tori.count);
+
+    f(planes.nx, planes.count); f(planes.ny, planes.count); f(planes.nz, planes.count);
+    f(planes.px, planes.count); f(planes.py, planes.count); f(planes.pz, planes.count);
+    f(planes.mat, planes.count);
+
+    f(sdf_nodes, num_sdf_nodes);
+    f(sdfs.root, sdfs.count);
+    f(sdfs.ox, sdfs.count); f(sdfs.oy, sdfs.count); f(sdfs.oz, sdfs.count);
+    f(sdfs.lo_x, sdfs.count); f(sdfs.lo_y, sdfs.count); f(sdfs.lo_z, sdfs.count);
+    f(sdfs.hi_x, sdfs.count); f(sdfs.hi_y, sdfs.count); f(sdfs.hi_z, sdfs.count);
+    f(sdfs.lipschitz, sdfs.count);
+    f(sdfs.mat, sdfs.count);
+
+    f(accel.nodes, accel.num_nodes);
+    f(accel.prims, accel.num_prims);
+
+    emitters.visit_arrays(f);
+}
+
+void scene::build()
+{
+    num_materials = staged_materials.size();
+    materials = mem.allocate_array<material>(num_materials);
+    for (size_t i = 0; i < num_materials; i++)
+        materials[i] = staged_materials[i];
+
+    size_t n = staged_spheres.size();
+    spheres.count = n;
+    spheres.cx = mem.allocate_array<double>(n); spheres.cy = mem.allocate_array<double>(n); spheres.cz = mem.allocate_array<double>(n);
+    spheres.radius = mem.allocate_array<double>(n);
+    spheres.mat = mem.allocate_array<uint32_t>(n);
+    spheres.light = mem.allocate_array<uint32_t>(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const sphere_in& s = staged_spheres[i];
+        spheres.cx[i] = s.c.x(); spheres.cy[i] = s.c.y(); spheres.cz[i] = s.c.z();
+        spheres.radius[i] = s.r;
+        spheres.mat[i] = s.mat;
+        spheres.light[i] = UINT32_MAX;
+    }
+
+    n = staged_triangles.size();
+    triangles.count = n;
+    triangles.ax = mem.allocate_array<double>(n); triangles.ay = mem.allocate_array<double>(n); triangles.az = mem.allocate_array<double>(n);
+    triangles.bx = mem.allocate_array<double>(n); triangles.by = mem.allocate_array<double>(n); triangles.bz = mem.allocate_array<double>(n);
+    triangles.cx = mem.allocate_array<double>(n); triangles.cy = mem.allocate_array<double>(n); triangles.cz = mem.allocate_array<double>(n);
+    triangles.nx = mem.allocate_array<double>(n); triangles.ny = mem.allocate_array<double>(n); triangles.nz = mem.allocate_array<double>(n);
+    triangles.u0 = mem.allocate_array<double>(n); triangles.v0 = mem.allocate_array<double>(n);
+    triangles.u1 = mem.allocate_array<double>(n); triangles.v1 = mem.allocate_array<double>(n);
+    triangles.u2 = mem.allocate_array<double>(n); triangles.v2 = mem.allocate_array<double>(n);
+    triangles.mat = mem.allocate_array<uint32_t>(n);
+    triangles.light = mem.allocate_array<uint32_t>(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const triangle_in& t = staged_triangles[i];
+        vec3 normal = unit_vector(cross((t.b - t.a), (t.c - t.a)));
+        triangles.ax[i] = t.a.x(); triangles.ay[i] = t.a.y(); triangles.az[i] = t.a.z();
+        triangles.bx[i] = t.b.x(); triangles.by[i] = t.b.y(); triangles.bz[i] = t.b.z();
+        triangles.cx[i] = t.c.x(); triangles.cy[i] = t.c.y(); triangles.cz[i] = t.c.z();
+        triangles.nx[i] = normal.x(); triangles.ny[i] = normal.y(); triangles.nz[i] = normal.z();
+        triangles.u0[i] = t.uv[0]; triangles.v0[i] = t.uv[1];
+        triangles.u1[i] = t.uv[2]; triangles.v1[i] = t.uv[3];
+        triangles.u2[i] = t.uv[4]; triangles.v2[i] = t.uv[5];
+        triangles.mat[i] = t.mat;
+        triangles.light[i] = UINT32_MAX;
+    }
+
+    n = staged_tori.size();
+    tori.count = n;
+    tori.cx = mem.allocate_array<double>(n); tori.cy = mem.allocate_array<double>(n); tori.cz = mem.allocate_array<double>(n);
+    tori.nx = mem.allocate_array<double>(n); tori.ny = mem.allocate_array<double>(n); tori.nz = mem.allocate_array<double>(n);
+    tori.r_disk = mem.allocate_array<double>(n);
+    tori.r_tube = mem.allocate_array<double>(n);
+    tori.mat = mem.allocate_array<uint32_t>(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const torus_in& t = staged_tori[i];
+        tori.cx[i] = t.c.x(); tori.cy[i] = t.c.y(); tori.cz[i] = t.c.z();
+        tori.nx[i] = t.n.x(); tori.ny[i] = t.n.y(); tori.nz[i] = t.n.z();
+        tori.r_disk[i] = t.r_disk;
+        tori.r_tube[i] = t.r_tube;
+        tori.mat[i] = t.mat;
+    }
+
+    n = staged_planes.size();
+    planes.count = n;
+    planes.nx = mem.allocate_array<double>(n); planes.ny = mem.allocate_array<double>(n); planes.nz = mem.allocate_array<double>(n);
+    planes.px = mem.allocate_array<double>(n); planes.py = mem.allocate_array<double>(n); planes.pz = mem.allocate_array<double>(n);
+    planes.mat = mem.allocate_array<uint32_t>(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const plane_in& p = staged_planes[i];
+        planes.nx[i] = p.n.x(); planes.ny[i] = p.n.y(); planes.nz[i] = p.n.z();
+        planes.px[i] = p.p.x(); planes.py[i] = p.p.y(); planes.pz[i] = p.p.z();
+        planes.mat[i] = p.mat;
+    }
+
+    num_sdf_nodes = staged_sdf_nodes.size();
+    sdf_nodes = mem.allocate_array<sdf_node>(num_sdf_nodes);
+    for (size_t i = 0; i < num_sdf_nodes; i++)
+        sdf_nodes[i] = staged_sdf_nodes[i];
+
+    n = staged_sdfs.size();
+    sdfs.count = n;
+    sdfs.root = mem.allocate_array<uint32_t>(n);
+    sdfs.ox = mem.allocate_array<double>(n); sdfs.oy = mem.allocate_array<double>(n); sdfs.oz = mem.allocate_array<double>(n);
+    sdfs.lo_x = mem.allocate_array<double>(n); sdfs.lo_y = mem.allocate_array<double>(n); sdfs.lo_z = mem.allocate_array<double>(n);
+    sdfs.hi_x = mem.allocate_array<double>(n); sdfs.hi_y = mem.allocate_array<double>(n); sdfs.hi_z = mem.allocate_array<double>(n);
+    sdfs.lipschitz = mem.allocate_array<double>(n);
+    sdfs.mat = mem.allocate_array<uint32_t>(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const sdf_in& d = staged_sdfs[i];
+        aabb b = sdf_bounds(sdf_nodes, d.root);
+        sdfs.root[i] = d.root;
+        sdfs.ox[i] = d.origin.x(); sdfs.oy[i] = d.origin.y(); sdfs.oz[i] = d.origin.z();
+        sdfs.lo_x[i] = b.min().x() + d.origin.x(); sdfs.lo_y[i] = b.min().y() + d.origin.y(); sdfs.lo_z[i] = b.min().z() + d.origin.z();
+        sdfs.hi_x[i] = b.max().x() + d.origin.x(); sdfs.hi_y[i] = b.max().y() + d.origin.y(); sdfs.hi_z[i] = b.max().z() + d.origin.z();
+        sdfs.lipschitz[i] = sdf_lipschitz(sdf_nodes, d.root);
+        sdfs.mat[i] = d.mat;
+    }
+
+    std::vector<prim_ref> refs;
+    std::vector<aabb> boxes;
+    refs.reserve(spheres.count + triangles.count + tori.count + sdfs.count);
+    boxes.reserve(refs.capacity());
+    for (size_t i = 0; i < spheres.count; i++)
+    {
+        vec3 c(spheres.cx[i], spheres.cy[i], spheres.cz[i]);
+        vec3 rad(spheres.radius[i], spheres.radius[i], spheres.radius[i]);
+        refs.push_back(make_prim_ref(uint32_t(prim_type::sphere), uint32_t(i)));
+        boxes.push_back(aabb(c - rad, c + rad));
+    }
+    for (size_t i = 0; i < triangles.count; i++)
+    {
+        vec3 lo(fmin(triangles.ax[i], fmin(triangles.bx[i], triangles.cx[i])),
+                fmin(triangles.ay[i], fmin(triangles.by[i], triangles.cy[i])),
+                fmin(triangles.az[i], fmin(triangles.bz[i], triangles.cz[i])));
+        vec3 hi(fmax(triangles.ax[i], fmax(triangles.bx[i], triangles.cx[i])),
+                fmax(triangles.ay[i], fmax(triangles.by[i], triangles.cy[i])),
+                fmax(triangles.az[i], fmax(triangles.bz[i], triangles.cz[i])));
+        refs.push_back(make_prim_ref(uint32_t(prim_type::triangle), uint32_t(i)));
+        boxes.push_back(aabb(lo, hi));
+    }
+    for (size_t i = 0; i < tori.count; i++)
+    {
+        refs.push_back(make_prim_ref(uint32_t(prim_type::torus), uint32_t(i)));
+        boxes.push_back(torus_bounds(vec3(tori.cx[i], tori.cy[i], tori.cz[i]), vec3(tori.nx[i], tori.ny[i], tori.nz[i]), tori.r_disk[i], tori.r_tube[i]));
+    }
+    for (size_t i = 0; i < sdfs.count; i++)
+    {
+        refs.push_back(make_prim_ref(uint32_t(prim_type::sdf), uint32_t(i)));
+        boxes.push_back(aabb(vec3(sdfs.lo_x[i], sdfs.lo_y[i], sdfs.lo_z[i]), vec3(sdfs.hi_x[i], sdfs.hi_y[i], sdfs.hi_z[i])));
+    }
+    {
+        trace_scope scope("bvh build", "setup", "primitives", int64_t(refs.size()));
+        mem_scope tagged(mem_tag::accel);
+        accel.build(refs, boxes, mem, builder);
+    }
+
+    //Emissive spheres and triangles become lights
+    std::vector<light_info> lights;
+    for (size_t i = 0; i < spheres.count; i++)
+    {
+        const material& m = materials[spheres.mat[i]];
+        if (!m.is_emissive())
+            continue;
+        light_info l = {};
+        l.shape = light_shape::sphere;
+        l.a = vec3(spheres.cx[i], spheres.cy[i], spheres.cz[i]);
+        l.radius = spheres.radius[i];
+        l.area = 4 * M_PI * l.radius * l.radius;
+        l.radiance = m.emission_radiance();
+        if (light_bvh::bounds_of(l).phi <= 0)
+            continue;
+        spheres.light[i] = uint32_t(lights.size());
+        lights.push_back(l);
+    }
+    for (size_t i = 0; i < triangles.count; i++)
+    {
+        const material& m = materials[triangles.mat[i]];
+        if (!m.is_emissive())
+            continue;
+        light_info l = {};
+        l.shape = light_shape::triangle;
+        l.a = vec3(triangles.ax[i], triangles.ay[i], triangles.az[i]);
+        l.b = vec3(triangles.bx[i], triangles.by[i], triangles.bz[i]);
+        l.c = vec3(triangles.cx[i], triangles.cy[i], triangles.cz[i]);
+        l.n = vec3(triangles.nx[i], triangles.ny[i], triangles.nz[i]);
+        l.area = 0.5 * cross(l.b - l.a, l.c - l.a).length();
+        l.radiance = m.emission_radiance();
+        if (light_bvh::bounds_of(l).phi <= 0)
+            continue;
+        triangles.light[i] = uint32_t(lights.size());
+        lights.push_back(l);
+    }
+    trace_scope scope("light bvh build", "setup", "lights", int64_t(lights.size()));
+    mem_scope tagged(mem_tag::accel);
+    emitters.build(lights);
+}
+
+/**
+* Finds the nearest plane or BVH primitive the ray intersects, planes are tested in a tight loop of their own and everything else
+* through the BVH. Meshes are left to the caller.
+* @param c - the closest hit so far, its t bounds the search and is replaced by any closer hit.
+*/
+void scene::hit_local(const ray& r, double t_min, closest_hit& c, hit_record& rec) const
+{
+    for (size_t i = 0; i < planes.count; i++)
+    {
+        if (hit_plane(vec3(planes.nx[i], planes.ny[i], planes.nz[i]), vec3(planes.px[i], planes.py[i], planes.pz[i]),
+                      r, t_min, c.t, rec))
+        {
+            c.t = rec.t;
+            c.mat = planes.mat[i];
+            c.type = prim_type::plane;
+            c.index = i;
+        }
+    }
+
+    accel.traverse(r, t_min, c.t, [&](prim_ref p, double& t_far)
+    {
+        size_t i = prim_ref_index(p);
+        prim_type type = prim_type(prim_ref_type(p));
+        bool hit = false;
+        switch (type)
+        {
+        case prim_type::sphere:
+            hit = hit_sphere(vec3(spheres.cx[i], spheres.cy[i], spheres.cz[i]), spheres.radius[i], r, t_min, t_far, rec);
+            break;
+        case prim_type::triangle:
+            hit = hit_triangle(vec3(triangles.ax[i], triangles.ay[i], triangles.az[i]),
+                               vec3(triangles.bx[i], triangles.by[i], triangles.bz[i]),
+                               vec3(triangles.cx[i], triangles.cy[i], triangles.cz[i]),
+                               vec3(triangles.nx[i], triangles.ny[i], triangles.nz[i]), r, t_min, t_far, rec);
+            break;
+        case prim_type::torus:
+            hit = hit_torus(vec3(tori.cx[i], tori.cy[i], tori.cz[i]), vec3(tori.nx[i], tori.ny[i], tori.nz[i]),
+                            tori.r_disk[i], tori.r_tube[i], r, t_min, t_far, rec);
+            break;
+        case prim_type::sdf:
+            hit = hit_sdf(sdf_nodes, sdfs.root[i], vec3(sdfs.ox[i], sdfs.oy[i], sdfs.oz[i]),
+                          aabb(vec3(sdfs.lo_x[i], sdfs.lo_y[i], sdfs.lo_z[i]), vec3(sdfs.hi_x[i], sdfs.hi_y[i], sdfs.hi_z[i])),
+                          sdfs.lipschitz[i], r, t_min, t_far, rec);
+            break;
+        case prim_type::plane:
+        case prim_type::mesh:
+            break;
+        }
+        if (!hit)
+            return false;
+
+        t_far = rec.t;
+        //Whatever is traced after the BVH (the meshes) only needs to beat this hit
+        c.t = rec.t;
+        c.mat = (type == prim_type::sphere) ? spheres.mat[i] : (type == prim_type::triangle) ? triangles.mat[i]
+                : (type == prim_type::torus) ? tori.mat[i] : sdfs.mat[i];
+        c.type = type;
+        c.index = i;
+        return true;
+    });
+}
+
+bool scene::resolve_hit(const ray& r, const closest_hit& c, hit_record& rec, material& closest_mat) const
+{
+    if (c.mat == UINT32_MAX)
+        return false;
+
+    surface_params(r, c.type, c.index, rec);
+    rec.light = (c.type == prim_type::sphere) ? spheres.light[c.index]
+              : (c.type == prim_type::triangle) ? triangles.light[c.index] : UINT32_MAX;
+    closest_mat = materials[c.mat];
+    return true;
+}
+
+bool scene::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
+{
+    closest_hit c = { t_max, UINT32_MAX, prim_type::sphere, 0 };
+    hit_local(r, t_min, c, rec);
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        if (meshes[i].mesh->hit(r, t_min, c.t, rec))
+            c = { rec.t, meshes[i].mat, prim_type::mesh, i };
+    }
+    return resolve_hit(r, c, rec, closest_mat);
+}
+
+/**
+* Traces the rays through the planes and BVH one at a time, then through each mesh as a batch so every cluster the rays reach is
+* paged in once for all of them.
+*/
+void scene::hit_batch(const ray* rays, size_t count, double t_min, double t_max, hit_record* recs, material* mats, bool* hit) const
+{
+    if (meshes.empty())
+    {
+        hitable::hit_batch(rays, count, t_min, t_max, recs, mats, hit);
+        return;
+    }
+
+    closest_hit c[max_batch];
+    double bound[max_batch];
+    bool mesh_hit[max_batch];
+    for (size_t k = 0; k < count; k++)
+    {
+        c[k] = { t_max, UINT32_MAX, prim_type::sphere, 0 };
+        hit_local(rays[k], t_min, c[k], recs[k]);
+        bound[k] = c[k].t;
+    }
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        meshes[i].mesh->intersect(rays, count, t_min, bound, recs, mesh_hit);
+        for (size_t k = 0; k < count; k++)
+            if (mesh_hit[k])
+                c[k] = { recs[k].t, meshes[i].mat, prim_type::mesh, i };
+    }
+    for (size_t k = 0; k < count; k++)
+        hit[k] = resolve_hit(rays[k], c[k], recs[k], mats[k]);
+}
+
+void scene::surface_params(const ray& r, prim_type type, size_t i, hit_record& rec) const
+{
+    //Area of a unit square of texture space on the surface, converts the world footprint to texture coords
+    double uv_area = 1;
+    vec3 local;
+
+    switch (type)
+    {
+    case prim_type::sphere:
+    {
+        vec3 n = (rec.p - vec3(spheres.cx[i], spheres.cy[i], spheres.cz[i])) / spheres.radius[i];
+        double theta = acos(fmin(fmax(-n.y(), -1.0), 1.0));
+        rec.u = (atan2(-n.z(), n.x()) + M_PI) / (2 * M_PI);
+        rec.v = theta / M_PI;
+        uv_area = 2 * M_PI * M_PI * spheres.radius[i] * spheres.radius[i] * fmax(sin(theta), 0.05);
+        break;
+    }
+    case prim_type::triangle:
+    {
+        vec3 a(triangles.ax[i], triangles.ay[i], triangles.az[i]);
+        vec3 b(triangles.bx[i], triangles.by[i], triangles.bz[i]);
+        vec3 c(triangles.cx[i], triangles.cy[i], triangles.cz[i]);
+        double area = cross(b - a, c - a).length();
+        double alpha = cross(b - rec.p, c - rec.p).length() / area;
+        double beta = cross(c - rec.p, a - rec.p).length() / area;
+        double gamma = 1 - alpha - beta;
+        rec.u = alpha * triangles.u0[i] + beta * triangles.u1[i] + gamma * triangles.u2[i];
+        rec.v = alpha * triangles.v0[i] + beta * triangles.v1[i] + gamma * triangles.v2[i];
+        double uv_tri = fabs((triangles.u1[i] - triangles.u0[i]) * (triangles.v2[i] - triangles.v0[i])
+                           - (triangles.u2[i] - triangles.u0[i]) * (triangles.v1[i] - triangles.v0[i]));
+        uv_area = (uv_tri > 0) ? area / uv_tri : 1;
+        break;
+    }
+    case prim_type::torus:
+    {
+        vec3 c(tori.cx[i], tori.cy[i], tori.cz[i]), n(tori.nx[i], tori.ny[i], tori.nz[i]);
+        local = rec.p - c;
+        double h = dot(local, n);
+        vec3 radial = local - h * n;
+        vec3 t1 = unit_vector(cross(fabs(n.x()) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0), n));
+        rec.u = (atan2(dot(radial, cross(n, t1)), dot(radial, t1)) + M_PI) / (2 * M_PI);
+        rec.v = (atan2(h, radial.length() - tori.r_disk[i]) + M_PI) / (2 * M_PI);
+        uv_area = 4 * M_PI * M_PI * tori.r_disk[i] * tori.r_tube[i];
+        break;
+    }
+    case prim_type::mesh:
+    case prim_type::sdf:
+        //Out-of-core meshes and SDF shapes carry no texture coordinates
+        rec.u = rec.v = 0;
+        break;
+    case prim_type::plane:
+    {
+        //One texture repeat per world unit
+        vec3 n(planes.nx[i], planes.ny[i], planes.nz[i]);
+        vec3 t1 = unit_vector(cross(fabs(n.x()) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0), n));
+        local = rec.p - vec3(planes.px[i], planes.py[i], planes.pz[i]);
+        rec.u = dot(local, t1);
+        rec.v = dot(local, cross(n, t1));
+        break;
+    }
+    }
+
+    //Width of the ray cone at the hit, stretched by how obliquely it meets the surface
+    double dist = rec.t * r.direction().length();
+    double cos_theta = fabs(dot(unit_vector(r.direction()), rec.normal));
+    rec.width = (r.cone_width + dist * r.cone_angle) / fmax(cos_theta, 0.1);
+    rec.uv_width = rec.width / sqrt(uv_area);
+}
+
+bool scene::bounding_box(aabb& box) const
+{
+    //Infinite planes can't be bound
+    if (planes.count > 0 || (size() == 0 && meshes.empty()))
+        return false;
+
+    bool first = true;
+    aabb temp_box;
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        if (!meshes[i].mesh->bounding_box(temp_box))
+            continue;
+        box = first ? temp_box : enclose_boxes(box, temp_box);
+        first = false;
+    }
+    for (size_t i = 0; i < spheres.count; i++)
+    {
+        vec3 c(spheres.cx[i], spheres.cy[i], spheres.cz[i]);
+        vec3 r(spheres.radius[i], spheres.radius[i], spheres.radius[i]);
+        temp_box = aabb(c - r, c + r);
+        box = first ? temp_box : enclose_boxes(box, temp_box);
+        first = false;
+    }
+    for (size_t i = 0; i < triangles.count; i++)
+    {
+        vec3 lo(fmin(triangles.ax[i], fmin(triangles.bx[i], triangles.cx[i])),
+                fmin(triangles.ay[i], fmin(triangles.by[i], triangles.cy[i])),
+                fmin(triangles.az[i], fmin(triangles.bz[i], triangles.cz[i])));
+        vec3 hi(fmax(triangles.ax[i], fmax(triangles.bx[i], triangles.cx[i])),
+                fmax(triangles.ay[i], fmax(triangles.by[i], triangles.cy[i])),
+                fmax(triangles.az[i], fmax(triangles.bz[i], triangles.cz[i])));
+        temp_box = aabb(lo, hi);
+        box = first ? temp_box : enclose_boxes(box, temp_box);
+        first = false;
+    }
+    for (size_t i = 0; i < tori.count; i++)
+    {
+        temp_box = torus_bounds(vec3(tori.cx[i], tori.cy[i], tori.cz[i]), vec3(tori.nx[i], tori.ny[i], tori.nz[i]), tori.r_disk[i], tori.r_tube[i]);
+        box = first ? temp_box : enclose_boxes(box, temp_box);
+        first = false;
+    }
+    for (size_t i = 0; i < sdfs.count; i++)
+    {
+        temp_box = aabb(vec3(sdfs.lo_x[i], sdfs.lo_y[i], sdfs.lo_z[i]), vec3(sdfs.hi_x[i], sdfs.hi_y[i], sdfs.hi_z[i]));
+        box = first ? temp_box : enclose_boxes(box, temp_box);
+        first = false;
+    }
+    return true;
+}
@@ -0,0 +1,258 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mapped_file.h"
+
+/**
+* 64 bit hash of a scene's source data, fed one field at a time. Only meant to notice that the data has changed, not to resist
+* anyone trying to collide it. Values must not contain padding, so structs are fed field by field.
+*/
+class content_hash
+{
+private:
+    uint64_t h = 0x243f6a8885a308d3ull;
+
+    inline void mix(uint64_t w)
+    {
+        h ^= w * 0x9e3779b97f4a7c15ull;
+        h = ((h << 29) | (h >> 35)) * 0xbf58476d1ce4e5b9ull;
+    }
+
+public:
+    void add_bytes(const void* data, size_t bytes);
+
+    template <class T>
+    inline void add(const T& v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be hashed by its bytes");
+        add_bytes(&v, sizeof(T));
+    }
+
+    inline uint64_t value() const
+    {
+        uint64_t x = h;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+void content_hash::add_bytes(const void* data, size_t bytes)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (; bytes >= 8; p += 8, bytes -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        mix(w);
+    }
+    if (bytes > 0)
+    {
+        uint64_t w = 0;
+        memcpy(&w, p, bytes);
+        mix(w ^ (uint64_t(bytes) << 56));
+    }
+}
+
+/**
+* Scene cache file (.gsc): the arrays of a committed scene exactly as they sit in memory, so a later run of the same scene can
+* map the file and trace straight out of it instead of packing and building everything again.
+*
+*     header
+*     array table: num_arrays scene_cache_array
+*     the arrays, each starting on a 64 byte boundary
+*
+* Everything is addressed by offset from the start of the file, so the mapping can land anywhere. The arrays are written and read
+* back in the same order by one visitor (see scene::visit_arrays), which is why the table only records their extent.
+*/
+struct scene_cache_header
+{
+    char magic[8];
+    uint32_t version;
+    //Written as 0x01020304, reads differently on a machine of the other byte order
+    uint32_t byte_order;
+    //content_hash of the source the scene was built from, a different hash means the cache is stale
+    uint64_t source_hash;
+    uint64_t file_bytes;
+    uint32_t num_arrays;
+    uint32_t reserved;
+};
+
+struct scene_cache_array
+{
+    uint64_t offset;
+    uint64_t count;
+    uint32_t elem_bytes;
+    uint32_t reserved;
+};
+
+//Bump whenever the layout of anything stored changes, or the builders produce something different from the same source.
+const uint32_t scene_cache_version = 2;
+const char scene_cache_magic[8] = { 'G', 'R', 'T', 'S', 'C', 'E', 'N', 'E' };
+
+//Collects the arrays of a scene and writes them out as a cache file.
+class scene_cache_writer
+{
+private:
+    struct source
+    {
+        const void* data;
+        scene_cache_array extent;
+    };
+
+    std::vector<source> arrays;
+
+public:
+    template <class T>
+    inline void add(const T* data, size_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be stored in the scene cache");
+        source s = { data, { 0, uint64_t(count), uint32_t(sizeof(T)), 0 } };
+        arrays.push_back(s);
+    }
+
+    /**
+    * Writes the file, replacing any at path only once the new one is complete.
+    * @return false if it couldn't be written.
+    */
+    bool write(const std::string& path, uint64_t source_hash);
+};
+
+bool scene_cache_writer::write(const std::string& path, uint64_t source_hash)
+{
+    scene_cache_header header = {};
+    memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+    header.version = scene_cache_version;
+    header.byte_order = 0x01020304u;
+    header.source_hash = source_hash;
+    header.num_arrays = uint32_t(arrays.size());
+
+    uint64_t offset = sizeof(scene_cache_header) + arrays.size() * sizeof(scene_cache_array);
+    for (size_t i = 0; i < arrays.size(); i++)
+    {
+        offset = (offset + 63) & ~uint64_t(63);
+        arrays[i].extent.offset = offset;
+        offset += arrays[i].extent.count * arrays[i].extent.elem_bytes;
+    }
+    header.file_bytes = offset;
+
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream os(temp, std::ios::binary | std::ios::trunc);
+        if (!os)
+            return false;
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (size_t i = 0; i < arrays.size(); i++)
+            os.write(reinterpret_cast<const char*>(&arrays[i].extent), sizeof(scene_cache_array));
+        static const char zeros[64] = {};
+        uint64_t at = sizeof(scene_cache_header) + arrays.size() * sizeof(scene_cache_array);
+        for (size_t i = 0; i < arrays.size(); i++)
+        {
+            os.write(zeros, std::streamsize(arrays[i].extent.offset - at));
+            uint64_t bytes = arrays[i].extent.count * arrays[i].extent.elem_bytes;
+            if (bytes > 0)
+                os.write(static_cast<const char*>(arrays[i].data), std::streamsize(bytes));
+            at = arrays[i].extent.offset + bytes;
+        }
+        if (!os)
+        {
+            os.close();
+            std::remove(temp.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    //rename won't replace an existing file here
+    std::remove(path.c_str());
+#endif
+    if (std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+* Maps a cache file and hands out its arrays in place, in the order they were written.
+*/
+class scene_cache_reader
+{
+private:
+    std::unique_ptr<mapped_region> view;
+    const scene_cache_array* table = nullptr;
+    uint32_t num_arrays = 0;
+    uint32_t next_array = 0;
+
+public:
+    /**
+    * Maps the file and checks it's a complete cache of this version, built from the source with the given hash.
+    * @return false if it's missing, stale or damaged, the scene then has to be built.
+    */
+    bool open(const std::string& path, uint64_t source_hash);
+
+    /**
+    * Points data at the next array in the mapping and sets count to its length (data is null for an empty array).
+    * @return false if the next array doesn't hold elements of T.
+    */
+    template <class T>
+    inline bool next(T*& data, size_t& count)
+    {
+        if (next_array >= num_arrays || table[next_array].elem_bytes != sizeof(T))
+            return false;
+        const scene_cache_array& a = table[next_array++];
+        count = size_t(a.count);
+        //The mapping is read-only, which is fine as nothing writes to a scene once it's committed
+        data = (count == 0) ? nullptr : reinterpret_cast<T*>(const_cast<uint8_t*>(view->data() + a.offset));
+        return true;
+    }
+
+    //True once every array in the file has been handed out.
+    inline bool done() const { return next_array == num_arrays; }
+
+    //Hands over the mapping, which has to stay alive as long as anything points into it.
+    inline std::unique_ptr<mapped_region> release() { return std::move(view); }
+};
+
+bool scene_cache_reader::open(const std::string& path, uint64_t source_hash)
+{
+    mapped_file file(path);
+    if (!file.valid() || file.size() < sizeof(scene_cache_header))
+        return false;
+    view = file.map(0, size_t(file.size()));
+    if (view == nullptr)
+        return false;
+
+    const scene_cache_header* header = reinterpret_cast<const scene_cache_header*>(view->data());
+    if (memcmp(header->magic, scene_cache_magic, sizeof(header->magic)) != 0 || header->version != scene_cache_version
+        || header->byte_order != 0x01020304u || header->source_hash != source_hash || header->file_bytes != file.size()
+        || header->num_arrays > (file.size() - sizeof(scene_cache_header)) / sizeof(scene_cache_array))
+    {
+        view.reset();
+        return false;
+    }
+
+    table = reinterpret_cast<const scene_cache_array*>(view->data() + sizeof(scene_cache_header));
+    num_arrays = header->num_arrays;
+    for (uint32_t i = 0; i < num_arrays; i++)
+    {
+        const scene_cache_array& a = table[i];
+        if (a.offset % 64 != 0 || a.offset > file.size() || a.elem_bytes == 0
+            || a.count > (file.size() - a.offset) / a.elem_bytes)
+        {
+            view.reset();
+            return false;
+        }
+    }
+    next_array = 0;
+    //Start reading everything in the background, traversal will touch most of it straight away
+    view->prefetch();
+    return true;
+}
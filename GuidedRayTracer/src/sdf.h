@@ -0,0 +1,733 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#include "hitable.h"
+
+/**
+* Sphere tracing of surfaces given by a distance function f (f < 0 inside, f > 0 outside, the surface where f = 0). Each
+* function declares a Lipschitz bound L, |f(p) - f(q)| <= L |p - q|, so f(p) / L is a distance that can always be stepped
+* without passing through the surface.
+*
+* Steps are over-relaxed (Keinert et al. 2014, "Enhanced Sphere Tracing"): each is stretched by sdf_relaxation, and if the
+* unbounding spheres of two steps stop overlapping the trace goes back and carries on with plain steps. Every trace is clipped to
+* the shape's bounding box and capped at sdf_max_steps, so no ray costs more than that many evaluations whatever the shape.
+*/
+const int sdf_max_steps = 256;
+//Distance at which a trace counts as having reached the surface
+const double sdf_hit_epsilon = 1e-4;
+const double sdf_relaxation = 1.6;
+
+//Counts of the work done by sphere_trace over the whole run, read by the regression harness.
+struct sdf_counters
+{
+    std::atomic<uint64_t> traces{ 0 };
+    std::atomic<uint64_t> steps{ 0 };
+    //Traces that ran out of steps before reaching the surface or leaving the bounds
+    std::atomic<uint64_t> exhausted{ 0 };
+};
+
+inline sdf_counters& sdf_stats()
+{
+    static sdf_counters counters;
+    return counters;
+}
+
+/**
+* Sphere traces a distance function, shared by every SDF primitive.
+* @param shape - provides distance(p) and normal(p) (unit, outward).
+* @param bounds - box containing the whole surface, the trace only covers the part of the ray inside it.
+* @param lipschitz - Lipschitz bound of shape.distance.
+* @return true if the ray reaches the surface within [t_min, t_max], in which case rec.t, rec.p and rec.normal are filled in.
+*/
+template <class D>
+bool sphere_trace(const D& shape, const aabb& bounds, double lipschitz, const ray& r, double t_min, double t_max, hit_record& rec)
+{
+    vec3 inv = r.inverse_direction();
+    for (int a = 0; a < 3; a++)
+    {
+        double t0 = (bounds.min()[a] - r.r0[a]) * inv[a];
+        double t1 = (bounds.max()[a] - r.r0[a]) * inv[a];
+        if (inv[a] < 0)
+            std::swap(t0, t1);
+        t_min = fmax(t_min, t0);
+        t_max = fmin(t_max, t1);
+    }
+    if (t_min > t_max)
+        return false;
+
+    //March by distance along the unit direction, s = t |d|
+    double len = r.direction().length();
+    vec3 u = r.direction() / len;
+    double s = t_min * len, s_end = t_max * len;
+    double inv_l = 1 / lipschitz;
+
+    //Rays leaving the surface they start on (scattered off it) trace whichever side of it they head into, and only start
+    //looking for a hit once they're clear of it
+    double f = shape.distance(r.r0 + s * u);
+    bool leaving = fabs(f) * inv_l < sdf_hit_epsilon;
+    double side = (leaving ? dot(shape.normal(r.r0 + s * u), u) < 0 : f < 0) ? -1 : 1;
+
+    double omega = sdf_relaxation, step = 0, prev_radius = 0;
+    int steps = 1;
+    bool hit = false;
+    for (;;)
+    {
+        double radius = side * f * inv_l;
+        if (leaving && radius < sdf_hit_epsilon)
+            step = sdf_hit_epsilon;
+        else if (omega > 1 && radius + prev_radius < step)
+        {
+            //The stretched step left a gap between the two spheres, take a plain step from the last point instead
+            s -= step;
+            step = prev_radius;
+            omega = 1;
+        }
+        else
+        {
+            leaving = false;
+            if (radius < sdf_hit_epsilon)
+            {
+                hit = true;
+                break;
+            }
+            step = omega * radius;
+            prev_radius = radius;
+        }
+        s += step;
+        //A stretched step past the end of the bounds may have jumped over the surface on the way out, step plainly instead
+        if (s > s_end && omega > 1)
+        {
+            s += prev_radius - step;
+            step = prev_radius;
+            omega = 1;
+        }
+        if (s > s_end || steps >= sdf_max_steps)
+            break;
+        f = shape.distance(r.r0 + s * u);
+        steps++;
+    }
+
+    sdf_counters& stats = sdf_stats();
+    stats.traces.fetch_add(1, std::memory_order_relaxed);
+    stats.steps.fetch_add(uint64_t(steps), std::memory_order_relaxed);
+    if (!hit && s <= s_end)
+        stats.exhausted.fetch_add(1, std::memory_order_relaxed);
+    if (!hit)
+        return false;
+
+    rec.t = s / len;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = shape.normal(rec.p);
+    return true;
+}
+
+//Operations a node of an SDF can perform, see sdf_node for their parameters.
+enum class sdf_op : uint32_t
+{
+    sphere,
+    box,
+    torus,
+    capsule,
+    unite,
+    intersect,
+    subtract,
+    smooth_unite,
+    translate,
+    rotate,
+    scale,
+    repeat,
+    round,
+    displace
+};
+
+/**
+* One node of a distance function, stored flat in an array and referring to its children (a, b) by index, so a whole shape is
+* plain data that can be copied, hashed and stored in the scene cache as is. Parameters by op:
+*
+*     sphere        p[0] radius
+*     box           p[0..2] half extents
+*     torus         p[0] r_disk (center to medial axis), p[1] r_tube, lying in the xz plane around the y axis
+*     capsule       p[0..2] and p[3..5] the ends of the segment, p[6] radius
+*     unite, intersect, subtract (a minus b)
+*     smooth_unite  p[0] blend radius k
+*     translate     p[0..2] offset of a
+*     rotate        p[0..8] rows of the matrix taking world to a's frame
+*     scale         p[0] uniform factor
+*     repeat        p[0..2] period and p[3..5] number of copies per axis of a, centered on the origin; p[6..8] the gap between a
+*                   and the walls of its cell
+*     round         p[0] radius added all around a
+*     displace      p[0] amplitude and p[1] frequency of sin(fx) sin(fy) sin(fz) added to a
+*/
+struct sdf_node
+{
+    sdf_op op;
+    uint32_t a, b;
+    uint32_t reserved;
+    double p[9];
+};
+
+//Adds offset to the indices of a node's children, for appending a shape's nodes to another array.
+inline void sdf_offset_children(sdf_node& n, uint32_t offset)
+{
+    if (n.op >= sdf_op::unite && n.op <= sdf_op::smooth_unite)
+        n.b += offset;
+    if (n.op >= sdf_op::unite)
+        n.a += offset;
+}
+
+/**
+* Distance from p to the surface of the function rooted at node i.
+*/
+double sdf_eval(const sdf_node* nodes, uint32_t i, const vec3& p);
+
+/**
+* Distance from p and its analytic gradient.
+* @return false if some node has no analytic gradient (displacement), the gradient then has to be estimated.
+*/
+bool sdf_eval_gradient(const sdf_node* nodes, uint32_t i, const vec3& p, double& d, vec3& gradient);
+
+//Lipschitz bound of the function rooted at node i.
+double sdf_lipschitz(const sdf_node* nodes, uint32_t i);
+
+//Box containing the whole surface of the function rooted at node i.
+aabb sdf_bounds(const sdf_node* nodes, uint32_t i);
+
+namespace sdf_detail
+{
+    inline double clampd(double x, double lo, double hi) { return fmin(fmax(x, lo), hi); }
+
+    //Index of the copy nearest to x along one axis of a repeat, and x relative to it.
+    inline double repeat_cell(double x, double period, double copies, double& cell)
+    {
+        if (copies <= 1)
+        {
+            cell = 0;
+            return x;
+        }
+        double half = 0.5 * (copies - 1);
+        cell = clampd(floor(x / period + half + 0.5), 0, copies - 1);
+        return x - period * (cell - half);
+    }
+}
+
+double sdf_eval(const sdf_node* nodes, uint32_t i, const vec3& p)
+{
+    using namespace sdf_detail;
+    const sdf_node& n = nodes[i];
+    switch (n.op)
+    {
+    case sdf_op::sphere:
+        return p.length() - n.p[0];
+    case sdf_op::box:
+    {
+        vec3 q(fabs(p.x()) - n.p[0], fabs(p.y()) - n.p[1], fabs(p.z()) - n.p[2]);
+        vec3 outside(fmax(q.x(), 0.0), fmax(q.y(), 0.0), fmax(q.z(), 0.0));
+        return outside.length() + fmin(fmax(q.x(), fmax(q.y(), q.z())), 0.0);
+    }
+    case sdf_op::torus:
+    {
+        double radial = sqrt(p.x() * p.x() + p.z() * p.z()) - n.p[0];
+        return sqrt(radial * radial + p.y() * p.y()) - n.p[1];
+    }
+    case sdf_op::capsule:
+    {
+        vec3 a(n.p[0], n.p[1], n.p[2]), ba = vec3(n.p[3], n.p[4], n.p[5]) - a, pa = p - a;
+        double h = clampd(dot(pa, ba) / dot(ba, ba), 0, 1);
+        return (pa - h * ba).length() - n.p[6];
+    }
+    case sdf_op::unite:
+        return fmin(sdf_eval(nodes, n.a, p), sdf_eval(nodes, n.b, p));
+    case sdf_op::intersect:
+        return fmax(sdf_eval(nodes, n.a, p), sdf_eval(nodes, n.b, p));
+    case sdf_op::subtract:
+        return fmax(sdf_eval(nodes, n.a, p), -sdf_eval(nodes, n.b, p));
+    case sdf_op::smooth_unite:
+    {
+        //Quadratic polynomial smooth minimum
+        double da = sdf_eval(nodes, n.a, p), db = sdf_eval(nodes, n.b, p), k = n.p[0];
+        double h = fmax(k - fabs(da - db), 0.0) / k;
+        return fmin(da, db) - 0.25 * h * h * k;
+    }
+    case sdf_op::translate:
+        return sdf_eval(nodes, n.a, p - vec3(n.p[0], n.p[1], n.p[2]));
+    case sdf_op::rotate:
+        return sdf_eval(nodes, n.a, vec3(n.p[0] * p.x() + n.p[1] * p.y() + n.p[2] * p.z(),
+                                         n.p[3] * p.x() + n.p[4] * p.y() + n.p[5] * p.z(),
+                                         n.p[6] * p.x() + n.p[7] * p.y() + n.p[8] * p.z()));
+    case sdf_op::scale:
+        return n.p[0] * sdf_eval(nodes, n.a, p / n.p[0]);
+    case sdf_op::repeat:
+    {
+        //Only the nearest copy is evaluated, the others are at least as far as the wall of its cell plus the gap behind it
+        vec3 q;
+        double bound = HUGE_VAL, cell;
+        for (int k = 0; k < 3; k++)
+        {
+            q[k] = repeat_cell(p[k], n.p[k], n.p[3 + k], cell);
+            if ((q[k] > 0) ? cell < n.p[3 + k] - 1 : cell > 0)
+                bound = fmin(bound, 0.5 * n.p[k] - fabs(q[k]) + n.p[6 + k]);
+        }
+        return fmin(sdf_eval(nodes, n.a, q), bound);
+    }
+    case sdf_op::round:
+        return sdf_eval(nodes, n.a, p) - n.p[0];
+    case sdf_op::displace:
+        return sdf_eval(nodes, n.a, p) + n.p[0] * sin(n.p[1] * p.x()) * sin(n.p[1] * p.y()) * sin(n.p[1] * p.z());
+    }
+    return HUGE_VAL;
+}
+
+bool sdf_eval_gradient(const sdf_node* nodes, uint32_t i, const vec3& p, double& d, vec3& gradient)
+{
+    using namespace sdf_detail;
+    const sdf_node& n = nodes[i];
+    switch (n.op)
+    {
+    case sdf_op::sphere:
+    {
+        double len = p.length();
+        d = len - n.p[0];
+        gradient = (len > 0) ? p / len : vec3(0, 1, 0);
+        return true;
+    }
+    case sdf_op::box:
+    {
+        vec3 q(fabs(p.x()) - n.p[0], fabs(p.y()) - n.p[1], fabs(p.z()) - n.p[2]);
+        vec3 outside(fmax(q.x(), 0.0), fmax(q.y(), 0.0), fmax(q.z(), 0.0));
+        double len = outside.length();
+        double inside = fmin(fmax(q.x(), fmax(q.y(), q.z())), 0.0);
+        d = len + inside;
+        if (len > 0)
+            gradient = outside / len;
+        else
+        {
+            int axis = (q.x() > q.y()) ? ((q.x() > q.z()) ? 0 : 2) : ((q.y() > q.z()) ? 1 : 2);
+            gradient = vec3(0, 0, 0);
+            gradient[axis] = 1;
+        }
+        for (int k = 0; k < 3; k++)
+            gradient[k] = copysign(gradient[k], p[k]);
+        return true;
+    }
+    case sdf_op::torus:
+    {
+        double rho = sqrt(p.x() * p.x() + p.z() * p.z());
+        vec3 m = (rho > 0) ? vec3(p.x(), 0, p.z()) * (n.p[0] / rho) : vec3(n.p[0], 0, 0);
+        vec3 pm = p - m;
+        double len = pm.length();
+        d = len - n.p[1];
+        gradient = (len > 0) ? pm / len : vec3(0, 1, 0);
+        return true;
+    }
+    case sdf_op::capsule:
+    {
+        vec3 a(n.p[0], n.p[1], n.p[2]), ba = vec3(n.p[3], n.p[4], n.p[5]) - a, pa = p - a;
+        vec3 off = pa - clampd(dot(pa, ba) / dot(ba, ba), 0, 1) * ba;
+        double len = off.length();
+        d = len - n.p[6];
+        gradient = (len > 0) ? off / len : vec3(0, 1, 0);
+        return true;
+    }
+    case sdf_op::unite:
+    case sdf_op::intersect:
+    case sdf_op::subtract:
+    case sdf_op::smooth_unite:
+    {
+        double da, db;
+        vec3 ga, gb;
+        if (!sdf_eval_gradient(nodes, n.a, p, da, ga) || !sdf_eval_gradient(nodes, n.b, p, db, gb))
+            return false;
+        if (n.op == sdf_op::subtract)
+        {
+            db = -db;
+            gb = -gb;
+        }
+        if (n.op == sdf_op::smooth_unite)
+        {
+            //Blend of the two gradients, weighted by how far the smooth minimum leans towards each side
+            double k = n.p[0];
+            double h = fmax(k - fabs(da - db), 0.0) / k;
+            double wb = (da < db) ? 0.5 * h : 1 - 0.5 * h;
+            d = fmin(da, db) - 0.25 * h * h * k;
+            gradient = (1 - wb) * ga + wb * gb;
+            return true;
+        }
+        bool take_a = (n.op == sdf_op::unite) ? da <= db : da >= db;
+        d = take_a ? da : db;
+        gradient = take_a ? ga : gb;
+        return true;
+    }
+    case sdf_op::translate:
+        return sdf_eval_gradient(nodes, n.a, p - vec3(n.p[0], n.p[1], n.p[2]), d, gradient);
+    case sdf_op::rotate:
+    {
+        vec3 g;
+        vec3 q(n.p[0] * p.x() + n.p[1] * p.y() + n.p[2] * p.z(),
+               n.p[3] * p.x() + n.p[4] * p.y() + n.p[5] * p.z(),
+               n.p[6] * p.x() + n.p[7] * p.y() + n.p[8] * p.z());
+        if (!sdf_eval_gradient(nodes, n.a, q, d, g))
+            return false;
+        //Back to world space by the transpose
+        gradient = vec3(n.p[0] * g.x() + n.p[3] * g.y() + n.p[6] * g.z(),
+                        n.p[1] * g.x() + n.p[4] * g.y() + n.p[7] * g.z(),
+                        n.p[2] * g.x() + n.p[5] * g.y() + n.p[8] * g.z());
+        return true;
+    }
+    case sdf_op::scale:
+        if (!sdf_eval_gradient(nodes, n.a, p / n.p[0], d, gradient))
+            return false;
+        d *= n.p[0];
+        return true;
+    case sdf_op::repeat:
+    {
+        vec3 q;
+        double bound = HUGE_VAL, cell;
+        int bound_axis = -1;
+        for (int k = 0; k < 3; k++)
+        {
+            q[k] = repeat_cell(p[k], n.p[k], n.p[3 + k], cell);
+            double wall = 0.5 * n.p[k] - fabs(q[k]) + n.p[6 + k];
+            if (((q[k] > 0) ? cell < n.p[3 + k] - 1 : cell > 0) && wall < bound)
+            {
+                bound = wall;
+                bound_axis = k;
+            }
+        }
+        if (!sdf_eval_gradient(nodes, n.a, q, d, gradient))
+            return false;
+        if (bound < d)
+        {
+            d = bound;
+            gradient = vec3(0, 0, 0);
+            gradient[bound_axis] = (q[bound_axis] > 0) ? -1 : 1;
+        }
+        return true;
+    }
+    case sdf_op::round:
+        if (!sdf_eval_gradient(nodes, n.a, p, d, gradient))
+            return false;
+        d -= n.p[0];
+        return true;
+    case sdf_op::displace:
+        return false;
+    }
+    return false;
+}
+
+double sdf_lipschitz(const sdf_node* nodes, uint32_t i)
+{
+    const sdf_node& n = nodes[i];
+    switch (n.op)
+    {
+    case sdf_op::sphere:
+    case sdf_op::box:
+    case sdf_op::torus:
+    case sdf_op::capsule:
+        return 1;
+    case sdf_op::unite:
+    case sdf_op::intersect:
+    case sdf_op::subtract:
+    case sdf_op::smooth_unite:
+        return fmax(sdf_lipschitz(nodes, n.a), sdf_lipschitz(nodes, n.b));
+    case sdf_op::translate:
+    case sdf_op::rotate:
+    case sdf_op::scale:
+    case sdf_op::round:
+    case sdf_op::repeat:
+        return sdf_lipschitz(nodes, n.a);
+    case sdf_op::displace:
+        //The gradient of the displacement is at most amplitude * frequency along each axis
+        return sdf_lipschitz(nodes, n.a) + fabs(n.p[0] * n.p[1]) * sqrt(3.0);
+    }
+    return 1;
+}
+
+aabb sdf_bounds(const sdf_node* nodes, uint32_t i)
+{
+    const sdf_node& n = nodes[i];
+    auto grown = [](const aabb& b, double r) { return aabb(b.min() - vec3(r, r, r), b.max() + vec3(r, r, r)); };
+    switch (n.op)
+    {
+    case sdf_op::sphere:
+        return aabb(-vec3(n.p[0], n.p[0], n.p[0]), vec3(n.p[0], n.p[0], n.p[0]));
+    case sdf_op::box:
+        return aabb(-vec3(n.p[0], n.p[1], n.p[2]), vec3(n.p[0], n.p[1], n.p[2]));
+    case sdf_op::torus:
+    {
+        double R = n.p[0] + n.p[1];
+        return aabb(vec3(-R, -n.p[1], -R), vec3(R, n.p[1], R));
+    }
+    case sdf_op::capsule:
+    {
+        vec3 a(n.p[0], n.p[1], n.p[2]), b(n.p[3], n.p[4], n.p[5]);
+        return grown(aabb(vec3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z())),
+                          vec3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()))), n.p[6]);
+    }
+    case sdf_op::unite:
+        return enclose_boxes(sdf_bounds(nodes, n.a), sdf_bounds(nodes, n.b));
+    case sdf_op::smooth_unite:
+        //The blend lowers the distance by at most k / 4, so the surface moves out at most that far
+        return grown(enclose_boxes(sdf_bounds(nodes, n.a), sdf_bounds(nodes, n.b)), 0.25 * n.p[0]);
+    case sdf_op::intersect:
+    {
+        aabb ba = sdf_bounds(nodes, n.a), bb = sdf_bounds(nodes, n.b);
+        vec3 lo(fmax(ba.min().x(), bb.min().x()), fmax(ba.min().y(), bb.min().y()), fmax(ba.min().z(), bb.min().z()));
+        vec3 hi(fmin(ba.max().x(), bb.max().x()), fmin(ba.max().y(), bb.max().y()), fmin(ba.max().z(), bb.max().z()));
+        for (int k = 0; k < 3; k++)
+            hi[k] = fmax(hi[k], lo[k]);
+        return aabb(lo, hi);
+    }
+    case sdf_op::subtract:
+        return sdf_bounds(nodes, n.a);
+    case sdf_op::translate:
+    {
+        aabb b = sdf_bounds(nodes, n.a);
+        vec3 t(n.p[0], n.p[1], n.p[2]);
+        return aabb(b.min() + t, b.max() + t);
+    }
+    case sdf_op::rotate:
+    {
+        //Enclose the corners of the child's box taken back to world space
+        aabb b = sdf_bounds(nodes, n.a);
+        vec3 lo(HUGE_VAL, HUGE_VAL, HUGE_VAL), hi = -lo;
+        for (int c = 0; c < 8; c++)
+        {
+            vec3 q((c & 1) ? b.max().x() : b.min().x(), (c & 2) ? b.max().y() : b.min().y(), (c & 4) ? b.max().z() : b.min().z());
+            for (int k = 0; k < 3; k++)
+            {
+                double w = n.p[k] * q.x() + n.p[3 + k] * q.y() + n.p[6 + k] * q.z();
+                lo[k] = fmin(lo[k], w);
+                hi[k] = fmax(hi[k], w);
+            }
+        }
+        return aabb(lo, hi);
+    }
+    case sdf_op::scale:
+    {
+        aabb b = sdf_bounds(nodes, n.a);
+        return aabb(b.min() * n.p[0], b.max() * n.p[0]);
+    }
+    case sdf_op::repeat:
+    {
+        aabb b = sdf_bounds(nodes, n.a);
+        vec3 reach(0.5 * n.p[0] * (n.p[3] - 1), 0.5 * n.p[1] * (n.p[4] - 1), 0.5 * n.p[2] * (n.p[5] - 1));
+        return aabb(b.min() - reach, b.max() + reach);
+    }
+    case sdf_op::round:
+        return grown(sdf_bounds(nodes, n.a), n.p[0]);
+    case sdf_op::displace:
+        return grown(sdf_bounds(nodes, n.a), fabs(n.p[0]));
+    }
+    return aabb(vec3(0, 0, 0), vec3(0, 0, 0));
+}
+
+/**
+* Gradient of the distance function rooted at root by central differences over a tetrahedron, four evaluations.
+*/
+inline vec3 sdf_tetrahedral_gradient(const sdf_node* nodes, uint32_t root, const vec3& p)
+{
+    const double h = 0.5 * sdf_hit_epsilon;
+    vec3 k0(1, -1, -1), k1(-1, -1, 1), k2(-1, 1, -1), k3(1, 1, 1);
+    return k0 * sdf_eval(nodes, root, p + h * k0) + k1 * sdf_eval(nodes, root, p + h * k1)
+         + k2 * sdf_eval(nodes, root, p + h * k2) + k3 * sdf_eval(nodes, root, p + h * k3);
+}
+
+/**
+* A distance function built up from primitives and operations. Shapes are values: combining two copies their nodes into the
+* result, so any shape can be reused as a part of several others.
+*/
+class sdf_shape
+{
+private:
+    std::vector<sdf_node> node_list;
+    uint32_t root_node = 0;
+
+    static sdf_shape leaf(sdf_op op, std::initializer_list<double> params);
+    sdf_shape unary(sdf_op op, std::initializer_list<double> params) const;
+    static sdf_shape binary(sdf_op op, const sdf_shape& a, const sdf_shape& b, double param);
+
+public:
+    inline const std::vector<sdf_node>& nodes() const { return node_list; }
+    inline uint32_t root() const { return root_node; }
+
+    inline double lipschitz() const { return sdf_lipschitz(node_list.data(), root_node); }
+    inline aabb bounds() const { return sdf_bounds(node_list.data(), root_node); }
+
+    //Primitives, centered on the origin.
+    static sdf_shape sphere(double radius) { return leaf(sdf_op::sphere, { radius }); }
+    static sdf_shape box(const vec3& half_extents) { return leaf(sdf_op::box, { half_extents.x(), half_extents.y(), half_extents.z() }); }
+    //Lies in the xz plane around the y axis, r_disk is dist from center to medial axis, r_tube from medial axis to surface.
+    static sdf_shape torus(double r_disk, double r_tube) { return leaf(sdf_op::torus, { r_disk, r_tube }); }
+    static sdf_shape capsule(const vec3& a, const vec3& b, double radius)
+    {
+        return leaf(sdf_op::capsule, { a.x(), a.y(), a.z(), b.x(), b.y(), b.z(), radius });
+    }
+
+    //Combinations.
+    friend inline sdf_shape unite(const sdf_shape& a, const sdf_shape& b) { return binary(sdf_op::unite, a, b, 0); }
+    friend inline sdf_shape intersect(const sdf_shape& a, const sdf_shape& b) { return binary(sdf_op::intersect, a, b, 0); }
+    //a with b carved out of it.
+    friend inline sdf_shape subtract(const sdf_shape& a, const sdf_shape& b) { return binary(sdf_op::subtract, a, b, 0); }
+    //Union with the crease filled in over a blend radius k.
+    friend inline sdf_shape smooth_unite(const sdf_shape& a, const sdf_shape& b, double k) { return binary(sdf_op::smooth_unite, a, b, k); }
+
+    //Transformations, all leave the Lipschitz bound as it was.
+    inline sdf_shape translated(const vec3& t) const { return unary(sdf_op::translate, { t.x(), t.y(), t.z() }); }
+    inline sdf_shape scaled(double s) const { return unary(sdf_op::scale, { s }); }
+    //Turns the shape so its y axis points along up (unit length).
+    sdf_shape oriented(const vec3& up) const;
+    //Rounds off every edge, growing the shape by radius.
+    inline sdf_shape rounded(double radius) const { return unary(sdf_op::round, { radius }); }
+
+    /**
+    * Copies of the shape on a grid centered on the origin.
+    * @param period - spacing of the copies along each axis, the shape should fit in a cell this size.
+    * @param nx/ny/nz - number of copies along each axis.
+    */
+    sdf_shape repeated(const vec3& period, int nx, int ny, int nz) const;
+
+    /**
+    * Ripples the surface by amplitude * sin(fx) sin(fy) sin(fz). Raises the Lipschitz bound (so the shape is traced in smaller
+    * steps) and has no analytic gradient, its normals are estimated.
+    */
+    inline sdf_shape displaced(double amplitude, double frequency) const { return unary(sdf_op::displace, { amplitude, frequency }); }
+};
+
+sdf_shape sdf_shape::leaf(sdf_op op, std::initializer_list<double> params)
+{
+    sdf_node n = {};
+    n.op = op;
+    std::copy(params.begin(), params.end(), n.p);
+    sdf_shape s;
+    s.node_list.push_back(n);
+    return s;
+}
+
+sdf_shape sdf_shape::unary(sdf_op op, std::initializer_list<double> params) const
+{
+    sdf_node n = {};
+    n.op = op;
+    n.a = root_node;
+    std::copy(params.begin(), params.end(), n.p);
+    sdf_shape s = *this;
+    s.root_node = uint32_t(s.node_list.size());
+    s.node_list.push_back(n);
+    return s;
+}
+
+sdf_shape sdf_shape::binary(sdf_op op, const sdf_shape& a, const sdf_shape& b, double param)
+{
+    sdf_shape s = a;
+    uint32_t offset = uint32_t(s.node_list.size());
+    for (size_t i = 0; i < b.node_list.size(); i++)
+    {
+        s.node_list.push_back(b.node_list[i]);
+        sdf_offset_children(s.node_list.back(), offset);
+    }
+    sdf_node n = {};
+    n.op = op;
+    n.a = a.root_node;
+    n.b = b.root_node + offset;
+    n.p[0] = param;
+    s.root_node = uint32_t(s.node_list.size());
+    s.node_list.push_back(n);
+    return s;
+}
+
+sdf_shape sdf_shape::oriented(const vec3& up) const
+{
+    //Rows are the shape's axes in world space, which as a matrix takes world to the shape's frame
+    vec3 y = unit_vector(up);
+    vec3 x = unit_vector(cross(fabs(y.x()) < 0.9 ? vec3(1, 0, 0) : vec3(0, 0, 1), y));
+    vec3 z = cross(x, y);
+    return unary(sdf_op::rotate, { x.x(), x.y(), x.z(), y.x(), y.y(), y.z(), z.x(), z.y(), z.z() });
+}
+
+sdf_shape sdf_shape::repeated(const vec3& period, int nx, int ny, int nz) const
+{
+    //The copies beyond a cell's wall are at least the gap between the shape's bounds and the wall further away
+    aabb b = bounds();
+    double gap[3];
+    for (int k = 0; k < 3; k++)
+        gap[k] = fmax(0.5 * period[k] - fmax(fabs(b.min()[k]), fabs(b.max()[k])), 0.0);
+    return unary(sdf_op::repeat, { period.x(), period.y(), period.z(), double(std::max(nx, 1)), double(std::max(ny, 1)), double(std::max(nz, 1)),
+                                   gap[0], gap[1], gap[2] });
+}
+
+/**
+* Distance function of a shape stored in a node array, in the form sphere_trace wants.
+*/
+struct sdf_program
+{
+    const sdf_node* nodes;
+    uint32_t root;
+    vec3 origin;
+
+    inline double distance(const vec3& p) const { return sdf_eval(nodes, root, p - origin); }
+
+    inline vec3 normal(const vec3& p) const
+    {
+        double d;
+        vec3 g;
+        if (!sdf_eval_gradient(nodes, root, p - origin, d, g))
+            g = sdf_tetrahedral_gradient(nodes, root, p - origin);
+        double len = g.length();
+        return (len > 0) ? g / len : vec3(0, 1, 0);
+    }
+};
+
+/**
+* Sphere traces a shape stored in a node array, shared by the sdf_object class and the SoA scene storage.
+* @param root - root node of the shape, which is placed at origin.
+* @param bounds - the shape's sdf_bounds, offset by origin.
+* @return true if the ray hits the shape within [t_min, t_max], in which case rec is filled in.
+*/
+inline bool hit_sdf(const sdf_node* nodes, uint32_t root, const vec3& origin, const aabb& bounds, double lipschitz, const ray& r,
+                    double t_min, double t_max, hit_record& rec)
+{
+    sdf_program shape = { nodes, root, origin };
+    return sphere_trace(shape, bounds, lipschitz, r, t_min, t_max, rec);
+}
+
+/**
+* A standalone SDF shape.
+*/
+class sdf_object : public hitable
+{
+private:
+    sdf_shape shape;
+    vec3 origin;
+    aabb box;
+    double lipschitz;
+
+public:
+    material mat;
+
+    sdf_object(const sdf_shape& shape, const vec3& origin, material mat) : shape{ shape }, origin{ origin }, mat{ mat }
+    {
+        aabb b = shape.bounds();
+        box = aabb(b.min() + origin, b.max() + origin);
+        lipschitz = shape.lipschitz();
+    }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const override;
+    virtual bool bounding_box(aabb& box) const override;
+};
+
+bool sdf_object::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
+{
+    if (!hit_sdf(shape.nodes().data(), shape.root(), origin, box, lipschitz, r, t_min, t_max, rec))
+        return false;
+    closest_mat = mat;
+    return true;
+}
+
+bool sdf_object::bounding_box(aabb& box) const
+{
+    box = this->box;
+    return true;
+}
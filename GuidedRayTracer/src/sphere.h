@@ -16,7 +16,11 @@ public:
 };
 
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
+/**
+* Ray-sphere intersection shared by the sphere class and the SoA scene storage.
+* @return true if the ray hits the sphere within (t_min, t_max), in which case rec is filled in.
+*/
+inline bool hit_sphere(const vec3& center, double radius, const ray& r, double t_min, double t_max, hit_record& rec)
 {
     vec3 oc = r.origin() - center;
     double a = dot(r.direction(), r.direction());
@@ -29,7 +33,6 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec, mate
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-            closest_mat = mat;
             return true;
         }
         temp = (-b + sqrt(discriminant)) / a;
@@ -37,13 +40,20 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec, mate
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-            closest_mat = mat;
             return true;
         }
     }
     return false;
 }
 
+bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
+{
+    if (!hit_sphere(center, radius, r, t_min, t_max, rec))
+        return false;
+    closest_mat = mat;
+    return true;
+}
+
 bool sphere::bounding_box(aabb& box) const
 {
     box = aabb(center - vec3(radius, radius, radius),
@@ -0,0 +1,478 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "alloc_tracker.h"
+#include "vec3.h"
+
+/**
+* On-disk layout of a tiled, mip-mapped texture (.gtx):
+*
+*     gtx_header
+*     gtx_level[levels]        level 0 is full resolution, each following level halves it (rounding up) down to 1x1
+*     uint64_t offsets[]       file offset of every tile, level by level, row by row
+*     tile data                tile_size x tile_size texels of 3 bytes (RGB), edge tiles are padded to the full size
+*
+* Texels are stored gamma 2 encoded, like the images the renderer writes.
+*/
+struct gtx_header
+{
+    static const uint32_t magic_value = 0x58544746; // "FGTX"
+    static const uint32_t current_version = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t levels;
+    uint32_t tile_size;
+};
+
+struct gtx_level
+{
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    //Index of the level's first tile in the offset table.
+    uint32_t first_tile;
+};
+
+//A single tile of texels, as held by the cache.
+struct texture_tile
+{
+    std::vector<uint8_t> texels;
+};
+
+/**
+* Bounded-memory LRU cache of texture tiles shared by every texture. Tiles are loaded from disk on demand. The cache is split into
+* shards, each with its own lock and LRU list, so threads fetching different tiles rarely contend. Tiles are handed out as
+* shared pointers, so a tile evicted while still being filtered stays alive until the caller is done with it.
+*/
+class tile_cache
+{
+public:
+    //Identifies a tile: texture, mip level and tile coordinates.
+    struct key
+    {
+        uint32_t texture, level, tx, ty;
+        inline bool operator==(const key& o) const { return texture == o.texture && level == o.level && tx == o.tx && ty == o.ty; }
+    };
+
+    struct key_hash
+    {
+        inline size_t operator()(const key& k) const
+        {
+            uint64_t h = (uint64_t(k.texture) << 40) ^ (uint64_t(k.level) << 32) ^ (uint64_t(k.tx) << 16) ^ uint64_t(k.ty);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            return size_t(h);
+        }
+    };
+
+    //Loads the tile for a key from disk, provided by the owner of the textures.
+    typedef std::shared_ptr<const texture_tile>(*loader_fn)(void* owner, const key& k);
+
+private:
+    static const int num_shards = 16;
+
+    struct shard
+    {
+        std::mutex lock;
+        std::list<std::pair<key, std::shared_ptr<const texture_tile>>> lru;
+        std::unordered_map<key, std::list<std::pair<key, std::shared_ptr<const texture_tile>>>::iterator, key_hash> map;
+        size_t bytes = 0;
+    };
+
+    shard shards[num_shards];
+    size_t shard_budget;
+    loader_fn loader;
+    void* owner;
+
+    static inline uint64_t next_serial()
+    {
+        static std::atomic<uint64_t> counter{ 0 };
+        return ++counter;
+    }
+
+public:
+    std::atomic<uint64_t> hits, misses, evictions;
+    //Unique for the lifetime of the process, lets per-thread memos tell caches apart even if one reuses another's address.
+    const uint64_t serial;
+
+    /**
+    * @param budget_bytes - upper bound on the memory held by cached tiles.
+    */
+    tile_cache(size_t budget_bytes, loader_fn loader, void* owner)
+        : shard_budget{ budget_bytes / num_shards }, loader{ loader }, owner{ owner }, hits{ 0 }, misses{ 0 }, evictions{ 0 }, serial{ next_serial() } {}
+
+    /**
+    * Gets a tile, loading it (and evicting least recently used tiles to stay within budget) on a miss.
+    * @return the tile, or null if it couldn't be loaded.
+    */
+    std::shared_ptr<const texture_tile> get(const key& k);
+};
+
+std::shared_ptr<const texture_tile> tile_cache::get(const key& k)
+{
+    shard& s = shards[key_hash()(k) % num_shards];
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.map.find(k);
+        if (it != s.map.end())
+        {
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return it->second->second;
+        }
+    }
+
+    //Load outside the lock so other threads can keep hitting this shard meanwhile
+    misses.fetch_add(1, std::memory_order_relaxed);
+    mem_scope tagged(mem_tag::textures);
+    std::shared_ptr<const texture_tile> tile = loader(owner, k);
+    if (!tile)
+        return tile;
+
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.map.find(k);
+    if (it != s.map.end())
+        return it->second->second;
+
+    s.lru.emplace_front(k, tile);
+    s.map[k] = s.lru.begin();
+    s.bytes += tile->texels.size();
+    while (s.bytes > shard_budget && s.lru.size() > 1)
+    {
+        s.bytes -= s.lru.back().second->texels.size();
+        s.map.erase(s.lru.back().first);
+        s.lru.pop_back();
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    return tile;
+}
+
+/**
+* A tiled, mip-mapped image texture whose tiles are streamed in through a tile_cache. Only the header and tile offset table are
+* held in memory.
+*/
+class image_texture
+{
+private:
+    std::string path;
+    gtx_header header;
+    std::vector<gtx_level> level_info;
+    std::vector<uint64_t> offsets;
+    FILE* file;
+    std::mutex file_lock;
+    uint32_t id;
+    tile_cache* cache;
+
+    //Fetches a single texel of the given level, wrapping coordinates around (repeat mode).
+    vec3 texel(uint32_t level, int x, int y) const;
+
+public:
+
+    /**
+    * Opens a .gtx file, only its header and offset table are read.
+    * @param id - identifies this texture's tiles in the cache.
+    */
+    image_texture(const std::string& path, uint32_t id, tile_cache* cache);
+    ~image_texture();
+
+    image_texture(const image_texture&) = delete;
+    image_texture& operator=(const image_texture&) = delete;
+
+    inline bool valid() const { return file != nullptr; }
+
+    //Reads a tile from disk, called by the cache on a miss.
+    std::shared_ptr<const texture_tile> load_tile(uint32_t level, uint32_t tx, uint32_t ty);
+
+    /**
+    * Trilinearly filtered lookup.
+    * @param u/v - texture coordinates, wrapped to [0, 1).
+    * @param width - footprint of the lookup in texture coordinates, picks the mip levels blended.
+    * @return the linear colour of the texture at (u, v).
+    */
+    vec3 lookup(double u, double v, double width) const;
+};
+
+image_texture::image_texture(const std::string& path, uint32_t id, tile_cache* cache) : path{ path }, header{}, file{ nullptr }, id{ id }, cache{ cache }
+{
+    FILE* f = nullptr;
+#ifdef _MSC_VER
+    if (fopen_s(&f, path.c_str(), "rb") != 0)
+        f = nullptr;
+#else
+    f = fopen(path.c_str(), "rb");
+#endif
+    if (f == nullptr)
+        return;
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != gtx_header::magic_value || header.version != gtx_header::current_version
+        || header.levels == 0 || header.tile_size == 0)
+    {
+        fclose(f);
+        return;
+    }
+
+    level_info.resize(header.levels);
+    if (fread(level_info.data(), sizeof(gtx_level), header.levels, f) != header.levels)
+    {
+        fclose(f);
+        return;
+    }
+
+    size_t num_tiles = level_info.back().first_tile + size_t(level_info.back().tiles_x) * level_info.back().tiles_y;
+    offsets.resize(num_tiles);
+    if (fread(offsets.data(), sizeof(uint64_t), num_tiles, f) != num_tiles)
+    {
+        fclose(f);
+        return;
+    }
+    file = f;
+}
+
+image_texture::~image_texture()
+{
+    if (file != nullptr)
+        fclose(file);
+}
+
+std::shared_ptr<const texture_tile> image_texture::load_tile(uint32_t level, uint32_t tx, uint32_t ty)
+{
+    const gtx_level& l = level_info[level];
+    size_t bytes = size_t(header.tile_size) * header.tile_size * 3;
+    std::shared_ptr<texture_tile> tile = std::make_shared<texture_tile>();
+    tile->texels.resize(bytes);
+
+    std::lock_guard<std::mutex> guard(file_lock);
+    uint64_t offset = offsets[l.first_tile + size_t(ty) * l.tiles_x + tx];
+#ifdef _WIN32
+    if (_fseeki64(file, int64_t(offset), SEEK_SET) != 0)
+#else
+    if (fseeko(file, off_t(offset), SEEK_SET) != 0)
+#endif
+        return nullptr;
+    if (fread(tile->texels.data(), 1, bytes, file) != bytes)
+        return nullptr;
+    return tile;
+}
+
+vec3 image_texture::texel(uint32_t level, int x, int y) const
+{
+    const gtx_level& l = level_info[level];
+    x %= int(l.width); if (x < 0) x += l.width;
+    y %= int(l.height); if (y < 0) y += l.height;
+
+    uint32_t ts = header.tile_size;
+    tile_cache::key k = { id, level, uint32_t(x) / ts, uint32_t(y) / ts };
+
+    //Consecutive texel fetches mostly land in the same tile, remember the last few per thread to skip the shared cache
+    struct memo_entry { tile_cache::key k; std::shared_ptr<const texture_tile> tile; uint64_t serial; };
+    static thread_local memo_entry memo[8];
+    memo_entry& m = memo[(k.tx * 3 + k.ty * 5 + level) & 7];
+    if (!(m.serial == cache->serial && m.tile && m.k == k))
+    {
+        m.k = k;
+        m.serial = cache->serial;
+        m.tile = cache->get(k);
+        if (!m.tile)
+            return vec3(1, 0, 1);
+    }
+
+    const uint8_t* t = m.tile->texels.data() + 3 * (size_t(uint32_t(y) % ts) * ts + uint32_t(x) % ts);
+    //Undo the gamma 2 encoding
+    double r = t[0] / 255.0, g = t[1] / 255.0, b = t[2] / 255.0;
+    return vec3(r * r, g * g, b * b);
+}
+
+vec3 image_texture::lookup(double u, double v, double width) const
+{
+    if (file == nullptr)
+        return vec3(1, 0, 1);
+
+    u -= floor(u);
+    v -= floor(v);
+
+    //Level whose texels are about as wide as the footprint
+    double lod = log2(fmax(width * double(header.width > header.height ? header.width : header.height), 1e-8));
+    lod = fmin(fmax(lod, 0.0), double(header.levels - 1));
+    uint32_t l0 = uint32_t(lod);
+    uint32_t l1 = (l0 + 1 < header.levels) ? l0 + 1 : l0;
+    double f = lod - l0;
+
+    vec3 result(0, 0, 0);
+    for (int k = 0; k < 2; k++)
+    {
+        uint32_t level = (k == 0) ? l0 : l1;
+        double weight = (k == 0) ? 1.0 - f : f;
+        if (weight <= 0)
+            continue;
+
+        //Bilinear, texel centres at half-integer coordinates; v = 0 is the bottom of the image
+        const gtx_level& l = level_info[level];
+        double x = u * l.width - 0.5, y = (1.0 - v) * l.height - 0.5;
+        int x0 = int(floor(x)), y0 = int(floor(y));
+        double fx = x - x0, fy = y - y0;
+        vec3 c = (1 - fx) * (1 - fy) * texel(level, x0, y0) + fx * (1 - fy) * texel(level, x0 + 1, y0)
+               + (1 - fx) * fy * texel(level, x0, y0 + 1) + fx * fy * texel(level, x0 + 1, y0 + 1);
+        result += weight * c;
+    }
+    return result;
+}
+
+/**
+* Owns every texture of a scene along with the tile cache they stream through.
+*/
+class texture_set
+{
+private:
+    std::vector<std::unique_ptr<image_texture>> textures;
+    tile_cache cache;
+
+    static std::shared_ptr<const texture_tile> load(void* owner, const tile_cache::key& k)
+    {
+        texture_set* set = static_cast<texture_set*>(owner);
+        return set->textures[k.texture]->load_tile(k.level, k.tx, k.ty);
+    }
+
+public:
+    /**
+    * @param budget_bytes - memory budget of the tile cache shared by all the textures.
+    */
+    explicit texture_set(size_t budget_bytes = size_t(256) << 20) : cache(budget_bytes, &texture_set::load, this) {}
+
+    /**
+    * Opens a .gtx texture.
+    * @return the texture, or null if the file is missing or malformed.
+    */
+    inline const image_texture* add(const std::string& path)
+    {
+        mem_scope tagged(mem_tag::textures);
+        std::unique_ptr<image_texture> t(new image_texture(path, uint32_t(textures.size()), &cache));
+        if (!t->valid())
+            return nullptr;
+        textures.push_back(std::move(t));
+        return textures.back().get();
+    }
+
+    inline const tile_cache& tiles() const { return cache; }
+};
+
+/**
+* Converts a PPM (P3 or P6) image into a tiled, mip-mapped .gtx texture. Mip levels are built with a 2x2 box filter in linear space.
+* @return false if the input can't be read or the output written.
+*/
+bool make_tiled_texture(const std::string& ppm_path, const std::string& gtx_path, uint32_t tile_size = 64)
+{
+    std::ifstream in(ppm_path, std::ios::binary);
+    std::string magic;
+    int w, h, maxval;
+    if (!(in >> magic >> w >> h >> maxval) || (magic != "P3" && magic != "P6") || w <= 0 || h <= 0 || maxval <= 0 || maxval > 255)
+        return false;
+    in.get();
+
+    //Level 0 in linear space, top row first
+    std::vector<vec3> img(size_t(w) * h);
+    for (size_t k = 0; k < img.size(); k++)
+    {
+        int c[3];
+        for (int ch = 0; ch < 3; ch++)
+        {
+            if (magic == "P3")
+                in >> c[ch];
+            else
+                c[ch] = in.get();
+        }
+        if (!in)
+            return false;
+        double r = c[0] / double(maxval), g = c[1] / double(maxval), b = c[2] / double(maxval);
+        img[k] = vec3(r * r, g * g, b * b);
+    }
+
+    std::vector<std::vector<vec3>> mips;
+    std::vector<gtx_level> levels;
+    uint32_t first_tile = 0;
+    mips.push_back(img);
+    while (true)
+    {
+        gtx_level l;
+        l.width = uint32_t(w);
+        l.height = uint32_t(h);
+        l.tiles_x = (l.width + tile_size - 1) / tile_size;
+        l.tiles_y = (l.height + tile_size - 1) / tile_size;
+        l.first_tile = first_tile;
+        first_tile += l.tiles_x * l.tiles_y;
+        levels.push_back(l);
+        if (w == 1 && h == 1)
+            break;
+
+        int nw = (w + 1) / 2, nh = (h + 1) / 2;
+        const std::vector<vec3>& prev = mips.back();
+        std::vector<vec3> next(size_t(nw) * nh);
+        for (int y = 0; y < nh; y++)
+            for (int x = 0; x < nw; x++)
+            {
+                int x1 = (2 * x + 1 < w) ? 2 * x + 1 : 2 * x, y1 = (2 * y + 1 < h) ? 2 * y + 1 : 2 * y;
+                next[size_t(y) * nw + x] = 0.25 * (prev[size_t(2 * y) * w + 2 * x] + prev[size_t(2 * y) * w + x1]
+                                                 + prev[size_t(y1) * w + 2 * x] + prev[size_t(y1) * w + x1]);
+            }
+        mips.push_back(next);
+        w = nw;
+        h = nh;
+    }
+
+    gtx_header header;
+    header.magic = gtx_header::magic_value;
+    header.version = gtx_header::current_version;
+    header.width = levels[0].width;
+    header.height = levels[0].height;
+    header.levels = uint32_t(levels.size());
+    header.tile_size = tile_size;
+
+    std::ofstream out(gtx_path, std::ios::binary);
+    if (!out)
+        return false;
+
+    uint64_t tile_bytes = uint64_t(tile_size) * tile_size * 3;
+    uint64_t data_start = sizeof(gtx_header) + levels.size() * sizeof(gtx_level) + uint64_t(first_tile) * sizeof(uint64_t);
+    std::vector<uint64_t> offsets(first_tile);
+    for (uint32_t t = 0; t < first_tile; t++)
+        offsets[t] = data_start + t * tile_bytes;
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(levels.data()), levels.size() * sizeof(gtx_level));
+    out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+
+    std::vector<uint8_t> tile(tile_bytes);
+    for (size_t li = 0; li < levels.size(); li++)
+    {
+        const gtx_level& l = levels[li];
+        const std::vector<vec3>& m = mips[li];
+        for (uint32_t ty = 0; ty < l.tiles_y; ty++)
+            for (uint32_t tx = 0; tx < l.tiles_x; tx++)
+            {
+                for (uint32_t y = 0; y < tile_size; y++)
+                    for (uint32_t x = 0; x < tile_size; x++)
+                    {
+                        //Pad edge tiles by clamping to the last texel
+                        uint32_t sx = tx * tile_size + x, sy = ty * tile_size + y;
+                        sx = (sx < l.width) ? sx : l.width - 1;
+                        sy = (sy < l.height) ? sy : l.height - 1;
+                        const vec3& c = m[size_t(sy) * l.width + sx];
+                        uint8_t* t = &tile[3 * (size_t(y) * tile_size + x)];
+                        for (int ch = 0; ch < 3; ch++)
+                            t[ch] = uint8_t(255.0 * sqrt(fmin(fmax(c[ch], 0.0), 1.0)) + 0.5);
+                    }
+                out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+            }
+    }
+    return bool(out);
+}
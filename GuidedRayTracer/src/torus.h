@@ -1,5 +1,5 @@
 #pragma once
-#include "hitable.h"
+#include "sdf.h"
 
 class torus : public hitable
 {
@@ -19,61 +19,75 @@ public:
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const override;
 	virtual bool bounding_box(aabb& box) const override;
+};
 
-	//Gets the normal to the surface at the given point of intersection.
-	inline vec3 surface_norm(const vec3& I, const vec3& m) const { return (I - m) / r_tube; }
+/**
+* Exact distance to a torus, in the form sphere_trace wants. Tori are traced through it rather than as a general sdf_shape so
+* they keep their closed form normal and skip the node interpreter.
+*/
+struct torus_distance
+{
+	vec3 center, n;
+	double r_disk, r_tube;
 
-	//Computes the closest point on the torus to the origin of the given ray and updates the corresponding point on the medial axis.
-	inline double distance(const ray& r, vec3& m) const
+	//Point of the medial axis closest to p.
+	inline vec3 medial_point(const vec3& p) const
 	{
-		double k = dot((r.origin() - center), disk_n);
-		vec3 p = r.origin() - (k * disk_n);
-		vec3 pc = (p - center);
-		pc.make_unit_vector();
-		m = center + pc * r_disk;
-		vec3 mr = m - r.origin();
-		return mr.length() - r_tube;
+		vec3 q = p - center;
+		vec3 radial = q - dot(q, n) * n;
+		double len = radial.length();
+		//Every point of the medial axis is equally close to points on the torus' axis
+		if (len == 0)
+		{
+			radial = cross(n, fabs(n.x()) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0));
+			len = radial.length();
+		}
+		return center + radial * (r_disk / len);
 	}
 
-	//Gets maximum distance on surface of torus from origin of given ray
-	inline double max_distance(const ray& r) const
+	inline double distance(const vec3& p) const
 	{
-		vec3 d = (center - r.origin());
-		d.make_unit_vector();
-		return (r.origin() - (center + d*R)).length();
+		vec3 q = p - center;
+		double h = dot(q, n);
+		double radial = (q - h * n).length() - r_disk;
+		return sqrt(radial * radial + h * h) - r_tube;
 	}
+
+	inline vec3 normal(const vec3& p) const { return unit_vector(p - medial_point(p)); }
 };
 
-//Via sphere tracing algo
-bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
+//Tight box around a torus with unit disk normal n.
+inline aabb torus_bounds(const vec3& center, const vec3& n, double r_disk, double r_tube)
 {
-	
-	double dsf = 0.0f, eps = 0.0001, max_dist = max_distance(r), radius;
-	vec3 m;
-	ray trc(r.origin(), unit_vector(r.direction()));
-	
-	do
-	{
-		radius = distance(trc, m);
-		if (radius < eps)
-		{
-			if (dsf < t_min || dsf > t_max)
-				return false;
+	vec3 reach;
+	for (int a = 0; a < 3; a++)
+		reach[a] = r_disk * sqrt(fmax(0.0, 1 - n[a] * n[a])) + r_tube;
+	return aabb(center - reach, center + reach);
+}
 
-			rec.t = dsf;
-			rec.p = trc.origin();
-			rec.normal = surface_norm(rec.p, m);
-			closest_mat = mat;
-			return true;
-		} 
-		trc.r0 += trc.direction() * radius;
-		dsf += radius;
-	} while (dsf < max_dist);
+/**
+* Sphere traces a torus, shared by the torus class and the SoA scene storage.
+* @param n - unit normal of the torus' disk.
+* @param r_disk - dist from center to medial axis, r_tube - dist from medial axis to surface.
+* @return true if the ray hits the torus within [t_min, t_max], in which case rec is filled in.
+*/
+inline bool hit_torus(const vec3& center, const vec3& n, double r_disk, double r_tube, const ray& r, double t_min, double t_max, hit_record& rec)
+{
+	torus_distance shape = { center, n, r_disk, r_tube };
+	return sphere_trace(shape, torus_bounds(center, n, r_disk, r_tube), 1.0, r, t_min, t_max, rec);
+}
 
-	return false;
+//Via sphere tracing algo
+bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
+{
+	if (!hit_torus(center, disk_n, r_disk, r_tube, r, t_min, t_max, rec))
+		return false;
+	closest_mat = mat;
+	return true;
 }
 
 bool torus::bounding_box(aabb& box) const
 {
+	box = torus_bounds(center, disk_n, r_disk, r_tube);
 	return true;
 }
\ No newline at end of file
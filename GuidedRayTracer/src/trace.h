@@ -0,0 +1,233 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+* One span of time on a thread's timeline. Names and argument names must be string literals (or otherwise outlive the tracer),
+* only the pointers are kept.
+*/
+struct trace_event
+{
+    const char* name;
+    const char* category;
+    //Nanoseconds since the tracer was enabled
+    uint64_t begin_ns, end_ns;
+    //Up to two integer arguments shown with the span, a null name means unused
+    const char* arg_names[2];
+    int64_t args[2];
+};
+
+/**
+* Timeline of one thread: a fixed-size ring of its most recent events. Only the owning thread writes to it, so recording an event
+* takes no lock, and once the ring is full the oldest events are overwritten rather than stalling the render.
+*/
+struct trace_buffer
+{
+    static const size_t capacity = size_t(1) << 16;
+
+    std::vector<trace_event> events;
+    //Number of events ever recorded, the ring holds the last min(written, capacity) of them
+    std::atomic<uint64_t> written;
+    uint32_t tid;
+    std::string thread_name;
+
+    explicit trace_buffer(uint32_t tid) : events(capacity), written{ 0 }, tid{ tid } {}
+
+    inline void record(const trace_event& e)
+    {
+        uint64_t n = written.load(std::memory_order_relaxed);
+        events[n & (capacity - 1)] = e;
+        written.store(n + 1, std::memory_order_release);
+    }
+};
+
+/**
+* Records scoped trace markers (see trace_scope) from any number of threads and exports them in the Chrome Trace Event format,
+* which chrome://tracing and Perfetto (ui.perfetto.dev) open directly. Disabled it costs one relaxed load per marker; each thread
+* gets its ring buffer the first time it records something after the tracer was enabled.
+*/
+class tracer
+{
+private:
+    typedef std::chrono::steady_clock clock;
+
+    std::atomic<bool> on;
+    clock::time_point origin;
+    std::mutex lock;
+    //Buffers outlive their threads so workers that have exited still show up in the export
+    std::vector<std::unique_ptr<trace_buffer>> buffers;
+
+    tracer() : on{ false } {}
+
+    static void write_string(std::ostream& os, const char* s);
+
+public:
+    static inline tracer& get()
+    {
+        static tracer instance;
+        return instance;
+    }
+
+    inline bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    //Starts recording, timestamps count from now. Best called before the threads to be traced are started.
+    inline void enable()
+    {
+        origin = clock::now();
+        on.store(true, std::memory_order_release);
+    }
+
+    inline uint64_t now_ns() const
+    {
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - origin).count());
+    }
+
+    //Gets the calling thread's buffer, creating it on first use.
+    trace_buffer& local();
+
+    //Names the calling thread in the exported timeline (no-op while disabled).
+    inline void set_thread_name(const std::string& name)
+    {
+        if (enabled())
+            local().thread_name = name;
+    }
+
+    /**
+    * Writes every event recorded so far as Chrome Trace Event JSON. Events still being recorded by running threads may be missed,
+    * so call this once the traced work is done.
+    * @return false if the file couldn't be written.
+    */
+    bool write_json(const std::string& path);
+};
+
+trace_buffer& tracer::local()
+{
+    thread_local trace_buffer* buffer = nullptr;
+    if (buffer == nullptr)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        buffers.emplace_back(new trace_buffer(uint32_t(buffers.size() + 1)));
+        buffer = buffers.back().get();
+    }
+    return *buffer;
+}
+
+void tracer::write_string(std::ostream& os, const char* s)
+{
+    os << '"';
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            os << '\\' << *s;
+        else if (static_cast<unsigned char>(*s) >= 0x20)
+            os << *s;
+    }
+    os << '"';
+}
+
+bool tracer::write_json(const std::string& path)
+{
+    std::ofstream out(path);
+    if (!out)
+        return false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char ts[64];
+    for (size_t b = 0; b < buffers.size(); b++)
+    {
+        const trace_buffer& buf = *buffers[b];
+        if (!buf.thread_name.empty())
+        {
+            out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buf.tid << ",\"args\":{\"name\":";
+            write_string(out, buf.thread_name.c_str());
+            out << "}}";
+            first = false;
+        }
+
+        uint64_t written = buf.written.load(std::memory_order_acquire);
+        uint64_t begin = (written > trace_buffer::capacity) ? written - trace_buffer::capacity : 0;
+        if (begin > 0)
+        {
+            //The ring wrapped, mark where this thread's timeline starts being complete
+            const trace_event& oldest = buf.events[begin & (trace_buffer::capacity - 1)];
+            snprintf(ts, sizeof(ts), "%.3f", oldest.begin_ns / 1000.0);
+            out << (first ? "\n" : ",\n") << "{\"name\":\"events dropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" << buf.tid << ",\"ts\":" << ts
+                << ",\"args\":{\"count\":" << begin << "}}";
+            first = false;
+        }
+        for (uint64_t k = begin; k < written; k++)
+        {
+            const trace_event& e = buf.events[k & (trace_buffer::capacity - 1)];
+            out << (first ? "\n" : ",\n") << "{\"name\":";
+            write_string(out, e.name);
+            out << ",\"cat\":";
+            write_string(out, e.category);
+            snprintf(ts, sizeof(ts), "%.3f,\"dur\":%.3f", e.begin_ns / 1000.0, (e.end_ns - e.begin_ns) / 1000.0);
+            out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buf.tid << ",\"ts\":" << ts;
+            if (e.arg_names[0] != nullptr)
+            {
+                out << ",\"args\":{";
+                for (int a = 0; a < 2 && e.arg_names[a] != nullptr; a++)
+                {
+                    if (a > 0)
+                        out << ',';
+                    write_string(out, e.arg_names[a]);
+                    out << ':' << e.args[a];
+                }
+                out << '}';
+            }
+            out << '}';
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    return bool(out);
+}
+
+/**
+* Marks the lifetime of the object as a span on the calling thread's timeline, e.g.
+*     trace_scope scope("tile", "engine", "x", t.x0, "y", t.y0);
+* Does nothing if the tracer wasn't enabled when the scope began.
+*/
+class trace_scope
+{
+private:
+    trace_event e;
+    bool active;
+
+public:
+    inline trace_scope(const char* name, const char* category, const char* arg0 = nullptr, int64_t value0 = 0,
+        const char* arg1 = nullptr, int64_t value1 = 0)
+        : active{ tracer::get().enabled() }
+    {
+        if (!active)
+            return;
+        e.name = name;
+        e.category = category;
+        e.arg_names[0] = arg0;
+        e.arg_names[1] = arg1;
+        e.args[0] = value0;
+        e.args[1] = value1;
+        e.begin_ns = tracer::get().now_ns();
+    }
+
+    inline ~trace_scope()
+    {
+        if (!active)
+            return;
+        e.end_ns = tracer::get().now_ns();
+        tracer::get().local().record(e);
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+};
@@ -1,6 +1,71 @@
 #pragma once
 #include "hitable.h"
 
+/**
+* Determines if ray intersects the plane through point a with unit normal n.
+* @param t - stores resultant parameter in case of valid intersection.
+* @return true if the intersection is valid (hits the plane and closer than previous intersections).
+*/
+inline bool triangle_in_plane(const vec3& a, const vec3& n, const ray& r, double t_min, double t_max, double* t)
+{
+	double num, denom, t_temp;
+	double eps = 0.0001;
+	denom = dot(n, r.direction());
+	if (-eps < denom && denom < eps)
+		return false;
+
+	num = dot(n, a - r.origin());
+	t_temp = num / denom;
+
+	if (t_temp < t_min || t_temp > t_max)
+		return false;
+
+	*t = t_temp;
+	return true;
+}
+
+/**
+* Determines if point I (already known to lie in the triangle's plane) is inside triangle abc, using properties of Barycentric coordinates.
+*/
+inline bool triangle_contains(const vec3& a, const vec3& b, const vec3& c, const vec3& I)
+{
+	double area, alpha, beta, gamma, eps, sum;
+	eps = 0.0001;
+
+	area = 0.5f * (cross((b - a), (c - a))).length();
+	alpha = (0.5f / area) * (cross((b - I), (c - I))).length();
+	beta = (0.5f / area) * (cross((c - I), (a - I))).length();
+	gamma = (0.5f / area) * (cross((a - I), (b - I))).length();
+
+	if (alpha < 0 || beta < 0 || gamma < 0)
+		return false;
+
+	sum = alpha + beta + gamma;
+	return (1.0f - eps < sum && sum < 1.0f + eps);
+}
+
+/**
+* Ray-triangle intersection shared by the triangle class and the SoA scene storage.
+* @param n - unit normal of the triangle.
+* @return true if the ray hits the triangle within [t_min, t_max], in which case rec is filled in.
+*/
+inline bool hit_triangle(const vec3& a, const vec3& b, const vec3& c, const vec3& n, const ray& r, double t_min, double t_max, hit_record& rec)
+{
+	double t_temp;
+	if (triangle_in_plane(a, n, r, t_min, t_max, &t_temp))
+	{
+		vec3 I = r.point_at_parameter(t_temp);
+		if (triangle_contains(a, b, c, I))
+		{
+			rec.t = t_temp;
+			rec.p = I;
+			rec.normal = n;
+			return true;
+		}
+	}
+	return false;
+}
+
 class triangle : public hitable {
 public:
 
@@ -30,20 +95,7 @@ public:
 	*/
 	inline bool in_plane(const ray& r, double t_min, double t_max, double * t) const
 	{
-		double num, denom, t_temp;
-		double eps = 0.0001;
-		denom = dot(n, r.direction());
-		if (-eps < denom && denom < eps)
-			return false;
-
-		num = dot(n, a - r.origin());
-		t_temp = num / denom;
-		
-		if (t_temp < t_min || t_temp > t_max)
-			return false;
-
-		*t = t_temp;
-		return true;
+		return triangle_in_plane(a, n, r, t_min, t_max, t);
 	}
     
 	/**
@@ -53,41 +105,17 @@ public:
 	*/
 	inline bool in_triangle(const vec3& I) const
 	{
-		double area, alpha, beta, gamma, eps, sum;
-		eps = 0.0001;
-
-		area = 0.5f * (cross((b - a), (c - a))).length();
-		alpha = (0.5f / area) * (cross((b - I), (c - I))).length();
-		beta = (0.5f / area) * (cross((c - I), (a - I))).length();
-		gamma = (0.5f / area) * (cross((a - I), (b - I))).length();
-		
-		if (alpha < 0 || beta < 0 || gamma < 0)
-			return false;
-
-		sum = alpha + beta + gamma;
-		return (1.0f - eps < sum && sum < 1.0f + eps);
+		return triangle_contains(a, b, c, I);
 	}
 };
 
 
 bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec, material& closest_mat) const
 {
-	
-	double t_temp;
-	if (in_plane(r, t_min, t_max, &t_temp))
-	{
-		vec3 I = r.point_at_parameter(t_temp);
-		if (in_triangle(I))
-		{
-			rec.t = t_temp;
-			rec.p = I;
-			rec.normal = n;
-			closest_mat = mat;
-			return true;
-		}
-	}
-	
-	return false;
+	if (!hit_triangle(a, b, c, n, r, t_min, t_max, rec))
+		return false;
+	closest_mat = mat;
+	return true;
 }
 
 
@@ -139,6 +139,11 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
+//Brightness of a linear Rec. 709 colour.
+inline double luminance(const vec3& c) {
+    return 0.2126 * c.r() + 0.7152 * c.g() + 0.0722 * c.b();
+}
+
 inline double determinant(const double col1[], const double col2[])
 {
     return col1[0] * col2[1] - col2[0] * col1[1];